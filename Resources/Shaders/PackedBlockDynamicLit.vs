@@ -0,0 +1,59 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+uniform mat4 projectionViewMatrix;
+uniform mat4 viewMatrix;
+uniform vec3 chunkPosition;
+uniform float fogDistance;
+uniform vec3 viewOriginVector;
+
+varying vec4 color;
+varying vec3 fogDensity;
+varying vec2 detailCoord;
+
+void PackedBlockFace(out vec3 normal, out vec3 tangentU, out vec3 tangentV);
+vec3 PackedBlockColor();
+vec3 PackedBlockPosition();
+
+void PrepareForDynamicLightNoBump(vec3 vertexCoord, vec3 normal);
+vec4 FogDensity(float poweredLength);
+
+void main() {
+	vec3 normal, tangentU, tangentV;
+	PackedBlockFace(normal, tangentU, tangentV);
+
+	vec4 vertexPos = vec4(chunkPosition, 1.);
+
+	vertexPos.xyz += PackedBlockPosition();
+
+	gl_Position = projectionViewMatrix * vertexPos;
+
+	color = vec4(PackedBlockColor(), 1.);
+	color.xyz *= color.xyz; // linearize
+
+	vec4 viewPos = viewMatrix * vertexPos;
+	vec2 horzRelativePos = vertexPos.xy - viewOriginVector.xy;
+	float horzDistance = dot(horzRelativePos, horzRelativePos);
+	fogDensity = FogDensity(horzDistance).xyz;
+
+	vec3 shadowVertexPos = vertexPos.xyz;
+
+	PrepareForDynamicLightNoBump(shadowVertexPos, normal);
+}
@@ -0,0 +1,83 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+uniform mat4 projectionViewMatrix;
+uniform mat4 viewMatrix;
+uniform vec3 chunkPosition;
+uniform float fogDistance;
+uniform vec3 viewOriginVector;
+
+// [tile x, tile y, u, v]
+varying vec4 ambientOcclusionCoord;
+varying vec4 color;
+varying vec3 fogDensity;
+
+varying vec3 viewSpaceCoord;
+varying vec3 viewSpaceNormal;
+
+varying vec3 reflectionDir;
+
+void PackedBlockFace(out vec3 normal, out vec3 tangentU, out vec3 tangentV);
+vec3 PackedBlockColor();
+vec4 PackedBlockAmbientOcclusionCoord(vec3 tangentU, vec3 tangentV);
+vec3 PackedBlockPosition();
+vec3 PackedBlockFixedPosition(vec3 tangentU, vec3 tangentV);
+
+void PrepareForShadowForMap(vec3 vertexCoord, vec3 fixedVertexCoord, vec3 normal);
+vec4 FogDensity(float poweredLength);
+
+void main() {
+	vec3 normal, tangentU, tangentV;
+	PackedBlockFace(normal, tangentU, tangentV);
+
+	vec4 vertexPos = vec4(chunkPosition, 1.);
+
+	vertexPos.xyz += PackedBlockPosition();
+
+	gl_Position = projectionViewMatrix * vertexPos;
+
+	color.xyz = PackedBlockColor();
+	color.xyz *= color.xyz; // linearize
+
+	// lambert reflection
+	vec3 sunDir = normalize(vec3(0, -1., -1.));
+	color.w = dot(sunDir, normal);
+
+	// ambient occlusion
+	ambientOcclusionCoord = PackedBlockAmbientOcclusionCoord(tangentU, tangentV);
+
+	vec4 viewPos = viewMatrix * vertexPos;
+	vec2 horzRelativePos = vertexPos.xy - viewOriginVector.xy;
+	float horzDistance = dot(horzRelativePos, horzRelativePos);
+	fogDensity = FogDensity(horzDistance).xyz;
+
+	vec3 fixedPosition = chunkPosition;
+	fixedPosition += PackedBlockFixedPosition(tangentU, tangentV);
+
+	vec3 shadowVertexPos = vertexPos.xyz;
+	PrepareForShadowForMap(shadowVertexPos, fixedPosition, normal);
+
+	// reflection vector (used for specular lighting)
+	reflectionDir = reflect(vertexPos.xyz - viewOriginVector, normal);
+
+	// used for diffuse lighting
+	viewSpaceCoord = viewPos.xyz;
+	viewSpaceNormal = (viewMatrix * vec4(normal, 0.)).xyz;
+}
@@ -0,0 +1,94 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+// Decodes the vertex format of the greedy chunk meshes (`GLMapChunk::PackedVertex`).
+// A vertex only stores the position, the face index and the quad corner; the rest is
+// derived here.
+
+// --- Vertex attribute ---
+// [x, y, z, face * 4 + corner]
+attribute vec4 positionAttribute;
+
+// [R, G, B, aoID / 255]
+attribute vec4 colorAttribute;
+
+// The faces are +Z, -Z, -X, +X, -Y, +Y. The tangents must match `GLMapChunk::MeshTask`.
+void PackedBlockFace(out vec3 normal, out vec3 tangentU, out vec3 tangentV) {
+	float face = floor(positionAttribute.w * .25);
+	if (face < .5) {
+		normal = vec3(0., 0., 1.);
+		tangentU = vec3(-1., 0., 0.);
+		tangentV = vec3(0., 1., 0.);
+	} else if (face < 1.5) {
+		normal = vec3(0., 0., -1.);
+		tangentU = vec3(1., 0., 0.);
+		tangentV = vec3(0., 1., 0.);
+	} else if (face < 2.5) {
+		normal = vec3(-1., 0., 0.);
+		tangentU = vec3(0., 0., 1.);
+		tangentV = vec3(0., -1., 0.);
+	} else if (face < 3.5) {
+		normal = vec3(1., 0., 0.);
+		tangentU = vec3(0., 0., 1.);
+		tangentV = vec3(0., 1., 0.);
+	} else if (face < 4.5) {
+		normal = vec3(0., -1., 0.);
+		tangentU = vec3(0., 0., 1.);
+		tangentV = vec3(1., 0., 0.);
+	} else {
+		normal = vec3(0., 1., 0.);
+		tangentU = vec3(0., 0., 1.);
+		tangentV = vec3(-1., 0., 0.);
+	}
+}
+
+// The same values as `shading` of the per-face vertex format
+float PackedBlockShading(vec3 normal) {
+	if (normal.z < -.5)
+		return 220. / 255.;
+	if (normal.y < -.5)
+		return 1.;
+	return 0.;
+}
+
+// [R, G, B] (not linearized yet)
+vec3 PackedBlockColor() { return colorAttribute.xyz; }
+
+// [tile x, tile y, u, v] of the ambient occlusion texture. The tile is in texels and (u, v)
+// is in voxels, so `fract(u, v)` is the position inside each voxel of a merged quad.
+vec4 PackedBlockAmbientOcclusionCoord(vec3 tangentU, vec3 tangentV) {
+	float aoID = floor(colorAttribute.w * 255. + .5);
+	float tileY = floor(aoID * (1. / 16.));
+	vec2 tile = vec2(aoID - tileY * 16., tileY) * 16.;
+	return vec4(tile, dot(positionAttribute.xyz, tangentU), dot(positionAttribute.xyz, tangentV));
+}
+
+// The chunk-local position of the vertex
+vec3 PackedBlockPosition() { return positionAttribute.xyz; }
+
+// The center of the voxel face at the corner of the quad, which is used instead of the
+// face center of the per-face vertex format to avoid self-shadow glitches. This is exact for
+// unmerged faces and is interpolated across merged ones.
+vec3 PackedBlockFixedPosition(vec3 tangentU, vec3 tangentV) {
+	float corner = positionAttribute.w - floor(positionAttribute.w * .25) * 4.;
+	float cornerV = floor(corner * .5);
+	float cornerU = corner - cornerV * 2.;
+	return positionAttribute.xyz + tangentU * (.5 - cornerU) + tangentV * (.5 - cornerV);
+}
@@ -395,20 +395,27 @@ namespace spades {
 			if (gameMap) {
 				Vector3 eye = listenerPosition;
 				Vector3 pos = origin;
-				Vector3 checkPos;
 				result.directGain = 0.4f;
+
+				client::GameMap::RayQuery queries[27];
+				client::GameMap::RayCastResult results[27];
+				int numQueries = 0;
 				for (int x = -1; x <= 1; x++)
 					for (int y = -1; y <= 1; y++)
 						for (int z = -1; z <= 1; z++) {
-							IntVector3 hitPos;
+							Vector3 checkPos;
 							checkPos.x = pos.x + (float)x * .2f;
 							checkPos.y = pos.y + (float)y * .2f;
 							checkPos.z = pos.z + (float)z * .2f;
-							if (!gameMap->CastRay(eye, (checkPos - eye).Normalize(),
-							                      (checkPos - eye).GetLength(), hitPos)) {
-								result.directGain = 1.f;
-							}
+							queries[numQueries++] =
+							  client::GameMap::RayQuery::Segment(eye, checkPos);
 						}
+				gameMap->CastRays(queries, results, numQueries);
+				for (const auto &rayResult : results) {
+					if (!rayResult.hit) {
+						result.directGain = 1.f;
+					}
+				}
 			} else {
 				result.directGain = 1.f;
 			}
@@ -484,31 +491,34 @@ namespace spades {
 			} else {
 				// do raycast
 				Vector3 rayFrom = eye;
-				Vector3 rayTo;
-
+				// Each ray is cast in both directions; the backward one is used to
+				// estimate the feedback
+				client::GameMap::RayQuery queries[8];
+				client::GameMap::RayCastResult results[8];
 				for (int rays = 0; rays < 4; rays++) {
+					Vector3 rayTo;
 					rayTo.x = SampleRandomFloat() - SampleRandomFloat();
 					rayTo.y = SampleRandomFloat() - SampleRandomFloat();
 					rayTo.z = SampleRandomFloat() - SampleRandomFloat();
 					rayTo = rayTo.Normalize();
 
-					IntVector3 hitPos;
-					bool hit = map->CastRay(rayFrom, rayTo, maxDistance, hitPos);
-					if (hit) {
-						Vector3 hitPosf = {(float)hitPos.x, (float)hitPos.y, (float)hitPos.z};
-						roomHistory[roomHistoryPos] = (hitPosf - rayFrom).GetLength();
+					queries[rays * 2] = client::GameMap::RayQuery::Segment(
+					  rayFrom, rayFrom + rayTo * maxDistance);
+					queries[rays * 2 + 1] = client::GameMap::RayQuery::Segment(
+					  rayFrom, rayFrom - rayTo * maxDistance);
+				}
+				map->CastRays(queries, results, 8);
+
+				for (int rays = 0; rays < 4; rays++) {
+					const auto &result = results[rays * 2];
+					if (result.hit) {
+						roomHistory[roomHistoryPos] = (result.hitPos - rayFrom).GetLength();
+						roomFeedbackHistory[roomHistoryPos] =
+						  results[rays * 2 + 1].hit ? 1.f : 0.f;
 					} else {
 						roomHistory[roomHistoryPos] = maxDistance * 2.f;
 					}
 
-					if (hit) {
-						bool hit2 = map->CastRay(rayFrom, -rayTo, maxDistance, hitPos);
-						if (hit2)
-							roomFeedbackHistory[roomHistoryPos] = 1.f;
-						else
-							roomFeedbackHistory[roomHistoryPos] = 0.f;
-					}
-
 					roomHistoryPos++;
 					if (roomHistoryPos == (int)roomHistory.size())
 						roomHistoryPos = 0;
@@ -49,6 +49,7 @@
 #include "SmokeSpriteEntity.h"
 
 #include "GameMap.h"
+#include "GameMapEncoder.h"
 #include "GameMapWrapper.h"
 #include "Weapon.h"
 #include "World.h"
@@ -214,6 +215,11 @@ namespace spades {
 
 			SPLog("Disconnected");
 
+			if (pendingMapShot) {
+				SPLog("Waiting for the map shot to be written");
+				pendingMapShot.reset();
+			}
+
 			RemoveAllLocalEntities();
 			RemoveAllCorpses();
 
@@ -424,6 +430,8 @@ namespace spades {
 			killfeedWindow->Update(dt);
 			limbo->Update(dt);
 
+			FinishMapShot(false);
+
 			// The loading screen
 			if (net->GetStatus() == NetClientStatusReceivingMap) {
 				// Apply temporal smoothing on the progress value
@@ -578,22 +586,51 @@ namespace spades {
 #pragma mark - Snapshots
 
 		void Client::TakeMapShot() {
+			// Only one map shot is written at once
+			FinishMapShot(true);
 
 			try {
-				std::string name = MapShotPath();
-				{
-					std::unique_ptr<IStream> stream(FileManager::OpenForWriting(name.c_str()));
-					try {
-						const Handle<GameMap> &map = GetWorld()->GetMap();
-						if (!map) {
-							SPRaise("No map loaded");
-						}
-						map->Save(stream.get());
-					} catch (...) {
-						throw;
-					}
+				const Handle<GameMap> &map = GetWorld()->GetMap();
+				if (!map) {
+					SPRaise("No map loaded");
 				}
 
+				// Encoding has to be done here because the map may change in the next frame.
+				// It's fast enough not to cause a noticeable hitch, unlike writing the file.
+				std::unique_ptr<GameMapEncoder> encoder{new GameMapEncoder(*map)};
+
+				std::string name = MapShotPath();
+				std::unique_ptr<IStream> stream(FileManager::OpenForWriting(name.c_str()));
+				encoder->StartWriting(std::move(stream));
+
+				pendingMapShot = std::move(encoder);
+				pendingMapShotName = name;
+			} catch (const Exception &ex) {
+				std::string msg;
+				msg = _Tr("Client", "Saving map failed: ");
+				msg += ex.GetShortMessage();
+				ShowAlert(msg, AlertType::Error);
+				SPLog("Saving map failed: %s", ex.what());
+			} catch (const std::exception &ex) {
+				std::string msg;
+				msg = _Tr("Client", "Saving map failed: ");
+				msg += ex.what();
+				ShowAlert(msg, AlertType::Error);
+				SPLog("Saving map failed: %s", ex.what());
+			}
+		}
+
+		void Client::FinishMapShot(bool wait) {
+			if (!pendingMapShot || (!wait && !pendingMapShot->IsComplete())) {
+				return;
+			}
+
+			std::unique_ptr<GameMapEncoder> encoder = std::move(pendingMapShot);
+			const std::string &name = pendingMapShotName;
+
+			try {
+				encoder->WaitComplete();
+
 				std::string msg;
 				msg = _Tr("Client", "Map saved: {0}", name);
 				ShowAlert(msg, AlertType::Notice);
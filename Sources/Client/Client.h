@@ -45,6 +45,7 @@ namespace spades {
 		class IRenderer;
 		struct SceneDefinition;
 		class GameMap;
+		class GameMapEncoder;
 		class GameMapWrapper;
 		class World;
 		struct PlayerInput;
@@ -333,6 +334,10 @@ namespace spades {
 			int nextScreenShotIndex;
 			int nextMapShotIndex;
 
+			/** The map shot being written in background. */
+			std::unique_ptr<GameMapEncoder> pendingMapShot;
+			std::string pendingMapShotName;
+
 			/** Project the specified world-space position to a screen space. */
 			Vector3 Project(Vector3);
 
@@ -398,6 +403,11 @@ namespace spades {
 
 			std::string MapShotPath();
 			void TakeMapShot();
+			/**
+			 * Reports the result of the map shot being written in background if it's done.
+			 * @param wait Waits for the completion instead of returning early.
+			 */
+			void FinishMapShot(bool wait);
 
 			void NetLog(const char *format, ...);
 
@@ -101,6 +101,7 @@ namespace spades {
 			Handle<IModel> CreateModel(VoxelModel &m) { return base->CreateModel(m); }
 
 			void SetGameMap(stmp::optional<GameMap &>) { OnProhibitedAction(); }
+			void PrebuildGameMap(GameMap &, const std::vector<bool> &) { OnProhibitedAction(); }
 
 			void SetFogDistance(float) { OnProhibitedAction(); }
 			void SetFogColor(Vector3) { OnProhibitedAction(); }
@@ -17,6 +17,9 @@
  along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "Client.h"
+#include "GameMap.h"
+#include "GameMapBenchmark.h"
+#include "World.h"
 
 #include <Gui/ConsoleCommand.h>
 
@@ -24,9 +27,12 @@ namespace spades {
 	namespace client {
 		namespace {
 			constexpr const char *CMD_SAVEMAP = "savemap";
+			constexpr const char *CMD_MAPBENCH = "mapbench";
 
 			std::map<std::string, std::string> const g_clientCommands{
 			  {CMD_SAVEMAP, ": Save the current state of the map to the disk"},
+			  {CMD_MAPBENCH,
+			   " <storage|snapshot|cache|raycast>: Run a micro-benchmark on the current map"},
 			};
 		} // namespace
 
@@ -38,6 +44,29 @@ namespace spades {
 				}
 				TakeMapShot();
 				return true;
+			} else if (cmd->GetName() == CMD_MAPBENCH) {
+				if (cmd->GetNumArguments() != 1) {
+					SPLog("Usage: %s <storage|snapshot|cache|raycast>", CMD_MAPBENCH);
+					return true;
+				}
+				if (!GetWorld() || !GetWorld()->GetMap()) {
+					SPLog("No map loaded");
+					return true;
+				}
+				GameMap &map = *GetWorld()->GetMap();
+				const std::string &benchmark = cmd->GetArgument(0);
+				if (benchmark == "storage") {
+					GameMapBenchmark::RunStorageBenchmark(map);
+				} else if (benchmark == "snapshot") {
+					GameMapBenchmark::RunSnapshotBenchmark(map);
+				} else if (benchmark == "cache") {
+					GameMapBenchmark::RunCacheBenchmark(map);
+				} else if (benchmark == "raycast") {
+					GameMapBenchmark::RunRayCastBenchmark(map);
+				} else {
+					SPLog("Unknown benchmark: %s", benchmark.c_str());
+				}
+				return true;
 			} else {
 				return false;
 			}
@@ -304,27 +304,36 @@ namespace spades {
 				freeState.position = lastPos;
 				freeState.velocity *= 0.f;
 			} else {
+				GameMap::RayQuery queries[27];
+				GameMap::RayCastResult results[27];
+				Vector3 shifts[27];
+				int numQueries = 0;
 				for (int sx = -1; sx <= 1; sx++)
 					for (int sy = -1; sy <= 1; sy++)
 						for (int sz = -1; sz <= 1; sz++) {
-							GameMap::RayCastResult result;
 							Vector3 shift = {sx * .1f, sy * .1f, sz * .1f};
-							result =
-							  map->CastRay2(lastPos + shift, freeState.position - lastPos, 256);
-							if (result.hit && !result.startSolid &&
-							    Vector3::Dot(result.hitPos - freeState.position - shift,
-							                 freeState.position - lastPos) < 0.f) {
-
-								float dist =
-								  Vector3::Dot(result.hitPos - freeState.position - shift,
-								               (freeState.position - lastPos).Normalize());
-								if (dist < minDist) {
-									minResult = result;
-									minDist = dist;
-									minShift = shift;
-								}
-							}
+							shifts[numQueries] = shift;
+							queries[numQueries++] = GameMap::RayQuery{
+							  lastPos + shift, freeState.position - lastPos, 256, INFINITY};
 						}
+				map->CastRays(queries, results, numQueries);
+
+				for (int i = 0; i < numQueries; i++) {
+					const GameMap::RayCastResult &result = results[i];
+					const Vector3 &shift = shifts[i];
+					if (result.hit && !result.startSolid &&
+					    Vector3::Dot(result.hitPos - freeState.position - shift,
+					                 freeState.position - lastPos) < 0.f) {
+
+						float dist = Vector3::Dot(result.hitPos - freeState.position - shift,
+						                          (freeState.position - lastPos).Normalize());
+						if (dist < minDist) {
+							minResult = result;
+							minDist = dist;
+							minShift = shift;
+						}
+					}
+				}
 			}
 			if (minDist < 1.e+9f) {
 				GameMap::RayCastResult result = minResult;
@@ -0,0 +1,156 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "CompactColorMap.h"
+#include <Core/Debug.h>
+
+namespace spades {
+	namespace client {
+		CompactColorMap::CompactColorMap(int width, int height)
+		    : width{width}, height{height}, numWastedEntries{0} {
+			SPADES_MARK_FUNCTION();
+
+			Column emptyColumn;
+			emptyColumn.mask = 0;
+			emptyColumn.offset = 0;
+			emptyColumn.capacity = 0;
+			columns.resize(static_cast<std::size_t>(width) * height, emptyColumn);
+		}
+
+		void CompactColorMap::Reserve(Column &col, uint32_t numEntries) {
+			if (numEntries <= col.capacity) {
+				return;
+			}
+
+			if (col.capacity == 0) {
+				// Nothing to move; just start a new run at the end of the pool
+				col.offset = static_cast<uint32_t>(pool.size());
+			}
+
+			if (col.offset + col.capacity == pool.size()) {
+				// This column is the last one in the pool. This is always the case while
+				// a map is being loaded, so the loaded map ends up being tightly packed.
+				pool.resize(col.offset + numEntries);
+				col.capacity = numEntries;
+				return;
+			}
+
+			// Relocate the column to the end of the pool, leaving some room for
+			// future insertions
+			uint32_t newCapacity = std::min<uint32_t>(numEntries + 3, 64);
+			uint32_t newOffset = static_cast<uint32_t>(pool.size());
+			pool.resize(pool.size() + newCapacity);
+			std::copy(pool.begin() + col.offset, pool.begin() + col.offset + col.capacity,
+			          pool.begin() + newOffset);
+			numWastedEntries += col.capacity + (newCapacity - numEntries);
+			col.offset = newOffset;
+			col.capacity = newCapacity;
+		}
+
+		void CompactColorMap::Set(int x, int y, int z, uint32_t color) {
+			SPAssert(z >= 0 && z < 64);
+
+			Column &col = columns[Index(x, y)];
+			uint64_t bit = 1ULL << z;
+			uint32_t index = static_cast<uint32_t>(CountBits64(col.mask & (bit - 1)));
+
+			if (col.mask & bit) {
+				pool[col.offset + index] = color;
+				return;
+			}
+
+			uint32_t count = static_cast<uint32_t>(CountBits64(col.mask));
+			if (count == col.capacity) {
+				if (col.offset + col.capacity != pool.size() &&
+				    numWastedEntries > std::max<std::size_t>(pool.size() / 2, 65536)) {
+					Compact();
+				}
+				Reserve(col, count + 1);
+			} else {
+				// Consume the slack space reserved by `Reserve`
+				SPAssert(numWastedEntries > 0);
+				numWastedEntries--;
+			}
+
+			uint32_t *colors = pool.data() + col.offset;
+			std::memmove(colors + index + 1, colors + index, (count - index) * sizeof(uint32_t));
+			colors[index] = color;
+			col.mask |= bit;
+		}
+
+		void CompactColorMap::AssignColumn(int x, int y, uint64_t mask, const uint32_t *colors) {
+			Column &col = columns[Index(x, y)];
+			if (col.mask != 0) {
+				while (mask) {
+					int z = CountTrailingZeros64(mask);
+					mask &= mask - 1;
+					Set(x, y, z, colors[z]);
+				}
+				return;
+			}
+
+			uint32_t count = static_cast<uint32_t>(CountBits64(mask));
+			// The column's current capacity (if any) is already accounted as wasted
+			if (count > col.capacity) {
+				col.offset = static_cast<uint32_t>(pool.size());
+				col.capacity = count;
+				pool.resize(pool.size() + count);
+			} else {
+				numWastedEntries -= count;
+			}
+
+			uint32_t *out = pool.data() + col.offset;
+			col.mask = mask;
+			while (mask) {
+				int z = CountTrailingZeros64(mask);
+				mask &= mask - 1;
+				*(out++) = colors[z];
+			}
+		}
+
+		void CompactColorMap::Compact() {
+			SPADES_MARK_FUNCTION();
+
+			std::vector<uint32_t> newPool;
+			newPool.reserve(pool.size() - numWastedEntries);
+
+			for (Column &col : columns) {
+				uint32_t count = static_cast<uint32_t>(CountBits64(col.mask));
+				uint32_t newOffset = static_cast<uint32_t>(newPool.size());
+				newPool.insert(newPool.end(), pool.begin() + col.offset,
+				               pool.begin() + col.offset + count);
+				col.offset = newOffset;
+				col.capacity = count;
+			}
+
+			pool.swap(newPool);
+			pool.shrink_to_fit();
+			numWastedEntries = 0;
+		}
+
+		std::size_t CompactColorMap::GetMemoryUsage() const {
+			return sizeof(*this) + columns.capacity() * sizeof(Column) +
+			       pool.capacity() * sizeof(uint32_t);
+		}
+	} // namespace client
+} // namespace spades
@@ -0,0 +1,115 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <Core/Debug.h>
+#include <Core/Math.h>
+
+namespace spades {
+	namespace client {
+		/**
+		 * Sparse voxel color storage used by `GameMap`'s compact storage mode.
+		 *
+		 * Only voxels that were explicitly given a color (which, for a map loaded from
+		 * a VXL file, are exactly the surface voxels) occupy memory. Each column has
+		 * a 64-bit occupancy mask and a run of colors stored in a shared pool, sorted by
+		 * Z coordinate. A voxel's index in the run is the number of occupied voxels
+		 * above it, so a lookup is a single population count and a load.
+		 *
+		 * Voxels without a stored color report a ground color generated by
+		 * `GetDefaultColor`, which is also what the dense storage is initialized with.
+		 */
+		class CompactColorMap {
+		public:
+			CompactColorMap(int width, int height);
+
+			inline uint32_t Get(int x, int y, int z) const {
+				const Column &col = columns[Index(x, y)];
+				uint64_t bit = 1ULL << z;
+				if (!(col.mask & bit)) {
+					return GetDefaultColor(x, y, z);
+				}
+				return pool[col.offset + CountBits64(col.mask & (bit - 1))];
+			}
+
+			void Set(int x, int y, int z, uint32_t color);
+
+			/**
+			 * Stores the colors of every voxel in `mask` at once. `colors` is indexed by
+			 * Z coordinate. This is faster than `Set` if the column has no stored colors yet.
+			 */
+			void AssignColumn(int x, int y, uint64_t mask, const uint32_t *colors);
+
+			/** Returns whether a color was explicitly stored for the voxel. */
+			bool Has(int x, int y, int z) const {
+				return (columns[Index(x, y)].mask >> z) & 1;
+			}
+
+			/** Returns the number of voxels that have a stored color. */
+			std::size_t GetNumStoredColors() const { return pool.size() - numWastedEntries; }
+
+			/** Returns the number of bytes allocated for this storage. */
+			std::size_t GetMemoryUsage() const;
+
+			/** Releases slack space left by relocated columns. */
+			void Compact();
+
+			/** Returns a randomized (but deterministic) ground color for a voxel. */
+			static uint32_t GetDefaultColor(int x, int y, int z) {
+				uint32_t h = static_cast<uint32_t>(x) * 0x9E3779B1U;
+				h ^= static_cast<uint32_t>(y) * 0x85EBCA77U;
+				h ^= static_cast<uint32_t>(z) * 0xC2B2AE3DU;
+				h ^= h >> 15;
+				uint32_t col = 0x00284067;
+				col ^= 0x070707 & h;
+				return col + (100UL * 0x1000000UL);
+			}
+
+		private:
+			struct Column {
+				/** Bit `z` is set if the voxel at Z coordinate `z` has a stored color. */
+				uint64_t mask;
+				/** Index of the first color of this column in `pool`. */
+				uint32_t offset;
+				/** The number of entries reserved for this column in `pool`. */
+				uint32_t capacity;
+			};
+
+			int width, height;
+			std::vector<Column> columns;
+			std::vector<uint32_t> pool;
+
+			/** The number of entries in `pool` not owned by any column. */
+			std::size_t numWastedEntries;
+
+			inline std::size_t Index(int x, int y) const {
+				SPAssert(x >= 0 && x < width);
+				SPAssert(y >= 0 && y < height);
+				return static_cast<std::size_t>(x) * height + y;
+			}
+
+			void Reserve(Column &, uint32_t numEntries);
+		};
+	} // namespace client
+} // namespace spades
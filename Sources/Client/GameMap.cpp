@@ -22,32 +22,141 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdlib>
+#include <iterator>
 #include <vector>
 
 #include "GameMap.h"
+#include "GameMapCastRay.h"
+#include "GameMapDecoder.h"
+#include "GameMapEncoder.h"
 #include <Core/Debug.h>
 #include <Core/Exception.h>
 #include <Core/FileManager.h>
 #include <Core/IStream.h>
-#include <Core/RandomAccessAdaptor.h>
+#include <Core/Settings.h>
+
+DEFINE_SPADES_SETTING(cl_mapStorage, "dense");
 
 namespace spades {
 	namespace client {
 
-		GameMap::GameMap() {
+		GameMap::GameMap() : GameMap(GetDefaultStorageMode()) {}
+
+		GameMap::GameMap(StorageMode storageMode) {
 			SPADES_MARK_FUNCTION();
 
+			static_assert(int{GameMapSnapshot::Width} == int{DefaultWidth}, "Dimension mismatch");
+			static_assert(int{GameMapSnapshot::Height} == int{DefaultHeight}, "Dimension mismatch");
+			static_assert(int{GameMapSnapshot::Depth} == int{DefaultDepth}, "Dimension mismatch");
+
 			for (int x = 0; x < DefaultWidth; x++)
-				for (int y = 0; y < DefaultHeight; y++) {
+				for (int y = 0; y < DefaultHeight; y++)
 					solidMap[x][y] = 1; // ground only
-					for (int z = 0; z < DefaultDepth; z++) {
-						uint32_t col = 0x00284067;
-						col ^= 0x070707 & static_cast<uint32_t>(SampleRandom());
-						colorMap[x][y][z] = col + (100UL * 0x1000000UL);
+
+			switch (storageMode) {
+				case StorageMode::Dense:
+					colorMap.reset(new uint32_t[DefaultWidth * DefaultHeight * DefaultDepth]);
+					// Use the same ground colors as the compact storage so that both modes
+					// behave identically
+					for (int x = 0; x < DefaultWidth; x++)
+						for (int y = 0; y < DefaultHeight; y++)
+							for (int z = 0; z < DefaultDepth; z++)
+								colorMap[ColorIndex(x, y, z)] =
+								  CompactColorMap::GetDefaultColor(x, y, z);
+					break;
+				case StorageMode::Compact:
+					compactColorMap.reset(new CompactColorMap(DefaultWidth, DefaultHeight));
+					break;
+			}
+		}
+		GameMap::GameMap(const GameMap &other) {
+			SPADES_MARK_FUNCTION();
+
+			std::copy(&other.solidMap[0][0], &other.solidMap[0][0] + DefaultWidth * DefaultHeight,
+			          &solidMap[0][0]);
+			if (other.colorMap) {
+				colorMap.reset(new uint32_t[DefaultWidth * DefaultHeight * DefaultDepth]);
+				std::copy(other.colorMap.get(),
+				          other.colorMap.get() + DefaultWidth * DefaultHeight * DefaultDepth,
+				          colorMap.get());
+			} else {
+				compactColorMap.reset(new CompactColorMap(*other.compactColorMap));
+			}
+		}
+		GameMap::~GameMap() { SPADES_MARK_FUNCTION(); }
+
+		GameMap::StorageMode GameMap::GetDefaultStorageMode() {
+			std::string mode = cl_mapStorage;
+			if (mode == "compact") {
+				return StorageMode::Compact;
+			} else if (mode != "dense") {
+				SPLog("Unknown map storage mode '%s'; falling back to 'dense'", mode.c_str());
+			}
+			return StorageMode::Dense;
+		}
+
+		std::size_t GameMap::GetMemoryUsage() const {
+			std::size_t size = sizeof(*this);
+			if (colorMap) {
+				size += sizeof(uint32_t) * DefaultWidth * DefaultHeight * DefaultDepth;
+			}
+			if (compactColorMap) {
+				size += compactColorMap->GetMemoryUsage();
+			}
+			for (const std::shared_ptr<const GameMapSnapshot::Page> &page : snapshotPages) {
+				if (page) {
+					size += page->GetMemoryUsage();
+				}
+			}
+			return size;
+		}
+
+		Handle<GameMapSnapshot> GameMap::CreateSnapshot() {
+			SPADES_MARK_FUNCTION();
+
+			Handle<GameMapSnapshot> snapshot{new GameMapSnapshot(), false};
+			snapshot->version = version;
+
+			for (int pageY = 0; pageY < GameMapSnapshot::NumPagesY; pageY++) {
+				for (int pageX = 0; pageX < GameMapSnapshot::NumPagesX; pageX++) {
+					int index = pageX + pageY * GameMapSnapshot::NumPagesX;
+					if (!snapshotPages[index]) {
+						snapshotPages[index] =
+						  std::make_shared<const GameMapSnapshot::Page>(*this, pageX, pageY);
+						snapshot->numCopiedPages++;
 					}
+					snapshot->pages[index] = snapshotPages[index];
 				}
+			}
+
+			return snapshot;
+		}
+
+		Handle<GameMap> GameMap::Clone() const { return {new GameMap(*this), false}; }
+
+		void GameMap::Assign(const GameMap &other) {
+			SPADES_MARK_FUNCTION();
+			SPAssert(GetStorageMode() == other.GetStorageMode());
+
+			std::copy(&other.solidMap[0][0], &other.solidMap[0][0] + DefaultWidth * DefaultHeight,
+			          &solidMap[0][0]);
+			if (colorMap) {
+				std::copy(other.colorMap.get(),
+				          other.colorMap.get() + DefaultWidth * DefaultHeight * DefaultDepth,
+				          colorMap.get());
+			} else {
+				*compactColorMap = *other.compactColorMap;
+			}
+
+			version++;
+			MarkAllPagesStale();
+		}
+
+		void GameMap::MarkAllPagesStale() {
+			for (std::shared_ptr<const GameMapSnapshot::Page> &page : snapshotPages) {
+				page.reset();
+			}
 		}
-		GameMap::~GameMap() { SPADES_MARK_FUNCTION(); }
 
 		void GameMap::AddListener(spades::client::IGameMapListener *l) {
 			std::lock_guard<std::mutex> _guard{listenersMutex};
@@ -62,101 +171,37 @@ namespace spades {
 			}
 		}
 
-		bool GameMap::IsSurface(int x, int y, int z) const {
-			if (!IsSolid(x, y, z))
-				return false;
-			if (z == 0)
-				return true;
-			if (x > 0 && !IsSolid(x - 1, y, z))
-				return true;
-			if (x < Width() - 1 && !IsSolid(x + 1, y, z))
-				return true;
-			if (y > 0 && !IsSolid(x, y - 1, z))
-				return true;
-			if (y < Height() - 1 && !IsSolid(x, y + 1, z))
-				return true;
-			if (!IsSolid(x, y, z - 1))
-				return true;
-			if (z < Depth() - 1 && !IsSolid(x, y, z + 1))
-				return true;
-			return false;
+		void GameMap::BeginBatch() { batchDepth++; }
+
+		void GameMap::EndBatch() {
+			SPAssert(batchDepth > 0);
+			if (--batchDepth > 0 || dirtyColumns.empty()) {
+				return;
+			}
+
+			{
+				std::lock_guard<std::mutex> guard{listenersMutex};
+				for (auto *l : listeners) {
+					l->GameMapColumnsChanged(dirtyColumns, this);
+				}
+			}
+
+			dirtyColumns.clear();
+			dirtyColumnIndices.clear();
 		}
 
-		static void WriteColor(std::vector<char> &buffer, int color) {
-			buffer.push_back((char)(color >> 16));
-			buffer.push_back((char)(color >> 8));
-			buffer.push_back((char)(color >> 0));
-			buffer.push_back((char)(color >> 24));
+		void GameMap::MarkDirty(int x, int y, int z) {
+			auto it = dirtyColumnIndices.emplace(x + y * DefaultWidth, dirtyColumns.size());
+			if (it.second) {
+				dirtyColumns.push_back(
+				  GameMapDirtyColumn{static_cast<short>(x), static_cast<short>(y), 0});
+			}
+			dirtyColumns[it.first->second].mask |= 1ULL << z;
 		}
 
-		// base on pysnip
 		void GameMap::Save(spades::IStream *stream) {
-			int w = Width();
-			int h = Height();
-			int d = Depth();
-			std::vector<char> buffer;
-			buffer.reserve(10 * 1024 * 1024);
-			for (int y = 0; y < h; y++) {
-				for (int x = 0; x < w; x++) {
-					int k = 0;
-					while (k < d) {
-						int z;
-
-						int air_start;
-						int top_colors_start;
-						int top_colors_end; // exclusive
-						int bottom_colors_start;
-						int bottom_colors_end; // exclusive
-						int top_colors_len;
-						int bottom_colors_len;
-						int colors;
-						air_start = k;
-						while (k < d && !IsSolid(x, y, k))
-							++k;
-						top_colors_start = k;
-						while (k < d && IsSurface(x, y, k))
-							++k;
-						top_colors_end = k;
-
-						while (k < d && IsSolid(x, y, k) && !IsSurface(x, y, k))
-							++k;
-
-						bottom_colors_start = k;
-
-						z = k;
-						while (z < d && IsSurface(x, y, z))
-							++z;
-
-						if (z != d) {
-							while (IsSurface(x, y, k))
-								++k;
-						}
-						bottom_colors_end = k;
-
-						top_colors_len = top_colors_end - top_colors_start;
-						bottom_colors_len = bottom_colors_end - bottom_colors_start;
-
-						colors = top_colors_len + bottom_colors_len;
-
-						if (k == d) {
-							buffer.push_back(0);
-						} else {
-							buffer.push_back(colors + 1);
-						}
-						buffer.push_back(top_colors_start);
-						buffer.push_back(top_colors_end - 1);
-						buffer.push_back(air_start);
-
-						for (z = 0; z < top_colors_len; ++z) {
-							WriteColor(buffer, GetColor(x, y, top_colors_start + z));
-						}
-						for (z = 0; z < bottom_colors_len; ++z) {
-							WriteColor(buffer, GetColor(x, y, bottom_colors_start + z));
-						}
-					}
-				}
-			}
-			stream->Write(buffer.data(), buffer.size());
+			SPADES_MARK_FUNCTION();
+			GameMapEncoder{*this}.Write(*stream);
 		}
 
 		bool GameMap::ClipBox(int x, int y, int z) const {
@@ -208,154 +253,7 @@ namespace spades {
 		bool GameMap::CastRay(spades::Vector3 v0, spades::Vector3 v1, float length,
 		                      spades::IntVector3 &vOut) const {
 			SPADES_MARK_FUNCTION_DEBUG();
-
-			SPAssert(!std::isnan(v0.x));
-			SPAssert(!std::isnan(v0.y));
-			SPAssert(!std::isnan(v0.z));
-			SPAssert(!std::isnan(v1.x));
-			SPAssert(!std::isnan(v1.y));
-			SPAssert(!std::isnan(v1.z));
-			SPAssert(!std::isnan(length));
-
-			v1 = v0 + v1 * length;
-
-			Vector3 f, g;
-			IntVector3 a, c, d, p, i;
-			long cnt = 0;
-
-			a = v0.Floor();
-			c = v1.Floor();
-
-			if (c.x < a.x) {
-				d.x = -1;
-				f.x = v0.x - a.x;
-				g.x = (v0.x - v1.x) * 1024;
-				cnt += a.x - c.x;
-			} else if (c.x != a.x) {
-				d.x = 1;
-				f.x = a.x + 1 - v0.x;
-				g.x = (v1.x - v0.x) * 1024;
-				cnt += c.x - a.x;
-			} else {
-				d.x = 0;
-				f.x = g.x = 0;
-			}
-			if (c.y < a.y) {
-				d.y = -1;
-				f.y = v0.y - a.y;
-				g.y = (v0.y - v1.y) * 1024;
-				cnt += a.y - c.y;
-			} else if (c.y != a.y) {
-				d.y = 1;
-				f.y = a.y + 1 - v0.y;
-				g.y = (v1.y - v0.y) * 1024;
-				cnt += c.y - a.y;
-			} else {
-				d.y = 0;
-				f.y = g.y = 0;
-			}
-			if (c.z < a.z) {
-				d.z = -1;
-				f.z = v0.z - a.z;
-				g.z = (v0.z - v1.z) * 1024;
-				cnt += a.z - c.z;
-			} else if (c.z != a.z) {
-				d.z = 1;
-				f.z = a.z + 1 - v0.z;
-				g.z = (v1.z - v0.z) * 1024;
-				cnt += c.z - a.z;
-			} else {
-				d.z = 0;
-				f.z = g.z = 0;
-			}
-
-			Vector3 pp =
-			  MakeVector3(f.x * g.z - f.z * g.x, f.y * g.z - f.z * g.y, f.y * g.x - f.x * g.y);
-			p = pp.Floor();
-			i = g.Floor();
-
-			if (cnt > (long)length)
-				cnt = (long)length;
-
-#if 1
-			// faster version
-			uint64_t lastSolidMap = solidMap[a.x & (DefaultWidth - 1)][a.y & (DefaultHeight - 1)];
-			if (a.z < 0 && d.z < 0) {
-				return false;
-			} else if (a.z < 0) {
-				while (cnt > 0 && a.z < 0) {
-					if (((p.x | p.y) >= 0) && (a.z != c.z)) {
-						a.z += d.z;
-						p.x -= i.x;
-						p.y -= i.y;
-					} else if ((p.z >= 0) && (a.x != c.x)) {
-						a.x += d.x;
-						p.x += i.z;
-						p.z -= i.y;
-					} else {
-						a.y += d.y;
-						p.y += i.z;
-						p.z += i.x;
-					}
-					cnt--;
-				}
-			} else if (a.z >= 64) {
-				vOut = a;
-				return true;
-			}
-			while (cnt > 0) {
-				if (((p.x | p.y) >= 0) && (a.z != c.z)) {
-					a.z += d.z;
-					p.x -= i.x;
-					p.y -= i.y;
-					if (a.z < 0 && d.z < 0) {
-						return false;
-					} else if (a.z >= 64) {
-						vOut = a;
-						return true;
-					}
-				} else if ((p.z >= 0) && (a.x != c.x)) {
-					a.x += d.x;
-					p.x += i.z;
-					p.z -= i.y;
-					lastSolidMap = solidMap[a.x & (DefaultWidth - 1)][a.y & (DefaultHeight - 1)];
-				} else {
-					a.y += d.y;
-					p.y += i.z;
-					p.z += i.x;
-					lastSolidMap = solidMap[a.x & (DefaultWidth - 1)][a.y & (DefaultHeight - 1)];
-				}
-
-				if ((lastSolidMap >> (uint64_t)a.z) & 1ULL) {
-					vOut = a;
-					return true;
-				}
-				cnt--;
-			}
-#else
-			while (cnt > 0) {
-				if (((p.x | p.y) >= 0) && (a.z != c.z)) {
-					a.z += d.z;
-					p.x -= i.x;
-					p.y -= i.y;
-				} else if ((p.z >= 0) && (a.x != c.x)) {
-					a.x += d.x;
-					p.x += i.z;
-					p.z -= i.y;
-				} else {
-					a.y += d.y;
-					p.y += i.z;
-					p.z += i.x;
-				}
-
-				if (IsSolidWrapped(a.x, a.y, a.z)) {
-					vOut = a;
-					return true;
-				}
-				cnt--;
-			}
-#endif
-			return false;
+			return CastRayVanilla(*this, v0, v1, length, vOut);
 		}
 
 		GameMap::RayCastResult GameMap::CastRay2(spades::Vector3 v0, spades::Vector3 dir,
@@ -506,93 +404,23 @@ namespace spades {
 			return result;
 		}
 
-		static uint32_t swapColor(uint32_t col) {
-			union {
-				uint8_t bytes[4];
-				uint32_t c;
-			} u;
-			u.c = col;
-			std::swap(u.bytes[0], u.bytes[2]);
-			return (u.c & 0xffffff) | (100UL * 0x1000000);
+		GameMap *GameMap::Load(spades::IStream *stream, std::function<void(int)> onProgress) {
+			return Load(stream, std::move(onProgress), GetDefaultStorageMode());
 		}
 
-		GameMap *GameMap::Load(spades::IStream *stream, std::function<void(int)> onProgress) {
+		GameMap *GameMap::Load(spades::IStream *stream, std::function<void(int)> onProgress,
+		                       StorageMode storageMode) {
 			SPADES_MARK_FUNCTION();
 
-			RandomAccessAdaptor view{*stream};
-
-			size_t pos = 0;
-
-			auto map = Handle<GameMap>::New();
-
 			if (onProgress) {
 				onProgress(0);
 			}
 
-			for (int y = 0; y < 512; y++) {
-				for (int x = 0; x < 512; x++) {
-					map->solidMap[x][y] = 0xffffffffffffffffULL;
-
-					int z = 0;
-					for (;;) {
-						// Read a block ahead in attempt to minimize the number of calls to
-						// `IStream::Read`
-						view.Prefetch(pos + 512);
-
-						int i;
-						int number_4byte_chunks = view.Read<int8_t>(pos);
-						int top_color_start = view.Read<int8_t>(pos + 1);
-						int top_color_end = view.Read<int8_t>(pos + 2);
-						int bottom_color_start;
-						int bottom_color_end;
-						int len_top;
-						int len_bottom;
-
-						for (i = z; i < top_color_start; i++)
-							map->Set(x, y, i, false, 0, true);
-
-						size_t colorOffset = pos + 4;
-						for (z = top_color_start; z <= top_color_end; z++) {
-							uint32_t col = swapColor(view.Read<uint32_t>(colorOffset));
-							map->Set(x, y, z, true, col, true);
-							colorOffset += 4;
-						}
-
-						if (top_color_end == 62) {
-							map->Set(x, y, 63, true, map->GetColor(x, y, 62), true);
-						}
-
-						len_bottom = top_color_end - top_color_start + 1;
-
-						if (number_4byte_chunks == 0) {
-							pos += 4 * (len_bottom + 1);
-							break;
-						}
-
-						len_top = (number_4byte_chunks - 1) - len_bottom;
-
-						pos += (int)view.Read<int8_t>(pos) * 4;
-
-						bottom_color_end = view.Read<int8_t>(pos + 3);
-						bottom_color_start = bottom_color_end - len_top;
-
-						for (z = bottom_color_start; z < bottom_color_end; z++) {
-							uint32_t col = swapColor(view.Read<uint32_t>(colorOffset));
-							map->Set(x, y, z, true, col, true);
-							colorOffset += 4;
-						}
-						if (bottom_color_end == 63) {
-							map->Set(x, y, 63, true, map->GetColor(x, y, 62), true);
-						}
-					}
+			GameMapDecoder decoder{storageMode, std::move(onProgress)};
 
-					if (onProgress) {
-						onProgress(x + y * 512 + 1);
-					}
-				}
-			}
+			decoder.AddData(*stream);
 
-			return std::move(map).Unmanage();
+			return decoder.Finish().Unmanage();
 		}
 	} // namespace client
 } // namespace spades
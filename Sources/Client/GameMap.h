@@ -24,18 +24,29 @@
 #include <cstdint>
 #include <functional>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include <Core/Debug.h>
 #include <Core/Math.h>
 
+#include "CompactColorMap.h"
+#include "GameMapSnapshot.h"
 #include "IGameMapListener.h"
 #include <Core/RefCountedObject.h>
 
 namespace spades {
 	class IStream;
 	namespace client {
+		class GameMapDecoder;
+		class GameMapCache;
+
 		class GameMap : public RefCountedObject {
+			friend class GameMapDecoder;
+			friend class GameMapCache;
+
 		protected:
 			~GameMap();
 
@@ -46,17 +57,47 @@ namespace spades {
 				DefaultHeight = 512,
 				DefaultDepth = 64 // should be <= 64
 			};
+
+			/** Specifies how voxel colors are stored. */
+			enum class StorageMode {
+				/** Every voxel has a color. Fast, but always takes 64MB. */
+				Dense,
+				/** Only the voxels that were assigned a color have one. See `CompactColorMap`. */
+				Compact
+			};
+
+			/** Constructs a `GameMap` using the storage mode specified by `cl_mapStorage`. */
 			GameMap();
+			GameMap(StorageMode);
 
 			/**
 			 * Construct a `GameMap` from VOXLAP5 terrain data supplied by the specified stream.
 			 *
+			 * The columns are decoded in parallel by `GameMapDecoder`.
+			 *
 			 * @param onProgress Called whenever a new column (a set of voxels with the same X and Y
 			 *                   coordinates) is loaded from the stream. The parameter indicates
 			 *					 the number of columns loaded
 			 *					 (up to `DefaultWidth * DefaultHeight`).
+			 *					 It may be called from worker threads, not necessarily in
+			 *					 the increasing order.
 			 */
 			static GameMap *Load(IStream *, std::function<void(int)> onProgress = {});
+			static GameMap *Load(IStream *, std::function<void(int)> onProgress,
+			                     StorageMode storageMode);
+
+			/** Returns the storage mode specified by `cl_mapStorage`. */
+			static StorageMode GetDefaultStorageMode();
+
+			StorageMode GetStorageMode() const {
+				return colorMap ? StorageMode::Dense : StorageMode::Compact;
+			}
+
+			/**
+			 * Returns the approximate number of bytes occupied by this map, including the
+			 * snapshot pages retained for `CreateSnapshot`.
+			 */
+			std::size_t GetMemoryUsage() const;
 
 			void Save(IStream *);
 
@@ -81,7 +122,10 @@ namespace spades {
 				SPAssert(y < Height());
 				SPAssert(z >= 0);
 				SPAssert(z < Depth());
-				return colorMap[x][y][z];
+				if (colorMap) {
+					return colorMap[ColorIndex(x, y, z)];
+				}
+				return compactColorMap->Get(x, y, z);
 			}
 
 			inline uint64_t GetSolidMapWrapped(int x, int y) const {
@@ -98,7 +142,7 @@ namespace spades {
 			}
 
 			inline uint32_t GetColorWrapped(int x, int y, int z) const {
-				return colorMap[x & (Width() - 1)][y & (Height() - 1)][z & (Depth() - 1)];
+				return GetColor(x & (Width() - 1), y & (Height() - 1), z & (Depth() - 1));
 			}
 
 			inline void Set(int x, int y, int z, bool solid, uint32_t color, bool unsafe = false) {
@@ -111,21 +155,42 @@ namespace spades {
 				uint64_t mask = 1ULL << z;
 				uint64_t value = solidMap[x][y];
 				bool changed = false;
+				bool solidityChanged = false;
 				if ((value & mask) != (solid ? mask : 0ULL)) {
 					changed = true;
+					solidityChanged = true;
 					value &= ~mask;
 					if (solid)
 						value |= mask;
 					solidMap[x][y] = value;
 				}
 				if (solid) {
-					if (color != colorMap[x][y][z]) {
+					if (colorMap) {
+						uint32_t &storedColor = colorMap[ColorIndex(x, y, z)];
+						if (color != storedColor) {
+							changed = true;
+							storedColor = color;
+						}
+					} else if (color != compactColorMap->Get(x, y, z)) {
 						changed = true;
-						colorMap[x][y][z] = color;
+						compactColorMap->Set(x, y, z, color);
 					}
 				}
+				if (changed) {
+					version++;
+					MarkPageStale(x, y);
+				}
+				if (solidityChanged) {
+					// The surface voxels of the neighboring columns may have changed
+					MarkPageStale(x - 1, y);
+					MarkPageStale(x + 1, y);
+					MarkPageStale(x, y - 1);
+					MarkPageStale(x, y + 1);
+				}
 				if (!unsafe) {
-					if (changed) {
+					if (changed && batchDepth > 0) {
+						MarkDirty(x, y, z);
+					} else if (changed) {
 						std::lock_guard<std::mutex> guard{listenersMutex};
 						for (auto *l : listeners) {
 							l->GameMapChanged(x, y, z, this);
@@ -134,9 +199,65 @@ namespace spades {
 				}
 			}
 
+			/** Returns a number that is incremented whenever a voxel is modified by `Set`. */
+			uint64_t GetVersion() const { return version; }
+
+			/**
+			 * Creates an immutable view of the current state of this map that can be read by
+			 * other threads while this map is being modified.
+			 *
+			 * The map retains the pages of the last snapshot until they are modified, and the
+			 * unmodified pages are shared with the new snapshot. This is cheap when called every
+			 * frame even if the earlier snapshots were already released. Must be called on the
+			 * thread that modifies the map.
+			 */
+			Handle<GameMapSnapshot> CreateSnapshot();
+
+			/** Returns a new map with the same voxels and storage mode. */
+			Handle<GameMap> Clone() const;
+
+			/**
+			 * Replaces all voxels of this map with the ones of `other`, which must have the
+			 * same storage mode. Listeners are not notified.
+			 */
+			void Assign(const GameMap &other);
+
 			void AddListener(IGameMapListener *);
 			void RemoveListener(IGameMapListener *);
 
+			/**
+			 * Starts a batch edit. Until the matching `EndBatch` call, `Set` records modified
+			 * voxels instead of notifying listeners. Batches can be nested.
+			 *
+			 * A batch must begin and end on the thread that modifies the map.
+			 */
+			void BeginBatch();
+
+			/**
+			 * Ends a batch edit. When the outermost batch ends, every listener is notified
+			 * once of all voxels modified during the batch through
+			 * `IGameMapListener::GameMapColumnsChanged`.
+			 */
+			void EndBatch();
+
+			/** Calls `BeginBatch` and `EndBatch` on construction and destruction. */
+			class BatchScope {
+				GameMap *map;
+
+			public:
+				/** @param map The map to edit. Can be null, in which case this does nothing. */
+				BatchScope(GameMap *map) : map(map) {
+					if (map)
+						map->BeginBatch();
+				}
+				~BatchScope() {
+					if (map)
+						map->EndBatch();
+				}
+				BatchScope(const BatchScope &) = delete;
+				void operator=(const BatchScope &) = delete;
+			};
+
 			bool ClipBox(int x, int y, int z) const;
 			bool ClipWorld(int x, int y, int z) const;
 
@@ -156,13 +277,78 @@ namespace spades {
 			};
 			RayCastResult CastRay2(Vector3 v0, Vector3 dir, int maxSteps) const;
 
+			/** A ray to be traced by `CastRays`. */
+			struct RayQuery {
+				Vector3 origin;
+				/** The direction of the ray. Doesn't have to be normalized. */
+				Vector3 dir;
+				/** The maximum number of voxel boundaries the ray crosses. */
+				int maxSteps;
+				/** The ray is terminated without a hit after travelling this distance. */
+				float maxDistance;
+
+				/** Makes a query for the line segment from `from` to `to`. */
+				static RayQuery Segment(const Vector3 &from, const Vector3 &to) {
+					Vector3 dir = to - from;
+					// A segment can't cross more voxel boundaries than this
+					int maxSteps = static_cast<int>(dir.GetManhattanLength()) + 3;
+					return RayQuery{from, dir, maxSteps, dir.GetLength()};
+				}
+			};
+
+			/**
+			 * Traces multiple rays at once. Each result is identical to the one that
+			 * `CastRay2(origin, dir, maxSteps)` would return if the ray isn't terminated by
+			 * `maxDistance`.
+			 *
+			 * Rays are traversed in packets using SIMD instructions (where available), so this
+			 * is considerably faster than calling `CastRay2` repeatedly.
+			 */
+			void CastRays(const RayQuery *queries, RayCastResult *results,
+			              std::size_t count) const;
+
 		private:
+			/** Copies the voxels of `other`. Used by `Clone`. */
+			GameMap(const GameMap &other);
+
 			uint64_t solidMap[DefaultWidth][DefaultHeight];
-			uint32_t colorMap[DefaultWidth][DefaultHeight][DefaultDepth];
+
+			// Exactly one of the following is non-null, depending on the storage mode.
+			std::unique_ptr<uint32_t[]> colorMap;
+			std::unique_ptr<CompactColorMap> compactColorMap;
+
 			std::list<IGameMapListener *> listeners;
 			std::mutex listenersMutex;
 
-			bool IsSurface(int x, int y, int z) const;
+			uint64_t version = 0;
+
+			/**
+			 * The pages last copied by `CreateSnapshot`. Each element is reset when the page is
+			 * modified.
+			 */
+			std::shared_ptr<const GameMapSnapshot::Page> snapshotPages[GameMapSnapshot::NumPages];
+
+			inline void MarkPageStale(int x, int y) {
+				x &= Width() - 1;
+				y &= Height() - 1;
+				int pageX = x >> GameMapSnapshot::PageSizeBits;
+				int pageY = y >> GameMapSnapshot::PageSizeBits;
+				snapshotPages[pageX + pageY * GameMapSnapshot::NumPagesX].reset();
+			}
+
+			/** Releases all elements of `snapshotPages`. */
+			void MarkAllPagesStale();
+
+			int batchDepth = 0;
+			std::vector<GameMapDirtyColumn> dirtyColumns;
+			/** Maps `x + y * DefaultWidth` to an index into `dirtyColumns`. */
+			std::unordered_map<int, std::size_t> dirtyColumnIndices;
+
+			void MarkDirty(int x, int y, int z);
+
+			static inline std::size_t ColorIndex(int x, int y, int z) {
+				return (static_cast<std::size_t>(x) * DefaultHeight + y) * DefaultDepth + z;
+			}
 		};
 	} // namespace client
 } // namespace spades
@@ -0,0 +1,409 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "GameMap.h"
+#include "GameMapBenchmark.h"
+#include "GameMapCache.h"
+#include "GameMapLoader.h"
+#include <Core/Debug.h>
+#include <Core/DeflateStream.h>
+#include <Core/DynamicMemoryStream.h>
+#include <Core/Exception.h>
+#include <Core/Stopwatch.h>
+
+namespace spades {
+	namespace client {
+		namespace GameMapBenchmark {
+			namespace {
+				const char *GetStorageModeName(GameMap::StorageMode mode) {
+					switch (mode) {
+						case GameMap::StorageMode::Dense: return "dense";
+						case GameMap::StorageMode::Compact: return "compact";
+					}
+					SPUnreachable();
+				}
+
+				/** Serializes `map` so that it can be loaded again with a different setting. */
+				std::unique_ptr<DynamicMemoryStream> SaveToMemory(GameMap &map) {
+					std::unique_ptr<DynamicMemoryStream> stream{new DynamicMemoryStream()};
+					map.Save(stream.get());
+					stream->SetPosition(0);
+					return stream;
+				}
+
+				Handle<GameMap> LoadFromMemory(DynamicMemoryStream &stream,
+				                               GameMap::StorageMode mode) {
+					stream.SetPosition(0);
+					return {GameMap::Load(&stream, {}, mode), false};
+				}
+			} // namespace
+
+			void RunStorageBenchmark(GameMap &sourceMap) {
+				SPADES_MARK_FUNCTION();
+
+				auto stream = SaveToMemory(sourceMap);
+
+				const GameMap::StorageMode modes[] = {GameMap::StorageMode::Dense,
+				                                      GameMap::StorageMode::Compact};
+
+				// Generate random sample positions on the surface so that every mode
+				// reads the same voxels in the same order.
+				std::vector<IntVector3> samples;
+				samples.reserve(1 << 22);
+				for (int i = 0; i < (1 << 22); i++) {
+					int x = SampleRandomInt(0, sourceMap.Width() - 1);
+					int y = SampleRandomInt(0, sourceMap.Height() - 1);
+					uint64_t column = sourceMap.GetSolidMapWrapped(x, y);
+					int z = CountTrailingZeros64(column | (1ULL << 63));
+					samples.push_back(IntVector3(x, y, z));
+				}
+
+				for (GameMap::StorageMode mode : modes) {
+					Stopwatch sw;
+					Handle<GameMap> map = LoadFromMemory(*stream, mode);
+					double loadTime = sw.GetTime();
+
+					// Sequential scan over every solid voxel
+					sw.Reset();
+					uint32_t checksum = 0;
+					std::size_t numVoxels = 0;
+					for (int x = 0; x < map->Width(); x++) {
+						for (int y = 0; y < map->Height(); y++) {
+							uint64_t column = map->GetSolidMapWrapped(x, y);
+							while (column) {
+								int z = CountTrailingZeros64(column);
+								column &= column - 1;
+								checksum += map->GetColor(x, y, z);
+								numVoxels++;
+							}
+						}
+					}
+					double scanTime = sw.GetTime();
+
+					// Random accesses to the surface voxels
+					sw.Reset();
+					uint32_t surfaceChecksum = 0;
+					for (const IntVector3 &p : samples) {
+						surfaceChecksum += map->GetColor(p.x, p.y, p.z);
+					}
+					double randomTime = sw.GetTime();
+
+					SPLog("Map storage '%s': %.2f MiB, loaded in %.1fms", GetStorageModeName(mode),
+					      map->GetMemoryUsage() / 1048576.0, loadTime * 1000.0);
+					SPLog("  GetColor (scan):   %.1f Mvoxels/s (%d voxels, checksum %08x)",
+					      numVoxels / scanTime * 1.0e-6, (int)numVoxels, checksum);
+					SPLog("  GetColor (random): %.1f Mvoxels/s (%d voxels, checksum %08x)",
+					      samples.size() / randomTime * 1.0e-6, (int)samples.size(),
+					      surfaceChecksum);
+				}
+			}
+
+			void RunSnapshotBenchmark(GameMap &sourceMap) {
+				SPADES_MARK_FUNCTION();
+
+				auto stream = SaveToMemory(sourceMap);
+				Handle<GameMap> map = LoadFromMemory(*stream, sourceMap.GetStorageMode());
+
+				Stopwatch sw;
+				Handle<GameMapSnapshot> snapshot = map->CreateSnapshot();
+				double initialTime = sw.GetTime();
+
+				SPLog("Map snapshot: initial snapshot took %.1fms (%d pages, %.2f MiB)",
+				      initialTime * 1000.0, snapshot->GetNumCopiedPages(),
+				      snapshot->GetMemoryUsage() / 1048576.0);
+				SPLog("  Map memory usage: %.2f MiB (including the retained snapshot pages)",
+				      map->GetMemoryUsage() / 1048576.0);
+				snapshot = nullptr;
+
+				// Modify random surface voxels between snapshots. Either keep every snapshot
+				// alive like a slow background consumer would, or release each one before
+				// taking the next like the renderers do.
+				const int numEditsPerSnapshot[] = {1, 16, 256, 4096};
+				for (bool keepSnapshots : {true, false}) {
+					SPLog("  %s the previous snapshots:", keepSnapshots ? "Keeping" : "Releasing");
+					for (int numEdits : numEditsPerSnapshot) {
+						std::vector<Handle<GameMapSnapshot>> snapshots;
+						const int numSnapshots = 16;
+						double snapshotTime = 0.0;
+						int numCopiedPages = 0;
+						for (int i = 0; i < numSnapshots; i++) {
+							if (!keepSnapshots) {
+								snapshots.clear();
+							}
+
+							for (int k = 0; k < numEdits; k++) {
+								int x = SampleRandomInt(0, map->Width() - 1);
+								int y = SampleRandomInt(0, map->Height() - 1);
+								uint64_t column = map->GetSolidMapWrapped(x, y);
+								int z = CountTrailingZeros64(column | (1ULL << 63));
+								if (z > 0 && z < map->Depth() - 1) {
+									map->Set(x, y, z - 1, true, 0x64ff0000);
+								}
+							}
+
+							sw.Reset();
+							snapshots.push_back(map->CreateSnapshot());
+							snapshotTime += sw.GetTime();
+							numCopiedPages += snapshots.back()->GetNumCopiedPages();
+						}
+
+						SPLog("    %5d edit(s) per snapshot: %.3fms per snapshot, %.1f pages "
+						      "copied",
+						      numEdits, snapshotTime * 1000.0 / numSnapshots,
+						      numCopiedPages / static_cast<double>(numSnapshots));
+					}
+				}
+
+				// Sequential scan over every surface voxel (the snapshot doesn't copy the colors of
+				// buried voxels)
+				snapshot = map->CreateSnapshot();
+				const GameMapSnapshot &view = *snapshot;
+				sw.Reset();
+				uint32_t checksum = 0;
+				for (int x = 0; x < map->Width(); x++) {
+					for (int y = 0; y < map->Height(); y++) {
+						uint64_t column = view.GetSurfaceMap(x, y);
+						while (column) {
+							int z = CountTrailingZeros64(column);
+							column &= column - 1;
+							checksum += map->GetColor(x, y, z);
+						}
+					}
+				}
+				double mapScanTime = sw.GetTime();
+
+				sw.Reset();
+				uint32_t snapshotChecksum = 0;
+				for (int x = 0; x < map->Width(); x++) {
+					for (int y = 0; y < map->Height(); y++) {
+						uint64_t column = view.GetSurfaceMap(x, y);
+						while (column) {
+							int z = CountTrailingZeros64(column);
+							column &= column - 1;
+							snapshotChecksum += view.GetColor(x, y, z);
+						}
+					}
+				}
+				double snapshotScanTime = sw.GetTime();
+
+				SPLog("  GetColor (scan): %.1fms on the map, %.1fms on a snapshot (%s)",
+				      mapScanTime * 1000.0, snapshotScanTime * 1000.0,
+				      checksum == snapshotChecksum ? "match" : "MISMATCH");
+			}
+
+			void RunCacheBenchmark(GameMap &sourceMap) {
+				SPADES_MARK_FUNCTION();
+
+				// Compress the map like a server does
+				DynamicMemoryStream compressedStream;
+				{
+					DeflateStream deflate(&compressedStream, CompressModeCompress, false);
+					sourceMap.Save(&deflate);
+					deflate.DeflateEnd();
+				}
+				compressedStream.SetPosition(0);
+				std::string compressed = compressedStream.ReadAllBytes();
+
+				// Use a separate directory so that the user's cache isn't disturbed
+				GameMapCache cache{"MapCache/Benchmark", 256ULL << 20};
+				GameMapCache::KeyBuilder keyBuilder;
+				keyBuilder.Update(compressed.data(), compressed.size());
+				GameMapCache::Key key = keyBuilder.Finish();
+				cache.Remove(key);
+
+				SPLog("Map cache (key %s, %.2f MiB compressed):", key.ToString().c_str(),
+				      compressed.size() / 1048576.0);
+
+				Handle<GameMap> maps[2];
+				const char *passNames[2] = {"miss", "hit"};
+				for (int pass = 0; pass < 2; pass++) {
+					Stopwatch sw;
+
+					// Feed the data in chunks of the size of the map chunk packet
+					GameMapLoader loader{&cache};
+					const std::size_t chunkSize = 8192;
+					for (std::size_t i = 0; i < compressed.size(); i += chunkSize) {
+						loader.AddRawChunk(compressed.data() + i,
+						                   std::min(chunkSize, compressed.size() - i));
+					}
+					double feedTime = sw.GetTime();
+
+					loader.MarkEOF();
+					loader.WaitComplete();
+					maps[pass] = loader.TakeGameMap();
+					double loadTime = sw.GetTime();
+
+					sw.Reset();
+					cache.Flush();
+					double flushTime = sw.GetTime();
+
+					SPLog("  %-4s: %.1fms (%.1fms to feed the data), %.1fms to write the entry",
+					      passNames[pass], loadTime * 1000.0, feedTime * 1000.0,
+					      flushTime * 1000.0);
+				}
+
+				int numMismatches = 0;
+				for (int x = 0; x < sourceMap.Width(); x++) {
+					for (int y = 0; y < sourceMap.Height(); y++) {
+						uint64_t column = maps[0]->GetSolidMapWrapped(x, y);
+						if (column != maps[1]->GetSolidMapWrapped(x, y)) {
+							numMismatches++;
+							continue;
+						}
+						while (column) {
+							int z = CountTrailingZeros64(column);
+							column &= column - 1;
+							if (maps[0]->GetColor(x, y, z) != maps[1]->GetColor(x, y, z)) {
+								numMismatches++;
+								break;
+							}
+						}
+					}
+				}
+				SPLog("  %d mismatching column(s)", numMismatches);
+
+				cache.Remove(key);
+			}
+
+			void RunRayCastBenchmark(const GameMap &map) {
+				SPADES_MARK_FUNCTION();
+
+				const int numBundles = 20000;
+
+				// Pick points slightly above the ground
+				auto samplePoint = [&]() {
+					float x = SampleRandomFloat() * map.Width();
+					float y = SampleRandomFloat() * map.Height();
+					uint64_t column = map.GetSolidMapWrapped(static_cast<int>(x),
+					                                         static_cast<int>(y));
+					int ground = CountTrailingZeros64(column | (1ULL << 63));
+					float z = static_cast<float>(std::max(ground, 3)) - 1.5f -
+					          SampleRandomFloat() * 8.f;
+					return MakeVector3(x, y, z);
+				};
+
+				struct Workload {
+					const char *name;
+					int raysPerBundle;
+					std::vector<GameMap::RayQuery> queries;
+				};
+				Workload workloads[2];
+
+				// 27 segments from the listener to the vicinity of a sound source
+				workloads[0].name = "obstruction";
+				workloads[0].raysPerBundle = 27;
+				for (int i = 0; i < numBundles; i++) {
+					Vector3 eye = samplePoint();
+					Vector3 pos = eye + MakeVector3(SampleRandomFloat() - .5f,
+					                                SampleRandomFloat() - .5f,
+					                                (SampleRandomFloat() - .5f) * .2f) *
+					                      60.f;
+					for (int x = -1; x <= 1; x++)
+						for (int y = -1; y <= 1; y++)
+							for (int z = -1; z <= 1; z++) {
+								Vector3 checkPos = pos + MakeVector3(x, y, z) * .2f;
+								workloads[0].queries.push_back(
+								  GameMap::RayQuery::Segment(eye, checkPos));
+							}
+				}
+
+				// 8 shotgun pellets
+				workloads[1].name = "pellets";
+				workloads[1].raysPerBundle = 8;
+				for (int i = 0; i < numBundles; i++) {
+					Vector3 muzzle = samplePoint();
+					Vector3 dir2 = MakeVector3(SampleRandomFloat() - .5f,
+					                           SampleRandomFloat() - .5f,
+					                           (SampleRandomFloat() - .5f) * .2f);
+					for (int k = 0; k < 8; k++) {
+						dir2.x += (SampleRandomFloat() - SampleRandomFloat()) * .024f;
+						dir2.y += (SampleRandomFloat() - SampleRandomFloat()) * .024f;
+						dir2.z += (SampleRandomFloat() - SampleRandomFloat()) * .024f;
+						workloads[1].queries.push_back(
+						  GameMap::RayQuery{muzzle, dir2.Normalize(), 500, INFINITY});
+					}
+				}
+
+				for (const Workload &workload : workloads) {
+					const std::vector<GameMap::RayQuery> &queries = workload.queries;
+					std::vector<GameMap::RayCastResult> results(queries.size());
+					std::vector<GameMap::RayCastResult> scalarResults(queries.size());
+
+					Stopwatch sw;
+					std::size_t numHits = 0;
+					for (const GameMap::RayQuery &query : queries) {
+						IntVector3 hitBlock;
+						float length = std::isinf(query.maxDistance)
+						                 ? static_cast<float>(query.maxSteps)
+						                 : query.maxDistance;
+						numHits +=
+						  map.CastRay(query.origin, query.dir.Normalize(), length, hitBlock);
+					}
+					double castRayTime = sw.GetTime();
+
+					sw.Reset();
+					for (std::size_t i = 0; i < queries.size(); i++) {
+						scalarResults[i] =
+						  map.CastRay2(queries[i].origin, queries[i].dir, queries[i].maxSteps);
+					}
+					double castRay2Time = sw.GetTime();
+
+					sw.Reset();
+					for (std::size_t i = 0; i < queries.size(); i += workload.raysPerBundle) {
+						map.CastRays(queries.data() + i, results.data() + i,
+						             workload.raysPerBundle);
+					}
+					double castRaysTime = sw.GetTime();
+
+					// `CastRays` must agree with `CastRay2` unless `maxDistance` is hit
+					int numMismatches = 0;
+					for (std::size_t i = 0; i < queries.size(); i++) {
+						const GameMap::RayCastResult &a = results[i];
+						const GameMap::RayCastResult &b = scalarResults[i];
+						if (!std::isinf(queries[i].maxDistance)) {
+							continue;
+						}
+						if (a.hit != b.hit ||
+						    (a.hit && (a.hitBlock.x != b.hitBlock.x ||
+						               a.hitBlock.y != b.hitBlock.y ||
+						               a.hitBlock.z != b.hitBlock.z ||
+						               a.hitPos.x != b.hitPos.x || a.hitPos.y != b.hitPos.y ||
+						               a.hitPos.z != b.hitPos.z))) {
+							numMismatches++;
+						}
+					}
+
+					double numRays = static_cast<double>(queries.size()) * 1.0e-6;
+					SPLog("Ray casting '%s' (%d rays, %d per bundle):", workload.name,
+					      (int)queries.size(), workload.raysPerBundle);
+					SPLog("  CastRay:  %.2f Mrays/s (%d hits)", numRays / castRayTime,
+					      (int)numHits);
+					SPLog("  CastRay2: %.2f Mrays/s", numRays / castRay2Time);
+					SPLog("  CastRays: %.2f Mrays/s (%.2fx of CastRay2, %d mismatches)",
+					      numRays / castRaysTime, castRay2Time / castRaysTime, numMismatches);
+				}
+			}
+		} // namespace GameMapBenchmark
+	} // namespace client
+} // namespace spades
@@ -0,0 +1,60 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+namespace spades {
+	namespace client {
+		class GameMap;
+
+		/**
+		 * Micro-benchmarks for `GameMap`. Each function runs a benchmark on a copy of
+		 * the given map and reports the result through `SPLog`.
+		 */
+		namespace GameMapBenchmark {
+			/**
+			 * Compares the memory usage and the `GetColor` throughput of every
+			 * `GameMap::StorageMode`.
+			 */
+			void RunStorageBenchmark(GameMap &);
+
+			/**
+			 * Measures the time and memory taken by `GameMap::CreateSnapshot` with various
+			 * numbers of modified voxels between snapshots, and the `GetColor` throughput of
+			 * a snapshot.
+			 */
+			void RunSnapshotBenchmark(GameMap &);
+
+			/**
+			 * Feeds the compressed map through `GameMapLoader` twice, acting as a local
+			 * stand-in for a server, and compares the time taken with and without a hit in
+			 * `GameMapCache`. The restored map is checked against the decoded one.
+			 */
+			void RunCacheBenchmark(GameMap &);
+
+			/**
+			 * Compares the throughput of the packet ray-casting API (`GameMap::CastRays`)
+			 * with the scalar ones (`CastRay` and `CastRay2`) using ray bundles modeled
+			 * after the sound obstruction test and shotgun pellets.
+			 */
+			void RunRayCastBenchmark(const GameMap &);
+		} // namespace GameMapBenchmark
+	} // namespace client
+} // namespace spades
@@ -0,0 +1,420 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#include "GameMap.h"
+#include "GameMapCache.h"
+#include <Core/ConcurrentDispatch.h>
+#include <Core/Debug.h>
+#include <Core/Exception.h>
+#include <Core/FileManager.h>
+#include <Core/IStream.h>
+#include <Core/Settings.h>
+#include <Core/Stopwatch.h>
+
+DEFINE_SPADES_SETTING(cl_mapCacheSize, "128");
+
+namespace spades {
+	namespace client {
+		namespace {
+			const char FileMagic[8] = {'O', 'S', 'M', 'A', 'P', 'C', 'A', 'C'};
+			const uint32_t FileVersion = 1;
+			const uint32_t ByteOrderMark = 0x01020304;
+
+			/** The header of an entry file. Followed by the solid map, the color masks, and
+			 * the colors. */
+			struct FileHeader {
+				char magic[8];
+				uint32_t version;
+				uint32_t byteOrderMark;
+				uint32_t width, height, depth;
+				uint32_t reserved;
+				uint64_t streamHash;
+				uint64_t streamSize;
+				uint64_t numColors;
+			};
+
+			const std::size_t NumColumns = GameMap::DefaultWidth * GameMap::DefaultHeight;
+		} // namespace
+
+		std::string GameMapCache::Key::ToString() const {
+			char buf[40];
+			std::snprintf(buf, sizeof(buf), "%016" PRIx64 "-%" PRIx64, hash, size);
+			return buf;
+		}
+
+		// 64-bit FNV-1a
+		GameMapCache::KeyBuilder::KeyBuilder() : hash{0xcbf29ce484222325ULL}, size{0} {}
+
+		void GameMapCache::KeyBuilder::Update(const char *bytes, std::size_t numBytes) {
+			uint64_t h = hash;
+			for (std::size_t i = 0; i < numBytes; i++) {
+				h ^= static_cast<uint8_t>(bytes[i]);
+				h *= 0x100000001b3ULL;
+			}
+			hash = h;
+			size += numBytes;
+		}
+
+		GameMapCache::GameMapCache(std::string directory, uint64_t maxSize)
+		    : directory{std::move(directory)}, maxSize{maxSize} {
+			SPADES_MARK_FUNCTION();
+
+			std::lock_guard<std::mutex> lock{mutex};
+			LoadIndex();
+		}
+
+		GameMapCache::~GameMapCache() {
+			SPADES_MARK_FUNCTION();
+			Flush();
+		}
+
+		std::unique_ptr<GameMapCache> GameMapCache::CreateDefault() {
+			int maxSizeMiB = cl_mapCacheSize;
+			if (maxSizeMiB <= 0) {
+				return nullptr;
+			}
+			return std::unique_ptr<GameMapCache>{
+			  new GameMapCache("MapCache", static_cast<uint64_t>(maxSizeMiB) << 20)};
+		}
+
+		std::string GameMapCache::GetEntryPath(const Key &key) const {
+			return directory + "/" + key.ToString() + ".ocm";
+		}
+
+		std::string GameMapCache::GetIndexPath() const { return directory + "/Index.txt"; }
+
+		void GameMapCache::LoadIndex() {
+			entries.clear();
+
+			std::string path = GetIndexPath();
+			if (!FileManager::FileExists(path.c_str())) {
+				return;
+			}
+
+			try {
+				std::istringstream ss{FileManager::ReadAllBytes(path.c_str())};
+				std::string line;
+				while (std::getline(ss, line)) {
+					Entry entry;
+					if (std::sscanf(line.c_str(), "%" SCNx64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+					                &entry.key.hash, &entry.key.size, &entry.fileSize,
+					                &entry.lastUse) != 4) {
+						continue;
+					}
+					entries.push_back(entry);
+				}
+			} catch (const std::exception &ex) {
+				SPLog("Failed to read the map cache index: %s", ex.what());
+				entries.clear();
+			}
+		}
+
+		void GameMapCache::SaveIndex() {
+			std::string text;
+			for (const Entry &entry : entries) {
+				char buf[128];
+				std::snprintf(buf, sizeof(buf),
+				              "%016" PRIx64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+				              entry.key.hash, entry.key.size, entry.fileSize, entry.lastUse);
+				text += buf;
+			}
+
+			try {
+				std::string path = GetIndexPath();
+				std::unique_ptr<IStream> stream = FileManager::OpenForWriting(path.c_str());
+				stream->Write(text);
+			} catch (const std::exception &ex) {
+				SPLog("Failed to write the map cache index: %s", ex.what());
+			}
+		}
+
+		uint64_t GameMapCache::NextUse() const {
+			uint64_t use = 0;
+			for (const Entry &entry : entries) {
+				use = std::max(use, entry.lastUse);
+			}
+			return use + 1;
+		}
+
+		void GameMapCache::RemoveEntry(const Key &key) {
+			auto it = std::find_if(entries.begin(), entries.end(),
+			                       [&](const Entry &e) { return e.key == key; });
+			if (it != entries.end()) {
+				entries.erase(it);
+			}
+
+			std::string path = GetEntryPath(key);
+			if (FileManager::FileExists(path.c_str())) {
+				FileManager::RemoveFile(path.c_str());
+			}
+		}
+
+		void GameMapCache::EvictEntries() {
+			uint64_t totalSize = 0;
+			for (const Entry &entry : entries) {
+				totalSize += entry.fileSize;
+			}
+
+			while (totalSize > maxSize && !entries.empty()) {
+				auto it = std::min_element(
+				  entries.begin(), entries.end(),
+				  [](const Entry &a, const Entry &b) { return a.lastUse < b.lastUse; });
+				SPLog("Evicting map cache entry %s (%.1f MiB)", it->key.ToString().c_str(),
+				      it->fileSize / 1048576.0);
+				totalSize -= it->fileSize;
+				RemoveEntry(it->key);
+			}
+		}
+
+		Handle<GameMap> GameMapCache::Load(const Key &key) {
+			SPADES_MARK_FUNCTION();
+
+			// Make sure a previous `Store` for the same key has finished
+			Flush();
+
+			std::lock_guard<std::mutex> lock{mutex};
+
+			auto it = std::find_if(entries.begin(), entries.end(),
+			                       [&](const Entry &e) { return e.key == key; });
+			if (it == entries.end()) {
+				return {};
+			}
+
+			Stopwatch sw;
+			Handle<GameMap> map;
+			try {
+				std::unique_ptr<IStream> stream =
+				  FileManager::OpenForReading(GetEntryPath(key).c_str());
+				map = Deserialize(key, *stream);
+			} catch (const std::exception &ex) {
+				SPLog("Failed to read the map cache entry %s: %s", key.ToString().c_str(),
+				      ex.what());
+			}
+
+			if (!map) {
+				RemoveEntry(key);
+				SaveIndex();
+				return {};
+			}
+
+			it = std::find_if(entries.begin(), entries.end(),
+			                  [&](const Entry &e) { return e.key == key; });
+			it->lastUse = NextUse();
+			SaveIndex();
+
+			SPLog("Map restored from the cache entry %s in %.1fms", key.ToString().c_str(),
+			      sw.GetTime() * 1000.0);
+			return map;
+		}
+
+		void GameMapCache::Store(const Key &key, const GameMap &map) {
+			SPADES_MARK_FUNCTION();
+
+			// Only one entry is written at once
+			Flush();
+
+			// Copy the map because it may change as soon as we return. This is much faster
+			// than serializing it here
+			Handle<GameMap> copy = map.Clone();
+
+			auto job = [this, key, copy]() {
+				std::vector<char> data = Serialize(key, *copy);
+
+				std::lock_guard<std::mutex> lock{mutex};
+
+				RemoveEntry(key);
+
+				try {
+					std::unique_ptr<IStream> stream =
+					  FileManager::OpenForWriting(GetEntryPath(key).c_str());
+					stream->Write(data.data(), data.size());
+				} catch (const std::exception &ex) {
+					SPLog("Failed to write the map cache entry %s: %s", key.ToString().c_str(),
+					      ex.what());
+					FileManager::RemoveFile(GetEntryPath(key).c_str());
+					return;
+				}
+
+				entries.push_back(Entry{key, static_cast<uint64_t>(data.size()), NextUse()});
+				EvictEntries();
+				SaveIndex();
+			};
+			pendingWrite.reset(new FunctionDispatch<decltype(job)>(job));
+			pendingWrite->Start();
+		}
+
+		void GameMapCache::Remove(const Key &key) {
+			SPADES_MARK_FUNCTION();
+
+			Flush();
+
+			std::lock_guard<std::mutex> lock{mutex};
+			RemoveEntry(key);
+			SaveIndex();
+		}
+
+		void GameMapCache::Flush() {
+			if (pendingWrite) {
+				pendingWrite->Join();
+				pendingWrite.reset();
+			}
+		}
+
+		std::vector<char> GameMapCache::Serialize(const Key &key, const GameMap &map) {
+			SPADES_MARK_FUNCTION();
+
+			const int w = GameMap::DefaultWidth, h = GameMap::DefaultHeight;
+
+			// Only the colors that differ from the default one are stored
+			std::vector<uint64_t> colorMasks(NumColumns);
+			std::vector<uint32_t> colors;
+			for (int x = 0; x < w; x++) {
+				for (int y = 0; y < h; y++) {
+					uint64_t solid = map.solidMap[x][y];
+					uint64_t colorMask = 0;
+					while (solid) {
+						int z = CountTrailingZeros64(solid);
+						solid &= solid - 1;
+						uint32_t color = map.GetColor(x, y, z);
+						if (color != CompactColorMap::GetDefaultColor(x, y, z)) {
+							colorMask |= 1ULL << z;
+							colors.push_back(color);
+						}
+					}
+					colorMasks[x * h + y] = colorMask;
+				}
+			}
+
+			FileHeader header;
+			std::memcpy(header.magic, FileMagic, sizeof(FileMagic));
+			header.version = FileVersion;
+			header.byteOrderMark = ByteOrderMark;
+			header.width = w;
+			header.height = h;
+			header.depth = GameMap::DefaultDepth;
+			header.reserved = 0;
+			header.streamHash = key.hash;
+			header.streamSize = key.size;
+			header.numColors = colors.size();
+
+			std::size_t solidMapSize = sizeof(map.solidMap);
+			std::size_t colorMasksSize = colorMasks.size() * sizeof(uint64_t);
+			std::size_t colorsSize = colors.size() * sizeof(uint32_t);
+
+			std::vector<char> data(sizeof(header) + solidMapSize + colorMasksSize + colorsSize);
+			char *out = data.data();
+			std::memcpy(out, &header, sizeof(header));
+			out += sizeof(header);
+			std::memcpy(out, map.solidMap, solidMapSize);
+			out += solidMapSize;
+			std::memcpy(out, colorMasks.data(), colorMasksSize);
+			out += colorMasksSize;
+			std::memcpy(out, colors.data(), colorsSize);
+
+			return data;
+		}
+
+		Handle<GameMap> GameMapCache::Deserialize(const Key &key, IStream &stream) {
+			SPADES_MARK_FUNCTION();
+
+			FileHeader header;
+			if (stream.Read(&header, sizeof(header)) < sizeof(header)) {
+				SPRaise("Truncated header");
+			}
+			if (std::memcmp(header.magic, FileMagic, sizeof(FileMagic)) != 0 ||
+			    header.version != FileVersion || header.byteOrderMark != ByteOrderMark) {
+				SPRaise("Unsupported format");
+			}
+			if (header.width != GameMap::DefaultWidth || header.height != GameMap::DefaultHeight ||
+			    header.depth != GameMap::DefaultDepth) {
+				SPRaise("Unsupported dimensions");
+			}
+			if (header.streamHash != key.hash || header.streamSize != key.size) {
+				SPRaise("Key mismatch");
+			}
+			if (header.numColors > NumColumns * GameMap::DefaultDepth) {
+				SPRaise("Too many colors");
+			}
+
+			Handle<GameMap> map{new GameMap(), false};
+
+			std::size_t solidMapSize = sizeof(map->solidMap);
+			if (stream.Read(map->solidMap, solidMapSize) < solidMapSize) {
+				SPRaise("Truncated solid map");
+			}
+
+			std::vector<uint64_t> colorMasks(NumColumns);
+			std::size_t colorMasksSize = colorMasks.size() * sizeof(uint64_t);
+			if (stream.Read(colorMasks.data(), colorMasksSize) < colorMasksSize) {
+				SPRaise("Truncated color masks");
+			}
+
+			std::vector<uint32_t> colors(static_cast<std::size_t>(header.numColors));
+			std::size_t colorsSize = colors.size() * sizeof(uint32_t);
+			if (stream.Read(colors.data(), colorsSize) < colorsSize) {
+				SPRaise("Truncated colors");
+			}
+
+			const int w = GameMap::DefaultWidth, h = GameMap::DefaultHeight;
+			const uint32_t *nextColor = colors.data();
+			const uint32_t *colorsEnd = colors.data() + colors.size();
+			uint32_t columnColors[GameMap::DefaultDepth];
+			for (int x = 0; x < w; x++) {
+				for (int y = 0; y < h; y++) {
+					uint64_t colorMask = colorMasks[x * h + y];
+					if (colorMask & ~map->solidMap[x][y]) {
+						SPRaise("Color stored for a non-solid voxel");
+					}
+					if (static_cast<std::size_t>(colorsEnd - nextColor) <
+					    static_cast<std::size_t>(CountBits64(colorMask))) {
+						SPRaise("Color spans out of bounds");
+					}
+
+					uint64_t mask = colorMask;
+					while (mask) {
+						int z = CountTrailingZeros64(mask);
+						mask &= mask - 1;
+						columnColors[z] = *(nextColor++);
+					}
+
+					if (map->colorMap) {
+						uint32_t *out = &map->colorMap[GameMap::ColorIndex(x, y, 0)];
+						mask = colorMask;
+						while (mask) {
+							int z = CountTrailingZeros64(mask);
+							mask &= mask - 1;
+							out[z] = columnColors[z];
+						}
+					} else if (colorMask) {
+						map->compactColorMap->AssignColumn(x, y, colorMask, columnColors);
+					}
+				}
+			}
+
+			return map;
+		}
+	} // namespace client
+} // namespace spades
@@ -0,0 +1,138 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Core/RefCountedObject.h>
+
+namespace spades {
+	class ConcurrentDispatch;
+	class IStream;
+
+	namespace client {
+		class GameMap;
+
+		/**
+		 * An on-disk cache of decoded maps, keyed by the hash of the compressed map data
+		 * sent by a server.
+		 *
+		 * Each entry stores the solid map exactly as laid out in `GameMap` (so it can be read
+		 * in one go or memory-mapped), followed by the span of colors of each column that
+		 * differ from the default ground color. The total size of the entries is bounded, and
+		 * the least recently used ones are evicted first.
+		 */
+		class GameMapCache {
+		public:
+			/** Identifies a compressed map stream. */
+			struct Key {
+				uint64_t hash;
+				uint64_t size;
+
+				bool operator==(const Key &o) const { return hash == o.hash && size == o.size; }
+				std::string ToString() const;
+			};
+
+			/** Computes a `Key` incrementally as the chunks of a map stream arrive. */
+			class KeyBuilder {
+				uint64_t hash;
+				uint64_t size;
+
+			public:
+				KeyBuilder();
+				void Update(const char *bytes, std::size_t numBytes);
+				Key Finish() const { return Key{hash, size}; }
+			};
+
+			/**
+			 * @param directory The directory (in the virtual file system) to store the entries
+			 *                  in.
+			 * @param maxSize The maximum total size of the entries in bytes.
+			 */
+			GameMapCache(std::string directory, uint64_t maxSize);
+
+			/** Waits until the pending write operation (if any) completes. */
+			~GameMapCache();
+
+			GameMapCache(const GameMapCache &) = delete;
+			void operator=(const GameMapCache &) = delete;
+
+			/**
+			 * Creates a `GameMapCache` with the settings specified by `cl_mapCacheSize`.
+			 * Returns `nullptr` if the cache is disabled.
+			 */
+			static std::unique_ptr<GameMapCache> CreateDefault();
+
+			/**
+			 * Restores the map stored for `key`. Returns `nullptr` if there's no such entry
+			 * or the entry is unusable (in which case it's deleted).
+			 */
+			Handle<GameMap> Load(const Key &key);
+
+			/**
+			 * Stores `map` for `key`. The map is copied before this function returns, so it can
+			 * be modified afterwards. The copy is serialized and written on a background
+			 * thread.
+			 */
+			void Store(const Key &key, const GameMap &map);
+
+			/** Removes the entry for `key` if it exists. */
+			void Remove(const Key &key);
+
+			/** Waits until the pending write operation (if any) completes. */
+			void Flush();
+
+		private:
+			struct Entry {
+				Key key;
+				uint64_t fileSize;
+				/** Larger values indicate more recent uses. */
+				uint64_t lastUse;
+			};
+
+			std::string directory;
+			uint64_t maxSize;
+
+			/** Protects `entries` and the index file. */
+			std::mutex mutex;
+			std::vector<Entry> entries;
+
+			std::unique_ptr<ConcurrentDispatch> pendingWrite;
+
+			std::string GetEntryPath(const Key &) const;
+			std::string GetIndexPath() const;
+
+			// The following functions must be called with `mutex` held
+			void LoadIndex();
+			void SaveIndex();
+			uint64_t NextUse() const;
+			void RemoveEntry(const Key &);
+			void EvictEntries();
+
+			static std::vector<char> Serialize(const Key &, const GameMap &);
+			static Handle<GameMap> Deserialize(const Key &, IStream &);
+		};
+	} // namespace client
+} // namespace spades
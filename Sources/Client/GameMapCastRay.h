@@ -0,0 +1,188 @@
+/*
+ Copyright (c) 2013 yvt
+ based on code of pysnip (c) Mathias Kaerlev 2011-2012.
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <cmath>
+
+#include <Core/Debug.h>
+#include <Core/Math.h>
+
+namespace spades {
+	namespace client {
+		/**
+		 * The implementation of `GameMap::CastRay` (vanilla-compatible ray casting), shared by
+		 * `GameMap` and `GameMapSnapshot`. `Map` must provide `GetSolidMapWrapped` and
+		 * `IsSolidWrapped`.
+		 */
+		template <class Map>
+		bool CastRayVanilla(const Map &map, Vector3 v0, Vector3 v1, float length,
+		                    IntVector3 &vOut) {
+			SPAssert(!std::isnan(v0.x));
+			SPAssert(!std::isnan(v0.y));
+			SPAssert(!std::isnan(v0.z));
+			SPAssert(!std::isnan(v1.x));
+			SPAssert(!std::isnan(v1.y));
+			SPAssert(!std::isnan(v1.z));
+			SPAssert(!std::isnan(length));
+
+			v1 = v0 + v1 * length;
+
+			Vector3 f, g;
+			IntVector3 a, c, d, p, i;
+			long cnt = 0;
+
+			a = v0.Floor();
+			c = v1.Floor();
+
+			if (c.x < a.x) {
+				d.x = -1;
+				f.x = v0.x - a.x;
+				g.x = (v0.x - v1.x) * 1024;
+				cnt += a.x - c.x;
+			} else if (c.x != a.x) {
+				d.x = 1;
+				f.x = a.x + 1 - v0.x;
+				g.x = (v1.x - v0.x) * 1024;
+				cnt += c.x - a.x;
+			} else {
+				d.x = 0;
+				f.x = g.x = 0;
+			}
+			if (c.y < a.y) {
+				d.y = -1;
+				f.y = v0.y - a.y;
+				g.y = (v0.y - v1.y) * 1024;
+				cnt += a.y - c.y;
+			} else if (c.y != a.y) {
+				d.y = 1;
+				f.y = a.y + 1 - v0.y;
+				g.y = (v1.y - v0.y) * 1024;
+				cnt += c.y - a.y;
+			} else {
+				d.y = 0;
+				f.y = g.y = 0;
+			}
+			if (c.z < a.z) {
+				d.z = -1;
+				f.z = v0.z - a.z;
+				g.z = (v0.z - v1.z) * 1024;
+				cnt += a.z - c.z;
+			} else if (c.z != a.z) {
+				d.z = 1;
+				f.z = a.z + 1 - v0.z;
+				g.z = (v1.z - v0.z) * 1024;
+				cnt += c.z - a.z;
+			} else {
+				d.z = 0;
+				f.z = g.z = 0;
+			}
+
+			Vector3 pp =
+			  MakeVector3(f.x * g.z - f.z * g.x, f.y * g.z - f.z * g.y, f.y * g.x - f.x * g.y);
+			p = pp.Floor();
+			i = g.Floor();
+
+			if (cnt > (long)length)
+				cnt = (long)length;
+
+#if 1
+			// faster version
+			uint64_t lastSolidMap = map.GetSolidMapWrapped(a.x, a.y);
+			if (a.z < 0 && d.z < 0) {
+				return false;
+			} else if (a.z < 0) {
+				while (cnt > 0 && a.z < 0) {
+					if (((p.x | p.y) >= 0) && (a.z != c.z)) {
+						a.z += d.z;
+						p.x -= i.x;
+						p.y -= i.y;
+					} else if ((p.z >= 0) && (a.x != c.x)) {
+						a.x += d.x;
+						p.x += i.z;
+						p.z -= i.y;
+					} else {
+						a.y += d.y;
+						p.y += i.z;
+						p.z += i.x;
+					}
+					cnt--;
+				}
+			} else if (a.z >= 64) {
+				vOut = a;
+				return true;
+			}
+			while (cnt > 0) {
+				if (((p.x | p.y) >= 0) && (a.z != c.z)) {
+					a.z += d.z;
+					p.x -= i.x;
+					p.y -= i.y;
+					if (a.z < 0 && d.z < 0) {
+						return false;
+					} else if (a.z >= 64) {
+						vOut = a;
+						return true;
+					}
+				} else if ((p.z >= 0) && (a.x != c.x)) {
+					a.x += d.x;
+					p.x += i.z;
+					p.z -= i.y;
+					lastSolidMap = map.GetSolidMapWrapped(a.x, a.y);
+				} else {
+					a.y += d.y;
+					p.y += i.z;
+					p.z += i.x;
+					lastSolidMap = map.GetSolidMapWrapped(a.x, a.y);
+				}
+
+				if ((lastSolidMap >> (uint64_t)a.z) & 1ULL) {
+					vOut = a;
+					return true;
+				}
+				cnt--;
+			}
+#else
+			while (cnt > 0) {
+				if (((p.x | p.y) >= 0) && (a.z != c.z)) {
+					a.z += d.z;
+					p.x -= i.x;
+					p.y -= i.y;
+				} else if ((p.z >= 0) && (a.x != c.x)) {
+					a.x += d.x;
+					p.x += i.z;
+					p.z -= i.y;
+				} else {
+					a.y += d.y;
+					p.y += i.z;
+					p.z += i.x;
+				}
+
+				if (map.IsSolidWrapped(a.x, a.y, a.z)) {
+					vOut = a;
+					return true;
+				}
+				cnt--;
+			}
+#endif
+			return false;
+		}
+	} // namespace client
+} // namespace spades
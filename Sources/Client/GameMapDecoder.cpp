@@ -0,0 +1,348 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <algorithm>
+
+#include "GameMapDecoder.h"
+#include <Core/ConcurrentDispatch.h>
+#include <Core/Debug.h>
+#include <Core/Exception.h>
+#include <Core/IStream.h>
+
+namespace spades {
+	namespace client {
+		namespace {
+			constexpr int NumColumns = GameMap::DefaultWidth * GameMap::DefaultHeight;
+
+			struct DecodedColumn {
+				uint64_t solid;
+				/** Bit `z` is set if `colors[z]` is valid. */
+				uint64_t colorMask;
+				uint32_t colors[GameMap::DefaultDepth];
+			};
+
+			inline uint32_t ReadColor(const unsigned char *bytes) {
+				// BGRA → 0xHHBBGGRR with full health
+				return static_cast<uint32_t>(bytes[2]) | (static_cast<uint32_t>(bytes[1]) << 8) |
+				       (static_cast<uint32_t>(bytes[0]) << 16) | (100UL * 0x1000000UL);
+			}
+
+			/**
+			 * Decodes a column that was already validated by `GameMapDecoder::ScanColumn`.
+			 * This reproduces the exact behavior of the original sequential decoder,
+			 * including its handling of Z = 63.
+			 */
+			void DecodeColumn(const unsigned char *data, int x, int y, DecodedColumn &out) {
+				uint64_t solid = 0xffffffffffffffffULL;
+				uint64_t colorMask = 0;
+
+				auto setColor = [&](int z, uint32_t color) {
+					solid |= 1ULL << z;
+					colorMask |= 1ULL << z;
+					out.colors[z] = color;
+				};
+				auto getColor = [&](int z) {
+					return (colorMask >> z) & 1 ? out.colors[z]
+					                            : CompactColorMap::GetDefaultColor(x, y, z);
+				};
+
+				int z = 0;
+				for (;;) {
+					int numChunks = data[0];
+					int topColorStart = data[1];
+					int topColorEnd = data[2];
+
+					for (int i = z; i < topColorStart; i++)
+						solid &= ~(1ULL << i);
+
+					const unsigned char *color = data + 4;
+					for (z = topColorStart; z <= topColorEnd; z++) {
+						setColor(z, ReadColor(color));
+						color += 4;
+					}
+
+					if (topColorEnd == 62) {
+						setColor(63, getColor(62));
+					}
+
+					int lenBottom = topColorEnd - topColorStart + 1;
+
+					if (numChunks == 0) {
+						break;
+					}
+
+					int lenTop = (numChunks - 1) - lenBottom;
+
+					data += numChunks * 4;
+
+					int bottomColorEnd = data[3];
+					int bottomColorStart = bottomColorEnd - lenTop;
+
+					for (z = bottomColorStart; z < bottomColorEnd; z++) {
+						setColor(z, ReadColor(color));
+						color += 4;
+					}
+					if (bottomColorEnd == 63) {
+						setColor(63, getColor(62));
+					}
+				}
+
+				out.solid = solid;
+				out.colorMask = colorMask;
+			}
+		} // namespace
+
+		struct GameMapDecoder::Band {
+			int startY;
+			std::vector<unsigned char> data;
+			/** The offset of each column in `data`, in the file order. */
+			std::vector<uint32_t> columnOffsets;
+		};
+
+		GameMapDecoder::GameMapDecoder(GameMap::StorageMode storageMode,
+		                               std::function<void(int)> onProgress,
+		                               std::function<void(int, int)> onRowsDecoded,
+		                               std::mutex *colorMutex)
+		    : map{Handle<GameMap>::New(storageMode)},
+		      onProgress{std::move(onProgress)},
+		      onRowsDecoded{std::move(onRowsDecoded)},
+		      scanPosition{0},
+		      numScannedColumns{0},
+		      numDecodedColumns{0},
+		      compactColorMapMutex{colorMutex ? *colorMutex : ownColorMutex},
+		      finished{false} {
+			SPADES_MARK_FUNCTION();
+
+			columnOffsets.reserve(GameMap::DefaultWidth * BandHeight);
+			jobs.reserve(GameMap::DefaultHeight / BandHeight);
+		}
+
+		GameMapDecoder::~GameMapDecoder() {
+			SPADES_MARK_FUNCTION();
+
+			// `ConcurrentDispatch`'s destructor can't wait for a job safely because `Run`
+			// is implemented by the derived class, which is already destroyed by then
+			for (const auto &job : jobs) {
+				job->Join();
+			}
+		}
+
+		std::size_t GameMapDecoder::ScanColumn(const unsigned char *data, std::size_t size) {
+			std::size_t pos = 0;
+			for (;;) {
+				if (pos + 4 > size) {
+					return 0;
+				}
+
+				int numChunks = data[pos];
+				int topColorStart = data[pos + 1];
+				int topColorEnd = data[pos + 2];
+
+				if (topColorStart >= GameMap::DefaultDepth ||
+				    topColorEnd >= GameMap::DefaultDepth || topColorEnd < topColorStart - 1) {
+					SPRaise("Malformed map data: invalid span [%d, %d]", topColorStart,
+					        topColorEnd);
+				}
+
+				int lenBottom = topColorEnd - topColorStart + 1;
+
+				if (numChunks == 0) {
+					std::size_t spanSize = 4 * (lenBottom + 1);
+					return pos + spanSize > size ? 0 : pos + spanSize;
+				}
+
+				int lenTop = (numChunks - 1) - lenBottom;
+				if (lenTop < 0) {
+					SPRaise("Malformed map data: span too short");
+				}
+
+				pos += numChunks * 4;
+				if (pos + 4 > size) {
+					return 0;
+				}
+
+				int bottomColorEnd = data[pos + 3];
+				if (bottomColorEnd > GameMap::DefaultDepth || bottomColorEnd < lenTop) {
+					SPRaise("Malformed map data: invalid bottom span end %d", bottomColorEnd);
+				}
+			}
+		}
+
+		void GameMapDecoder::AddData(const char *bytes, std::size_t numBytes) {
+			SPADES_MARK_FUNCTION();
+
+			if (finished) {
+				SPRaise("The decoder is already finished.");
+			}
+
+			if (numScannedColumns == NumColumns) {
+				// Trailing data is ignored
+				return;
+			}
+
+			pending.insert(pending.end(), reinterpret_cast<const unsigned char *>(bytes),
+			               reinterpret_cast<const unsigned char *>(bytes) + numBytes);
+			ScanPending();
+		}
+
+		void GameMapDecoder::AddData(IStream &stream) {
+			SPADES_MARK_FUNCTION();
+
+			// Small reads let the decoder start scanning while a streaming source (such as
+			// `GameMapLoader`'s pipe) is still being filled
+			std::vector<char> buffer(16384);
+			while (numScannedColumns < NumColumns) {
+				std::size_t numBytes = stream.Read(buffer.data(), buffer.size());
+				if (numBytes == 0) {
+					break;
+				}
+				AddData(buffer.data(), numBytes);
+			}
+		}
+
+		void GameMapDecoder::ScanPending() {
+			while (numScannedColumns < NumColumns) {
+				std::size_t columnSize =
+				  ScanColumn(pending.data() + scanPosition, pending.size() - scanPosition);
+				if (columnSize == 0) {
+					break;
+				}
+
+				columnOffsets.push_back(static_cast<uint32_t>(scanPosition));
+				scanPosition += columnSize;
+				numScannedColumns++;
+
+				if (numScannedColumns % (GameMap::DefaultWidth * BandHeight) == 0) {
+					StartBand();
+				}
+			}
+		}
+
+		void GameMapDecoder::StartBand() {
+			auto band = std::make_shared<Band>();
+			band->startY = numScannedColumns / GameMap::DefaultWidth - BandHeight;
+			band->data.assign(pending.begin(), pending.begin() + scanPosition);
+			band->columnOffsets.swap(columnOffsets);
+
+			pending.erase(pending.begin(), pending.begin() + scanPosition);
+			scanPosition = 0;
+			columnOffsets.reserve(GameMap::DefaultWidth * BandHeight);
+
+			auto job = [this, band]() {
+				try {
+					DecodeBand(*band);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock{errorMutex};
+					if (!error) {
+						error = std::current_exception();
+					}
+				}
+			};
+			jobs.emplace_back(new FunctionDispatch<decltype(job)>(job));
+			jobs.back()->Start();
+		}
+
+		void GameMapDecoder::DecodeBand(Band &band) {
+			SPADES_MARK_FUNCTION();
+
+			GameMap &map = *this->map;
+			const int width = GameMap::DefaultWidth;
+			DecodedColumn column;
+
+			// Colors for `CompactColorMap` are merged in one go at the end
+			std::vector<uint64_t> compactMasks;
+			std::vector<uint32_t> compactColors;
+			if (map.compactColorMap) {
+				compactMasks.resize(width * BandHeight);
+				compactColors.resize(width * BandHeight * GameMap::DefaultDepth);
+			}
+
+			for (int row = 0; row < BandHeight; row++) {
+				int y = band.startY + row;
+				for (int x = 0; x < width; x++) {
+					std::size_t index = row * width + x;
+					DecodeColumn(band.data.data() + band.columnOffsets[index], x, y, column);
+
+					map.solidMap[x][y] = column.solid;
+
+					if (map.colorMap) {
+						uint32_t *colors = &map.colorMap[GameMap::ColorIndex(x, y, 0)];
+						uint64_t mask = column.colorMask;
+						while (mask) {
+							int z = CountTrailingZeros64(mask);
+							mask &= mask - 1;
+							colors[z] = column.colors[z];
+						}
+					} else {
+						compactMasks[index] = column.colorMask;
+						std::copy(column.colors, column.colors + GameMap::DefaultDepth,
+						          compactColors.begin() + index * GameMap::DefaultDepth);
+					}
+				}
+
+				int numDecoded = numDecodedColumns.fetch_add(width) + width;
+				if (onProgress) {
+					onProgress(numDecoded);
+				}
+			}
+
+			if (map.compactColorMap) {
+				std::lock_guard<std::mutex> lock{compactColorMapMutex};
+				for (int row = 0; row < BandHeight; row++) {
+					for (int x = 0; x < width; x++) {
+						std::size_t index = row * width + x;
+						map.compactColorMap->AssignColumn(
+						  x, band.startY + row, compactMasks[index],
+						  compactColors.data() + index * GameMap::DefaultDepth);
+					}
+				}
+			}
+
+			if (onRowsDecoded) {
+				onRowsDecoded(band.startY, band.startY + BandHeight);
+			}
+		}
+
+		Handle<GameMap> GameMapDecoder::Finish() {
+			SPADES_MARK_FUNCTION();
+
+			if (finished) {
+				SPRaise("The decoder is already finished.");
+			}
+			finished = true;
+
+			for (const auto &job : jobs) {
+				job->Join();
+			}
+
+			if (error) {
+				std::rethrow_exception(error);
+			}
+
+			if (numScannedColumns < NumColumns) {
+				SPRaise("Unexpected EOF");
+			}
+
+			SPAssert(numDecodedColumns == NumColumns);
+
+			return std::move(map);
+		}
+	} // namespace client
+} // namespace spades
@@ -0,0 +1,150 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "GameMap.h"
+#include <Core/Debug.h>
+#include <Core/RefCountedObject.h>
+
+namespace spades {
+	class ConcurrentDispatch;
+	class IStream;
+
+	namespace client {
+		/**
+		 * Decodes VOXLAP5 terrain data in two phases.
+		 *
+		 * The first phase runs on the thread calling `AddData`. It only looks at span headers
+		 * to find where each column begins, which is cheap enough to keep up with the
+		 * inflated data as it arrives. Whenever a band of `BandHeight` rows has been
+		 * located, the band's bytes and its column offset table are handed to a
+		 * `ConcurrentDispatch` that decodes the voxels (the second phase). Bands are
+		 * disjoint, so they are decoded in parallel without locking (except for merging
+		 * colors into a `CompactColorMap`, which is a `memcpy` per column).
+		 *
+		 * When the last byte arrives only the last band is left to decode.
+		 *
+		 * The rows of a band never change once the band is decoded, so they can be read
+		 * (through `GetMap`) before the whole map is decoded. `onRowsDecoded` reports such
+		 * rows.
+		 */
+		class GameMapDecoder {
+		public:
+			enum { BandHeight = 16 };
+
+			/**
+			 * @param onProgress Called with the number of columns decoded so far. It may be
+			 *                   called from any thread, and calls may be reordered.
+			 * @param onRowsDecoded Called with a range `[startY, endY)` of rows when they
+			 *                      are completely decoded. It may be called from any
+			 *                      thread, and the ranges are not necessarily reported in
+			 *                      order.
+			 * @param colorMutex The mutex held while merging colors into the map's
+			 *                   `CompactColorMap`. Hold it to read the colors of decoded
+			 *                   rows before `Finish` returns. An internal one is used if
+			 *                   `nullptr` is given.
+			 */
+			GameMapDecoder(GameMap::StorageMode storageMode,
+			               std::function<void(int)> onProgress = {},
+			               std::function<void(int, int)> onRowsDecoded = {},
+			               std::mutex *colorMutex = nullptr);
+			~GameMapDecoder();
+
+			GameMapDecoder(const GameMapDecoder &) = delete;
+			void operator=(const GameMapDecoder &) = delete;
+
+			/** Supplies the next part of the uncompressed VXL data. */
+			void AddData(const char *bytes, std::size_t numBytes);
+
+			/** Supplies the uncompressed VXL data read from `stream` until it reaches EOF or
+			 * the map is complete. */
+			void AddData(IStream &stream);
+
+			/**
+			 * Returns the map being decoded. Only the rows reported by `onRowsDecoded` can be
+			 * read until `Finish` returns. Must not be called after `Finish`.
+			 */
+			GameMap &GetMap() {
+				SPAssert(map);
+				return *map;
+			}
+
+			/**
+			 * Waits until all bands are decoded and returns the map.
+			 *
+			 * Throws an exception if the data was truncated, malformed, or decoding failed.
+			 */
+			Handle<GameMap> Finish();
+
+			/** Returns the number of columns whose offsets have been located. */
+			int GetNumScannedColumns() const { return numScannedColumns; }
+
+			/**
+			 * Locates the end of the column at the beginning of `data`.
+			 *
+			 * @return The size of the column in bytes, or zero if `data` does not contain the
+			 *         whole column. Throws an exception if the column is malformed.
+			 */
+			static std::size_t ScanColumn(const unsigned char *data, std::size_t size);
+
+		private:
+			struct Band;
+
+			Handle<GameMap> map;
+			std::function<void(int)> onProgress;
+			std::function<void(int, int)> onRowsDecoded;
+
+			/** Bytes that are not assigned to a band yet. */
+			std::vector<unsigned char> pending;
+			/** The offset in `pending` where the next column to scan begins. */
+			std::size_t scanPosition;
+			int numScannedColumns;
+			/** Column offsets of the current incomplete band, relative to `pending`. */
+			std::vector<uint32_t> columnOffsets;
+
+			std::atomic<int> numDecodedColumns;
+
+			std::mutex ownColorMutex;
+			std::mutex &compactColorMapMutex;
+
+			std::mutex errorMutex;
+			std::exception_ptr error;
+
+			bool finished;
+
+			// Declared last so that outstanding jobs are joined before anything else is
+			// destroyed.
+			std::vector<std::unique_ptr<ConcurrentDispatch>> jobs;
+
+			void ScanPending();
+			void StartBand();
+			void DecodeBand(Band &);
+		};
+	} // namespace client
+} // namespace spades
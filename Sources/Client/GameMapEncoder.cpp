@@ -0,0 +1,256 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <array>
+#include <mutex>
+
+#include "GameMap.h"
+#include "GameMapEncoder.h"
+#include <Core/ConcurrentDispatch.h>
+#include <Core/Debug.h>
+#include <Core/Exception.h>
+#include <Core/IStream.h>
+
+namespace spades {
+	namespace client {
+		namespace {
+			constexpr int Width = GameMap::DefaultWidth;
+			constexpr int Height = GameMap::DefaultHeight;
+			constexpr int Depth = GameMap::DefaultDepth;
+
+			/** Returns the index of the first set bit at or after `start`, or `Depth`. */
+			inline int FindFirstSet(uint64_t mask, int start) {
+				if (start >= Depth) {
+					return Depth;
+				}
+				mask &= 0xffffffffffffffffULL << start;
+				return mask ? CountTrailingZeros64(mask) : Depth;
+			}
+
+			/**
+			 * Computes the set of surface voxels in the column (x, y).
+			 *
+			 * A solid voxel is on the surface if it's at Z = 0 or if any of its six neighbors
+			 * is empty. Neighbors outside the map are considered solid.
+			 */
+			inline uint64_t GetSurfaceMask(const GameMap &map, int x, int y) {
+				uint64_t solid = map.GetSolidMapWrapped(x, y);
+				uint64_t exposed = 1 | (~solid << 1) | (~solid >> 1);
+				if (x > 0)
+					exposed |= ~map.GetSolidMapWrapped(x - 1, y);
+				if (x < Width - 1)
+					exposed |= ~map.GetSolidMapWrapped(x + 1, y);
+				if (y > 0)
+					exposed |= ~map.GetSolidMapWrapped(x, y - 1);
+				if (y < Height - 1)
+					exposed |= ~map.GetSolidMapWrapped(x, y + 1);
+				return solid & exposed;
+			}
+
+			struct Span {
+				int airStart;
+				int topColorStart, topColorEnd;       // exclusive end
+				int bottomColorStart, bottomColorEnd; // exclusive end
+				bool last;
+			};
+
+			/**
+			 * Splits a column into spans. This is a bit-parallel version of the algorithm
+			 * found in pysnip.
+			 */
+			template <class F> inline void ForEachSpan(uint64_t solid, uint64_t surface, F f) {
+				int k = 0;
+				while (k < Depth) {
+					Span span;
+					span.airStart = k;
+					k = FindFirstSet(solid, k);
+					span.topColorStart = k;
+					k = FindFirstSet(~surface, k);
+					span.topColorEnd = k;
+					k = FindFirstSet(~solid | surface, k);
+					span.bottomColorStart = k;
+
+					// If the surface voxels continue to the bottom, they become the top
+					// colors of the next span instead
+					int z = FindFirstSet(~surface, k);
+					if (z != Depth) {
+						k = z;
+					}
+					span.bottomColorEnd = k;
+					span.last = k == Depth;
+					f(span);
+				}
+			}
+
+			inline char *WriteColor(char *out, uint32_t color) {
+				out[0] = static_cast<char>(color >> 16);
+				out[1] = static_cast<char>(color >> 8);
+				out[2] = static_cast<char>(color >> 0);
+				out[3] = static_cast<char>(color >> 24);
+				return out + 4;
+			}
+
+			void EncodeBand(const GameMap &map, int startY, std::vector<char> &out) {
+				SPADES_MARK_FUNCTION();
+
+				std::array<uint64_t, Width * GameMapEncoder::BandHeight> surfaceMasks;
+
+				// Pass 1: Find the surface voxels and compute the output size
+				std::size_t size = 0;
+				for (int row = 0; row < GameMapEncoder::BandHeight; row++) {
+					int y = startY + row;
+					for (int x = 0; x < Width; x++) {
+						uint64_t surface = GetSurfaceMask(map, x, y);
+						surfaceMasks[row * Width + x] = surface;
+						ForEachSpan(map.GetSolidMapWrapped(x, y), surface, [&](const Span &span) {
+							int numColors = (span.topColorEnd - span.topColorStart) +
+							                (span.bottomColorEnd - span.bottomColorStart);
+							size += 4 + 4 * numColors;
+						});
+					}
+				}
+
+				// Pass 2: Write the spans
+				out.resize(size);
+				char *p = out.data();
+				for (int row = 0; row < GameMapEncoder::BandHeight; row++) {
+					int y = startY + row;
+					for (int x = 0; x < Width; x++) {
+						uint64_t surface = surfaceMasks[row * Width + x];
+						ForEachSpan(map.GetSolidMapWrapped(x, y), surface, [&](const Span &span) {
+							int numColors = (span.topColorEnd - span.topColorStart) +
+							                (span.bottomColorEnd - span.bottomColorStart);
+							p[0] = static_cast<char>(span.last ? 0 : numColors + 1);
+							p[1] = static_cast<char>(span.topColorStart);
+							p[2] = static_cast<char>(span.topColorEnd - 1);
+							p[3] = static_cast<char>(span.airStart);
+							p += 4;
+							for (int z = span.topColorStart; z < span.topColorEnd; z++)
+								p = WriteColor(p, map.GetColor(x, y, z));
+							for (int z = span.bottomColorStart; z < span.bottomColorEnd; z++)
+								p = WriteColor(p, map.GetColor(x, y, z));
+						});
+					}
+				}
+				SPAssert(p == out.data() + out.size());
+			}
+		} // namespace
+
+		GameMapEncoder::GameMapEncoder(const GameMap &map) : writeComplete{false} {
+			SPADES_MARK_FUNCTION();
+
+			SPAssert(map.Width() == Width);
+			SPAssert(map.Height() == Height);
+			SPAssert(map.Depth() == Depth);
+
+			bands.resize(Height / BandHeight);
+
+			std::mutex errorMutex;
+			std::exception_ptr error;
+
+			std::vector<std::unique_ptr<ConcurrentDispatch>> jobs;
+			jobs.reserve(bands.size());
+			for (std::size_t i = 0; i < bands.size(); i++) {
+				auto job = [&, i]() {
+					try {
+						EncodeBand(map, static_cast<int>(i) * BandHeight, bands[i]);
+					} catch (...) {
+						std::lock_guard<std::mutex> lock{errorMutex};
+						error = std::current_exception();
+					}
+				};
+				jobs.emplace_back(new FunctionDispatch<decltype(job)>(job));
+				jobs.back()->Start();
+			}
+			for (const auto &job : jobs) {
+				job->Join();
+			}
+
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		}
+
+		GameMapEncoder::~GameMapEncoder() {
+			SPADES_MARK_FUNCTION();
+
+			if (writer) {
+				writer->Join();
+			}
+		}
+
+		std::size_t GameMapEncoder::GetSize() const {
+			std::size_t size = 0;
+			for (const auto &band : bands) {
+				size += band.size();
+			}
+			return size;
+		}
+
+		void GameMapEncoder::Write(IStream &stream) const {
+			SPADES_MARK_FUNCTION();
+
+			for (const auto &band : bands) {
+				stream.Write(band.data(), band.size());
+			}
+		}
+
+		void GameMapEncoder::StartWriting(std::unique_ptr<IStream> stream) {
+			SPADES_MARK_FUNCTION();
+
+			if (writer) {
+				SPRaise("Writing is already started.");
+			}
+
+			this->stream = std::move(stream);
+
+			auto job = [this]() {
+				try {
+					Write(*this->stream);
+					// Close the stream on this thread as well
+					this->stream.reset();
+				} catch (...) {
+					writeError = std::current_exception();
+				}
+				writeComplete.store(true, std::memory_order_release);
+			};
+			writer.reset(new FunctionDispatch<decltype(job)>(job));
+			writer->Start();
+		}
+
+		bool GameMapEncoder::IsComplete() const {
+			return writeComplete.load(std::memory_order_acquire);
+		}
+
+		void GameMapEncoder::WaitComplete() {
+			SPADES_MARK_FUNCTION();
+
+			if (!writer) {
+				SPRaise("Writing is not started.");
+			}
+
+			writer->Join();
+
+			if (writeError) {
+				std::rethrow_exception(writeError);
+			}
+		}
+	} // namespace client
+} // namespace spades
@@ -0,0 +1,95 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <vector>
+
+namespace spades {
+	class IStream;
+	class ConcurrentDispatch;
+
+	namespace client {
+		class GameMap;
+
+		/**
+		 * Encodes a `GameMap` into VOXLAP5 terrain data.
+		 *
+		 * The map is split into bands of `BandHeight` rows, which are encoded in parallel.
+		 * For each column, the set of surface voxels is computed at once from the solid
+		 * bitmaps of the column and its four neighbors. Each band is encoded in two passes
+		 * (one to compute the exact size, one to write bytes) into a buffer owned by the
+		 * band, so the output is written without reallocation.
+		 *
+		 * The encoded data does not depend on the map after the constructor returns, so it
+		 * can be written to a stream on a background thread (`StartWriting`) while the map
+		 * continues to be modified.
+		 */
+		class GameMapEncoder {
+		public:
+			enum { BandHeight = 16 };
+
+			/**
+			 * Encodes the current state of `map`. Blocks until the encoding is done.
+			 * `map` must not be modified during the call.
+			 */
+			GameMapEncoder(const GameMap &map);
+
+			/** Waits until the background writing operation (if any) completes. */
+			~GameMapEncoder();
+
+			GameMapEncoder(const GameMapEncoder &) = delete;
+			void operator=(const GameMapEncoder &) = delete;
+
+			/** Returns the size of the encoded data in bytes. */
+			std::size_t GetSize() const;
+
+			/** Writes the encoded data to `stream` on the current thread. */
+			void Write(IStream &stream) const;
+
+			/**
+			 * Starts writing the encoded data to `stream` on a background thread.
+			 * `stream` is closed when the operation completes.
+			 */
+			void StartWriting(std::unique_ptr<IStream> stream);
+
+			/** Returns `true` if the operation started by `StartWriting` is complete. */
+			bool IsComplete() const;
+
+			/**
+			 * Blocks the current thread until the operation started by `StartWriting`
+			 * completes. Rethrows the exception that occured while writing, if any.
+			 */
+			void WaitComplete();
+
+		private:
+			std::vector<std::vector<char>> bands;
+
+			std::unique_ptr<IStream> stream;
+			std::exception_ptr writeError;
+			std::atomic<bool> writeComplete;
+			std::unique_ptr<ConcurrentDispatch> writer;
+		};
+	} // namespace client
+} // namespace spades
@@ -17,15 +17,18 @@
  along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
 
  */
+#include <algorithm>
 #include <exception>
 
 #include "GameMap.h"
+#include "GameMapDecoder.h"
 #include "GameMapLoader.h"
 #include <Core/Debug.h>
 #include <Core/DeflateStream.h>
 #include <Core/Exception.h>
 #include <Core/IRunnable.h>
 #include <Core/PipeStream.h>
+#include <Core/TaskScheduler.h>
 #include <Core/Thread.h>
 
 namespace spades {
@@ -37,6 +40,34 @@ namespace spades {
 			Handle<GameMap> gameMap;
 		};
 
+		namespace {
+			/** Forwards reads to another stream until the loader is cancelled. */
+			class CancellableStream : public IStream {
+				IStream &base;
+				std::atomic<bool> &cancelled;
+
+				void CheckCancelled() {
+					if (cancelled.load(std::memory_order_relaxed)) {
+						SPRaise("The map loading was cancelled.");
+					}
+				}
+
+			public:
+				CancellableStream(IStream &base, std::atomic<bool> &cancelled)
+				    : base{base}, cancelled{cancelled} {}
+
+				int ReadByte() override {
+					CheckCancelled();
+					return base.ReadByte();
+				}
+
+				size_t Read(void *data, size_t bytes) override {
+					CheckCancelled();
+					return base.Read(data, bytes);
+				}
+			};
+		} // namespace
+
 		struct GameMapLoader::Decoder : public IRunnable {
 			GameMapLoader &parent;
 			std::unique_ptr<IStream> rawDataReader;
@@ -50,12 +81,37 @@ namespace spades {
 				auto result = stmp::make_unique<Result>();
 
 				try {
-					DeflateStream inflate(rawDataReader.get(), CompressModeDecompress, false);
-
-					GameMap *gameMapPtr =
-					  GameMap::Load(&inflate, [this](int x) { HandleProgress(x); });
-
-					result->gameMap = Handle<GameMap>{gameMapPtr, false};
+					CancellableStream reader{*rawDataReader, parent.cancelled};
+					DeflateStream inflate(&reader, CompressModeDecompress, false);
+
+					Handle<GameMap> map;
+					{
+						GameMapDecoder decoder{
+						  GameMap::GetDefaultStorageMode(), [this](int x) { HandleProgress(x); },
+						  [this](int startY, int endY) { HandleRowsDecoded(startY, endY); },
+						  &parent.partialMapMutex};
+
+						{
+							std::lock_guard<std::mutex> lock{parent.partialMapMutex};
+							parent.partialMap = Handle<GameMap>{decoder.GetMap()};
+						}
+
+						try {
+							decoder.AddData(inflate);
+							map = decoder.Finish();
+						} catch (...) {
+							// `cancelled` is only set when the map was found in the cache
+							if (!parent.cancelled) {
+								throw;
+							}
+						}
+						// `~GameMapDecoder` waits for the remaining decoding jobs
+					}
+
+					if (parent.cache) {
+						map = ResolveCache(std::move(map));
+					}
+					result->gameMap = std::move(map);
 				} catch (...) {
 					// Capture the current exception
 					result->exceptionThrown = std::current_exception();
@@ -66,11 +122,54 @@ namespace spades {
 			}
 
 			void HandleProgress(int numColumnsLoaded) {
-				parent.progressCell.store(numColumnsLoaded);
+				// Called by multiple decoding threads, so make sure the value only increases
+				std::uint32_t value = static_cast<std::uint32_t>(numColumnsLoaded);
+				std::uint32_t current = parent.progressCell.load(std::memory_order_relaxed);
+				while (current < value &&
+				       !parent.progressCell.compare_exchange_weak(current, value)) {
+				}
+			}
+
+			/**
+			 * Takes the result of the cache lookup. `map` is the decoded map, or null if the
+			 * decoding was cancelled because of a cache hit.
+			 */
+			Handle<GameMap> ResolveCache(Handle<GameMap> map) {
+				SPADES_MARK_FUNCTION();
+
+				CacheLookupState state = parent.WaitCacheLookup();
+				if (!map) {
+					SPAssert(state == CacheLookupState::Hit);
+
+					// Restore the cached map into the map being decoded so that anything
+					// built from the decoded rows remains valid
+					std::lock_guard<std::mutex> lock{parent.partialMapMutex};
+					map = parent.partialMap;
+					map->Assign(*parent.cachedMap);
+					std::fill(parent.decodedRows.begin(), parent.decodedRows.end(), true);
+					parent.decodedRowsChanged = true;
+				} else if (state == CacheLookupState::Miss) {
+					parent.cache->Store(parent.cacheKey, *map);
+				}
+				parent.cachedMap = nullptr;
+				return map;
+			}
+
+			void HandleRowsDecoded(int startY, int endY) {
+				std::lock_guard<std::mutex> lock{parent.partialMapMutex};
+				std::fill(parent.decodedRows.begin() + startY, parent.decodedRows.begin() + endY,
+				          true);
+				parent.decodedRowsChanged = true;
 			}
 		};
 
-		GameMapLoader::GameMapLoader() : progressCell{0} {
+		GameMapLoader::GameMapLoader(GameMapCache *cache)
+		    : progressCell{0},
+		      decodedRows(GameMap::DefaultHeight, false),
+		      decodedRowsChanged{false},
+		      cancelled{false},
+		      cache{cache},
+		      cacheLookupState{CacheLookupState::Pending} {
 			SPADES_MARK_FUNCTION();
 
 			auto pipe = CreatePipeStream();
@@ -88,10 +187,21 @@ namespace spades {
 			SPADES_MARK_FUNCTION();
 
 			// Hang up the writer. This causes the decoder thread to exit gracefully.
+			{
+				std::lock_guard<std::mutex> lock{cacheMutex};
+				if (cacheLookupState == CacheLookupState::Pending) {
+					cacheLookupState = CacheLookupState::Abandoned;
+				}
+			}
+			cacheCondition.notify_all();
 			rawDataWriter.reset();
 
 			decodingThread->Join();
 			decodingThread.reset();
+
+			if (cacheLookupTask) {
+				TaskScheduler::GetInstance().Wait(*cacheLookupTask);
+			}
 		}
 
 		void GameMapLoader::AddRawChunk(const char *bytes, std::size_t numBytes) {
@@ -101,6 +211,10 @@ namespace spades {
 				SPRaise("The raw data channel is already closed.");
 			}
 
+			if (cache) {
+				cacheKeyBuilder.Update(bytes, numBytes);
+			}
+
 			rawDataWriter->Write(bytes, numBytes);
 		}
 
@@ -110,9 +224,42 @@ namespace spades {
 			if (!rawDataWriter) {
 				SPRaise("The raw data channel is already closed.");
 			}
+
+			if (cache) {
+				cacheKey = cacheKeyBuilder.Finish();
+
+				auto lookup = [this]() {
+					Handle<GameMap> map = cache->Load(cacheKey);
+
+					std::lock_guard<std::mutex> lock{cacheMutex};
+					if (cacheLookupState != CacheLookupState::Pending) {
+						return;
+					}
+					if (map) {
+						cachedMap = std::move(map);
+						cacheLookupState = CacheLookupState::Hit;
+
+						// Don't bother decoding the rest
+						cancelled = true;
+					} else {
+						cacheLookupState = CacheLookupState::Miss;
+					}
+					cacheCondition.notify_all();
+				};
+				cacheLookupTask.reset(new FunctionTask<decltype(lookup)>(lookup));
+				TaskScheduler::GetInstance().Spawn(*cacheLookupTask);
+			}
+
 			rawDataWriter.reset();
 		}
 
+		auto GameMapLoader::WaitCacheLookup() -> CacheLookupState {
+			std::unique_lock<std::mutex> lock{cacheMutex};
+			cacheCondition.wait(lock,
+			                    [&] { return cacheLookupState != CacheLookupState::Pending; });
+			return cacheLookupState;
+		}
+
 		bool GameMapLoader::IsComplete() const { return resultCell.operator bool(); }
 
 		void GameMapLoader::WaitComplete() {
@@ -127,6 +274,16 @@ namespace spades {
 			return static_cast<float>(progressCell.load(std::memory_order_relaxed)) / (512 * 512);
 		}
 
+		auto GameMapLoader::LockPartialGameMap() -> PartialGameMap {
+			PartialGameMap partial;
+			partial.lock = std::unique_lock<std::mutex>{partialMapMutex};
+			partial.map = partialMap;
+			partial.decodedRows = decodedRows;
+			partial.changed = decodedRowsChanged;
+			decodedRowsChanged = false;
+			return partial;
+		}
+
 		Handle<GameMap> GameMapLoader::TakeGameMap() {
 			SPADES_MARK_FUNCTION();
 
@@ -18,14 +18,19 @@
 
  */
 #include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <vector>
 
+#include "GameMapCache.h"
 #include <Core/IStream.h>
 #include <Core/TMPUtils.h>
 
 namespace spades {
 	class Thread;
 	class IRunnable;
+	class Task;
 
 	namespace client {
 
@@ -34,10 +39,22 @@ namespace spades {
 		/**
 		 * A streaming map loader that can decode a game map in a streaming fashion and
 		 * report the progress based on the incomplete decoded data.
+		 *
+		 * If a `GameMapCache` is given, the undecoded data is hashed as it arrives, and the
+		 * complete data is looked up in the cache by a `TaskScheduler` task, concurrently with
+		 * the rest of the decoding. If the lookup finishes first, the decoding is cancelled
+		 * and the cached map is copied into the map being decoded. Otherwise, the decoded
+		 * map is added to the cache (in the background). In either case the calling thread
+		 * doesn't access the disk, and the final map is the object returned by
+		 * `LockPartialGameMap`.
+		 *
+		 * The rows decoded so far can be accessed through `LockPartialGameMap` before the
+		 * download completes, e.g., to build renderer data structures early.
 		 */
 		class GameMapLoader {
 		public:
-			GameMapLoader();
+			/** @param cache The cache to use. Can be null. Must outlive this object. */
+			GameMapLoader(GameMapCache *cache = nullptr);
 			~GameMapLoader();
 
 			GameMapLoader(const GameMapLoader &) = delete;
@@ -71,6 +88,28 @@ namespace spades {
 			 */
 			float GetProgress();
 
+			/** The map being decoded, locked for reading by `LockPartialGameMap`. */
+			struct PartialGameMap {
+				/** Blocks the decoding threads from modifying the colors of `map`. */
+				std::unique_lock<std::mutex> lock;
+				/** The map being decoded. `nullptr` if the decoding hasn't started yet. */
+				Handle<GameMap> map;
+				/** `decodedRows[y]` is `true` if the row `y` of `map` is completely decoded. */
+				std::vector<bool> decodedRows;
+				/** `true` if some rows were decoded since the last call. */
+				bool changed;
+			};
+
+			/**
+			 * Returns the map being decoded, with a lock that keeps the decoded rows readable
+			 * until it's released. Other rows must not be read. Don't hold the lock for long,
+			 * or the decoding stalls.
+			 *
+			 * The final map returned by `TakeGameMap` is the same object, even if it was
+			 * restored from the cache.
+			 */
+			PartialGameMap LockPartialGameMap();
+
 			/**
 			 * Gets the loaded `GameMap` and takes the ownership of it.
 			 *
@@ -99,6 +138,37 @@ namespace spades {
 
 			/** The cell for receiving the decode result. */
 			stmp::atomic_unique_ptr<Result> resultCell;
+
+			/**
+			 * Serializes the color updates by the decoding threads. Also protects
+			 * `partialMap` and `decodedRows`.
+			 */
+			std::mutex partialMapMutex;
+			Handle<GameMap> partialMap;
+			std::vector<bool> decodedRows;
+			bool decodedRowsChanged;
+
+			/** Set to make the decoding thread stop reading the undecoded data. */
+			std::atomic<bool> cancelled;
+
+			GameMapCache *cache;
+			GameMapCache::KeyBuilder cacheKeyBuilder;
+
+			enum class CacheLookupState { Pending, Hit, Miss, Abandoned };
+
+			/** Protects `cacheLookupState` and `cachedMap`. */
+			std::mutex cacheMutex;
+			std::condition_variable cacheCondition;
+			CacheLookupState cacheLookupState;
+			/** The map restored from `cache`. Set if `cacheLookupState` is `Hit`. */
+			Handle<GameMap> cachedMap;
+			/** Set by `MarkEOF`. */
+			GameMapCache::Key cacheKey;
+			/** Looks up `cacheKey` in `cache`. Spawned by `MarkEOF`. */
+			std::unique_ptr<Task> cacheLookupTask;
+
+			/** Waits until the cache lookup completes or is abandoned. */
+			CacheLookupState WaitCacheLookup();
 		};
 
 	} // namespace client
@@ -0,0 +1,481 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <cmath>
+
+#include "GameMap.h"
+#include <Core/Debug.h>
+#include <Core/Exception.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ENABLE_SSE2 1
+#include <emmintrin.h>
+#else
+#define ENABLE_SSE2 0
+#endif
+
+namespace spades {
+	namespace client {
+		namespace {
+			using SolidMap = const uint64_t (*)[GameMap::DefaultHeight];
+
+			inline bool IsSolidWrapped(SolidMap solidMap, int x, int y, int z) {
+				if (z < 0)
+					return false;
+				if (z >= GameMap::DefaultDepth)
+					return true;
+				return ((solidMap[x & (GameMap::DefaultWidth - 1)]
+				                 [y & (GameMap::DefaultHeight - 1)] >>
+				         (uint64_t)z) &
+				        1ULL) != 0;
+			}
+
+			/** The traversal state of a ray, laid out in the same way as `CastRay2`'s. */
+			struct RayState {
+				IntVector3 iv;
+				IntVector3 step;
+				Vector3 fv;
+				Vector3 absDir;
+				Vector3 inv;
+			};
+
+			/**
+			 * Does what `CastRay2` does before the main loop.
+			 *
+			 * @return `true` if the ray has to be traversed. `false` if `result` is already
+			 *         final.
+			 */
+			bool SetupRay(SolidMap solidMap, const GameMap::RayQuery &query, RayState &state,
+			              GameMap::RayCastResult &result) {
+				SPAssert(!std::isnan(query.origin.x));
+				SPAssert(!std::isnan(query.origin.y));
+				SPAssert(!std::isnan(query.origin.z));
+				SPAssert(!std::isnan(query.dir.x));
+				SPAssert(!std::isnan(query.dir.y));
+				SPAssert(!std::isnan(query.dir.z));
+
+				const Vector3 &v0 = query.origin;
+				Vector3 dir = query.dir.Normalize();
+				IntVector3 iv = v0.Floor();
+
+				if (IsSolidWrapped(solidMap, iv.x, iv.y, iv.z)) {
+					result.hit = true;
+					result.startSolid = true;
+					result.hitPos = v0;
+					result.hitBlock = iv;
+					result.normal = IntVector3::Make(0, 0, 0);
+					return false;
+				}
+
+				result.hit = false;
+				result.startSolid = false;
+				result.hitPos = v0;
+				result.hitBlock = iv;
+				result.normal = IntVector3::Make(0, 0, 0);
+
+				if (query.maxSteps <= 0 || (dir.x == 0.f && dir.y == 0.f && dir.z == 0.f)) {
+					return false;
+				}
+
+				state.iv = iv;
+				state.step.x = dir.x > 0.f ? 1 : -1;
+				state.step.y = dir.y > 0.f ? 1 : -1;
+				state.step.z = dir.z > 0.f ? 1 : -1;
+				state.fv.x = dir.x > 0.f ? (float)(iv.x + 1) - v0.x : v0.x - (float)iv.x;
+				state.fv.y = dir.y > 0.f ? (float)(iv.y + 1) - v0.y : v0.y - (float)iv.y;
+				state.fv.z = dir.z > 0.f ? (float)(iv.z + 1) - v0.z : v0.z - (float)iv.z;
+				state.absDir = MakeVector3(fabsf(dir.x), fabsf(dir.y), fabsf(dir.z));
+				state.inv.x = dir.x != 0.f ? 1.f / state.absDir.x : 0.f;
+				state.inv.y = dir.y != 0.f ? 1.f / state.absDir.y : 0.f;
+				state.inv.z = dir.z != 0.f ? 1.f / state.absDir.z : 0.f;
+				return true;
+			}
+
+			/** Computes the position where a ray enters `block`. */
+			inline Vector3 ComputeHitPos(const IntVector3 &block, const IntVector3 &step,
+			                             const Vector3 &fv) {
+				Vector3 hitPos;
+				hitPos.x = step.x > 0 ? (float)(block.x + 1) - fv.x : (float)block.x + fv.x;
+				hitPos.y = step.y > 0 ? (float)(block.y + 1) - fv.y : (float)block.y + fv.y;
+				hitPos.z = step.z > 0 ? (float)(block.z + 1) - fv.z : (float)block.z + fv.z;
+				return hitPos;
+			}
+
+			void TraceRay(SolidMap solidMap, const GameMap::RayQuery &query, RayState &state,
+			              GameMap::RayCastResult &result) {
+				float travelled = 0.f;
+
+				for (int i = 0; i < query.maxSteps; i++) {
+					// Find the nearest boundary, preferring X over Y over Z on ties
+					int axis = 0;
+					float t = 0.f;
+					if (state.inv.x != 0.f) {
+						axis = 1;
+						t = state.fv.x * state.inv.x;
+					}
+					if (state.inv.y != 0.f) {
+						float ty = state.fv.y * state.inv.y;
+						if (axis == 0 || ty < t) {
+							axis = 2;
+							t = ty;
+						}
+					}
+					if (state.inv.z != 0.f) {
+						float tz = state.fv.z * state.inv.z;
+						if (axis == 0 || tz < t) {
+							axis = 3;
+							t = tz;
+						}
+					}
+
+					IntVector3 nextBlock = state.iv;
+					switch (axis) {
+						case 1: nextBlock.x += state.step.x; break;
+						case 2: nextBlock.y += state.step.y; break;
+						case 3: nextBlock.z += state.step.z; break;
+						default: SPUnreachable();
+					}
+
+					state.fv.x = axis == 1 ? 1.f : state.fv.x - state.absDir.x * t;
+					state.fv.y = axis == 2 ? 1.f : state.fv.y - state.absDir.y * t;
+					state.fv.z = axis == 3 ? 1.f : state.fv.z - state.absDir.z * t;
+					travelled += t;
+
+					result.hitBlock = nextBlock;
+					result.normal = state.iv - nextBlock;
+
+					if (travelled > query.maxDistance) {
+						return;
+					}
+
+					if (IsSolidWrapped(solidMap, nextBlock.x, nextBlock.y, nextBlock.z)) {
+						result.hit = true;
+						result.hitPos = ComputeHitPos(nextBlock, state.step, state.fv);
+						return;
+					}
+
+					state.iv = nextBlock;
+				}
+			}
+
+#if ENABLE_SSE2
+			/** The states of rays traced by `TraceRayPackets`, in the SoA layout. */
+			template <int N> struct alignas(16) RayLanes {
+				int32_t ivx[N], ivy[N], ivz[N];
+				int32_t nextX[N], nextY[N], nextZ[N];
+				int32_t stepx[N], stepy[N], stepz[N];
+				int32_t remaining[N];
+				float fvx[N], fvy[N], fvz[N];
+				float adx[N], ady[N], adz[N];
+				float invx[N], invy[N], invz[N];
+				float travelled[N], maxDistance[N];
+				std::size_t rayIndices[N];
+
+				static_assert(N % 4 == 0, "N must be a multiple of the SIMD width");
+
+				void Set(int lane, const RayState &state, const GameMap::RayQuery &query,
+				         std::size_t rayIndex) {
+					ivx[lane] = state.iv.x;
+					ivy[lane] = state.iv.y;
+					ivz[lane] = state.iv.z;
+					stepx[lane] = state.step.x;
+					stepy[lane] = state.step.y;
+					stepz[lane] = state.step.z;
+					fvx[lane] = state.fv.x;
+					fvy[lane] = state.fv.y;
+					fvz[lane] = state.fv.z;
+					adx[lane] = state.absDir.x;
+					ady[lane] = state.absDir.y;
+					adz[lane] = state.absDir.z;
+					invx[lane] = state.inv.x;
+					invy[lane] = state.inv.y;
+					invz[lane] = state.inv.z;
+					remaining[lane] = query.maxSteps;
+					travelled[lane] = 0.f;
+					maxDistance[lane] = query.maxDistance;
+					rayIndices[lane] = rayIndex;
+				}
+
+				/** Fills `lane` with a dummy ray that moves along the X axis. */
+				void SetIdle(int lane) {
+					ivx[lane] = ivy[lane] = ivz[lane] = 0;
+					stepx[lane] = stepy[lane] = stepz[lane] = 1;
+					fvx[lane] = fvy[lane] = fvz[lane] = 1.f;
+					adx[lane] = invx[lane] = 1.f;
+					ady[lane] = adz[lane] = invy[lane] = invz[lane] = 0.f;
+					remaining[lane] = 0;
+					travelled[lane] = 0.f;
+					maxDistance[lane] = 0.f;
+				}
+			};
+
+			/** Four rays in SIMD registers. */
+			struct RayLaneGroup {
+				__m128i ivx, ivy, ivz;
+				__m128i nextX, nextY, nextZ;
+				__m128i stepx, stepy, stepz;
+				__m128i remaining;
+				__m128 fvx, fvy, fvz;
+				__m128 adx, ady, adz;
+				__m128 invx, invy, invz;
+				__m128 travelled, maxDistance;
+				__m128 hasX, hasY, hasZ, hasXY;
+
+#define SPADES_LOAD_I(name)                                                                        \
+	name = _mm_load_si128(reinterpret_cast<const __m128i *>(lanes.name + offset))
+#define SPADES_LOAD_F(name) name = _mm_load_ps(lanes.name + offset)
+#define SPADES_STORE_I(name) _mm_store_si128(reinterpret_cast<__m128i *>(lanes.name + offset), name)
+#define SPADES_STORE_F(name) _mm_store_ps(lanes.name + offset, name)
+
+				template <int N> void Load(const RayLanes<N> &lanes, int offset) {
+					SPADES_LOAD_I(ivx);
+					SPADES_LOAD_I(ivy);
+					SPADES_LOAD_I(ivz);
+					SPADES_LOAD_I(stepx);
+					SPADES_LOAD_I(stepy);
+					SPADES_LOAD_I(stepz);
+					SPADES_LOAD_I(remaining);
+					SPADES_LOAD_F(fvx);
+					SPADES_LOAD_F(fvy);
+					SPADES_LOAD_F(fvz);
+					SPADES_LOAD_F(adx);
+					SPADES_LOAD_F(ady);
+					SPADES_LOAD_F(adz);
+					SPADES_LOAD_F(invx);
+					SPADES_LOAD_F(invy);
+					SPADES_LOAD_F(invz);
+					SPADES_LOAD_F(travelled);
+					SPADES_LOAD_F(maxDistance);
+
+					__m128 zero = _mm_setzero_ps();
+					hasX = _mm_cmpneq_ps(invx, zero);
+					hasY = _mm_cmpneq_ps(invy, zero);
+					hasZ = _mm_cmpneq_ps(invz, zero);
+					hasXY = _mm_or_ps(hasX, hasY);
+				}
+
+				/** Stores the variables that `Step` modifies. */
+				template <int N> void Store(RayLanes<N> &lanes, int offset) const {
+					SPADES_STORE_I(ivx);
+					SPADES_STORE_I(ivy);
+					SPADES_STORE_I(ivz);
+					SPADES_STORE_I(nextX);
+					SPADES_STORE_I(nextY);
+					SPADES_STORE_I(nextZ);
+					SPADES_STORE_I(remaining);
+					SPADES_STORE_F(fvx);
+					SPADES_STORE_F(fvy);
+					SPADES_STORE_F(fvz);
+					SPADES_STORE_F(travelled);
+				}
+
+#undef SPADES_LOAD_I
+#undef SPADES_LOAD_F
+#undef SPADES_STORE_I
+#undef SPADES_STORE_F
+
+				/**
+				 * Moves every ray to the next voxel (`next[XYZ]`), without updating `iv`.
+				 *
+				 * @param solidLanes Receives the bitmask of lanes that hit a solid voxel.
+				 * @return The bitmask of lanes that terminated.
+				 */
+				int Step(const uint64_t *flatSolidMap, int &solidLanes) {
+					const __m128 ones = _mm_castsi128_ps(_mm_set1_epi32(-1));
+					const __m128 oneF = _mm_set1_ps(1.f);
+
+					// Find the nearest boundary, preferring X over Y over Z on ties
+					__m128 tX = _mm_mul_ps(fvx, invx);
+					__m128 tY = _mm_mul_ps(fvy, invy);
+					__m128 tZ = _mm_mul_ps(fvz, invz);
+
+					__m128 selY =
+					  _mm_and_ps(hasY, _mm_or_ps(_mm_andnot_ps(hasX, ones), _mm_cmplt_ps(tY, tX)));
+					__m128 t = _mm_or_ps(_mm_and_ps(selY, tY), _mm_andnot_ps(selY, tX));
+					__m128 selZ =
+					  _mm_and_ps(hasZ, _mm_or_ps(_mm_andnot_ps(hasXY, ones), _mm_cmplt_ps(tZ, t)));
+					t = _mm_or_ps(_mm_and_ps(selZ, tZ), _mm_andnot_ps(selZ, t));
+					selY = _mm_andnot_ps(selZ, selY);
+					__m128 selX = _mm_andnot_ps(_mm_or_ps(selY, selZ), ones);
+
+					nextX = _mm_add_epi32(ivx, _mm_and_si128(_mm_castps_si128(selX), stepx));
+					nextY = _mm_add_epi32(ivy, _mm_and_si128(_mm_castps_si128(selY), stepy));
+					nextZ = _mm_add_epi32(ivz, _mm_and_si128(_mm_castps_si128(selZ), stepz));
+
+					fvx = _mm_or_ps(_mm_and_ps(selX, oneF),
+					                _mm_andnot_ps(selX, _mm_sub_ps(fvx, _mm_mul_ps(adx, t))));
+					fvy = _mm_or_ps(_mm_and_ps(selY, oneF),
+					                _mm_andnot_ps(selY, _mm_sub_ps(fvy, _mm_mul_ps(ady, t))));
+					fvz = _mm_or_ps(_mm_and_ps(selZ, oneF),
+					                _mm_andnot_ps(selZ, _mm_sub_ps(fvz, _mm_mul_ps(adz, t))));
+					travelled = _mm_add_ps(travelled, t);
+					remaining = _mm_sub_epi32(remaining, _mm_set1_epi32(1));
+
+					int beyondLanes = _mm_movemask_ps(_mm_cmpgt_ps(travelled, maxDistance));
+					int exhaustedLanes = _mm_movemask_ps(
+					  _mm_castsi128_ps(_mm_cmpeq_epi32(remaining, _mm_setzero_si128())));
+
+					// Voxels above the map are empty, and ones below it are solid
+					int aboveLanes = _mm_movemask_ps(
+					  _mm_castsi128_ps(_mm_cmplt_epi32(nextZ, _mm_setzero_si128())));
+					int belowLanes = _mm_movemask_ps(_mm_castsi128_ps(
+					  _mm_cmpgt_epi32(nextZ, _mm_set1_epi32(GameMap::DefaultDepth - 1))));
+
+					// `solidMap[x][y]` is `flatSolidMap[(x << 9) | y]`
+					static_assert(GameMap::DefaultHeight == 1 << 9, "");
+					__m128i columnIndices = _mm_or_si128(
+					  _mm_slli_epi32(
+					    _mm_and_si128(nextX, _mm_set1_epi32(GameMap::DefaultWidth - 1)), 9),
+					  _mm_and_si128(nextY, _mm_set1_epi32(GameMap::DefaultHeight - 1)));
+					__m128i bitIndices =
+					  _mm_and_si128(nextZ, _mm_set1_epi32(GameMap::DefaultDepth - 1));
+					alignas(16) int32_t columns[4], bits[4];
+					_mm_store_si128(reinterpret_cast<__m128i *>(columns), columnIndices);
+					_mm_store_si128(reinterpret_cast<__m128i *>(bits), bitIndices);
+
+					solidLanes = 0;
+					for (int lane = 0; lane < 4; lane++) {
+						solidLanes |=
+						  static_cast<int>((flatSolidMap[columns[lane]] >> bits[lane]) & 1)
+						  << lane;
+					}
+					solidLanes = (solidLanes & ~aboveLanes) | belowLanes;
+
+					return solidLanes | beyondLanes | exhaustedLanes;
+				}
+
+				void Advance() {
+					ivx = nextX;
+					ivy = nextY;
+					ivz = nextZ;
+				}
+			};
+
+			/**
+			 * Traces rays in packets of four. The boundary selection and the state update are
+			 * done in SIMD registers with the exact same floating-point operations as
+			 * `TraceRay`, so the results are bit-identical. The voxel lookups are scalar.
+			 *
+			 * (Interleaving two packets to hide the latency of a step doesn't pay off because
+			 * a packet's state barely fits in the SSE register file.)
+			 *
+			 * When a ray in a lane terminates, the lane is refilled with the next ray, so
+			 * lanes don't sit idle waiting for the longest ray in a packet.
+			 */
+			void TraceRayPackets(SolidMap solidMap, const GameMap::RayQuery *queries,
+			                     GameMap::RayCastResult *results, std::size_t count) {
+				enum { NumLanes = 4 };
+
+				RayLanes<NumLanes> lanes;
+				std::size_t nextRay = 0;
+
+				// Loads the next ray that needs traversal into `lane`
+				auto fillLane = [&](int lane) {
+					while (nextRay < count) {
+						std::size_t index = nextRay++;
+						RayState state;
+						if (SetupRay(solidMap, queries[index], state, results[index])) {
+							lanes.Set(lane, state, queries[index], index);
+							return true;
+						}
+					}
+					lanes.SetIdle(lane);
+					return false;
+				};
+
+				int activeLanes = 0;
+				for (int lane = 0; lane < NumLanes; lane++) {
+					if (fillLane(lane)) {
+						activeLanes |= 1 << lane;
+					}
+				}
+
+				const uint64_t *flatSolidMap = solidMap[0];
+				RayLaneGroup group;
+
+				while (activeLanes) {
+					group.Load(lanes, 0);
+
+					int terminatedLanes;
+					int solidLanes;
+					for (;;) {
+						terminatedLanes = group.Step(flatSolidMap, solidLanes) & activeLanes;
+						if (terminatedLanes) {
+							break;
+						}
+						group.Advance();
+					}
+
+					group.Store(lanes, 0);
+
+					for (int lane = 0; lane < NumLanes; lane++) {
+						IntVector3 nextBlock =
+						  IntVector3::Make(lanes.nextX[lane], lanes.nextY[lane], lanes.nextZ[lane]);
+
+						if (terminatedLanes & (1 << lane)) {
+							GameMap::RayCastResult &result = results[lanes.rayIndices[lane]];
+							result.hitBlock = nextBlock;
+							result.normal =
+							  IntVector3::Make(lanes.ivx[lane], lanes.ivy[lane], lanes.ivz[lane]) -
+							  nextBlock;
+							if ((solidLanes & (1 << lane)) &&
+							    !(lanes.travelled[lane] > lanes.maxDistance[lane])) {
+								result.hit = true;
+								result.hitPos = ComputeHitPos(
+								  nextBlock,
+								  IntVector3::Make(lanes.stepx[lane], lanes.stepy[lane],
+								                   lanes.stepz[lane]),
+								  MakeVector3(lanes.fvx[lane], lanes.fvy[lane], lanes.fvz[lane]));
+							}
+
+							activeLanes &= ~(1 << lane);
+							if (fillLane(lane)) {
+								activeLanes |= 1 << lane;
+							}
+						} else {
+							lanes.ivx[lane] = nextBlock.x;
+							lanes.ivy[lane] = nextBlock.y;
+							lanes.ivz[lane] = nextBlock.z;
+						}
+					}
+				}
+			}
+#endif
+		} // namespace
+
+		void GameMap::CastRays(const RayQuery *queries, RayCastResult *results,
+		                       std::size_t count) const {
+			SPADES_MARK_FUNCTION_DEBUG();
+
+#if ENABLE_SSE2
+			if (count > 1) {
+				TraceRayPackets(solidMap, queries, results, count);
+				return;
+			}
+#endif
+			for (std::size_t i = 0; i < count; i++) {
+				RayState state;
+				if (SetupRay(solidMap, queries[i], state, results[i])) {
+					TraceRay(solidMap, queries[i], state, results[i]);
+				}
+			}
+		}
+	} // namespace client
+} // namespace spades
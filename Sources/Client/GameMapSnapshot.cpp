@@ -0,0 +1,86 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include "GameMapSnapshot.h"
+#include "GameMap.h"
+#include "GameMapCastRay.h"
+#include <Core/Debug.h>
+
+namespace spades {
+	namespace client {
+		GameMapSnapshot::Page::Page(const GameMap &map, int pageX, int pageY) {
+			int originX = pageX << PageSizeBits;
+			int originY = pageY << PageSizeBits;
+
+			uint32_t numColors = 0;
+			for (int y = 0; y < PageSize; y++) {
+				for (int x = 0; x < PageSize; x++) {
+					int index = ColumnIndex(x, y);
+					int mapX = originX + x, mapY = originY + y;
+					uint64_t column = map.GetSolidMapWrapped(mapX, mapY);
+
+					// A voxel is buried if all of its six neighbors are solid
+					uint64_t buried = (column << 1) & ((column >> 1) | (1ULL << 63));
+					buried &= map.GetSolidMapWrapped(mapX - 1, mapY);
+					buried &= map.GetSolidMapWrapped(mapX + 1, mapY);
+					buried &= map.GetSolidMapWrapped(mapX, mapY - 1);
+					buried &= map.GetSolidMapWrapped(mapX, mapY + 1);
+
+					solid[index] = column;
+					surface[index] = column & (~buried | (1ULL << 63));
+					colorOffsets[index] = numColors;
+					numColors += CountBits64(surface[index]);
+				}
+			}
+
+			colors.reserve(numColors);
+			for (int y = 0; y < PageSize; y++) {
+				for (int x = 0; x < PageSize; x++) {
+					uint64_t mask = surface[ColumnIndex(x, y)];
+					while (mask) {
+						int z = CountTrailingZeros64(mask);
+						mask &= mask - 1;
+						colors.push_back(map.GetColor(originX + x, originY + y, z));
+					}
+				}
+			}
+		}
+
+		GameMapSnapshot::GameMapSnapshot() : version{0}, numCopiedPages{0} {}
+
+		GameMapSnapshot::~GameMapSnapshot() {}
+
+		bool GameMapSnapshot::CastRay(spades::Vector3 v0, spades::Vector3 v1, float length,
+		                              spades::IntVector3 &vOut) const {
+			SPADES_MARK_FUNCTION_DEBUG();
+			return CastRayVanilla(*this, v0, v1, length, vOut);
+		}
+
+		std::size_t GameMapSnapshot::GetMemoryUsage() const {
+			std::size_t size = sizeof(*this);
+			for (const auto &page : pages) {
+				if (page) {
+					size += page->GetMemoryUsage();
+				}
+			}
+			return size;
+		}
+	} // namespace client
+} // namespace spades
@@ -0,0 +1,178 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "CompactColorMap.h"
+#include <Core/Debug.h>
+#include <Core/Math.h>
+#include <Core/RefCountedObject.h>
+
+namespace spades {
+	namespace client {
+		class GameMap;
+
+		/**
+		 * An immutable view of a `GameMap` at some point in time, created by
+		 * `GameMap::CreateSnapshot`.
+		 *
+		 * A snapshot can be read from any thread while the original map is being modified.
+		 * The voxels are stored in pages of `PageSize` x `PageSize` columns. Pages are
+		 * reference-counted and shared between successive snapshots of the same map; only
+		 * the pages modified since the previous snapshot are copied. The map doesn't own the
+		 * pages, so they are freed once no snapshot uses them.
+		 *
+		 * Only the colors of the surface voxels (see `GetSurfaceMap`) are copied.
+		 */
+		class GameMapSnapshot : public RefCountedObject {
+			friend class GameMap;
+
+		public:
+			enum {
+				PageSizeBits = 4,
+				PageSize = 1 << PageSizeBits,
+				Width = 512,
+				Height = 512,
+				Depth = 64,
+				NumPagesX = Width >> PageSizeBits,
+				NumPagesY = Height >> PageSizeBits,
+				NumPages = NumPagesX * NumPagesY
+			};
+
+			/** Returns the value of `GameMap::GetVersion` when this snapshot was taken. */
+			uint64_t GetVersion() const { return version; }
+
+			inline bool IsSolid(int x, int y, int z) const {
+				SPAssert(z >= 0);
+				SPAssert(z < Depth);
+				return ((GetSolidMap(x, y) >> (uint64_t)z) & 1ULL) != 0;
+			}
+
+			inline bool IsSolidWrapped(int x, int y, int z) const {
+				if (z < 0)
+					return false;
+				if (z >= Depth)
+					return true;
+				return ((GetSolidMapWrapped(x, y) >> (uint64_t)z) & 1ULL) != 0;
+			}
+
+			inline uint64_t GetSolidMap(int x, int y) const {
+				SPAssert(x >= 0);
+				SPAssert(x < Width);
+				SPAssert(y >= 0);
+				SPAssert(y < Height);
+				return GetPage(x, y).solid[ColumnIndex(x, y)];
+			}
+
+			inline uint64_t GetSolidMapWrapped(int x, int y) const {
+				return GetSolidMap(x & (Width - 1), y & (Height - 1));
+			}
+
+			/**
+			 * Returns the surface voxels of a column: the solid voxels that have a non-solid
+			 * neighbor (above the map is air and below the map is solid), and the solid voxels
+			 * at the bottom layer, which is rendered as water.
+			 */
+			inline uint64_t GetSurfaceMap(int x, int y) const {
+				SPAssert(x >= 0);
+				SPAssert(x < Width);
+				SPAssert(y >= 0);
+				SPAssert(y < Height);
+				return GetPage(x, y).surface[ColumnIndex(x, y)];
+			}
+
+			/**
+			 * Returns the color of a solid voxel in the same format as `GameMap::GetColor`.
+			 * Returns `0` for a non-solid voxel. The colors of buried voxels aren't copied, so
+			 * they are replaced with `CompactColorMap::GetDefaultColor`.
+			 */
+			inline uint32_t GetColor(int x, int y, int z) const {
+				SPAssert(z >= 0);
+				SPAssert(z < Depth);
+				const Page &page = GetPage(x, y);
+				int index = ColumnIndex(x, y);
+				uint64_t surface = page.surface[index];
+				uint64_t bit = 1ULL << z;
+				if (!(surface & bit)) {
+					return (page.solid[index] & bit) ? CompactColorMap::GetDefaultColor(x, y, z)
+					                                 : 0;
+				}
+				return page.colors[page.colorOffsets[index] + CountBits64(surface & (bit - 1))];
+			}
+
+			inline uint32_t GetColorWrapped(int x, int y, int z) const {
+				return GetColor(x & (Width - 1), y & (Height - 1), z & (Depth - 1));
+			}
+
+			/** Same as `GameMap::CastRay`. */
+			bool CastRay(Vector3 v0, Vector3 v1, float length, IntVector3 &vOut) const;
+
+			/**
+			 * Returns the number of bytes occupied by the pages of this snapshot, including the
+			 * ones shared with other snapshots.
+			 */
+			std::size_t GetMemoryUsage() const;
+
+			/** Returns the number of pages that were copied (not shared) when this snapshot was
+			 * taken. */
+			int GetNumCopiedPages() const { return numCopiedPages; }
+
+		private:
+			struct Page {
+				uint64_t solid[PageSize * PageSize];
+				/** See `GetSurfaceMap`. */
+				uint64_t surface[PageSize * PageSize];
+				/** The index of the first color of each column in `colors`. */
+				uint32_t colorOffsets[PageSize * PageSize];
+				/** The colors of the surface voxels, sorted by column and then Z coordinate. */
+				std::vector<uint32_t> colors;
+
+				/**
+				 * Copies the columns in the specified page from `map`. Also reads the columns
+				 * next to the page to find the surface voxels.
+				 */
+				Page(const GameMap &map, int pageX, int pageY);
+
+				std::size_t GetMemoryUsage() const {
+					return sizeof(*this) + colors.capacity() * sizeof(uint32_t);
+				}
+			};
+
+			std::shared_ptr<const Page> pages[NumPages];
+			uint64_t version;
+			int numCopiedPages;
+
+			GameMapSnapshot();
+			~GameMapSnapshot();
+
+			static inline int ColumnIndex(int x, int y) {
+				return (x & (PageSize - 1)) | ((y & (PageSize - 1)) << PageSizeBits);
+			}
+
+			inline const Page &GetPage(int x, int y) const {
+				return *pages[(x >> PageSizeBits) + (y >> PageSizeBits) * NumPagesX];
+			}
+		};
+	} // namespace client
+} // namespace spades
@@ -18,19 +18,39 @@
 
  */
 
+#include <algorithm>
 #include <cstring>
-#include <deque>
-#include <queue>
-#include <set>
+#include <memory>
 #include <vector>
 
 #include "GameMap.h"
 #include "GameMapWrapper.h"
+#include <Core/ConcurrentDispatch.h>
 #include <Core/Debug.h>
 #include <Core/Stopwatch.h>
 
 namespace spades {
 	namespace client {
+		namespace {
+			/** Returns the vertical runs of set bits in `mask` containing any bit of `seeds`. */
+			inline uint64_t FillRuns(uint64_t seeds, uint64_t mask) {
+				// Kogge-Stone occluded fill in both directions
+				uint64_t up = seeds & mask, down = up;
+				uint64_t upMask = mask, downMask = mask;
+				for (int shift = 1; shift < 64; shift <<= 1) {
+					up |= upMask & (up << shift);
+					upMask &= upMask << shift;
+					down |= downMask & (down >> shift);
+					downMask &= downMask >> shift;
+				}
+				return up | down;
+			}
+
+			struct ColumnSeeds {
+				short x, y;
+				uint64_t seeds;
+			};
+		} // namespace
 
 		GameMapWrapper::GameMapWrapper(GameMap &mp) : map(mp) {
 			SPADES_MARK_FUNCTION();
@@ -38,64 +58,132 @@ namespace spades {
 			width = mp.Width();
 			height = mp.Height();
 			depth = mp.Depth();
+			SPAssert(depth == 64);
+			SPAssert(height % BandHeight == 0);
+
 			// TODO: `stmp::make_unique` doesn't support array initialization yet
-			linkMap.reset(new uint8_t[width * height * depth]);
-			memset(linkMap.get(), 0, width * height * depth);
+			connectedMap.reset(new uint64_t[width * height]);
+			searchMap.reset(new uint64_t[width * height]);
+			resolvedMap.reset(new uint64_t[width * height]);
+			std::fill(connectedMap.get(), connectedMap.get() + width * height,
+			          1ULL << (depth - 1));
+			std::fill(searchMap.get(), searchMap.get() + width * height, 0);
+			std::fill(resolvedMap.get(), resolvedMap.get() + width * height, 0);
 		}
 
 		GameMapWrapper::~GameMapWrapper() { SPADES_MARK_FUNCTION(); }
 
-		void GameMapWrapper::Rebuild() {
+		uint64_t GameMapWrapper::GetLinkableMask(int x, int y) const {
+			// The root layer doesn't link voxels to each other
+			return map.GetSolidMapWrapped(x, y) & ~(1ULL << (depth - 1));
+		}
+
+		void GameMapWrapper::FloodFillBand(int startY, int endY, std::vector<int> &columns) {
 			SPADES_MARK_FUNCTION();
 
-			Stopwatch stopwatch;
+			while (!columns.empty()) {
+				int index = columns.back();
+				columns.pop_back();
 
-			GameMap &m = map;
-			memset(linkMap.get(), 0, width * height * depth);
+				int x = index % width, y = index / width;
+				uint64_t connected = connectedMap[index] & ~(1ULL << (depth - 1));
 
-			for (int x = 0; x < width; x++)
-				for (int y = 0; y < height; y++)
-					SetLink(x, y, depth - 1, Root);
+				auto visit = [&](int nx, int ny) {
+					int nIndex = ColumnIndex(nx, ny);
+					uint64_t linkable = GetLinkableMask(nx, ny);
+					uint64_t added = FillRuns(connected, linkable) & ~connectedMap[nIndex];
+					if (added) {
+						connectedMap[nIndex] |= added;
+						columns.push_back(nIndex);
+					}
+				};
+				if (x > 0)
+					visit(x - 1, y);
+				if (x < width - 1)
+					visit(x + 1, y);
+				if (y > startY)
+					visit(x, y - 1);
+				if (y < endY - 1)
+					visit(x, y + 1);
+			}
+		}
 
-			std::deque<CellPos> queue(width * height * 2);
+		void GameMapWrapper::Rebuild() {
+			SPADES_MARK_FUNCTION();
 
-			for (int x = 0; x < width; x++)
-				for (int y = 0; y < height; y++)
-					if (m.IsSolid(x, y, depth - 2)) {
-						SetLink(x, y, depth - 2, PositiveZ);
-						queue.push_back(CellPos(x, y, depth - 2));
-					}
+			Stopwatch stopwatch;
 
-			while (!queue.empty()) {
-				CellPos p = queue.front();
-				queue.pop_front();
+			const uint64_t rootMask = 1ULL << (depth - 1);
+			const uint64_t groundMask = 1ULL << (depth - 2);
+			const int numBands = height / BandHeight;
 
-				int x = p.x, y = p.y, z = p.z;
+			// Each band is flood-filled independently. The connectivity is then propagated
+			// across the band boundaries, and the bands that received new voxels are
+			// flood-filled again until nothing changes.
+			std::vector<std::vector<int>> pendingColumns(numBands);
 
-				if (p.x > 0 && m.IsSolid(x - 1, y, z) && GetLink(x - 1, y, z) == Invalid) {
-					SetLink(x - 1, y, z, PositiveX);
-					queue.push_back(CellPos(x - 1, y, z));
-				}
-				if (p.x < width - 1 && m.IsSolid(x + 1, y, z) && GetLink(x + 1, y, z) == Invalid) {
-					SetLink(x + 1, y, z, NegativeX);
-					queue.push_back(CellPos(x + 1, y, z));
-				}
-				if (p.y > 0 && m.IsSolid(x, y - 1, z) && GetLink(x, y - 1, z) == Invalid) {
-					SetLink(x, y - 1, z, PositiveY);
-					queue.push_back(CellPos(x, y - 1, z));
+			auto runBands = [&](bool initial) {
+				std::vector<std::unique_ptr<ConcurrentDispatch>> jobs;
+				for (int band = 0; band < numBands; band++) {
+					if (!initial && pendingColumns[band].empty()) {
+						continue;
+					}
+
+					auto job = [=, &pendingColumns]() {
+						int startY = band * BandHeight, endY = startY + BandHeight;
+						std::vector<int> &columns = pendingColumns[band];
+						if (initial) {
+							for (int y = startY; y < endY; y++) {
+								for (int x = 0; x < width; x++) {
+									int index = ColumnIndex(x, y);
+									uint64_t connected =
+									  FillRuns(groundMask, GetLinkableMask(x, y));
+									connectedMap[index] = rootMask | connected;
+									if (connected) {
+										columns.push_back(index);
+									}
+								}
+							}
+						}
+						FloodFillBand(startY, endY, columns);
+					};
+					jobs.emplace_back(new FunctionDispatch<decltype(job)>(job));
+					jobs.back()->Start();
 				}
-				if (p.y < height - 1 && m.IsSolid(x, y + 1, z) && GetLink(x, y + 1, z) == Invalid) {
-					SetLink(x, y + 1, z, NegativeY);
-					queue.push_back(CellPos(x, y + 1, z));
+				for (const auto &job : jobs) {
+					job->Join();
 				}
-				if (p.z > 0 && m.IsSolid(x, y, z - 1) && GetLink(x, y, z - 1) == Invalid) {
-					SetLink(x, y, z - 1, PositiveZ);
-					queue.push_back(CellPos(x, y, z - 1));
+			};
+
+			runBands(true);
+
+			for (;;) {
+				bool changed = false;
+
+				auto propagate = [&](int x, int fromY, int toY, int band) {
+					int toIndex = ColumnIndex(x, toY);
+					uint64_t linkable = GetLinkableMask(x, toY);
+					uint64_t added = FillRuns(connectedMap[ColumnIndex(x, fromY)], linkable) &
+					                 ~connectedMap[toIndex];
+					if (added) {
+						connectedMap[toIndex] |= added;
+						pendingColumns[band].push_back(toIndex);
+						changed = true;
+					}
+				};
+				for (int band = 1; band < numBands; band++) {
+					int y = band * BandHeight;
+					for (int x = 0; x < width; x++) {
+						propagate(x, y - 1, y, band);
+						propagate(x, y, y - 1, band - 1);
+					}
 				}
-				if (p.z < depth - 1 && m.IsSolid(x, y, z + 1) && GetLink(x, y, z + 1) == Invalid) {
-					SetLink(x, y, z + 1, NegativeZ);
-					queue.push_back(CellPos(x, y, z + 1));
+
+				if (!changed) {
+					break;
 				}
+
+				runBands(false);
 			}
 
 			SPLog("%.3f msecs to rebuild", stopwatch.GetTime() * 1000.);
@@ -105,97 +193,60 @@ namespace spades {
 			SPADES_MARK_FUNCTION();
 
 			GameMap &m = map;
+			uint64_t bit = 1ULL << z;
 
-			if (GetLink(x, y, z) != Invalid) {
+			if (connectedMap[ColumnIndex(x, y)] & bit) {
 				SPAssert(m.IsSolid(x, y, z));
 				return;
 			}
 
 			m.Set(x, y, z, true, color);
 
-			if (GetLink(x, y, z) != Invalid) {
+			bool linked = (connectedMap[ColumnIndex(x, y)] & ((bit << 1) | (bit >> 1))) != 0;
+			if (x > 0 && (connectedMap[ColumnIndex(x - 1, y)] & bit))
+				linked = true;
+			if (x < width - 1 && (connectedMap[ColumnIndex(x + 1, y)] & bit))
+				linked = true;
+			if (y > 0 && (connectedMap[ColumnIndex(x, y - 1)] & bit))
+				linked = true;
+			if (y < height - 1 && (connectedMap[ColumnIndex(x, y + 1)] & bit))
+				linked = true;
+
+			if (!linked)
 				return;
-			}
 
-			LinkType l = Invalid;
-			if (x > 0 && m.IsSolid(x - 1, y, z) && GetLink(x - 1, y, z) != Invalid) {
-				l = NegativeX;
-				SPAssert(GetLink(x - 1, y, z) != PositiveX);
-			}
-			if (x < width - 1 && m.IsSolid(x + 1, y, z) && GetLink(x + 1, y, z) != Invalid) {
-				l = PositiveX;
-				SPAssert(GetLink(x + 1, y, z) != NegativeX);
-			}
-			if (y > 0 && m.IsSolid(x, y - 1, z) && GetLink(x, y - 1, z) != Invalid) {
-				l = NegativeY;
-				SPAssert(GetLink(x, y - 1, z) != PositiveY);
-			}
-			if (y < height - 1 && m.IsSolid(x, y + 1, z) && GetLink(x, y + 1, z) != Invalid) {
-				l = PositiveY;
-				SPAssert(GetLink(x, y + 1, z) != NegativeY);
-			}
-			if (z > 0 && m.IsSolid(x, y, z - 1) && GetLink(x, y, z - 1) != Invalid) {
-				l = NegativeZ;
-				SPAssert(GetLink(x, y, z - 1) != PositiveZ);
-			}
-			if (z < depth - 1 && m.IsSolid(x, y, z + 1) && GetLink(x, y, z + 1) != Invalid) {
-				l = PositiveZ;
-				SPAssert(GetLink(x, y, z + 1) != NegativeZ);
-			}
-			SetLink(x, y, z, l);
-
-			if (l == Invalid)
-				return;
-			// if there's invalid block around this block,
-			// rebuild tree
-			std::deque<CellPos> queue;
-			queue.push_back(CellPos(x, y, z));
+			// if there are unlinked blocks around this block, link them as well
+			std::vector<ColumnSeeds> queue;
+			queue.push_back(ColumnSeeds{static_cast<short>(x), static_cast<short>(y), bit});
 			while (!queue.empty()) {
-				CellPos p = queue.front();
-				queue.pop_front();
-
-				int x = p.x, y = p.y, z = p.z;
-				SPAssert(m.IsSolid(x, y, z));
-
-				LinkType thisLink = GetLink(x, y, z);
+				ColumnSeeds item = queue.back();
+				queue.pop_back();
 
-				if (p.x > 0 && m.IsSolid(x - 1, y, z) && GetLink(x - 1, y, z) == Invalid &&
-				    thisLink != NegativeX) {
-					SetLink(x - 1, y, z, PositiveX);
-					queue.push_back(CellPos(x - 1, y, z));
-				}
-				if (p.x < width - 1 && m.IsSolid(x + 1, y, z) && GetLink(x + 1, y, z) == Invalid &&
-				    thisLink != PositiveX) {
-					SetLink(x + 1, y, z, NegativeX);
-					queue.push_back(CellPos(x + 1, y, z));
-				}
-				if (p.y > 0 && m.IsSolid(x, y - 1, z) && GetLink(x, y - 1, z) == Invalid &&
-				    thisLink != NegativeY) {
-					SetLink(x, y - 1, z, PositiveY);
-					queue.push_back(CellPos(x, y - 1, z));
-				}
-				if (p.y < height - 1 && m.IsSolid(x, y + 1, z) && GetLink(x, y + 1, z) == Invalid &&
-				    thisLink != PositiveY) {
-					SetLink(x, y + 1, z, NegativeY);
-					queue.push_back(CellPos(x, y + 1, z));
-				}
-				if (p.z > 0 && m.IsSolid(x, y, z - 1) && GetLink(x, y, z - 1) == Invalid &&
-				    thisLink != NegativeZ) {
-					SetLink(x, y, z - 1, PositiveZ);
-					queue.push_back(CellPos(x, y, z - 1));
-				}
-				if (p.z < depth - 1 && m.IsSolid(x, y, z + 1) && GetLink(x, y, z + 1) == Invalid &&
-				    thisLink != PositiveZ) {
-					SetLink(x, y, z + 1, NegativeZ);
-					queue.push_back(CellPos(x, y, z + 1));
-				}
+				int index = ColumnIndex(item.x, item.y);
+				uint64_t unlinked = GetLinkableMask(item.x, item.y) & ~connectedMap[index];
+				uint64_t added = FillRuns(item.seeds, unlinked);
+				if (!added)
+					continue;
+				connectedMap[index] |= added;
+
+				auto visit = [&](int nx, int ny) {
+					uint64_t seeds = added & GetLinkableMask(nx, ny) &
+					                 ~connectedMap[ColumnIndex(nx, ny)];
+					if (seeds)
+						queue.push_back(
+						  ColumnSeeds{static_cast<short>(nx), static_cast<short>(ny), seeds});
+				};
+				if (item.x > 0)
+					visit(item.x - 1, item.y);
+				if (item.x < width - 1)
+					visit(item.x + 1, item.y);
+				if (item.y > 0)
+					visit(item.x, item.y - 1);
+				if (item.y < height - 1)
+					visit(item.x, item.y + 1);
 			}
 		}
 
-		template <typename T> static inline bool EqualTwoCond(T a, T b, T c, bool cond) {
-			return a == b || (cond && a == c);
-		}
-
 		std::vector<CellPos> GameMapWrapper::RemoveBlocks(const std::vector<CellPos> &cells) {
 			SPADES_MARK_FUNCTION();
 
@@ -203,158 +254,108 @@ namespace spades {
 				return std::vector<CellPos>();
 
 			GameMap &m = map;
+			const uint64_t groundMask = 1ULL << (depth - 2);
 
-			// solid, but unlinked cells
-			std::vector<CellPos> unlinkedCells;
-			std::deque<CellPos> queue;
-
-			// unlink children
-			for (size_t i = 0; i < cells.size(); i++) {
-				CellPos pos = cells[i];
+			for (const CellPos &pos : cells) {
+				SPAssert(pos.z < depth - 1);
 				m.Set(pos.x, pos.y, pos.z, false, 0);
-				// if(GetLink(pos.x, pos.y, pos.z) == Invalid){
-				// this block is already disconnected.
-				// }
-
-				if (GetLink(pos.x, pos.y, pos.z) == Marked) {
-					continue;
-				}
-				SPAssert(GetLink(pos.x, pos.y, pos.z) != Root);
-
-				SetLink(pos.x, pos.y, pos.z, Invalid);
-				queue.push_back(pos);
-
-				while (!queue.empty()) {
-					pos = queue.front();
-					queue.pop_front();
-
-					if (m.IsSolid(pos.x, pos.y, pos.z))
-						unlinkedCells.push_back(pos);
-					// don't "continue;" when non-solid
-
-					int x = pos.x, y = pos.y, z = pos.z;
-					if (x > 0 && EqualTwoCond(GetLink(x - 1, y, z), PositiveX, Invalid,
-					                          m.IsSolid(x - 1, y, z))) {
-						SetLink(x - 1, y, z, Marked);
-						queue.push_back(CellPos(x - 1, y, z));
-					}
-					if (x < width - 1 && EqualTwoCond(GetLink(x + 1, y, z), NegativeX, Invalid,
-					                                  m.IsSolid(x + 1, y, z))) {
-						SetLink(x + 1, y, z, Marked);
-						queue.push_back(CellPos(x + 1, y, z));
-					}
-					if (y > 0 && EqualTwoCond(GetLink(x, y - 1, z), PositiveY, Invalid,
-					                          m.IsSolid(x, y - 1, z))) {
-						SetLink(x, y - 1, z, Marked);
-						queue.push_back(CellPos(x, y - 1, z));
-					}
-					if (y < height - 1 && EqualTwoCond(GetLink(x, y + 1, z), NegativeY, Invalid,
-					                                   m.IsSolid(x, y + 1, z))) {
-						SetLink(x, y + 1, z, Marked);
-						queue.push_back(CellPos(x, y + 1, z));
-					}
-					if (z > 0 && EqualTwoCond(GetLink(x, y, z - 1), PositiveZ, Invalid,
-					                          m.IsSolid(x, y, z - 1))) {
-						SetLink(x, y, z - 1, Marked);
-						queue.push_back(CellPos(x, y, z - 1));
-					}
-					if (z < depth - 1 && EqualTwoCond(GetLink(x, y, z + 1), NegativeZ, Invalid,
-					                                  m.IsSolid(x, y, z + 1))) {
-						SetLink(x, y, z + 1, Marked);
-						queue.push_back(CellPos(x, y, z + 1));
-					}
-				}
+				connectedMap[ColumnIndex(pos.x, pos.y)] &= ~(1ULL << pos.z);
 			}
 
-			// remove "visited" mark
-			for (size_t i = 0; i < unlinkedCells.size(); i++) {
-				const CellPos &pos = unlinkedCells[i];
-				if (GetLink(pos.x, pos.y, pos.z) == Marked)
-					SetLink(pos.x, pos.y, pos.z, Invalid);
-			}
+			std::vector<CellPos> floatingBlocks;
 
-			SPAssert(queue.empty());
+			// Columns where `searchMap` or `resolvedMap` is non-zero
+			std::vector<int> searchedColumns;
+			std::vector<int> resolvedColumns;
+			std::vector<ColumnSeeds> queue;
+
+			// Finds the blocks connected to `seeds` and determines whether they are still
+			// connected to the ground. The search ends as soon as it reaches the ground or
+			// a block that is already known to be connected to the ground.
+			auto search = [&](int x, int y, uint64_t seeds) {
+				seeds &= GetLinkableMask(x, y) & ~resolvedMap[ColumnIndex(x, y)];
+				if (!seeds)
+					return;
+
+				bool grounded = false;
+				queue.clear();
+				queue.push_back(ColumnSeeds{static_cast<short>(x), static_cast<short>(y), seeds});
+				for (std::size_t i = 0; i < queue.size(); i++) {
+					ColumnSeeds item = queue[i];
+					int index = ColumnIndex(item.x, item.y);
+					uint64_t run = FillRuns(item.seeds, GetLinkableMask(item.x, item.y));
+					if (run & (groundMask | resolvedMap[index])) {
+						grounded = true;
+						break;
+					}
 
-			// start relinking
-			for (size_t i = 0; i < unlinkedCells.size(); i++) {
-				const CellPos &pos = unlinkedCells[i];
-				int x = pos.x, y = pos.y, z = pos.z;
-				if (!m.IsSolid(x, y, z)) {
-					// notice: (x,y,z) may be air, so
-					// don't use SPAssert()
-					continue;
+					uint64_t added = run & ~searchMap[index];
+					if (!added)
+						continue;
+					if (!searchMap[index])
+						searchedColumns.push_back(index);
+					searchMap[index] |= added;
+
+					auto visit = [&](int nx, int ny) {
+						uint64_t seeds = added & GetLinkableMask(nx, ny) &
+						                 ~searchMap[ColumnIndex(nx, ny)];
+						if (seeds)
+							queue.push_back(
+							  ColumnSeeds{static_cast<short>(nx), static_cast<short>(ny), seeds});
+					};
+					if (item.x > 0)
+						visit(item.x - 1, item.y);
+					if (item.x < width - 1)
+						visit(item.x + 1, item.y);
+					if (item.y > 0)
+						visit(item.x, item.y - 1);
+					if (item.y < height - 1)
+						visit(item.x, item.y + 1);
 				}
 
-				LinkType newLink = Invalid;
-				if (z < depth - 1 && GetLink(x, y, z + 1) != Invalid) {
-					newLink = PositiveZ;
-				} else if (x > 0 && GetLink(x - 1, y, z) != Invalid) {
-					newLink = NegativeX;
-				} else if (x < width - 1 && GetLink(x + 1, y, z) != Invalid) {
-					newLink = PositiveX;
-				} else if (y > 0 && GetLink(x, y - 1, z) != Invalid) {
-					newLink = NegativeY;
-				} else if (y < height - 1 && GetLink(x, y + 1, z) != Invalid) {
-					newLink = PositiveY;
-				} else if (z > 0 && GetLink(x, y, z - 1) != Invalid) {
-					newLink = NegativeZ;
-				}
+				for (int index : searchedColumns) {
+					uint64_t found = searchMap[index];
+					searchMap[index] = 0;
 
-				if (newLink != Invalid) {
-					SetLink(x, y, z, newLink);
-					queue.push_back(pos);
-				}
-			}
+					if (!resolvedMap[index])
+						resolvedColumns.push_back(index);
+					resolvedMap[index] |= found;
 
-			while (!queue.empty()) {
-				CellPos p = queue.front();
-				queue.pop_front();
+					if (grounded) {
+						connectedMap[index] |= found;
+						continue;
+					}
 
-				int x = p.x, y = p.y, z = p.z;
-				LinkType thisLink = GetLink(x, y, z);
+					connectedMap[index] &= ~found;
 
-				if (p.x > 0 && m.IsSolid(x - 1, y, z) && GetLink(x - 1, y, z) == Invalid &&
-				    thisLink != NegativeX) {
-					SetLink(x - 1, y, z, PositiveX);
-					queue.push_back(CellPos(x - 1, y, z));
-				}
-				if (p.x < width - 1 && m.IsSolid(x + 1, y, z) && GetLink(x + 1, y, z) == Invalid &&
-				    thisLink != PositiveX) {
-					SetLink(x + 1, y, z, NegativeX);
-					queue.push_back(CellPos(x + 1, y, z));
-				}
-				if (p.y > 0 && m.IsSolid(x, y - 1, z) && GetLink(x, y - 1, z) == Invalid &&
-				    thisLink != NegativeY) {
-					SetLink(x, y - 1, z, PositiveY);
-					queue.push_back(CellPos(x, y - 1, z));
-				}
-				if (p.y < height - 1 && m.IsSolid(x, y + 1, z) && GetLink(x, y + 1, z) == Invalid &&
-				    thisLink != PositiveY) {
-					SetLink(x, y + 1, z, NegativeY);
-					queue.push_back(CellPos(x, y + 1, z));
-				}
-				if (p.z > 0 && m.IsSolid(x, y, z - 1) && GetLink(x, y, z - 1) == Invalid &&
-				    thisLink != NegativeZ) {
-					SetLink(x, y, z - 1, PositiveZ);
-					queue.push_back(CellPos(x, y, z - 1));
-				}
-				if (p.z < depth - 1 && m.IsSolid(x, y, z + 1) && GetLink(x, y, z + 1) == Invalid &&
-				    thisLink != PositiveZ) {
-					SetLink(x, y, z + 1, NegativeZ);
-					queue.push_back(CellPos(x, y, z + 1));
+					int fx = index % width, fy = index / width;
+					while (found) {
+						int z = CountTrailingZeros64(found);
+						found &= found - 1;
+						floatingBlocks.push_back(CellPos(fx, fy, z));
+					}
 				}
-			}
+				searchedColumns.clear();
+			};
 
-			std::vector<CellPos> floatingBlocks;
-			floatingBlocks.reserve(unlinkedCells.size());
+			for (const CellPos &pos : cells) {
+				int x = pos.x, y = pos.y, z = pos.z;
+				uint64_t bit = 1ULL << z;
+				// The voxels above and below may belong to different components
+				search(x, y, bit << 1);
+				search(x, y, bit >> 1);
+				if (x > 0)
+					search(x - 1, y, bit);
+				if (x < width - 1)
+					search(x + 1, y, bit);
+				if (y > 0)
+					search(x, y - 1, bit);
+				if (y < height - 1)
+					search(x, y + 1, bit);
+			}
 
-			for (size_t i = 0; i < unlinkedCells.size(); i++) {
-				const CellPos &p = unlinkedCells[i];
-				if (!m.IsSolid(p.x, p.y, p.z))
-					continue;
-				if (GetLink(p.x, p.y, p.z) == Invalid) {
-					floatingBlocks.push_back(p);
-				}
+			for (int index : resolvedColumns) {
+				resolvedMap[index] = 0;
 			}
 
 			return floatingBlocks;
@@ -68,37 +68,46 @@ namespace spades {
 			}
 		};
 
-		/** Wraps GameMap and provides floating-block detection.*/
+		/**
+		 * Wraps GameMap and provides floating-block detection.
+		 *
+		 * A voxel is connected to the ground if it's linked to a solid voxel at
+		 * Z = `depth - 2` through a chain of solid voxels (sharing faces). The voxels at
+		 * Z = `depth - 1` are the root and are always considered connected.
+		 *
+		 * The connectivity is stored as a 64-bit mask per column (like `GameMap`'s solid
+		 * map) and is computed by a flood fill that operates on vertical runs of solid voxels
+		 * rather than on individual voxels.
+		 */
 		class GameMapWrapper {
 			friend class Client; // FIXME: for debug
 		public:
 		private:
 			GameMap &map;
 
-			/** Each element represents where this cell is connected from. */
-			std::unique_ptr<uint8_t[]> linkMap;
+			/**
+			 * Each bit is set if the corresponding voxel is connected to the ground.
+			 * Indexed by `ColumnIndex`.
+			 */
+			std::unique_ptr<uint64_t[]> connectedMap;
 
-			enum LinkType {
-				Invalid = 0,
-				Root,
-				NegativeX,
-				PositiveX,
-				NegativeY,
-				PositiveY,
-				NegativeZ,
-				PositiveZ,
+			/** Scratch buffers used by `RemoveBlocks`. Indexed by `ColumnIndex`. */
+			std::unique_ptr<uint64_t[]> searchMap;
+			std::unique_ptr<uint64_t[]> resolvedMap;
 
-				Marked
+			int width, height, depth;
+
+			enum {
+				/** The number of rows processed by each job of `Rebuild`. */
+				BandHeight = 16
 			};
 
-			int width, height, depth;
+			inline int ColumnIndex(int x, int y) const { return y * width + x; }
 
-			inline LinkType GetLink(int x, int y, int z) {
-				return (LinkType)linkMap[(x * height + y) * depth + z];
-			}
-			void SetLink(int x, int y, int z, LinkType l) {
-				linkMap[(x * height + y) * depth + z] = l;
-			}
+			/** Returns the solid voxels of a column that may be linked to others. */
+			inline uint64_t GetLinkableMask(int x, int y) const;
+
+			void FloodFillBand(int startY, int endY, std::vector<int> &columns);
 
 		public:
 			GameMapWrapper(GameMap &);
@@ -111,6 +120,8 @@ namespace spades {
 			 * This function, however, doesn't remove floating blocks. */
 			std::vector<CellPos> RemoveBlocks(const std::vector<CellPos> &);
 
+			/** Recomputes the connectivity of the whole map. Bands of rows are processed in
+			 * parallel. */
 			void Rebuild();
 		};
 	} // namespace client
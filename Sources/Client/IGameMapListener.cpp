@@ -19,3 +19,20 @@
  */
 
 #include "IGameMapListener.h"
+#include <Core/Math.h>
+
+namespace spades {
+	namespace client {
+		void IGameMapListener::GameMapColumnsChanged(const std::vector<GameMapDirtyColumn> &columns,
+		                                             GameMap *map) {
+			for (const GameMapDirtyColumn &column : columns) {
+				uint64_t mask = column.mask;
+				while (mask) {
+					int z = CountTrailingZeros64(mask);
+					mask &= mask - 1;
+					GameMapChanged(column.x, column.y, z, map);
+				}
+			}
+		}
+	} // namespace client
+} // namespace spades
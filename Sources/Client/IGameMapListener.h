@@ -20,12 +20,29 @@
 
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
 namespace spades {
 	namespace client {
 		class GameMap;
+
+		/** A set of modified voxels in a column. */
+		struct GameMapDirtyColumn {
+			short x, y;
+			/** Each bit is set if the voxel at the corresponding Z coordinate was modified. */
+			uint64_t mask;
+		};
+
 		class IGameMapListener {
 		public:
 			virtual void GameMapChanged(int x, int y, int z, GameMap *) = 0;
+
+			/**
+			 * Called once with all voxels modified in a batch (see `GameMap::BeginBatch`).
+			 * The default implementation calls `GameMapChanged` for each voxel.
+			 */
+			virtual void GameMapColumnsChanged(const std::vector<GameMapDirtyColumn> &, GameMap *);
 		};
 	} // namespace client
 } // namespace spades
@@ -21,6 +21,7 @@
 #pragma once
 
 #include <array>
+#include <vector>
 
 #include "IImage.h"
 #include "IModel.h"
@@ -120,6 +121,17 @@ namespace spades {
 
 			virtual void SetGameMap(stmp::optional<GameMap &>) = 0;
 
+			/**
+			 * Builds the data structures for a map that is still being decoded, so that a
+			 * subsequent `SetGameMap` for the same map completes faster. This method is
+			 * merely a hint, like `ClearCache`.
+			 *
+			 * Only the rows `y` where `decodedRows[y]` is `true` can be read, and only during
+			 * this call. The partial results are discarded by the next call of `SetGameMap`
+			 * (unless it's for the same map) or `PrebuildGameMap` for another map.
+			 */
+			virtual void PrebuildGameMap(GameMap &, const std::vector<bool> & /*decodedRows*/) {}
+
 			virtual void SetFogDistance(float) = 0;
 			virtual void SetFogColor(Vector3) = 0;
 
@@ -28,6 +28,7 @@
 #include "CTFGameMode.h"
 #include "Client.h"
 #include "GameMap.h"
+#include "GameMapCache.h"
 #include "GameMapLoader.h"
 #include "GameProperties.h"
 #include "Grenade.h"
@@ -46,6 +47,7 @@
 #include <Core/TMPUtils.h>
 
 DEFINE_SPADES_SETTING(cg_unicode, "1");
+DEFINE_SPADES_SETTING(cl_mapPrebuild, "0");
 
 namespace spades {
 	namespace client {
@@ -383,6 +385,8 @@ namespace spades {
 			std::fill(savedPlayerTeam.begin(), savedPlayerTeam.end(), -1);
 
 			bandwidthMonitor.reset(new BandwidthMonitor(host));
+
+			mapCache = GameMapCache::CreateDefault();
 		}
 		NetClient::~NetClient() {
 			SPADES_MARK_FUNCTION();
@@ -530,7 +534,7 @@ namespace spades {
 						auto mapSize = reader.ReadInt();
 						SPLog("Map size advertised by the server: %lu", (unsigned long)mapSize);
 
-						mapLoader.reset(new GameMapLoader());
+						mapLoader.reset(new GameMapLoader(mapCache.get()));
 						mapLoadMonitor.reset(new MapDownloadMonitor(*mapLoader));
 
 						status = NetClientStatusReceivingMap;
@@ -624,6 +628,23 @@ namespace spades {
 					}
 				}
 			}
+
+			if (status == NetClientStatusReceivingMap && cl_mapPrebuild) {
+				PrebuildMap();
+			}
+		}
+
+		void NetClient::PrebuildMap() {
+			SPADES_MARK_FUNCTION();
+
+			SPAssert(mapLoader);
+
+			// Let the renderer process the rows decoded so far while the rest of the map
+			// is still being downloaded
+			GameMapLoader::PartialGameMap partial = mapLoader->LockPartialGameMap();
+			if (partial.map && partial.changed) {
+				client->GetRenderer().PrebuildGameMap(*partial.map, partial.decodedRows);
+			}
 		}
 
 		stmp::optional<World &> NetClient::GetWorld() { return client->GetWorld(); }
@@ -1301,7 +1322,7 @@ namespace spades {
 					auto mapSize = reader.ReadInt();
 					SPLog("Map size advertised by the server: %lu", (unsigned long)mapSize);
 
-					mapLoader.reset(new GameMapLoader());
+					mapLoader.reset(new GameMapLoader(mapCache.get()));
 					mapLoadMonitor.reset(new MapDownloadMonitor(*mapLoader));
 
 					status = NetClientStatusReceivingMap;
@@ -1822,7 +1843,8 @@ namespace spades {
 			mapLoader->MarkEOF();
 			mapLoader->WaitComplete();
 			GameMap *map = mapLoader->TakeGameMap().Unmanage();
-			SPLog("The game map was decoded successfully.");
+			SPLog("The game map was decoded successfully (%.1f MiB).",
+			      map->GetMemoryUsage() / 1048576.0);
 
 			// now initialize world
 			World *w = new World(properties);
@@ -66,6 +66,7 @@ namespace spades {
 		class Grenade;
 		struct GameProperties;
 		class GameMapLoader;
+		class GameMapCache;
 
 		class NetClient {
 			Client *client;
@@ -87,6 +88,8 @@ namespace spades {
 				std::string GetDisplayedText();
 			};
 
+			/** Null if the map cache is disabled. Must outlive `mapLoader`. */
+			std::unique_ptr<GameMapCache> mapCache;
 			/** Only valid in the `NetClientStatusReceivingMap` state */
 			std::unique_ptr<GameMapLoader> mapLoader;
 			/** Only valid in the `NetClientStatusReceivingMap` state */
@@ -154,6 +157,7 @@ namespace spades {
 			std::string DisconnectReasonString(uint32_t);
 
 			void MapLoaded();
+			void PrebuildMap();
 
 			void SendVersion();
 			void SendVersionEnhanced(const std::set<std::uint8_t> &propertyIds);
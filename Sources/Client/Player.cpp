@@ -564,8 +564,8 @@ namespace spades {
 			std::unique_ptr<IBulletHitScanState> stateCell;
 
 			Vector3 dir2 = GetFront();
+			std::vector<GameMap::RayQuery> mapQueries;
 			for (int i = 0; i < pellets; i++) {
-
 				// AoS 0.75's way (dir2 shouldn't be normalized!)
 				dir2.x += (SampleRandomFloat() - SampleRandomFloat()) * spread;
 				dir2.y += (SampleRandomFloat() - SampleRandomFloat()) * spread;
@@ -573,10 +573,17 @@ namespace spades {
 				Vector3 dir = dir2.Normalize();
 
 				bulletVectors.push_back(dir);
+				mapQueries.push_back(GameMap::RayQuery{muzzle, dir, 500, INFINITY});
+			}
 
-				// first do map raycast
-				GameMap::RayCastResult mapResult;
-				mapResult = map->CastRay2(muzzle, dir, 500);
+			// First do map raycast for all pellets at once. This is fine because hitting a
+			// block only changes its health and doesn't affect the solidity.
+			std::vector<GameMap::RayCastResult> mapResults(pellets);
+			map->CastRays(mapQueries.data(), mapResults.data(), mapQueries.size());
+
+			for (int i = 0; i < pellets; i++) {
+				const Vector3 &dir = bulletVectors[i];
+				const GameMap::RayCastResult &mapResult = mapResults[i];
 
 				stmp::optional<Player &> hitPlayer;
 				float hitPlayerDistance = 0.f; // disregarding Z coordinate
@@ -67,23 +67,26 @@ namespace spades {
 				if (player)
 					player->Update(dt);
 
-			while (!blockRegenerationQueue.empty()) {
-				auto it = blockRegenerationQueue.begin();
-				if (it->first > time) {
-					break;
-				}
+			{
+				GameMap::BatchScope batch{map.GetPointerOrNull()};
+				while (!blockRegenerationQueue.empty()) {
+					auto it = blockRegenerationQueue.begin();
+					if (it->first > time) {
+						break;
+					}
 
-				const IntVector3 &block = it->second;
+					const IntVector3 &block = it->second;
 
-				if (map && map->IsSolid(block.x, block.y, block.z)) {
-					uint32_t color = map->GetColor(block.x, block.y, block.z);
-					uint32_t health = 100;
-					color = (color & 0xffffff) | (health << 24);
-					map->Set(block.x, block.y, block.z, true, color);
-				}
+					if (map && map->IsSolid(block.x, block.y, block.z)) {
+						uint32_t color = map->GetColor(block.x, block.y, block.z);
+						uint32_t health = 100;
+						color = (color & 0xffffff) | (health << 24);
+						map->Set(block.x, block.y, block.z, true, color);
+					}
 
-				blockRegenerationQueueMap.erase(blockRegenerationQueueMap.find(it->second));
-				blockRegenerationQueue.erase(it);
+					blockRegenerationQueueMap.erase(blockRegenerationQueueMap.find(it->second));
+					blockRegenerationQueue.erase(it);
+				}
 			}
 
 			std::vector<decltype(grenades.begin())> removedGrenades;
@@ -225,6 +228,9 @@ namespace spades {
 		}
 
 		void World::ApplyBlockActions() {
+			// Notify the listeners once after all blocks are created, destroyed, and fallen
+			GameMap::BatchScope batch{map.GetPointerOrNull()};
+
 			for (const auto &creation : createdBlocks) {
 				const auto &pos = creation.first;
 				const auto &color = creation.second;
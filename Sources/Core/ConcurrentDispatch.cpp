@@ -18,171 +18,56 @@
 
  */
 
-#include <list>
-#include <sys/types.h>
-#include <memory>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
 
 #include <Imports/SDL.h>
 
-#if defined(__APPLE__)
-#include <sys/sysctl.h>
-#else
-#if defined(WIN32)
-#include <windows.h>
-#else
-#ifndef _MSC_VER
-#include <unistd.h>
-#endif
-#if defined(__linux__)
-#include <sys/sysinfo.h>
-#endif
-#endif
-#endif
-
 #include "ConcurrentDispatch.h"
 #include "Debug.h"
 #include "Exception.h"
-#include "Settings.h"
 #include "Thread.h"
-#include <OpenSpades.h>
 #include "ThreadLocalStorage.h"
 
-DEFINE_SPADES_SETTING(core_numDispatchQueueThreads, "auto");
-
-static int GetNumCores() {
-#ifdef WIN32
-	SYSTEM_INFO sysinfo;
-	GetSystemInfo(&sysinfo);
-	return sysinfo.dwNumberOfProcessors;
-#elif defined(__APPLE__)
-	int nm[2];
-	size_t len = 4;
-	uint32_t count;
-
-	nm[0] = CTL_HW;
-	nm[1] = HW_AVAILCPU;
-	sysctl(nm, 2, &count, &len, NULL, 0);
-
-	if (count < 1) {
-		nm[1] = HW_NCPU;
-		sysctl(nm, 2, &count, &len, NULL, 0);
-		if (count < 1) {
-			count = 1;
-		}
-	}
-	return count;
-#elif defined(__linux__)
-	return get_nprocs();
-#else
-	return sysconf(_SC_NPROCESSORS_ONLN);
-#endif
-}
-
 namespace spades {
 
-	struct SyncQueueEntry {
-		SDL_cond *doneCond;
-		SDL_mutex *doneMutex;
-		ConcurrentDispatch *dispatch;
-		bool done;
-		bool released;
-
-		SyncQueueEntry(ConcurrentDispatch *disp)
-		    : doneCond(SDL_CreateCond()),
-		      doneMutex(SDL_CreateMutex()),
-		      dispatch(disp),
-		      done(false),
-		      released(false) {}
-		~SyncQueueEntry() {
-			SDL_DestroyCond(doneCond);
-			SDL_DestroyMutex(doneMutex);
-			if (released) {
-				dispatch->entry = NULL;
-				delete dispatch;
-			}
-		}
-
-		void Done() {
-			SDL_LockMutex(doneMutex);
-			done = true;
-			SDL_CondBroadcast(doneCond);
-			if (released) {
-				delete this;
-				return;
-			}
-			SDL_UnlockMutex(doneMutex);
-		}
-
-		void Release() {
-			SDL_LockMutex(doneMutex);
-			released = true;
-			if (done) {
-				delete this;
-				return;
-			}
-			SDL_UnlockMutex(doneMutex);
-		}
-
-		void Join() {
-			SDL_LockMutex(doneMutex);
-			while (!done) {
-				SDL_CondWait(doneCond, doneMutex);
-			}
-			SDL_UnlockMutex(doneMutex);
-		}
-	};
-
 	class SynchronizedQueue {
-		std::list<SyncQueueEntry *> entries;
+		std::deque<ConcurrentDispatch *> entries;
 
-		SDL_cond *pushCond;
-		SDL_mutex *pushMutex;
+		std::mutex pushMutex;
+		std::condition_variable pushCond;
 
 	public:
-		SynchronizedQueue() {
-			pushMutex = SDL_CreateMutex();
-			pushCond = SDL_CreateCond();
-		}
-		~SynchronizedQueue() {
-			SDL_DestroyMutex(pushMutex);
-			SDL_DestroyCond(pushCond);
-		}
-
-		void Push(SyncQueueEntry *entry) {
-			SDL_LockMutex(pushMutex);
-			try {
+		void Push(ConcurrentDispatch *entry) {
+			{
+				std::lock_guard<std::mutex> lock{pushMutex};
 				entries.push_back(entry);
-			} catch (...) {
-				SDL_UnlockMutex(pushMutex);
-				throw;
 			}
-			SDL_CondSignal(pushCond);
-			SDL_UnlockMutex(pushMutex);
+			pushCond.notify_one();
 		}
 
-		SyncQueueEntry *Wait() {
-			SDL_LockMutex(pushMutex);
+		ConcurrentDispatch *Wait() {
+			std::unique_lock<std::mutex> lock{pushMutex};
 			while (entries.empty()) {
-				SDL_CondWait(pushCond, pushMutex);
+				pushCond.wait(lock);
 			}
 
-			SyncQueueEntry *ent = entries.front();
+			ConcurrentDispatch *ent = entries.front();
 			entries.pop_front();
-			SDL_UnlockMutex(pushMutex);
-
 			return ent;
 		}
 
-		SyncQueueEntry *Poll() {
-			SDL_LockMutex(pushMutex);
-			if (!entries.empty()) {
-				SyncQueueEntry *ent = entries.front();
-				entries.pop_front();
-				SDL_UnlockMutex(pushMutex);
-				return ent;
+		ConcurrentDispatch *Poll() {
+			std::lock_guard<std::mutex> lock{pushMutex};
+			if (entries.empty()) {
+				return nullptr;
 			}
-			SDL_UnlockMutex(pushMutex);
-			return NULL;
+			ConcurrentDispatch *ent = entries.front();
+			entries.pop_front();
+			return ent;
 		}
 	};
 
@@ -210,90 +95,35 @@ namespace spades {
 
 	void DispatchQueue::ProcessQueue() {
 		SPADES_MARK_FUNCTION();
-		SyncQueueEntry *ent;
+		ConcurrentDispatch *ent;
 		while ((ent = internal->Poll()) != NULL) {
-			ent->dispatch->Execute();
+			TaskScheduler::GetInstance().ExecuteExternal(*ent);
 		}
 		Thread::CleanupExitedThreads();
 	}
 
 	void DispatchQueue::EnterEventLoop() noexcept {
 		while (true) {
-			SyncQueueEntry *ent = internal->Wait();
-			ent->dispatch->ExecuteProtected();
-		}
-	}
-
-	void DispatchQueue::MarkSDLVideoThread() { sdlQueue = this; }
-
-	namespace {
-		struct GlobalDispatchThreadPool {
-			SynchronizedQueue globalQueue;
-			std::vector<std::unique_ptr<DispatchThread>> threads;
-
-			GlobalDispatchThreadPool();
-			~GlobalDispatchThreadPool();
-		};
-
-		std::unique_ptr<GlobalDispatchThreadPool> globalThreadPool;
-	}
-
-	// Cannot define this in an anonymous namespace since this is referred to by
-	// `ConcurrentDispatch`'s friend class declaration
-	class DispatchThread : public Thread {
-	public:
-		DispatchThread(GlobalDispatchThreadPool &pool) : pool{pool} {
-		}
-		void Run() noexcept override {
-			SPADES_MARK_FUNCTION();
-			while (true) {
-				SyncQueueEntry *ent = pool.globalQueue.Wait();
-				if (ent->dispatch == nullptr) {
-					// Exit request
-					return;
-				}
-				ent->dispatch->ExecuteProtected();
+			ConcurrentDispatch *ent = internal->Wait();
+			try {
+				TaskScheduler::GetInstance().ExecuteExternal(*ent);
+			} catch (const std::exception &ex) {
+				fprintf(stderr, "-- UNHANDLED CONCURRENT DISPATCH EXCEPTION ---\n");
+				fprintf(stderr, "%s\n", ex.what());
+			} catch (...) {
+				fprintf(stderr, "-- UNHANDLED CONCURRENT DISPATCH EXCEPTION ---\n");
+				fprintf(stderr, "(no information provided)\n");
 			}
 		}
-
-	private:
-		GlobalDispatchThreadPool &pool;
-	};
-
-	GlobalDispatchThreadPool::GlobalDispatchThreadPool() {
-		int cnt = GetNumCores();
-		if (!("auto" == core_numDispatchQueueThreads)) {
-			cnt = core_numDispatchQueueThreads;
-		}
-
-		SPLog("Creating %d dispatch thread(s)", cnt);
-		for (int i = 0; i < cnt; i++) {
-			DispatchThread *t = new DispatchThread(*this);
-			threads.emplace_back(t);
-			t->Start();
-		}
 	}
 
-	GlobalDispatchThreadPool::~GlobalDispatchThreadPool() {
-		// From this point no more dispatches are accepted
-		for (const auto &_: threads) {
-			(void) _; // unused!
-			globalQueue.Push(new SyncQueueEntry(nullptr));
-		}
-
-		// Destroy all `DispatchThread`s
-		threads.clear();
-
-		// When `Thread`s' destructors are called, they'll wait until the execution of
-		// the thread is completed. So at this point all `DispatchThread`s have finished execution
-		// and there'll be no threads accessing the `globalQueue`, thus it's safe to delete it.
-	}
+	void DispatchQueue::MarkSDLVideoThread() { sdlQueue = this; }
 
-	ConcurrentDispatch::ConcurrentDispatch() : entry(NULL), runnable(NULL) {
+	ConcurrentDispatch::ConcurrentDispatch() : started(false), runnable(NULL) {
 		SPADES_MARK_FUNCTION();
 	}
 	ConcurrentDispatch::ConcurrentDispatch(std::string name)
-	    : name(name), entry(NULL), runnable(NULL) {
+	    : name(name), started(false), runnable(NULL) {
 		SPADES_MARK_FUNCTION();
 	}
 
@@ -302,79 +132,46 @@ namespace spades {
 		Join();
 	}
 
-	void ConcurrentDispatch::Execute() {
-		SPADES_MARK_FUNCTION();
-		SyncQueueEntry *ent = entry;
-		if (!ent) {
-			SPRaise("Attempted to execute dispatch '%s' without entry", name.c_str());
-		}
-		try {
-			Run();
-		} catch (...) {
-			ent->Done();
-			throw;
-		}
-		ent->Done();
-	}
-
-	void ConcurrentDispatch::ExecuteProtected() noexcept {
-		try {
-			Execute();
-		} catch (const std::exception &ex) {
-			fprintf(stderr, "-- UNHANDLED CONCURRENT DISPATCH EXCEPTION ---\n");
-			fprintf(stderr, "%s\n", ex.what());
-		} catch (...) {
-			fprintf(stderr, "-- UNHANDLED CONCURRENT DISPATCH EXCEPTION ---\n");
-			fprintf(stderr, "(no information provided)\n");
-		}
-	}
+	void ConcurrentDispatch::Execute() { Run(); }
 
 	void ConcurrentDispatch::Start() {
 		SPADES_MARK_FUNCTION();
-		if (entry) {
+		if (started) {
 			SPRaise("Attempted to start dispatch '%s' when it's already started", name.c_str());
-		} else {
-			// should we atomically initialize globalThreadPool? maybe not
-			if (!globalThreadPool) {
-				globalThreadPool.reset(new GlobalDispatchThreadPool());
-			}
-			entry = new SyncQueueEntry(this);
-			globalThreadPool->globalQueue.Push(entry);
 		}
+		started = true;
+		TaskScheduler::GetInstance().Spawn(*this);
 	}
 
 	void ConcurrentDispatch::StartOn(DispatchQueue *queue) {
 		SPADES_MARK_FUNCTION();
-		if (entry) {
+		if (started) {
 			SPRaise("Attempted to start dispatch '%s' when it's already started", name.c_str());
-		} else {
-			entry = new SyncQueueEntry(this);
-			queue->internal->Push(entry);
+		}
+		started = true;
+		TaskScheduler::GetInstance().BeginExternal(*this);
+		queue->internal->Push(this);
 
-			if (queue == sdlQueue) {
-				SDL_Event evt;
-				memset(&evt, 0, sizeof(evt));
-				evt.type = SDL_USEREVENT;
-				SDL_PushEvent(&evt);
-			}
+		if (queue == sdlQueue) {
+			SDL_Event evt;
+			memset(&evt, 0, sizeof(evt));
+			evt.type = SDL_USEREVENT;
+			SDL_PushEvent(&evt);
 		}
 	}
 
 	void ConcurrentDispatch::Join() {
 		SPADES_MARK_FUNCTION();
-		if (!entry) {
-		} else {
-			entry->Join();
-			delete entry;
-			entry = NULL;
+		if (started) {
+			TaskScheduler::GetInstance().Wait(*this);
+			started = false;
 		}
 	}
 
 	void ConcurrentDispatch::Release() {
 		SPADES_MARK_FUNCTION();
-		if (entry) {
-			SyncQueueEntry *ent = entry;
-			ent->Release();
+		if (started) {
+			Detach();
 		}
 	}
 
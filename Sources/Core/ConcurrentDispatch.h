@@ -24,10 +24,9 @@
 #include <string>
 
 #include "IRunnable.h"
+#include "TaskScheduler.h"
 
 namespace spades {
-	struct SyncQueueEntry;
-	class DispatchThread;
 	class SynchronizedQueue;
 	class ConcurrentDispatch;
 
@@ -45,28 +44,31 @@ namespace spades {
 		void MarkSDLVideoThread();
 	};
 
-	class ConcurrentDispatch : public IRunnable {
-		friend class DispatchThread;
+	/**
+	 * A job executed by a worker thread of the global `TaskScheduler` (`Start`) or by
+	 * a thread processing a `DispatchQueue` (`StartOn`).
+	 *
+	 * New code that doesn't need `Release` or `StartOn` should prefer `Task`, `TaskGroup`,
+	 * or `ParallelFor`, which don't require a heap allocation per job.
+	 */
+	class ConcurrentDispatch : public IRunnable, private Task {
 		friend class DispatchQueue;
-		friend struct SyncQueueEntry;
 
 		std::string name;
-		SyncQueueEntry *volatile entry;
+		bool started;
 
 		IRunnable *runnable;
 
-		void Execute();
-		void ExecuteProtected() noexcept;
-
-		// disable
-		ConcurrentDispatch(const ConcurrentDispatch &) {}
-		void operator=(const ConcurrentDispatch &disp) {}
+		void Execute() override;
 
 	public:
 		ConcurrentDispatch();
 		ConcurrentDispatch(std::string name);
 		~ConcurrentDispatch();
 
+		ConcurrentDispatch(const ConcurrentDispatch &) = delete;
+		void operator=(const ConcurrentDispatch &) = delete;
+
 		void Start();
 		void StartOn(DispatchQueue *);
 		void Join();
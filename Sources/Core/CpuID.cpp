@@ -28,6 +28,18 @@ namespace spades {
 		return regs;
 	}
 
+	/** Returns the extended control register `XCR0`. Requires `OSXSAVE`. */
+	static uint64_t xgetbv0() {
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		uint32_t eax, edx;
+		// `xgetbv`, spelled out for assemblers that don't know it
+		asm volatile(".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0));
+		return eax | (static_cast<uint64_t>(edx) << 32);
+#endif
+	}
+
 	CpuID::CpuID() {
 		uint32_t maxStdLevel;
 		{
@@ -56,10 +68,16 @@ namespace spades {
 				brand = "Unknown";
 			}
 		}
-		{
+		if (maxStdLevel >= 7) {
 			auto ar = cpuid(7);
 			// FIXME: sublevels?
 			subfeature = ar[1];
+		} else {
+			subfeature = 0;
+		}
+		{
+			// The AVX registers can only be used if the OS saves them on context switches
+			osSavesYmm = (featureEcx & (1U << 27)) && (xgetbv0() & 6) == 6;
 		}
 		{ info = "(none)"; }
 	}
@@ -71,9 +89,9 @@ namespace spades {
 			case CpuFeature::SSE2: return featureEdx & (1U << 26);
 			case CpuFeature::SSE3: return featureEcx & (1U << 0);
 			case CpuFeature::SSSE3: return featureEcx & (1U << 9);
-			case CpuFeature::FMA: return featureEcx & (1U << 12);
-			case CpuFeature::AVX: return featureEcx & (1U << 28);
-			case CpuFeature::AVX2: return subfeature & (1U << 5);
+			case CpuFeature::FMA: return osSavesYmm && (featureEcx & (1U << 12));
+			case CpuFeature::AVX: return osSavesYmm && (featureEcx & (1U << 28));
+			case CpuFeature::AVX2: return osSavesYmm && (subfeature & (1U << 5));
 			case CpuFeature::AVX512CD: return subfeature & (1U << 28);
 			case CpuFeature::AVX512ER: return subfeature & (1U << 27);
 			case CpuFeature::AVX512PF: return subfeature & (1U << 26);
@@ -35,6 +35,8 @@ namespace spades {
 		uint32_t featureEcx;
 		uint32_t featureEdx;
 		uint32_t subfeature;
+		/** `true` if the OS supports the AVX state (YMM registers). */
+		bool osSavesYmm;
 		std::string info;
 
 	public:
@@ -18,6 +18,7 @@
 
  */
 
+#include <cstdio>
 #include <sys/stat.h>
 
 #ifdef WIN32
@@ -202,4 +203,17 @@ namespace spades {
 		}
 		return false;
 	}
+
+	bool DirectoryFileSystem::RemoveFile(const char *fn) {
+		SPADES_MARK_FUNCTION();
+		if (!canWrite) {
+			return false;
+		}
+		std::string path = PathToPhysical(fn);
+#ifdef WIN32
+		return _wremove(Utf8ToWString(path.c_str()).c_str()) == 0;
+#else
+		return std::remove(path.c_str()) == 0;
+#endif
+	}
 } // namespace spades
@@ -40,5 +40,6 @@ namespace spades {
 		std::unique_ptr<IStream> OpenForReading(const char *) override;
 		std::unique_ptr<IStream> OpenForWriting(const char *) override;
 		bool FileExists(const char *) override;
+		bool RemoveFile(const char *) override;
 	};
 }
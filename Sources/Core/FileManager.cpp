@@ -94,6 +94,19 @@ namespace spades {
 		return false;
 	}
 
+	bool FileManager::RemoveFile(const char *fn) {
+		SPADES_MARK_FUNCTION();
+		if (!fn)
+			SPInvalidArgument("fn");
+
+		for (auto *fs : g_fileSystems) {
+			if (fs->FileExists(fn))
+				return fs->RemoveFile(fn);
+		}
+
+		return false;
+	}
+
 	void FileManager::AddFileSystem(spades::IFileSystem *fs) {
 		SPADES_MARK_FUNCTION();
 		AppendFileSystem(fs);
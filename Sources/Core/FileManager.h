@@ -34,6 +34,8 @@ namespace spades {
 		static std::unique_ptr<IStream> OpenForReading(const char *);
 		static std::unique_ptr<IStream> OpenForWriting(const char *);
 		static bool FileExists(const char *);
+		/** Deletes a file from the first file system that has it. */
+		static bool RemoveFile(const char *);
 		static void AddFileSystem(IFileSystem *);
 		static void AppendFileSystem(IFileSystem *);
 		static void PrependFileSystem(IFileSystem *);
@@ -33,5 +33,7 @@ namespace spades {
 		virtual std::unique_ptr<IStream> OpenForReading(const char *) = 0;
 		virtual std::unique_ptr<IStream> OpenForWriting(const char *) = 0;
 		virtual bool FileExists(const char *) = 0;
+		/** Deletes a file. Returns `false` if the file doesn't exist or can't be deleted. */
+		virtual bool RemoveFile(const char *) = 0;
 	};
 } // namespace spades
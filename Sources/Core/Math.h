@@ -909,6 +909,44 @@ namespace spades {
 		}
 	};
 
+#pragma mark - Bit Manipulation
+
+	/** Returns the number of set bits in `v`. */
+	static inline int CountBits64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_popcountll(v);
+#else
+		v = v - ((v >> 1) & 0x5555555555555555ULL);
+		v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+		v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		return static_cast<int>((v * 0x0101010101010101ULL) >> 56);
+#endif
+	}
+
+	/** Returns the index of the lowest set bit in `v`. `v` must not be zero. */
+	static inline int CountTrailingZeros64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctzll(v);
+#else
+		return CountBits64((v & (0 - v)) - 1);
+#endif
+	}
+
+	/** Returns the index of the highest set bit in `v`. `v` must not be zero. */
+	static inline int FindLastSet64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+		return 63 - __builtin_clzll(v);
+#else
+		v |= v >> 1;
+		v |= v >> 2;
+		v |= v >> 4;
+		v |= v >> 8;
+		v |= v >> 16;
+		v |= v >> 32;
+		return CountBits64(v) - 1;
+#endif
+	}
+
 #pragma mark - Utilities
 
 	template <typename T> static inline void FastErase(std::vector<T> &vec, size_t index) {
@@ -0,0 +1,363 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <sys/types.h>
+
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#else
+#if defined(WIN32)
+#include <windows.h>
+#else
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/sysinfo.h>
+#endif
+#endif
+#endif
+
+#include "Debug.h"
+#include "Settings.h"
+#include "TaskScheduler.h"
+#include "Thread.h"
+#include "ThreadLocalStorage.h"
+
+DEFINE_SPADES_SETTING(core_numDispatchQueueThreads, "auto");
+
+static int GetNumCores() {
+#ifdef WIN32
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+	return sysinfo.dwNumberOfProcessors;
+#elif defined(__APPLE__)
+	int nm[2];
+	size_t len = 4;
+	uint32_t count;
+
+	nm[0] = CTL_HW;
+	nm[1] = HW_AVAILCPU;
+	sysctl(nm, 2, &count, &len, NULL, 0);
+
+	if (count < 1) {
+		nm[1] = HW_NCPU;
+		sysctl(nm, 2, &count, &len, NULL, 0);
+		if (count < 1) {
+			count = 1;
+		}
+	}
+	return count;
+#elif defined(__linux__)
+	return get_nprocs();
+#else
+	return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+namespace spades {
+	// Cannot define this in an anonymous namespace since this is referred to by
+	// `TaskScheduler`'s friend class declaration
+	class TaskWorker : public Thread {
+	public:
+		TaskWorker(TaskScheduler &scheduler) : scheduler{scheduler} {}
+
+		void Run() noexcept override;
+
+		TaskScheduler &scheduler;
+
+		/** Protects `tasks`. */
+		std::mutex mutex;
+		std::deque<Task *> tasks;
+
+		/** The index of the worker to steal from next. */
+		std::size_t nextVictim = 0;
+	};
+
+	namespace {
+		ThreadLocalStorage<TaskWorker> currentWorker("currentTaskWorker");
+
+		std::once_flag globalSchedulerOnce;
+		std::unique_ptr<TaskScheduler> globalScheduler;
+
+		bool RemoveTask(std::deque<Task *> &tasks, Task &task) {
+			auto it = std::find(tasks.begin(), tasks.end(), &task);
+			if (it == tasks.end()) {
+				return false;
+			}
+			tasks.erase(it);
+			return true;
+		}
+	} // namespace
+
+	void TaskWorker::Run() noexcept {
+		SPADES_MARK_FUNCTION();
+		currentWorker = this;
+		scheduler.RunWorker(*this);
+	}
+
+	void Task::Detach() {
+		unsigned oldState = state.fetch_or(StateDetached);
+		SPAssert(oldState & (StatePending | StateDone));
+		if (oldState & StateDone) {
+			delete this;
+		}
+	}
+
+	TaskScheduler &TaskScheduler::GetInstance() {
+		std::call_once(globalSchedulerOnce, [] {
+			int count = GetNumCores();
+			if (!("auto" == core_numDispatchQueueThreads)) {
+				count = core_numDispatchQueueThreads;
+			}
+			globalScheduler.reset(new TaskScheduler(std::max(count, 1)));
+		});
+		return *globalScheduler;
+	}
+
+	TaskScheduler::TaskScheduler(int numWorkers)
+	    : numQueuedTasks{0}, numIdleWorkers{0}, numWaiters{0}, shuttingDown{false} {
+		SPADES_MARK_FUNCTION();
+
+		SPLog("Creating %d task worker thread(s)", numWorkers);
+
+		// Create all workers before starting any, since they steal from each other
+		for (int i = 0; i < numWorkers; i++) {
+			workers.emplace_back(new TaskWorker(*this));
+			workers.back()->nextVictim = (i + 1) % numWorkers;
+		}
+		for (const auto &worker : workers) {
+			worker->Start();
+		}
+	}
+
+	TaskScheduler::~TaskScheduler() {
+		SPADES_MARK_FUNCTION();
+
+		{
+			std::lock_guard<std::mutex> lock{sleepMutex};
+			shuttingDown = true;
+		}
+		workCondition.notify_all();
+
+		// `Thread`'s destructor waits until the thread exits. Workers only exit when the
+		// queues are empty, so no worker accesses another's deque after this.
+		for (const auto &worker : workers) {
+			worker->Join();
+		}
+		workers.clear();
+	}
+
+	void TaskScheduler::Spawn(Task &task) {
+		SPAssert(!task.IsPendingOrRunning());
+		task.state.store(Task::StatePending);
+
+		TaskWorker *self = currentWorker;
+		if (self && &self->scheduler == this) {
+			std::lock_guard<std::mutex> lock{self->mutex};
+			self->tasks.push_back(&task);
+		} else {
+			std::lock_guard<std::mutex> lock{injectedMutex};
+			injectedTasks.push_back(&task);
+		}
+
+		numQueuedTasks.fetch_add(1);
+
+		// `numQueuedTasks` must be incremented before `numIdleWorkers` is checked. See
+		// `RunWorker` for the other half.
+		if (numIdleWorkers.load() > 0) {
+			{ std::lock_guard<std::mutex> lock{sleepMutex}; }
+			workCondition.notify_one();
+		}
+	}
+
+	Task *TaskScheduler::FindTask(TaskWorker *self) {
+		if (numQueuedTasks.load() == 0) {
+			return nullptr;
+		}
+
+		Task *task = nullptr;
+
+		if (self) {
+			// The most recently spawned task is likely to share data with the current one
+			std::lock_guard<std::mutex> lock{self->mutex};
+			if (!self->tasks.empty()) {
+				task = self->tasks.back();
+				self->tasks.pop_back();
+			}
+		}
+
+		if (!task) {
+			std::lock_guard<std::mutex> lock{injectedMutex};
+			if (!injectedTasks.empty()) {
+				task = injectedTasks.front();
+				injectedTasks.pop_front();
+			}
+		}
+
+		if (!task) {
+			std::size_t numWorkers = workers.size();
+			std::size_t start = self ? self->nextVictim : 0;
+			for (std::size_t i = 0; i < numWorkers && !task; i++) {
+				TaskWorker &victim = *workers[(start + i) % numWorkers];
+				if (&victim == self) {
+					continue;
+				}
+				std::lock_guard<std::mutex> lock{victim.mutex};
+				if (!victim.tasks.empty()) {
+					task = victim.tasks.front();
+					victim.tasks.pop_front();
+					if (self) {
+						self->nextVictim = (start + i) % numWorkers;
+					}
+				}
+			}
+		}
+
+		if (task) {
+			numQueuedTasks.fetch_sub(1);
+		}
+		return task;
+	}
+
+	void TaskScheduler::RunWorker(TaskWorker &self) {
+		while (true) {
+			if (Task *task = FindTask(&self)) {
+				Execute(*task);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock{sleepMutex};
+			if (shuttingDown && numQueuedTasks.load() == 0) {
+				return;
+			}
+
+			// `numIdleWorkers` must be incremented before `numQueuedTasks` is checked so
+			// that `Spawn` never misses a sleeping worker
+			numIdleWorkers.fetch_add(1);
+			while (numQueuedTasks.load() == 0 && !shuttingDown) {
+				workCondition.wait(lock);
+			}
+			numIdleWorkers.fetch_sub(1);
+		}
+	}
+
+	void TaskScheduler::Execute(Task &task) noexcept {
+		try {
+			task.Execute();
+		} catch (const std::exception &ex) {
+			fprintf(stderr, "-- UNHANDLED CONCURRENT DISPATCH EXCEPTION ---\n");
+			fprintf(stderr, "%s\n", ex.what());
+		} catch (...) {
+			fprintf(stderr, "-- UNHANDLED CONCURRENT DISPATCH EXCEPTION ---\n");
+			fprintf(stderr, "(no information provided)\n");
+		}
+		Complete(task);
+	}
+
+	void TaskScheduler::Complete(Task &task) {
+		unsigned oldState = task.state.fetch_or(Task::StateDone);
+		SPAssert(oldState & Task::StatePending);
+
+		// `task` may be destroyed by its owner from this point unless it's detached
+		if (numWaiters.load() > 0) {
+			{ std::lock_guard<std::mutex> lock{sleepMutex}; }
+			doneCondition.notify_all();
+		}
+
+		if (oldState & Task::StateDetached) {
+			delete &task;
+		}
+	}
+
+	void TaskScheduler::Wait(Task &task) {
+		TaskWorker *self = currentWorker;
+		if (self && &self->scheduler != this) {
+			self = nullptr;
+		}
+
+		while (!(task.state.load() & Task::StateDone)) {
+			if (task.state.load() == Task::StateIdle) {
+				// Never spawned or revoked
+				return;
+			}
+
+			if (self) {
+				// Help the other workers instead of blocking one of them
+				if (Task *other = FindTask(self)) {
+					Execute(*other);
+					continue;
+				}
+			}
+
+			std::unique_lock<std::mutex> lock{sleepMutex};
+			numWaiters.fetch_add(1);
+			if (!(task.state.load() & Task::StateDone)) {
+				if (self) {
+					// Wake up periodically to look for tasks to help with
+					doneCondition.wait_for(lock, std::chrono::milliseconds(1));
+				} else {
+					doneCondition.wait(lock);
+				}
+			}
+			numWaiters.fetch_sub(1);
+		}
+	}
+
+	bool TaskScheduler::TryRevoke(Task &task) {
+		if (task.state.load() != Task::StatePending) {
+			return false;
+		}
+
+		bool removed = false;
+		{
+			std::lock_guard<std::mutex> lock{injectedMutex};
+			removed = RemoveTask(injectedTasks, task);
+		}
+		for (std::size_t i = 0; i < workers.size() && !removed; i++) {
+			std::lock_guard<std::mutex> lock{workers[i]->mutex};
+			removed = RemoveTask(workers[i]->tasks, task);
+		}
+
+		if (removed) {
+			numQueuedTasks.fetch_sub(1);
+			task.state.store(Task::StateIdle);
+		}
+		return removed;
+	}
+
+	void TaskScheduler::BeginExternal(Task &task) {
+		SPAssert(!task.IsPendingOrRunning());
+		task.state.store(Task::StatePending);
+	}
+
+	void TaskScheduler::ExecuteExternal(Task &task) {
+		try {
+			task.Execute();
+		} catch (...) {
+			Complete(task);
+			throw;
+		}
+		Complete(task);
+	}
+} // namespace spades
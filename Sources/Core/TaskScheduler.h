@@ -0,0 +1,279 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace spades {
+	class TaskScheduler;
+	class TaskWorker;
+
+	/**
+	 * A unit of work executed by `TaskScheduler`.
+	 *
+	 * A task is owned by whoever spawned it and must outlive its execution, unless it's
+	 * detached by `Detach`. Spawning a task doesn't allocate memory, so it can live on the
+	 * stack.
+	 */
+	class Task {
+		friend class TaskScheduler;
+		friend class TaskGroup;
+
+	public:
+		Task() : state{StateIdle}, groupNext{nullptr} {}
+		virtual ~Task() {}
+
+		Task(const Task &) = delete;
+		void operator=(const Task &) = delete;
+
+		/** Returns `true` if the task was spawned and has completed execution. */
+		bool IsDone() const { return (state.load() & StateDone) != 0; }
+
+		/**
+		 * Makes the task delete itself when it completes (or immediately if it already has).
+		 * The task must have been allocated by `new` and spawned, and must not be waited
+		 * for after this call.
+		 */
+		void Detach();
+
+	protected:
+		virtual void Execute() = 0;
+
+	private:
+		enum : unsigned { StateIdle = 0, StatePending = 1, StateDone = 2, StateDetached = 4 };
+
+		bool IsPendingOrRunning() const {
+			return (state.load() & (StatePending | StateDone)) == StatePending;
+		}
+
+		std::atomic<unsigned> state;
+
+		/** The next task in the same `TaskGroup`. */
+		Task *groupNext;
+	};
+
+	/** A `Task` calling a function object. */
+	template <class F> class FunctionTask : public Task {
+		F f;
+
+	public:
+		FunctionTask(F f) : f(std::move(f)) {}
+
+	protected:
+		void Execute() override { f(); }
+	};
+
+	/**
+	 * A work-stealing task scheduler.
+	 *
+	 * Each worker thread owns a deque of tasks. A worker pushes the tasks it spawns to the
+	 * back of its own deque and takes tasks from the back (so nested parallelism runs
+	 * depth-first with warm caches). An idle worker steals the oldest tasks from the front
+	 * of the other workers' deques. Tasks spawned by other threads go to a shared queue.
+	 *
+	 * Each deque has its own lock, which is held only while pushing or popping a pointer,
+	 * so the workers rarely contend with each other.
+	 */
+	class TaskScheduler {
+		friend class TaskWorker;
+
+	public:
+		/**
+		 * Returns the global scheduler, creating it on first use. The number of worker
+		 * threads is specified by `core_numDispatchQueueThreads`.
+		 */
+		static TaskScheduler &GetInstance();
+
+		explicit TaskScheduler(int numWorkers);
+
+		/** Executes the remaining tasks and stops the worker threads. */
+		~TaskScheduler();
+
+		TaskScheduler(const TaskScheduler &) = delete;
+		void operator=(const TaskScheduler &) = delete;
+
+		int GetNumWorkers() const { return static_cast<int>(workers.size()); }
+
+		/** Queues `task` for execution by a worker thread. */
+		void Spawn(Task &task);
+
+		/**
+		 * Waits until `task` completes. Returns immediately if it was never spawned.
+		 *
+		 * When called by a worker thread, executes other tasks while waiting so that nested
+		 * parallelism can't starve the workers.
+		 */
+		void Wait(Task &task);
+
+		/**
+		 * Removes `task` from the queues if no worker has started it yet. Returns `true` if
+		 * it was removed, in which case it's not executed (and `Wait` returns immediately).
+		 */
+		bool TryRevoke(Task &task);
+
+		/**
+		 * Marks `task` as pending without queueing it, for tasks executed through another
+		 * queue (e.g., `DispatchQueue`). `Wait` waits until it's passed to `ExecuteExternal`.
+		 */
+		void BeginExternal(Task &task);
+
+		/**
+		 * Executes a task marked by `BeginExternal` on the calling thread. An exception
+		 * thrown by the task is rethrown after the task is marked as completed.
+		 */
+		void ExecuteExternal(Task &task);
+
+	private:
+		std::vector<std::unique_ptr<TaskWorker>> workers;
+
+		/** Tasks spawned by non-worker threads. */
+		std::mutex injectedMutex;
+		std::deque<Task *> injectedTasks;
+
+		/** The total number of queued tasks. */
+		std::atomic<int> numQueuedTasks;
+
+		/** Protects the sleep state below. */
+		std::mutex sleepMutex;
+		/** Wakes up idle workers when tasks are queued. */
+		std::condition_variable workCondition;
+		/** Wakes up threads waiting in `Wait` when tasks complete. */
+		std::condition_variable doneCondition;
+		std::atomic<int> numIdleWorkers;
+		std::atomic<int> numWaiters;
+		bool shuttingDown;
+
+		Task *FindTask(TaskWorker *self);
+		void RunWorker(TaskWorker &);
+		void Execute(Task &) noexcept;
+		void Complete(Task &);
+	};
+
+	/**
+	 * Spawns a set of tasks and waits for all of them.
+	 *
+	 * The tasks are linked intrusively, so no memory is allocated.
+	 */
+	class TaskGroup {
+		TaskScheduler &scheduler;
+		Task *head;
+
+	public:
+		explicit TaskGroup(TaskScheduler &scheduler = TaskScheduler::GetInstance())
+		    : scheduler(scheduler), head(nullptr) {}
+		~TaskGroup() { Wait(); }
+
+		TaskGroup(const TaskGroup &) = delete;
+		void operator=(const TaskGroup &) = delete;
+
+		/** Spawns `task`. It must outlive the next call to `Wait`. */
+		void Run(Task &task) {
+			task.groupNext = head;
+			head = &task;
+			scheduler.Spawn(task);
+		}
+
+		/** Waits until all tasks passed to `Run` complete. */
+		void Wait() {
+			while (head) {
+				Task *task = head;
+				head = task->groupNext;
+				task->groupNext = nullptr;
+				scheduler.Wait(*task);
+			}
+		}
+	};
+
+	/**
+	 * Calls `f(i)` for every `i` in `[begin, end)` in parallel. The indices are handed out
+	 * in chunks of `grainSize` to the calling thread and (up to `MaxParallelForHelpers`)
+	 * helper tasks. Returns after all calls have returned.
+	 *
+	 * Helpers that didn't get to start because the workers were busy are revoked, so the
+	 * calling thread never waits for unrelated tasks.
+	 */
+	template <class F>
+	void ParallelFor(int begin, int end, F f, int grainSize = 1,
+	                 TaskScheduler &scheduler = TaskScheduler::GetInstance()) {
+		enum { MaxParallelForHelpers = 31 };
+
+		if (begin >= end) {
+			return;
+		}
+		grainSize = std::max(grainSize, 1);
+
+		std::atomic<int> next{begin};
+		auto drain = [&]() {
+			for (;;) {
+				int i = next.fetch_add(grainSize);
+				if (i >= end) {
+					break;
+				}
+				int chunkEnd = std::min(end - i, grainSize) + i;
+				for (; i < chunkEnd; i++) {
+					f(i);
+				}
+			}
+		};
+
+		int numChunks = (end - begin + grainSize - 1) / grainSize;
+		int numHelpers = std::min(numChunks - 1, scheduler.GetNumWorkers());
+		numHelpers = std::min(numHelpers, static_cast<int>(MaxParallelForHelpers));
+
+		using Helper = FunctionTask<std::reference_wrapper<decltype(drain)>>;
+
+		// Revokes or waits for the helpers even if `f` throws, since they refer to `drain`
+		struct Helpers {
+			TaskScheduler &scheduler;
+			alignas(Helper) unsigned char storage[sizeof(Helper) * MaxParallelForHelpers];
+			int count;
+
+			Helpers(TaskScheduler &scheduler) : scheduler(scheduler), count(0) {}
+
+			Helper &operator[](int i) { return reinterpret_cast<Helper *>(storage)[i]; }
+
+			~Helpers() {
+				for (int i = 0; i < count; i++) {
+					if (!scheduler.TryRevoke((*this)[i])) {
+						scheduler.Wait((*this)[i]);
+					}
+					(*this)[i].~Helper();
+				}
+			}
+		} helpers(scheduler);
+
+		for (int i = 0; i < numHelpers; i++) {
+			new (&helpers[i]) Helper(std::ref(drain));
+			helpers.count++;
+			scheduler.Spawn(helpers[i]);
+		}
+
+		drain();
+	}
+} // namespace spades
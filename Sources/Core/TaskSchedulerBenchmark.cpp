@@ -0,0 +1,238 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ConcurrentDispatch.h"
+#include "Debug.h"
+#include "Stopwatch.h"
+#include "TaskScheduler.h"
+#include "TaskSchedulerBenchmark.h"
+#include "Thread.h"
+
+namespace spades {
+	namespace TaskSchedulerBenchmark {
+		namespace {
+			enum { NumFanOutTasks = 64 };
+
+			/**
+			 * The global queue used by `ConcurrentDispatch` before it was built on
+			 * `TaskScheduler`: a single locked list shared by all threads, and a heap-allocated
+			 * entry with its own mutex and condition variable for every dispatch. (SDL's
+			 * mutexes are replaced with the standard ones, which are slightly cheaper.)
+			 */
+			class LegacyQueue {
+			public:
+				struct Entry {
+					std::function<void()> function;
+					std::mutex doneMutex;
+					std::condition_variable doneCond;
+					bool done = false;
+
+					Entry(std::function<void()> function) : function(std::move(function)) {}
+
+					void Join() {
+						std::unique_lock<std::mutex> lock{doneMutex};
+						while (!done) {
+							doneCond.wait(lock);
+						}
+					}
+				};
+
+				LegacyQueue(int numThreads) {
+					for (int i = 0; i < numThreads; i++) {
+						threads.emplace_back(new WorkerThread(*this));
+						threads.back()->Start();
+					}
+				}
+
+				~LegacyQueue() {
+					for (std::size_t i = 0; i < threads.size(); i++) {
+						Push(nullptr);
+					}
+					threads.clear();
+				}
+
+				void Push(Entry *entry) {
+					{
+						std::lock_guard<std::mutex> lock{pushMutex};
+						entries.push_back(entry);
+					}
+					pushCond.notify_one();
+				}
+
+			private:
+				class WorkerThread : public Thread {
+					LegacyQueue &queue;
+
+				public:
+					WorkerThread(LegacyQueue &queue) : queue(queue) {}
+
+					void Run() noexcept override {
+						while (Entry *entry = queue.Wait()) {
+							entry->function();
+							std::lock_guard<std::mutex> lock{entry->doneMutex};
+							entry->done = true;
+							entry->doneCond.notify_all();
+						}
+					}
+				};
+
+				std::mutex pushMutex;
+				std::condition_variable pushCond;
+				std::list<Entry *> entries;
+				std::vector<std::unique_ptr<WorkerThread>> threads;
+
+				Entry *Wait() {
+					std::unique_lock<std::mutex> lock{pushMutex};
+					while (entries.empty()) {
+						pushCond.wait(lock);
+					}
+					Entry *entry = entries.front();
+					entries.pop_front();
+					return entry;
+				}
+			};
+
+			/** The body of a task. A small task takes roughly a microsecond. */
+			struct Work {
+				std::atomic<std::uint32_t> *sink;
+				int numIterations;
+
+				void operator()() const {
+					std::uint32_t x = static_cast<std::uint32_t>(numIterations);
+					for (int i = 0; i < numIterations; i++) {
+						x = x * 1664525U + 1013904223U;
+					}
+					sink->fetch_add(x, std::memory_order_relaxed);
+				}
+			};
+
+			/** Returns the average time taken by `f` in microseconds. */
+			template <class F> double Measure(int numRepeats, F f) {
+				f(); // warm up
+				Stopwatch sw;
+				for (int i = 0; i < numRepeats; i++) {
+					f();
+				}
+				return sw.GetTime() / numRepeats * 1.0e6;
+			}
+
+			void RunFanOut(LegacyQueue &legacyQueue, Work work, const char *workName) {
+				const int numRepeats = 2000;
+
+				double legacyTime = Measure(numRepeats, [&] {
+					std::unique_ptr<LegacyQueue::Entry> entries[NumFanOutTasks];
+					for (auto &entry : entries) {
+						entry.reset(new LegacyQueue::Entry(work));
+						legacyQueue.Push(entry.get());
+					}
+					for (auto &entry : entries) {
+						entry->Join();
+					}
+				});
+
+				double dispatchTime = Measure(numRepeats, [&] {
+					std::unique_ptr<ConcurrentDispatch> dispatches[NumFanOutTasks];
+					for (auto &dispatch : dispatches) {
+						dispatch.reset(new FunctionDispatch<Work>(work));
+						dispatch->Start();
+					}
+					for (auto &dispatch : dispatches) {
+						dispatch->Join();
+					}
+				});
+
+				// `FunctionTask`s can be spawned again once they complete, so this doesn't
+				// allocate memory at all
+				std::deque<FunctionTask<Work>> tasks;
+				for (int i = 0; i < NumFanOutTasks; i++) {
+					tasks.emplace_back(work);
+				}
+				double groupTime = Measure(numRepeats, [&] {
+					TaskGroup group;
+					for (auto &task : tasks) {
+						group.Run(task);
+					}
+				});
+
+				SPLog("  Fan-out of %d %s tasks (per task):", NumFanOutTasks, workName);
+				SPLog("    Legacy queue:       %7.3fus", legacyTime / NumFanOutTasks);
+				SPLog("    ConcurrentDispatch: %7.3fus", dispatchTime / NumFanOutTasks);
+				SPLog("    TaskGroup:          %7.3fus", groupTime / NumFanOutTasks);
+			}
+
+			void RunForkJoin(LegacyQueue &legacyQueue, Work work, const char *workName,
+			                 int numSlices) {
+				const int numRepeats = 10000;
+
+				// This is how `InvokeParallel` used to work
+				double legacyTime = Measure(numRepeats, [&] {
+					std::unique_ptr<LegacyQueue::Entry> entries[NumFanOutTasks];
+					for (int i = 1; i < numSlices; i++) {
+						entries[i].reset(new LegacyQueue::Entry(work));
+						legacyQueue.Push(entries[i].get());
+					}
+					work();
+					for (int i = 1; i < numSlices; i++) {
+						entries[i]->Join();
+					}
+				});
+
+				double parallelForTime =
+				  Measure(numRepeats, [&] { ParallelFor(0, numSlices, [&](int) { work(); }); });
+
+				SPLog("  Fork-join of %d %s slices (per round):", numSlices, workName);
+				SPLog("    Legacy queue:       %7.3fus", legacyTime);
+				SPLog("    ParallelFor:        %7.3fus", parallelForTime);
+			}
+		} // namespace
+
+		void Run() {
+			SPADES_MARK_FUNCTION();
+
+			TaskScheduler &scheduler = TaskScheduler::GetInstance();
+			int numWorkers = scheduler.GetNumWorkers();
+			LegacyQueue legacyQueue(numWorkers);
+
+			std::atomic<std::uint32_t> sink{0};
+			const Work emptyWork{&sink, 0};
+			const Work smallWork{&sink, 1000};
+
+			SPLog("Task scheduler benchmark (%d worker thread(s))", numWorkers);
+			RunFanOut(legacyQueue, emptyWork, "empty");
+			RunFanOut(legacyQueue, smallWork, "small");
+			RunForkJoin(legacyQueue, emptyWork, "empty",
+			            std::min(numWorkers + 1, static_cast<int>(NumFanOutTasks)));
+			RunForkJoin(legacyQueue, smallWork, "small",
+			            std::min(numWorkers + 1, static_cast<int>(NumFanOutTasks)));
+			SPLog("  (checksum %08x)", static_cast<unsigned int>(sink.load()));
+		}
+	} // namespace TaskSchedulerBenchmark
+} // namespace spades
@@ -0,0 +1,36 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+namespace spades {
+	/**
+	 * Micro-benchmarks for `TaskScheduler`. The results are reported through `SPLog`.
+	 */
+	namespace TaskSchedulerBenchmark {
+		/**
+		 * Measures the dispatch overhead of empty and small tasks spawned through
+		 * `ConcurrentDispatch`, `TaskGroup`, and `ParallelFor`, and compares it with a
+		 * replica of the global queue that `ConcurrentDispatch` used before it was built on
+		 * `TaskScheduler`.
+		 */
+		void Run();
+	} // namespace TaskSchedulerBenchmark
+} // namespace spades
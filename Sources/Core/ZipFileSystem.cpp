@@ -461,4 +461,6 @@ namespace spades {
 
 		return files.find(f) != files.end();
 	}
+
+	bool ZipFileSystem::RemoveFile(const char *) { return false; }
 }
@@ -0,0 +1,268 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "BenchmarkScene.h"
+#include <Client/GameMap.h>
+#include <Core/Bitmap.h>
+#include <Core/Debug.h>
+#include <Core/Exception.h>
+#include <Core/IBitmapCodec.h>
+#include <Core/StdStream.h>
+
+namespace spades {
+	namespace draw {
+		namespace {
+			float ToRadians(float degrees) { return degrees * static_cast<float>(M_PI) / 180.f; }
+		} // namespace
+
+		BenchmarkScene::BenchmarkScene(const std::string &path)
+		    : fovY(ToRadians(68.f)),
+		      fogColor(MakeVector3(0.5f, 0.5f, 0.5f)),
+		      fogDistance(128.f) {
+			SPADES_MARK_FUNCTION();
+
+			std::ifstream file(path);
+			if (!file) {
+				SPRaise("Failed to open the scene script: %s", path.c_str());
+			}
+
+			std::string line;
+			int lineNumber = 0;
+			while (std::getline(file, line)) {
+				lineNumber++;
+
+				std::istringstream args(line);
+				std::string command;
+				if (!(args >> command) || command[0] == '#') {
+					continue;
+				}
+
+				bool ok;
+				if (command == "camera") {
+					CameraKey key;
+					ok = static_cast<bool>(args >> key.position.x >> key.position.y >>
+					                       key.position.z >> key.yaw >> key.pitch);
+					key.yaw = ToRadians(key.yaw);
+					key.pitch = ToRadians(key.pitch);
+					cameraPath.push_back(key);
+				} else if (command == "fov") {
+					float degrees;
+					ok = static_cast<bool>(args >> degrees);
+					fovY = ToRadians(degrees);
+				} else if (command == "fog") {
+					Vector3 &c = fogColor;
+					ok = static_cast<bool>(args >> c.x >> c.y >> c.z >> fogDistance);
+				} else if (command == "model") {
+					SceneModel model;
+					Vector3 pos;
+					float scale = 1.f, yaw = 0.f;
+					ok = static_cast<bool>(args >> model.path >> pos.x >> pos.y >> pos.z);
+					if (ok && args >> scale) {
+						args >> yaw;
+					}
+					model.param.matrix = Matrix4::Translate(pos) *
+					                     Matrix4::Rotate(MakeVector3(0, 0, 1), ToRadians(yaw)) *
+					                     Matrix4::Scale(scale);
+					models.push_back(std::move(model));
+				} else if (command == "sprite") {
+					SceneSprite sprite;
+					Vector3 &c = sprite.center;
+					ok = static_cast<bool>(args >> sprite.path >> c.x >> c.y >> c.z >>
+					                       sprite.radius);
+					sprites.push_back(std::move(sprite));
+				} else if (command == "light") {
+					client::DynamicLightParam light;
+					Vector3 &o = light.origin;
+					Vector3 &c = light.color;
+					ok = static_cast<bool>(args >> o.x >> o.y >> o.z >> light.radius >> c.x >>
+					                       c.y >> c.z);
+					lights.push_back(light);
+				} else if (command == "image") {
+					SceneImage image;
+					ok = static_cast<bool>(args >> image.path >> image.position.x >>
+					                       image.position.y);
+					images.push_back(std::move(image));
+				} else if (command == "flatmap") {
+					FlatMap flatMap;
+					ok = static_cast<bool>(args >> flatMap.position.x >> flatMap.position.y >>
+					                       flatMap.size);
+					flatMaps.push_back(flatMap);
+				} else {
+					SPRaise("%s:%d: Unknown command: %s", path.c_str(), lineNumber,
+					        command.c_str());
+				}
+
+				if (!ok) {
+					SPRaise("%s:%d: Invalid arguments for '%s'", path.c_str(), lineNumber,
+					        command.c_str());
+				}
+			}
+
+			if (cameraPath.empty()) {
+				SPRaise("%s: The scene has no 'camera' command", path.c_str());
+			}
+		}
+
+		void BenchmarkScene::Register(client::IRenderer &renderer) {
+			SPADES_MARK_FUNCTION();
+
+			for (SceneModel &m : models) {
+				m.model = renderer.RegisterModel(m.path.c_str());
+			}
+			for (SceneSprite &s : sprites) {
+				s.image = renderer.RegisterImage(s.path.c_str());
+			}
+			for (SceneImage &i : images) {
+				i.image = renderer.RegisterImage(i.path.c_str());
+			}
+
+			renderer.SetFogColor(fogColor);
+			renderer.SetFogDistance(fogDistance);
+		}
+
+		client::SceneDefinition BenchmarkScene::MakeSceneDefinition(float t, int width,
+		                                                            int height) const {
+			const auto &path = cameraPath;
+			float pos = t * static_cast<float>(path.size() - 1);
+			std::size_t index = std::min(static_cast<std::size_t>(pos), path.size() - 1);
+			std::size_t next = std::min(index + 1, path.size() - 1);
+			float frac = pos - static_cast<float>(index);
+
+			const CameraKey &a = path[index];
+			const CameraKey &b = path[next];
+			Vector3 eye = a.position + (b.position - a.position) * frac;
+			float yaw = a.yaw + (b.yaw - a.yaw) * frac;
+			float pitch = a.pitch + (b.pitch - a.pitch) * frac;
+
+			// The same convention as the free camera of `Client` (+Z is down)
+			Vector3 front;
+			front.x = -cosf(yaw) * cosf(pitch);
+			front.y = -sinf(yaw) * cosf(pitch);
+			front.z = sinf(pitch);
+			Vector3 up = {0, 0, -1};
+
+			client::SceneDefinition def;
+			def.viewportLeft = 0;
+			def.viewportTop = 0;
+			def.viewportWidth = width;
+			def.viewportHeight = height;
+			def.viewOrigin = eye;
+			def.viewAxis[0] = -Vector3::Cross(up, front).Normalize();
+			def.viewAxis[1] = -Vector3::Cross(front, def.viewAxis[0]).Normalize();
+			def.viewAxis[2] = front;
+			def.fovY = fovY;
+			def.fovX =
+			  atanf(tanf(def.fovY * .5f) * static_cast<float>(width) / static_cast<float>(height)) *
+			  2.f;
+			def.zNear = 0.05f;
+			def.zFar = 200.f;
+			def.skipWorld = false;
+			return def;
+		}
+
+		void BenchmarkScene::Render(client::IRenderer &renderer,
+		                            const client::SceneDefinition &def,
+		                            const client::GameMap &map) {
+			SPADES_MARK_FUNCTION();
+
+			renderer.StartScene(def);
+			for (SceneModel &m : models) {
+				renderer.RenderModel(*m.model, m.param);
+			}
+			renderer.SetColorAlphaPremultiplied(MakeVector4(1, 1, 1, 1));
+			for (SceneSprite &s : sprites) {
+				renderer.AddSprite(*s.image, s.center, s.radius, 0.f);
+			}
+			for (const client::DynamicLightParam &l : lights) {
+				renderer.AddLight(l);
+			}
+			renderer.EndScene();
+
+			renderer.SetColorAlphaPremultiplied(MakeVector4(1, 1, 1, 1));
+			for (SceneImage &i : images) {
+				renderer.DrawImage(*i.image, i.position);
+			}
+			for (const FlatMap &f : flatMaps) {
+				float mapSize = static_cast<float>(map.Width());
+				renderer.DrawFlatGameMap(AABB2(f.position.x, f.position.y, f.size, f.size),
+				                         AABB2(0, 0, mapSize, mapSize));
+			}
+			renderer.FrameDone();
+		}
+
+		void BenchmarkSamples::Print(double scale, const char *unit) {
+			std::sort(samples.begin(), samples.end());
+			double sum = 0.0;
+			for (double s : samples) {
+				sum += s;
+			}
+			auto percentile = [&](double p) {
+				std::size_t i = static_cast<std::size_t>(p * (samples.size() - 1));
+				return samples[i] * scale;
+			};
+			printf("  %-14s avg %10.3f%-2s  p50 %10.3f%-2s  p95 %10.3f%-2s  max %10.3f%-2s\n",
+			       name, sum / samples.size() * scale, unit, percentile(0.5), unit,
+			       percentile(0.95), unit, samples.back() * scale, unit);
+		}
+
+		Handle<client::GameMap> LoadBenchmarkMap(const std::string &path) {
+			SPADES_MARK_FUNCTION();
+
+			FILE *f = fopen(path.c_str(), "rb");
+			if (!f) {
+				SPRaise("Failed to open the map: %s", path.c_str());
+			}
+			StdStream stream(f, true);
+			return {client::GameMap::Load(&stream), false};
+		}
+
+		void SaveBenchmarkFrame(client::IRenderer &renderer, const std::string &path) {
+			SPADES_MARK_FUNCTION();
+
+			Handle<Bitmap> bmp = renderer.ReadBitmap();
+
+			// force 100% opacity
+			uint32_t *pixels = bmp->GetPixels();
+			for (size_t i = bmp->GetWidth() * bmp->GetHeight(); i > 0; i--) {
+				*(pixels++) |= 0xff000000UL;
+			}
+
+			// `Bitmap::Save` takes an OpenSpades filesystem path
+			for (IBitmapCodec *codec : IBitmapCodec::GetAllCodecs()) {
+				if (codec->CanSave() && codec->CheckExtension(path)) {
+					FILE *f = fopen(path.c_str(), "wb");
+					if (!f) {
+						SPRaise("Failed to open '%s' for writing", path.c_str());
+					}
+					StdStream stream(f, true);
+					codec->Save(&stream, bmp.GetPointerOrNull());
+					return;
+				}
+			}
+			SPRaise("Bitmap codec not found for filename: %s", path.c_str());
+		}
+	} // namespace draw
+} // namespace spades
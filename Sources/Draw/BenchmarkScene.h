@@ -0,0 +1,130 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <Client/IRenderer.h>
+#include <Core/RefCountedObject.h>
+
+namespace spades {
+	namespace draw {
+		/**
+		 * A scripted scene shared by the headless renderer benchmarks (`SWFrameBenchmark` and
+		 * `GLFrameBenchmark`). Only uses `client::IRenderer`, so every renderer draws exactly the
+		 * same frames.
+		 *
+		 * The scene script is a text file with one command per line. Angles are in degrees,
+		 * and blank lines and lines starting with `#` are ignored.
+		 *
+		 *     camera X Y Z YAW PITCH          A key frame of the camera path. The frames are
+		 *                                     spread evenly over the path.
+		 *     fov FOVY                        The vertical field of view (default: 68).
+		 *     fog R G B DISTANCE              The fog color (0-1) and distance.
+		 *     model PATH X Y Z [SCALE [YAW]]  A model (e.g., `Models/Player/Dead.kv6`).
+		 *     sprite PATH X Y Z RADIUS        A sprite (e.g., `Gfx/Ball.png`).
+		 *     light X Y Z RADIUS R G B        A point light.
+		 *     image PATH X Y                  An image drawn in 2D after the scene.
+		 *     flatmap X Y SIZE                The flat map drawn in 2D after the scene.
+		 *
+		 * The models and the images are loaded from the OpenSpades filesystem.
+		 */
+		class BenchmarkScene {
+		public:
+			/** Loads a scene script from the host filesystem. */
+			explicit BenchmarkScene(const std::string &path);
+
+			/** Registers the models and the images with `renderer` and sets up the fog. */
+			void Register(client::IRenderer &renderer);
+
+			/** Interpolates the camera path linearly. `t` is in `[0, 1]`. */
+			client::SceneDefinition MakeSceneDefinition(float t, int width, int height) const;
+
+			/**
+			 * Draws a frame, from `StartScene` to `FrameDone`. `Flip` is left to the caller so
+			 * that the frame can be read back first.
+			 */
+			void Render(client::IRenderer &renderer, const client::SceneDefinition &def,
+			            const client::GameMap &map);
+
+		private:
+			struct CameraKey {
+				Vector3 position;
+				float yaw, pitch;
+			};
+
+			struct SceneModel {
+				std::string path;
+				Handle<client::IModel> model;
+				client::ModelRenderParam param;
+			};
+
+			struct SceneSprite {
+				std::string path;
+				Handle<client::IImage> image;
+				Vector3 center;
+				float radius;
+			};
+
+			struct SceneImage {
+				std::string path;
+				Handle<client::IImage> image;
+				Vector2 position;
+			};
+
+			struct FlatMap {
+				Vector2 position;
+				float size;
+			};
+
+			std::vector<CameraKey> cameraPath;
+			float fovY;
+			Vector3 fogColor;
+			float fogDistance;
+			std::vector<SceneModel> models;
+			std::vector<SceneSprite> sprites;
+			std::vector<client::DynamicLightParam> lights;
+			std::vector<SceneImage> images;
+			std::vector<FlatMap> flatMaps;
+		};
+
+		/** Per-frame samples of a benchmark, printed as a single line. */
+		struct BenchmarkSamples {
+			const char *name;
+			std::vector<double> samples;
+
+			explicit BenchmarkSamples(const char *name) : name{name} {}
+
+			/**
+			 * Prints the average, p50, p95 and maximum to the standard output. The samples are
+			 * multiplied by `scale` (by default, seconds are printed in milliseconds).
+			 */
+			void Print(double scale = 1000.0, const char *unit = "ms");
+		};
+
+		/** Loads a `.vxl` file from the host filesystem. */
+		Handle<client::GameMap> LoadBenchmarkMap(const std::string &path);
+
+		/** Saves the current frame of `renderer` to the host filesystem as an image. */
+		void SaveBenchmarkFrame(client::IRenderer &renderer, const std::string &path);
+	} // namespace draw
+} // namespace spades
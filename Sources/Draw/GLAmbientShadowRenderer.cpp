@@ -18,6 +18,7 @@
 
  */
 
+#include <algorithm>
 #include <atomic>
 #include <cstdlib>
 
@@ -27,19 +28,37 @@
 #include <Client/GameMap.h>
 
 #include <Core/ConcurrentDispatch.h>
+#include <Core/TaskScheduler.h>
 
 namespace spades {
 	namespace draw {
+		namespace {
+			/**
+			 * Returns the solid bits of the voxels `dz` voxels below (+Z) the voxels of a
+			 * column. The voxels above the map are air and the ones below are solid, like
+			 * `IsSolidWrapped`. `dz` must be in `(-64, 64)`.
+			 */
+			inline uint64_t ShiftColumn(uint64_t column, int dz) {
+				if (dz > 0) {
+					return (column >> dz) | (~0ULL << (64 - dz));
+				} else {
+					return column << -dz;
+				}
+			}
+		} // namespace
+
 		class GLAmbientShadowRenderer::UpdateDispatch : public ConcurrentDispatch {
 			GLAmbientShadowRenderer &renderer;
+			Handle<client::GameMapSnapshot> snapshot;
 
 		public:
 			std::atomic<bool> done{false};
-			UpdateDispatch(GLAmbientShadowRenderer &r) : renderer(r) {}
+			UpdateDispatch(GLAmbientShadowRenderer &r, Handle<client::GameMapSnapshot> snapshot)
+			    : renderer(r), snapshot(std::move(snapshot)) {}
 			void Run() override {
 				SPADES_MARK_FUNCTION();
 
-				renderer.UpdateDirtyChunks();
+				renderer.UpdateDirtyChunks(*snapshot);
 
 				done = true;
 			}
@@ -56,6 +75,7 @@ namespace spades {
 				dir += 0.01f;
 				rayDir = dir;
 			}
+			BuildRayPaths();
 
 			w = map->Width();
 			h = map->Height();
@@ -113,6 +133,7 @@ namespace spades {
 			SPLog("Chunk texture initialized");
 
 			dispatch = NULL;
+			convergenceTime = -1.0;
 		}
 
 		GLAmbientShadowRenderer::~GLAmbientShadowRenderer() {
@@ -124,10 +145,120 @@ namespace spades {
 			device.DeleteTexture(texture);
 		}
 
+		Vector3 GLAmbientShadowRenderer::GetRayDirection(int i) const {
+			Vector3 dir = rays[i];
+
+			unsigned int bits = i & 7;
+			if (bits & 1)
+				dir.x = -dir.x;
+			if (bits & 2)
+				dir.y = -dir.y;
+			if (bits & 4)
+				dir.z = -dir.z;
+
+			return dir;
+		}
+
+		/**
+		 * Traces the rays from a voxel center in the same way as `GameMap::CastRay` and
+		 * records the visited voxels.
+		 */
+		void GLAmbientShadowRenderer::BuildRayPaths() {
+			SPADES_MARK_FUNCTION();
+
+			for (int ray = 0; ray < NumRays; ray++) {
+				std::vector<RayStep> &path = rayPaths[ray];
+				path.clear();
+
+				Vector3 v0 = MakeVector3(.5f, .5f, .5f);
+				Vector3 v1 = v0 + GetRayDirection(ray) * (float)RayLength;
+
+				Vector3 f, g;
+				IntVector3 a, c, d, p, i;
+				long cnt = 0;
+
+				a = v0.Floor();
+				c = v1.Floor();
+
+				if (c.x < a.x) {
+					d.x = -1;
+					f.x = v0.x - a.x;
+					g.x = (v0.x - v1.x) * 1024;
+					cnt += a.x - c.x;
+				} else if (c.x != a.x) {
+					d.x = 1;
+					f.x = a.x + 1 - v0.x;
+					g.x = (v1.x - v0.x) * 1024;
+					cnt += c.x - a.x;
+				} else {
+					d.x = 0;
+					f.x = g.x = 0;
+				}
+				if (c.y < a.y) {
+					d.y = -1;
+					f.y = v0.y - a.y;
+					g.y = (v0.y - v1.y) * 1024;
+					cnt += a.y - c.y;
+				} else if (c.y != a.y) {
+					d.y = 1;
+					f.y = a.y + 1 - v0.y;
+					g.y = (v1.y - v0.y) * 1024;
+					cnt += c.y - a.y;
+				} else {
+					d.y = 0;
+					f.y = g.y = 0;
+				}
+				if (c.z < a.z) {
+					d.z = -1;
+					f.z = v0.z - a.z;
+					g.z = (v0.z - v1.z) * 1024;
+					cnt += a.z - c.z;
+				} else if (c.z != a.z) {
+					d.z = 1;
+					f.z = a.z + 1 - v0.z;
+					g.z = (v1.z - v0.z) * 1024;
+					cnt += c.z - a.z;
+				} else {
+					d.z = 0;
+					f.z = g.z = 0;
+				}
+
+				Vector3 pp =
+				  MakeVector3(f.x * g.z - f.z * g.x, f.y * g.z - f.z * g.y, f.y * g.x - f.x * g.y);
+				p = pp.Floor();
+				i = g.Floor();
+
+				if (cnt > (long)RayLength)
+					cnt = (long)RayLength;
+
+				for (; cnt > 0; cnt--) {
+					if (((p.x | p.y) >= 0) && (a.z != c.z)) {
+						a.z += d.z;
+						p.x -= i.x;
+						p.y -= i.y;
+					} else if ((p.z >= 0) && (a.x != c.x)) {
+						a.x += d.x;
+						p.x += i.z;
+						p.z -= i.y;
+					} else {
+						a.y += d.y;
+						p.y += i.z;
+						p.z += i.x;
+					}
+
+					// `a` is relative to the starting voxel
+					float dist = (float)(a.x * a.x + a.y * a.y + a.z * a.z);
+					float brightness = dist * (1.0 / float((RayLength - 1) * (RayLength - 1)));
+					path.push_back(RayStep{a.x, a.y, a.z, std::min(brightness, 1.f)});
+				}
+			}
+		}
+
 		/**
 		 * Evaluate the AO term at the point specified by given world coordinates.
 		 */
-		float GLAmbientShadowRenderer::Evaluate(IntVector3 ipos) {
+		float GLAmbientShadowRenderer::Evaluate(const client::GameMapSnapshot &snapshot,
+		                                        IntVector3 ipos) {
 			SPADES_MARK_FUNCTION_DEBUG();
 
 			float sum = 0.0f;
@@ -137,21 +268,13 @@ namespace spades {
 			pos.z += 0.5f;
 
 			for (int i = 0; i < NumRays; i++) {
-				Vector3 dir = rays[i];
-
-				unsigned int bits = i & 7;
-				if (bits & 1)
-					dir.x = -dir.x;
-				if (bits & 2)
-					dir.y = -dir.y;
-				if (bits & 4)
-					dir.z = -dir.z;
+				Vector3 dir = GetRayDirection(i);
 
 				Vector3 muzzle = pos;
 				IntVector3 hitBlock;
 
 				float brightness = 1.f;
-				if (map->CastRay(muzzle, dir, (float)RayLength, hitBlock)) {
+				if (snapshot.CastRay(muzzle, dir, (float)RayLength, hitBlock)) {
 					Vector3 centerPos =
 					  MakeVector3(hitBlock.x + .5f, hitBlock.y + .5f, hitBlock.z + .5f);
 					float dist = (centerPos - muzzle).GetPoweredLength();
@@ -168,6 +291,42 @@ namespace spades {
 			return sum;
 		}
 
+		void GLAmbientShadowRenderer::EvaluateColumn(const uint64_t *column, int pitch,
+		                                             uint64_t mask, float *out) const {
+			SPADES_MARK_FUNCTION_DEBUG();
+
+			float sum[64];
+			for (uint64_t bits = mask; bits; bits &= bits - 1) {
+				sum[CountTrailingZeros64(bits)] = 0.f;
+			}
+
+			// Walk each ray for all voxels at once. `remaining` tracks the voxels whose ray
+			// hasn't hit anything yet. The sums are accumulated in the same order as
+			// `Evaluate` so that the results match exactly.
+			for (int i = 0; i < NumRays; i++) {
+				uint64_t remaining = mask;
+				for (const RayStep &step : rayPaths[i]) {
+					uint64_t hits =
+					  remaining & ShiftColumn(column[step.dy * pitch + step.dx], step.dz);
+					remaining &= ~hits;
+					for (; hits; hits &= hits - 1) {
+						sum[CountTrailingZeros64(hits)] += step.brightness;
+					}
+					if (remaining == 0) {
+						break;
+					}
+				}
+				for (; remaining; remaining &= remaining - 1) {
+					sum[CountTrailingZeros64(remaining)] += 1.f;
+				}
+			}
+
+			for (uint64_t bits = mask; bits; bits &= bits - 1) {
+				int z = CountTrailingZeros64(bits);
+				out[z] = std::min(sum[z] * (2.f / (float)NumRays), 1.0f);
+			}
+		}
+
 		void GLAmbientShadowRenderer::GameMapChanged(int x, int y, int z, client::GameMap *map) {
 			SPADES_MARK_FUNCTION_DEBUG();
 			if (map != this->map.GetPointerOrNull()) {
@@ -178,6 +337,29 @@ namespace spades {
 			           z + RayLength);
 		}
 
+		void GLAmbientShadowRenderer::GameMapColumnChanged(int x, int y, uint64_t mask,
+		                                                   client::GameMap *map) {
+			SPADES_MARK_FUNCTION_DEBUG();
+			if (map != this->map.GetPointerOrNull()) {
+				return;
+			}
+
+			while (mask) {
+				int minZ = CountTrailingZeros64(mask);
+				int maxZ = minZ;
+				mask &= mask - 1;
+
+				// Merge the voxels whose invalidated ranges overlap or touch
+				while (mask && CountTrailingZeros64(mask) <= maxZ + RayLength * 2 + 1) {
+					maxZ = CountTrailingZeros64(mask);
+					mask &= mask - 1;
+				}
+
+				Invalidate(x - RayLength, y - RayLength, minZ - RayLength, x + RayLength,
+				           y + RayLength, maxZ + RayLength);
+			}
+		}
+
 		void GLAmbientShadowRenderer::Invalidate(int minX, int minY, int minZ, int maxX, int maxY,
 		                                         int maxZ) {
 			SPADES_MARK_FUNCTION_DEBUG();
@@ -241,12 +423,15 @@ namespace spades {
 		}
 
 		void GLAmbientShadowRenderer::Update() {
-			if (GetNumDirtyChunks() > 0 && (dispatch == NULL || dispatch->done)) {
+			int numDirtyChunks = GetNumDirtyChunks();
+			bool dispatchRunning = dispatch != NULL && !dispatch->done.load();
+			if (numDirtyChunks > 0 && !dispatchRunning) {
 				if (dispatch) {
 					dispatch->Join();
 					delete dispatch;
 				}
-				dispatch = new UpdateDispatch(*this);
+				// The map may be modified while the chunks are being updated
+				dispatch = new UpdateDispatch(*this, map->CreateSnapshot());
 				dispatch->Start();
 			}
 
@@ -267,9 +452,16 @@ namespace spades {
 					                     c.data);
 				}
 			}
+
+			// every chunk was evaluated and the last results were uploaded just now
+			if (convergenceTime < 0.0 && numDirtyChunks == 0 && !dispatchRunning) {
+				convergenceTime = clock.GetTime();
+				SPLog("Ambient occlusion converged in %.2fs after the map was loaded",
+				      convergenceTime);
+			}
 		}
 
-		void GLAmbientShadowRenderer::UpdateDirtyChunks() {
+		void GLAmbientShadowRenderer::UpdateDirtyChunks(const client::GameMapSnapshot &snapshot) {
 			std::array<std::size_t, 256> dirtyChunkIds;
 			std::size_t numDirtyChunks = 0;
 			int nearDirtyChunks = 0;
@@ -311,27 +503,27 @@ namespace spades {
 				}
 			}
 
-			// limit update count per frame
-			for (int i = 0; i < 8; i++) {
-				if (numDirtyChunks <= 0)
-					break;
-				std::size_t idx = SampleRandomInt(std::size_t{0}, numDirtyChunks - 1);
-				Chunk &c = chunks[dirtyChunkIds[idx]];
-
-				// remove from list (fast)
-				if (idx < numDirtyChunks - 1) {
-					std::swap(dirtyChunkIds[idx], dirtyChunkIds[numDirtyChunks - 1]);
-				}
-				numDirtyChunks--;
-
-				UpdateChunk(c.cx, c.cy, c.cz);
+			// visit them in a random order
+			for (std::size_t i = numDirtyChunks; i > 1; i--) {
+				std::swap(dirtyChunkIds[i - 1],
+				          dirtyChunkIds[SampleRandomInt(std::size_t{0}, i - 1)]);
 			}
+
+			// limit update count per frame
+			TaskScheduler &scheduler = TaskScheduler::GetInstance();
+			std::size_t numUpdates = std::min<std::size_t>(
+			  numDirtyChunks, static_cast<std::size_t>(8 * (scheduler.GetNumWorkers() + 1)));
+			ParallelFor(0, static_cast<int>(numUpdates), [&](int i) {
+				Chunk &c = chunks[dirtyChunkIds[i]];
+				UpdateChunk(snapshot, c.cx, c.cy, c.cz);
+			});
 			/*
 			printf("%d (%d near) chunk update left\n",
 			       GetNumDirtyChunks(), nearDirtyChunks);*/
 		}
 
-		void GLAmbientShadowRenderer::UpdateChunk(int cx, int cy, int cz) {
+		void GLAmbientShadowRenderer::UpdateChunk(const client::GameMapSnapshot &snapshot, int cx,
+		                                          int cy, int cz) {
 			Chunk &c = GetChunk(cx, cy, cz);
 			if (!c.dirty)
 				return;
@@ -359,54 +551,83 @@ namespace spades {
 			auto b = [](int i) -> std::uint8_t { return (std::uint8_t)1 << i; };
 			auto to_b = [](bool b, int i) -> std::uint8_t { return (std::uint8_t)b << i; };
 
-			for (int z = wDirtyMinZ; z <= wDirtyMaxZ; z++)
-				for (int y = wDirtyMinY; y <= wDirtyMaxY; y++)
-					for (int x = wDirtyMinX; x <= wDirtyMaxX; x++) {
+			// Cache the solid maps of the columns the rays can reach
+			constexpr int cachePitch = ChunkSize + padding * 2 + RayLength * 2;
+			uint64_t columns[cachePitch][cachePitch];
+			for (int y = 0; y < cachePitch; y++)
+				for (int x = 0; x < cachePitch; x++) {
+					columns[y][x] = snapshot.GetSolidMapWrapped(wOriginX - RayLength + x,
+					                                            wOriginY - RayLength + y);
+				}
+
+			// The voxels of each column to evaluate (if they are inside the map)
+			uint64_t windowMask = 0;
+			for (int z = wDirtyMinZ; z <= wDirtyMaxZ; z++) {
+				int pz = z + wOriginZ;
+				if (pz >= 0 && pz < 64) {
+					windowMask |= 1ULL << pz;
+				}
+			}
+
+			for (int y = wDirtyMinY; y <= wDirtyMaxY; y++)
+				for (int x = wDirtyMinX; x <= wDirtyMaxX; x++) {
+					const uint64_t *column = &columns[y + RayLength][x + RayLength];
+					uint64_t solids = *column;
+
+					// Any of the 26 neighbors is solid
+					uint64_t contacts = 0;
+					for (int dy = -1; dy <= 1; dy++)
+						for (int dx = -1; dx <= 1; dx++) {
+							uint64_t neighbor = column[dy * cachePitch + dx];
+							contacts |= ShiftColumn(neighbor, -1) | ShiftColumn(neighbor, 1);
+							if (dx != 0 || dy != 0) {
+								contacts |= neighbor;
+							}
+						}
+
+					float ao[64];
+					EvaluateColumn(column, cachePitch, windowMask & ~solids, ao);
+
+					for (int z = wDirtyMinZ; z <= wDirtyMaxZ; z++) {
 						IntVector3 pos{
 						  x + wOriginX,
 						  y + wOriginY,
 						  z + wOriginZ,
 						};
 
-						if (map->IsSolidWrapped(pos.x, pos.y, pos.z)) {
-							wData[z][y][x][0] = 0.0;
-							wData[z][y][x][1] = 0.0;
+						bool solid, contact;
+						float value = 0.f;
+						if (pos.z >= 0 && pos.z < 64) {
+							solid = (solids >> pos.z) & 1;
+							contact = (contacts >> pos.z) & 1;
+							if (!solid) {
+								value = ao[pos.z];
+							}
 						} else {
-							wData[z][y][x][0] = Evaluate(pos);
-							wData[z][y][x][1] = 1.0;
+							// Outside the solid maps (the padding of the top and bottom chunks)
+							solid = snapshot.IsSolidWrapped(pos.x, pos.y, pos.z);
+							contact = false;
+							for (int dz = -1; dz <= 1; dz++)
+								for (int dy = -1; dy <= 1; dy++)
+									for (int dx = -1; dx <= 1; dx++) {
+										if (dx == 0 && dy == 0 && dz == 0) {
+											continue;
+										}
+										contact |= snapshot.IsSolidWrapped(
+										  pos.x + dx, pos.y + dy, pos.z + dz);
+									}
+							if (!solid) {
+								value = Evaluate(snapshot, pos);
+							}
 						}
+
+						wData[z][y][x][0] = value;
+						wData[z][y][x][1] = solid ? 0.0f : 1.0f;
 						// bit 0: solids
 						// bit 1: contact (by-surface voxel)
-						wFlags[z][y][x] =
-						  to_b(map->IsSolidWrapped(pos.x, pos.y, pos.z), 0) |
-						  to_b(map->IsSolidWrapped(pos.x - 1, pos.y - 1, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y - 1, pos.z) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y - 1, pos.z + 1) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y, pos.z) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y, pos.z + 1) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y + 1, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y + 1, pos.z) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y + 1, pos.z + 1) |
-						         map->IsSolidWrapped(pos.x - 1, pos.y - 1, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x, pos.y - 1, pos.z) |
-						         map->IsSolidWrapped(pos.x, pos.y - 1, pos.z + 1) |
-						         map->IsSolidWrapped(pos.x, pos.y, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x, pos.y, pos.z + 1) |
-						         map->IsSolidWrapped(pos.x, pos.y + 1, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x, pos.y + 1, pos.z) |
-						         map->IsSolidWrapped(pos.x, pos.y + 1, pos.z + 1) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y - 1, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y - 1, pos.z) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y - 1, pos.z + 1) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y, pos.z) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y, pos.z + 1) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y + 1, pos.z - 1) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y + 1, pos.z) |
-						         map->IsSolidWrapped(pos.x + 1, pos.y + 1, pos.z + 1),
-						       1);
+						wFlags[z][y][x] = to_b(solid, 0) | to_b(contact, 1);
 					}
+				}
 
 			// The AO terms are sampled 0.5 blocks away from the terrain surface,
 			// which leads to under-shadowing. Compensate for this effect.
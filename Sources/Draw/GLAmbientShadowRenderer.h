@@ -28,10 +28,12 @@
 #include <Core/Debug.h>
 #include <Core/Math.h>
 #include <Core/RefCountedObject.h>
+#include <Core/Stopwatch.h>
 
 namespace spades {
 	namespace client {
 		class GameMap;
+		class GameMapSnapshot;
 	}
 	namespace draw {
 		class GLRenderer;
@@ -49,6 +51,20 @@ namespace spades {
 			Handle<client::GameMap> map;
 			std::array<Vector3, NumRays> rays;
 
+			/** A voxel visited by a ray, relative to the voxel the ray was cast from. */
+			struct RayStep {
+				int dx, dy, dz;
+				/** The ray's contribution if this voxel is the first solid one. */
+				float brightness;
+			};
+
+			/**
+			 * The voxels visited by each ray of `Evaluate`, in order. The rays are cast from
+			 * voxel centers, so they visit the same sequence of voxels regardless of the
+			 * starting voxel.
+			 */
+			std::array<std::vector<RayStep>, NumRays> rayPaths;
+
 			struct Chunk {
 				int cx, cy, cz;
 				float data[ChunkSize][ChunkSize][ChunkSize][2];
@@ -84,22 +100,54 @@ namespace spades {
 
 			void Invalidate(int minX, int minY, int minZ, int maxX, int maxY, int maxZ);
 
-			void UpdateChunk(int cx, int cy, int cz);
-			void UpdateDirtyChunks();
+			Vector3 GetRayDirection(int i) const;
+			void BuildRayPaths();
+
+			/**
+			 * Evaluates the AO terms of a column of voxels at once, producing the same results
+			 * as `Evaluate`. `column` points to the column's solid map in a cache of columns
+			 * with a row pitch of `pitch`, which must cover `RayLength` columns around it.
+			 * Only the voxels in `mask` are evaluated, and their AO terms are stored in
+			 * `out[z]`.
+			 */
+			void EvaluateColumn(const uint64_t *column, int pitch, uint64_t mask,
+			                    float *out) const;
+
+			void UpdateChunk(const client::GameMapSnapshot &, int cx, int cy, int cz);
+			/**
+			 * Updates up to 8 dirty chunks per task scheduler thread, preferring the ones near
+			 * the camera. The chunks are updated in parallel.
+			 */
+			void UpdateDirtyChunks(const client::GameMapSnapshot &);
 			int GetNumDirtyChunks();
 
 			UpdateDispatch *dispatch;
 
+			/** The time base of `convergenceTime`, started when the map is loaded. */
+			Stopwatch clock;
+			double convergenceTime;
+
 		public:
 			GLAmbientShadowRenderer(GLRenderer &renderer, client::GameMap &map);
 			~GLAmbientShadowRenderer();
 
-			float Evaluate(IntVector3);
+			float Evaluate(const client::GameMapSnapshot &, IntVector3);
 
 			void GameMapChanged(int x, int y, int z, client::GameMap *);
+			/**
+			 * Equivalent to calling `GameMapChanged` for every voxel of the column `(x, y)`
+			 * in `mask`, but invalidates each overlapping range of voxels only once.
+			 */
+			void GameMapColumnChanged(int x, int y, uint64_t mask, client::GameMap *);
 
 			void Update();
 
+			/**
+			 * Returns the time in seconds from the map load until all chunks were evaluated
+			 * and uploaded for the first time, or a negative value if that hasn't happened yet.
+			 */
+			double GetConvergenceTime() const { return convergenceTime; }
+
 			IGLDevice::UInteger GetTexture() { return texture; }
 		};
 	} // namespace draw
@@ -24,6 +24,8 @@
 #include <Client/GameMap.h>
 #include <Core/Bitmap.h>
 #include <Core/Debug.h>
+#include <Core/Math.h>
+#include <Core/TaskScheduler.h>
 
 namespace spades {
 	namespace draw {
@@ -36,7 +38,12 @@ namespace spades {
 			for (int i = 0; i < chunkRows * chunkCols; i++)
 				chunkInvalid.push_back(false);
 
-			Handle<Bitmap> bmp(GenerateBitmap(0, 0, m.Width(), m.Height()), false);
+			auto bmp = Handle<Bitmap>::New(m.Width(), m.Height());
+			uint32_t *pixels = bmp->GetPixels();
+			ParallelFor(
+			  0, m.Height(),
+			  [&](int y) { GenerateRow(0, y, m.Width(), pixels + y * m.Width()); },
+			  ChunkSize);
 			image = renderer.CreateImage(*bmp).Cast<GLImage>();
 
 			image->Bind(IGLDevice::Texture2D);
@@ -47,28 +54,25 @@ namespace spades {
 
 		GLFlatMapRenderer::~GLFlatMapRenderer() {}
 
+		void GLFlatMapRenderer::GenerateRow(int mx, int my, int w, uint32_t *outPixels) {
+			for (int x = 0; x < w; x++) {
+				uint64_t solid = map->GetSolidMapWrapped(mx + x, my);
+				if (!solid) {
+					// shouldn't reach here for valid maps
+					outPixels[x] = 0;
+					continue;
+				}
+				uint32_t col = map->GetColor(mx + x, my, CountTrailingZeros64(solid));
+				outPixels[x] = col | 0xff000000UL;
+			}
+		}
+
 		Bitmap *GLFlatMapRenderer::GenerateBitmap(int mx, int my, int w, int h) {
 			SPADES_MARK_FUNCTION();
 			auto bmp = Handle<Bitmap>::New(w, h);
-			try {
-				uint32_t *pixels = bmp->GetPixels();
-
-				for (int y = 0; y < h; y++) {
-					for (int x = 0; x < w; x++) {
-						int px = mx + x, py = my + y;
-						for (int z = 0; z < 64; z++) {
-							if (map->IsSolid(px, py, z)) {
-								uint32_t col = map->GetColor(px, py, z);
-								col |= 0xff000000UL;
-								*pixels = col;
-								break;
-							}
-						}
-						pixels++;
-					}
-				}
-			} catch (...) {
-				throw;
+			uint32_t *pixels = bmp->GetPixels();
+			for (int y = 0; y < h; y++) {
+				GenerateRow(mx, my + y, w, pixels + y * w);
 			}
 			return std::move(bmp).Unmanage();
 		}
@@ -89,28 +93,35 @@ namespace spades {
 			int chunkId = chunkX + chunkY * chunkCols;
 			SPAssert(chunkId >= 0);
 			SPAssert(chunkId < chunkCols * chunkRows);
-			chunkInvalid[chunkId] = true;
+			if (!chunkInvalid[chunkId]) {
+				chunkInvalid[chunkId] = true;
+				invalidChunks.push_back(chunkId);
+			}
 		}
 
 		void GLFlatMapRenderer::Draw(const AABB2 &dest, const AABB2 &src) {
 			SPADES_MARK_FUNCTION();
 
-			// update chunks
-			for (size_t i = 0; i < chunkInvalid.size(); i++) {
-				if (!chunkInvalid[i])
-					continue;
-				int chunkX = ((int)i) % chunkCols;
-				int chunkY = ((int)i) / chunkCols;
-
-				Handle<Bitmap> bmp(
-				  GenerateBitmap(chunkX * ChunkSize, chunkY * ChunkSize, ChunkSize, ChunkSize),
-				  false);
-				try {
-					image->SubImage(bmp.GetPointerOrNull(), chunkX * ChunkSize, chunkY * ChunkSize);
-				} catch (...) {
-					throw;
+			// update chunks. The pixels are generated in parallel, but the uploads must happen
+			// on this thread.
+			if (!invalidChunks.empty()) {
+				std::vector<Handle<Bitmap>> bitmaps(invalidChunks.size());
+				ParallelFor(0, static_cast<int>(invalidChunks.size()), [&](int i) {
+					int chunkX = invalidChunks[i] % chunkCols;
+					int chunkY = invalidChunks[i] / chunkCols;
+					bitmaps[i] = Handle<Bitmap>(
+					  GenerateBitmap(chunkX * ChunkSize, chunkY * ChunkSize, ChunkSize, ChunkSize),
+					  false);
+				});
+
+				for (std::size_t i = 0; i < invalidChunks.size(); i++) {
+					int chunkX = invalidChunks[i] % chunkCols;
+					int chunkY = invalidChunks[i] / chunkCols;
+					image->SubImage(bitmaps[i].GetPointerOrNull(), chunkX * ChunkSize,
+					                chunkY * ChunkSize);
+					chunkInvalid[invalidChunks[i]] = false;
 				}
-				chunkInvalid[i] = false;
+				invalidChunks.clear();
 			}
 
 			renderer.DrawImage(*image, dest, src);
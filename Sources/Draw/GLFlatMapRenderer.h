@@ -33,8 +33,12 @@ namespace spades {
 	namespace draw {
 		class GLRenderer;
 		class GLImage;
+		/**
+		 * Draws the top view of the map. The image is divided into 32x32 chunks, and only the
+		 * changed chunks are regenerated (in parallel) and uploaded by `Draw`.
+		 */
 		class GLFlatMapRenderer {
-			enum { ChunkSize = 16, ChunkBits = 4 };
+			enum { ChunkSize = 32, ChunkBits = 5 };
 
 			GLRenderer &renderer;
 			Handle<client::GameMap> map;
@@ -44,6 +48,10 @@ namespace spades {
 
 			int chunkCols, chunkRows;
 
+			/** The indices of the chunks with `chunkInvalid` set. */
+			std::vector<int> invalidChunks;
+
+			void GenerateRow(int x, int y, int w, uint32_t *outPixels);
 			Bitmap *GenerateBitmap(int x, int y, int w, int h);
 
 		public:
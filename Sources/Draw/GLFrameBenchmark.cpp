@@ -0,0 +1,184 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <cstdio>
+
+#include "BenchmarkScene.h"
+#include "GLAmbientShadowRenderer.h"
+#include "GLFrameBenchmark.h"
+#include "GLHeadlessDevice.h"
+#include "GLMapChunk.h"
+#include "GLMapRenderer.h"
+#include "GLRadiosityRenderer.h"
+#include "GLRenderer.h"
+#include "GLSettings.h"
+#include <Client/GameMap.h>
+#include <Client/GameMapSnapshot.h>
+#include <Core/Debug.h>
+#include <Core/Exception.h>
+#include <Core/Stopwatch.h>
+
+namespace spades {
+	namespace draw {
+		namespace GLFrameBenchmark {
+			namespace {
+				void PrintMeshStatistics(const char *name,
+				                         const GLMapChunk::MeshStatistics &stats) {
+					printf("  %-14s %6zu chunks, %9zu vertices, %9zu indices, %8.1fMB\n", name,
+					       stats.numChunks, stats.numVertices, stats.numIndices,
+					       stats.numBytes / 1048576.0);
+				}
+
+				int RunInner(const Options &options) {
+					if (options.numFrames <= 0) {
+						SPRaise("The number of frames must be positive");
+					}
+
+					BenchmarkScene scene(options.scriptPath);
+
+					Stopwatch sw;
+					Handle<client::GameMap> map = LoadBenchmarkMap(options.mapPath);
+					double mapLoadTime = sw.GetTime();
+
+					auto device = Handle<GLHeadlessDevice>::New(options.width, options.height);
+					auto renderer = Handle<GLRenderer>::New(device.Cast<IGLDevice>());
+					renderer->Init();
+
+					sw.Reset();
+					renderer->SetGameMap(*map);
+					double rendererSetupTime = sw.GetTime();
+
+					scene.Register(*renderer);
+
+					// Don't count the uploads made while loading
+					device->ResetStatistics();
+
+					BenchmarkSamples total{"Total"}, drawCalls{"Draw calls"},
+					  vertices{"Vertices"}, stateChanges{"State changes"},
+					  uniformUpdates{"Uniforms"}, bufferUploads{"Buffer uploads"},
+					  bufferBytes{"Buffer bytes"}, textureUploads{"Tex uploads"},
+					  textureBytes{"Tex bytes"};
+
+					for (int frame = 0; frame < options.numFrames; frame++) {
+						float t = options.numFrames > 1
+						            ? static_cast<float>(frame) / (options.numFrames - 1)
+						            : 0.f;
+						client::SceneDefinition def =
+						  scene.MakeSceneDefinition(t, options.width, options.height);
+						def.time = static_cast<unsigned int>(frame * 1000 / 60);
+
+						sw.Reset();
+						scene.Render(*renderer, def, *map);
+						renderer->Flip();
+						total.samples.push_back(sw.GetTime());
+
+						const GLHeadlessDevice::FrameStatistics &stats =
+						  device->GetLastFrameStatistics();
+						drawCalls.samples.push_back(static_cast<double>(stats.drawCalls));
+						vertices.samples.push_back(static_cast<double>(stats.vertices));
+						stateChanges.samples.push_back(static_cast<double>(stats.stateChanges));
+						uniformUpdates.samples.push_back(
+						  static_cast<double>(stats.uniformUpdates));
+						bufferUploads.samples.push_back(static_cast<double>(stats.bufferUploads));
+						bufferBytes.samples.push_back(
+						  static_cast<double>(stats.bufferUploadBytes));
+						textureUploads.samples.push_back(
+						  static_cast<double>(stats.textureUploads));
+						textureBytes.samples.push_back(
+						  static_cast<double>(stats.textureUploadBytes));
+					}
+
+					printf("OpenGL renderer frame benchmark (headless device)\n");
+					printf("  Map:            %s (loaded in %.1fms, renderer set up in %.1fms)\n",
+					       options.mapPath.c_str(), mapLoadTime * 1000.0,
+					       rendererSetupTime * 1000.0);
+					printf("  Script:         %s\n", options.scriptPath.c_str());
+					printf("  Frames:         %d at %dx%d\n", options.numFrames, options.width,
+					       options.height);
+					printf("  Memory:         %.1fMB in buffers, %.1fMB in textures\n",
+					       device->GetBufferMemoryUsage() / 1048576.0,
+					       device->GetTextureMemoryUsage() / 1048576.0);
+					if (GLRadiosityRenderer *radiosity = renderer->GetRadiosityRenderer()) {
+						if (radiosity->GetConvergenceTime() >= 0.0) {
+							printf("  Radiosity:      converged in %.2fs after the map load\n",
+							       radiosity->GetConvergenceTime());
+						} else {
+							printf("  Radiosity:      didn't converge\n");
+						}
+					}
+					if (GLAmbientShadowRenderer *ao = renderer->GetAmbientShadowRenderer()) {
+						if (ao->GetConvergenceTime() >= 0.0) {
+							printf("  Ambient occl.:  converged in %.2fs after the map load\n",
+							       ao->GetConvergenceTime());
+						} else {
+							printf("  Ambient occl.:  didn't converge\n");
+						}
+					}
+					total.Print();
+					printf("Per frame:\n");
+					drawCalls.Print(1.0, "");
+					vertices.Print(1.0, "");
+					stateChanges.Print(1.0, "");
+					uniformUpdates.Print(1.0, "");
+					bufferUploads.Print(1.0, "");
+					bufferBytes.Print(1.0 / 1024.0, "KB");
+					textureUploads.Print(1.0, "");
+					textureBytes.Print(1.0 / 1024.0, "KB");
+
+					printf("Map meshes (realized chunks, %s):\n",
+					       renderer->GetSettings().r_mapGreedyMeshing ? "greedy" : "per-face");
+					PrintMeshStatistics("Current",
+					                    renderer->GetMapRenderer()->GetMeshStatistics());
+
+					// Compare the meshing modes over the whole map
+					Handle<client::GameMapSnapshot> snapshot = map->CreateSnapshot();
+					bool water = renderer->GetSettings().r_water;
+					printf("Map meshes (whole map):\n");
+					sw.Reset();
+					GLMapChunk::MeshStatistics perFace =
+					  GLMapChunk::MeasureMap(snapshot, water, false);
+					double perFaceTime = sw.GetTime();
+					sw.Reset();
+					GLMapChunk::MeshStatistics greedy =
+					  GLMapChunk::MeasureMap(snapshot, water, true);
+					double greedyTime = sw.GetTime();
+					PrintMeshStatistics("Per-face", perFace);
+					PrintMeshStatistics("Greedy", greedy);
+					printf("  Meshed in %.1fms (per-face) and %.1fms (greedy)\n",
+					       perFaceTime * 1000.0, greedyTime * 1000.0);
+
+					renderer->Shutdown();
+					return 0;
+				}
+			} // namespace
+
+			int Run(const Options &options) {
+				SPADES_MARK_FUNCTION();
+
+				try {
+					return RunInner(options);
+				} catch (const std::exception &ex) {
+					fprintf(stderr, "OpenGL renderer frame benchmark failed: %s\n", ex.what());
+					return 1;
+				}
+			}
+		} // namespace GLFrameBenchmark
+	} // namespace draw
+} // namespace spades
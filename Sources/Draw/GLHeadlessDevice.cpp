@@ -0,0 +1,507 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <cstring>
+
+#include "GLHeadlessDevice.h"
+#include <Core/Debug.h>
+#include <Core/Exception.h>
+
+namespace spades {
+	namespace draw {
+		namespace {
+			/** Returns the size of a pixel in client memory, or zero if unknown. */
+			std::size_t GetPixelSize(IGLDevice::Enum format, IGLDevice::Enum type) {
+				std::size_t components;
+				switch (format) {
+					case IGLDevice::Red:
+					case IGLDevice::DepthComponent:
+					case IGLDevice::StencilIndex: components = 1; break;
+					case IGLDevice::RG: components = 2; break;
+					case IGLDevice::RGB: components = 3; break;
+					case IGLDevice::RGBA:
+					case IGLDevice::BGRA: components = 4; break;
+					default: return 0;
+				}
+				switch (type) {
+					case IGLDevice::Byte:
+					case IGLDevice::UnsignedByte: return components;
+					case IGLDevice::Short:
+					case IGLDevice::UnsignedShort: return components * 2;
+					case IGLDevice::Int:
+					case IGLDevice::UnsignedInt:
+					case IGLDevice::FloatType: return components * 4;
+					case IGLDevice::UnsignedShort5551:
+					case IGLDevice::UnsignedShort1555Rev: return 2;
+					case IGLDevice::UnsignedInt2101010Rev: return 4;
+					default: return 0;
+				}
+			}
+		} // namespace
+
+		GLHeadlessDevice::GLHeadlessDevice(Integer width, Integer height)
+		    : width(width), height(height), textureUnits(1) {
+			SPADES_MARK_FUNCTION();
+			if (width <= 0 || height <= 0) {
+				SPInvalidArgument("width");
+			}
+		}
+
+		GLHeadlessDevice::~GLHeadlessDevice() {}
+
+		std::size_t GLHeadlessDevice::GetBufferMemoryUsage() const {
+			std::size_t size = 0;
+			for (const auto &buffer : buffers) {
+				size += buffer.second.size();
+			}
+			return size;
+		}
+
+		std::size_t GLHeadlessDevice::GetTextureMemoryUsage() const {
+			std::size_t size = 0;
+			for (const auto &texture : textures) {
+				size += texture.second.data.size();
+			}
+			return size;
+		}
+
+		std::vector<std::uint8_t> *GLHeadlessDevice::GetBoundBuffer(Enum target) {
+			auto it = buffers.find(boundBuffers[target]);
+			if (it == buffers.end()) {
+				SPRaise("No buffer is bound to the target %d", static_cast<int>(target));
+			}
+			return &it->second;
+		}
+
+		GLHeadlessDevice::Texture *GLHeadlessDevice::GetBoundTexture(Enum target) {
+			auto it = textures.find(textureUnits[activeTextureUnit][target]);
+			if (it == textures.end()) {
+				SPRaise("No texture is bound to the target %d", static_cast<int>(target));
+			}
+			return &it->second;
+		}
+
+		void GLHeadlessDevice::UploadTexture(Enum target, Integer level, Enum internalFormat,
+		                                     Sizei width, Sizei height, Sizei depth, Enum format,
+		                                     Enum type, const void *data) {
+			SPADES_MARK_FUNCTION_DEBUG();
+			(void)internalFormat;
+
+			Texture &texture = *GetBoundTexture(target);
+			std::size_t pixelSize = GetPixelSize(format, type);
+			std::size_t size = std::size_t(width) * height * depth * pixelSize;
+
+			if (data) {
+				currentFrame.textureUploads++;
+				currentFrame.textureUploadBytes += size;
+			}
+
+			// Mipmaps are only counted
+			if (level != 0) {
+				return;
+			}
+
+			texture.target = target;
+			texture.width = width;
+			texture.height = height;
+			texture.depth = depth;
+			texture.texelSize = pixelSize;
+			texture.data.assign(size, 0);
+			if (data) {
+				std::memcpy(texture.data.data(), data, size);
+			}
+		}
+
+		void GLHeadlessDevice::UpdateTexture(Enum target, Integer level, Integer x, Integer y,
+		                                     Integer z, Sizei width, Sizei height, Sizei depth,
+		                                     Enum format, Enum type, const void *data) {
+			SPADES_MARK_FUNCTION_DEBUG();
+
+			Texture &texture = *GetBoundTexture(target);
+			std::size_t pixelSize = GetPixelSize(format, type);
+
+			currentFrame.textureUploads++;
+			currentFrame.textureUploadBytes += std::size_t(width) * height * depth * pixelSize;
+
+			if (level != 0) {
+				return;
+			}
+			if (x < 0 || y < 0 || z < 0 || x + width > texture.width ||
+			    y + height > texture.height || z + depth > texture.depth) {
+				SPRaise("The region (%d, %d, %d)-(%d, %d, %d) is outside the texture",
+				        static_cast<int>(x), static_cast<int>(y), static_cast<int>(z),
+				        static_cast<int>(x + width), static_cast<int>(y + height),
+				        static_cast<int>(z + depth));
+			}
+
+			// Conversion between formats isn't emulated
+			if (pixelSize == 0 || pixelSize != texture.texelSize) {
+				return;
+			}
+
+			const auto *src = reinterpret_cast<const std::uint8_t *>(data);
+			std::size_t rowSize = width * pixelSize;
+			for (Sizei layer = 0; layer < depth; layer++) {
+				for (Sizei row = 0; row < height; row++) {
+					std::size_t offset =
+					  ((std::size_t(z + layer) * texture.height + y + row) * texture.width + x) *
+					  pixelSize;
+					std::memcpy(texture.data.data() + offset, src, rowSize);
+					src += rowSize;
+				}
+			}
+		}
+
+		void GLHeadlessDevice::Draw(Sizei count, Sizei instances) {
+			currentFrame.drawCalls++;
+			currentFrame.vertices += std::uint64_t(count) * instances;
+		}
+
+		void GLHeadlessDevice::DepthRange(Float, Float) { StateChange(); }
+		void GLHeadlessDevice::Viewport(Integer, Integer, Sizei, Sizei) { StateChange(); }
+
+		void GLHeadlessDevice::ClearDepth(Float) { StateChange(); }
+		void GLHeadlessDevice::ClearColor(Float, Float, Float, Float) { StateChange(); }
+		void GLHeadlessDevice::Clear(Enum) {}
+
+		void GLHeadlessDevice::DepthMask(bool) { StateChange(); }
+		void GLHeadlessDevice::ColorMask(bool, bool, bool, bool) { StateChange(); }
+
+		void GLHeadlessDevice::Finish() {}
+		void GLHeadlessDevice::Flush() {}
+
+		void GLHeadlessDevice::FrontFace(Enum) { StateChange(); }
+		void GLHeadlessDevice::Enable(Enum, bool) { StateChange(); }
+
+		const char *GLHeadlessDevice::GetString(Enum type) {
+			SPADES_MARK_FUNCTION();
+			switch (type) {
+				case Vendor: return "OpenSpades";
+				case Renderer: return "Headless";
+				case Version: return "3.3.0 Headless";
+				case ShadingLanguageVersion: return "3.30";
+				default: SPInvalidEnum("type", type);
+			}
+		}
+
+		const char *GLHeadlessDevice::GetIndexedString(Enum type, UInteger) {
+			SPADES_MARK_FUNCTION();
+			switch (type) {
+				// No extensions are supported. `glGetStringi` returns `NULL` for an index out of
+				// range.
+				case Extensions: return nullptr;
+				default: SPInvalidEnum("type", type);
+			}
+		}
+
+		IGLDevice::Integer GLHeadlessDevice::GetInteger(Enum type) {
+			SPADES_MARK_FUNCTION();
+			switch (type) {
+				case FramebufferBinding: return static_cast<Integer>(drawFramebuffer);
+				default: SPInvalidEnum("type", type);
+			}
+		}
+
+		void GLHeadlessDevice::BlendEquation(Enum) { StateChange(); }
+		void GLHeadlessDevice::BlendEquation(Enum, Enum) { StateChange(); }
+		void GLHeadlessDevice::BlendFunc(Enum, Enum) { StateChange(); }
+		void GLHeadlessDevice::BlendFunc(Enum, Enum, Enum, Enum) { StateChange(); }
+		void GLHeadlessDevice::BlendColor(Float, Float, Float, Float) { StateChange(); }
+		void GLHeadlessDevice::DepthFunc(Enum) { StateChange(); }
+		void GLHeadlessDevice::LineWidth(Float) { StateChange(); }
+
+		IGLDevice::UInteger GLHeadlessDevice::GenBuffer() {
+			UInteger name = nextName++;
+			buffers[name];
+			return name;
+		}
+
+		void GLHeadlessDevice::DeleteBuffer(UInteger name) {
+			buffers.erase(name);
+			for (auto &binding : boundBuffers) {
+				if (binding.second == name) {
+					binding.second = 0;
+				}
+			}
+		}
+
+		void GLHeadlessDevice::BindBuffer(Enum target, UInteger name) {
+			StateChange();
+			boundBuffers[target] = name;
+		}
+
+		void GLHeadlessDevice::BufferData(Enum target, Sizei size, const void *data, Enum) {
+			SPADES_MARK_FUNCTION_DEBUG();
+			std::vector<std::uint8_t> &buffer = *GetBoundBuffer(target);
+			buffer.assign(size, 0);
+			if (data) {
+				std::memcpy(buffer.data(), data, size);
+				currentFrame.bufferUploads++;
+				currentFrame.bufferUploadBytes += size;
+			}
+		}
+
+		void GLHeadlessDevice::BufferSubData(Enum target, Sizei offset, Sizei size,
+		                                     const void *data) {
+			SPADES_MARK_FUNCTION_DEBUG();
+			std::vector<std::uint8_t> &buffer = *GetBoundBuffer(target);
+			if (std::size_t(offset) + size > buffer.size()) {
+				SPRaise("The range [%u, %u) is outside the buffer of %u bytes", offset,
+				        offset + size, static_cast<unsigned int>(buffer.size()));
+			}
+			std::memcpy(buffer.data() + offset, data, size);
+			currentFrame.bufferUploads++;
+			currentFrame.bufferUploadBytes += size;
+		}
+
+		IGLDevice::UInteger GLHeadlessDevice::GenQuery() { return nextName++; }
+		void GLHeadlessDevice::DeleteQuery(UInteger) {}
+		void GLHeadlessDevice::BeginQuery(Enum, UInteger) {}
+		void GLHeadlessDevice::EndQuery(Enum) {}
+
+		IGLDevice::UInteger GLHeadlessDevice::GetQueryObjectUInteger(UInteger, Enum pname) {
+			// The result is always available (and always zero)
+			return pname == QueryResultAvailable ? 1 : 0;
+		}
+
+		IGLDevice::UInteger64 GLHeadlessDevice::GetQueryObjectUInteger64(UInteger, Enum pname) {
+			return pname == QueryResultAvailable ? 1 : 0;
+		}
+
+		void GLHeadlessDevice::BeginConditionalRender(UInteger, Enum) {}
+		void GLHeadlessDevice::EndConditionalRender() {}
+
+		void *GLHeadlessDevice::MapBuffer(Enum target, Enum access) {
+			SPADES_MARK_FUNCTION_DEBUG();
+			std::vector<std::uint8_t> &buffer = *GetBoundBuffer(target);
+			if (access != ReadOnly) {
+				// Assume the client rewrites the whole buffer
+				currentFrame.bufferUploads++;
+				currentFrame.bufferUploadBytes += buffer.size();
+			}
+			return buffer.data();
+		}
+
+		void GLHeadlessDevice::UnmapBuffer(Enum) {}
+
+		IGLDevice::UInteger GLHeadlessDevice::GenTexture() {
+			UInteger name = nextName++;
+			textures[name];
+			return name;
+		}
+
+		void GLHeadlessDevice::DeleteTexture(UInteger name) {
+			textures.erase(name);
+			for (auto &unit : textureUnits) {
+				for (auto &binding : unit) {
+					if (binding.second == name) {
+						binding.second = 0;
+					}
+				}
+			}
+		}
+
+		void GLHeadlessDevice::ActiveTexture(UInteger stage) {
+			StateChange();
+			activeTextureUnit = stage;
+			if (stage >= textureUnits.size()) {
+				textureUnits.resize(stage + 1);
+			}
+		}
+
+		void GLHeadlessDevice::BindTexture(Enum target, UInteger name) {
+			StateChange();
+			textureUnits[activeTextureUnit][target] = name;
+		}
+
+		void GLHeadlessDevice::TexParamater(Enum, Enum, Enum) { StateChange(); }
+		void GLHeadlessDevice::TexParamater(Enum, Enum, float) { StateChange(); }
+
+		void GLHeadlessDevice::TexImage2D(Enum target, Integer level, Enum internalFormat,
+		                                  Sizei width, Sizei height, Integer, Enum format,
+		                                  Enum type, const void *data) {
+			UploadTexture(target, level, internalFormat, width, height, 1, format, type, data);
+		}
+
+		void GLHeadlessDevice::TexImage3D(Enum target, Integer level, Enum internalFormat,
+		                                  Sizei width, Sizei height, Sizei depth, Integer,
+		                                  Enum format, Enum type, const void *data) {
+			UploadTexture(target, level, internalFormat, width, height, depth, format, type,
+			              data);
+		}
+
+		void GLHeadlessDevice::TexSubImage2D(Enum target, Integer level, Integer x, Integer y,
+		                                     Sizei width, Sizei height, Enum format, Enum type,
+		                                     const void *data) {
+			UpdateTexture(target, level, x, y, 0, width, height, 1, format, type, data);
+		}
+
+		void GLHeadlessDevice::TexSubImage3D(Enum target, Integer level, Integer x, Integer y,
+		                                     Integer z, Sizei width, Sizei height, Sizei depth,
+		                                     Enum format, Enum type, const void *data) {
+			UpdateTexture(target, level, x, y, z, width, height, depth, format, type, data);
+		}
+
+		void GLHeadlessDevice::CopyTexSubImage2D(Enum, Integer, Integer, Integer, Integer,
+		                                         Integer, Sizei, Sizei) {}
+		void GLHeadlessDevice::GenerateMipmap(Enum) {}
+
+		void GLHeadlessDevice::VertexAttrib(UInteger, Float) { StateChange(); }
+		void GLHeadlessDevice::VertexAttrib(UInteger, Float, Float) { StateChange(); }
+		void GLHeadlessDevice::VertexAttrib(UInteger, Float, Float, Float) { StateChange(); }
+		void GLHeadlessDevice::VertexAttrib(UInteger, Float, Float, Float, Float) {
+			StateChange();
+		}
+
+		void GLHeadlessDevice::VertexAttribPointer(UInteger, Integer, Enum, bool, Sizei,
+		                                           const void *) {
+			StateChange();
+		}
+		void GLHeadlessDevice::VertexAttribIPointer(UInteger, Integer, Enum, Sizei,
+		                                            const void *) {
+			StateChange();
+		}
+		void GLHeadlessDevice::EnableVertexAttribArray(UInteger, bool) { StateChange(); }
+		void GLHeadlessDevice::VertexAttribDivisor(UInteger, UInteger) { StateChange(); }
+
+		void GLHeadlessDevice::DrawArrays(Enum, Integer, Sizei count) { Draw(count, 1); }
+		void GLHeadlessDevice::DrawElements(Enum, Sizei count, Enum, const void *) {
+			Draw(count, 1);
+		}
+		void GLHeadlessDevice::DrawArraysInstanced(Enum, Integer, Sizei count, Sizei instances) {
+			Draw(count, instances);
+		}
+		void GLHeadlessDevice::DrawElementsInstanced(Enum, Sizei count, Enum, const void *,
+		                                             Sizei instances) {
+			Draw(count, instances);
+		}
+
+		IGLDevice::UInteger GLHeadlessDevice::CreateShader(Enum) { return nextName++; }
+		void GLHeadlessDevice::ShaderSource(UInteger, Sizei, const char **, const int *) {}
+		void GLHeadlessDevice::CompileShader(UInteger) {}
+		void GLHeadlessDevice::DeleteShader(UInteger) {}
+
+		IGLDevice::Integer GLHeadlessDevice::GetShaderInteger(UInteger, Enum param) {
+			return param == CompileStatus ? 1 : 0;
+		}
+
+		void GLHeadlessDevice::GetShaderInfoLog(UInteger, Sizei bufferSize, Sizei *length,
+		                                        char *outString) {
+			if (bufferSize > 0) {
+				outString[0] = 0;
+			}
+			if (length) {
+				*length = 0;
+			}
+		}
+
+		IGLDevice::Integer GLHeadlessDevice::GetProgramInteger(UInteger, Enum param) {
+			return param == LinkStatus || param == ValidateStatus ? 1 : 0;
+		}
+
+		void GLHeadlessDevice::GetProgramInfoLog(UInteger, Sizei bufferSize, Sizei *length,
+		                                         char *outString) {
+			if (bufferSize > 0) {
+				outString[0] = 0;
+			}
+			if (length) {
+				*length = 0;
+			}
+		}
+
+		IGLDevice::UInteger GLHeadlessDevice::CreateProgram() { return nextName++; }
+		void GLHeadlessDevice::AttachShader(UInteger, UInteger) {}
+		void GLHeadlessDevice::DetachShader(UInteger, UInteger) {}
+		void GLHeadlessDevice::LinkProgram(UInteger) {}
+		void GLHeadlessDevice::UseProgram(UInteger) { StateChange(); }
+		void GLHeadlessDevice::DeleteProgram(UInteger) {}
+		void GLHeadlessDevice::ValidateProgram(UInteger) {}
+
+		IGLDevice::Integer GLHeadlessDevice::GetAttribLocation(UInteger, const char *name) {
+			return locations.emplace(name, static_cast<Integer>(locations.size())).first->second;
+		}
+
+		void GLHeadlessDevice::BindAttribLocation(UInteger, UInteger, const char *) {}
+
+		IGLDevice::Integer GLHeadlessDevice::GetUniformLocation(UInteger, const char *name) {
+			return locations.emplace(name, static_cast<Integer>(locations.size())).first->second;
+		}
+
+		void GLHeadlessDevice::Uniform(Integer, Float) { UniformUpdate(); }
+		void GLHeadlessDevice::Uniform(Integer, Float, Float) { UniformUpdate(); }
+		void GLHeadlessDevice::Uniform(Integer, Float, Float, Float) { UniformUpdate(); }
+		void GLHeadlessDevice::Uniform(Integer, Float, Float, Float, Float) { UniformUpdate(); }
+		void GLHeadlessDevice::Uniform(Integer, Integer) { UniformUpdate(); }
+		void GLHeadlessDevice::Uniform(Integer, Integer, Integer) { UniformUpdate(); }
+		void GLHeadlessDevice::Uniform(Integer, Integer, Integer, Integer) { UniformUpdate(); }
+		void GLHeadlessDevice::Uniform(Integer, Integer, Integer, Integer, Integer) {
+			UniformUpdate();
+		}
+		void GLHeadlessDevice::Uniform(Integer, bool, const Matrix4 &) { UniformUpdate(); }
+
+		IGLDevice::UInteger GLHeadlessDevice::GenRenderbuffer() { return nextName++; }
+		void GLHeadlessDevice::DeleteRenderbuffer(UInteger) {}
+		void GLHeadlessDevice::BindRenderbuffer(Enum, UInteger) { StateChange(); }
+		void GLHeadlessDevice::RenderbufferStorage(Enum, Enum, Sizei, Sizei) {}
+		void GLHeadlessDevice::RenderbufferStorage(Enum, Sizei, Enum, Sizei, Sizei) {}
+
+		IGLDevice::UInteger GLHeadlessDevice::GenFramebuffer() { return nextName++; }
+
+		void GLHeadlessDevice::BindFramebuffer(Enum target, UInteger framebuffer) {
+			StateChange();
+			if (target == Framebuffer || target == DrawFramebuffer) {
+				drawFramebuffer = framebuffer;
+			}
+		}
+
+		void GLHeadlessDevice::DeleteFramebuffer(UInteger framebuffer) {
+			if (drawFramebuffer == framebuffer) {
+				drawFramebuffer = 0;
+			}
+		}
+
+		void GLHeadlessDevice::FramebufferTexture2D(Enum, Enum, Enum, UInteger, Integer) {}
+		void GLHeadlessDevice::FramebufferRenderbuffer(Enum, Enum, Enum, UInteger) {}
+		void GLHeadlessDevice::BlitFramebuffer(Integer, Integer, Integer, Integer, Integer,
+		                                       Integer, Integer, Integer, UInteger, Enum) {}
+
+		IGLDevice::Enum GLHeadlessDevice::CheckFramebufferStatus(Enum) {
+			return FramebufferComplete;
+		}
+
+		void GLHeadlessDevice::ReadPixels(Integer, Integer, Sizei width, Sizei height,
+		                                  Enum format, Enum type, void *data) {
+			SPADES_MARK_FUNCTION();
+			std::size_t pixelSize = GetPixelSize(format, type);
+			if (pixelSize == 0) {
+				SPInvalidEnum("format", format);
+			}
+			std::memset(data, 0, std::size_t(width) * height * pixelSize);
+		}
+
+		IGLDevice::Integer GLHeadlessDevice::ScreenWidth() { return width; }
+		IGLDevice::Integer GLHeadlessDevice::ScreenHeight() { return height; }
+
+		void GLHeadlessDevice::Swap() {
+			lastFrame = currentFrame;
+			currentFrame = FrameStatistics();
+		}
+	} // namespace draw
+} // namespace spades
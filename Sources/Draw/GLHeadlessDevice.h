@@ -0,0 +1,273 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "IGLDevice.h"
+
+namespace spades {
+	namespace draw {
+		/**
+		 * An `IGLDevice` that doesn't talk to a GPU. Every call succeeds: shaders compile,
+		 * programs link and framebuffers are complete. Buffers and the base level of textures
+		 * are kept in memory, but nothing is ever rasterized, so `ReadPixels` returns zeros.
+		 *
+		 * Used to run and profile the CPU side of `GLRenderer` on machines without a GPU
+		 * (see `GLFrameBenchmark`). It also counts the calls made in each frame.
+		 */
+		class GLHeadlessDevice : public IGLDevice {
+		public:
+			/** The calls made between two `Swap`s. */
+			struct FrameStatistics {
+				/** `DrawArrays` and `DrawElements`, including the instanced variants. */
+				std::uint64_t drawCalls = 0;
+				/** The number of vertices drawn, multiplied by the number of instances. */
+				std::uint64_t vertices = 0;
+				/**
+				 * Calls that change the pipeline state (bindings, capabilities, blending,
+				 * vertex attribute setup, ...). Redundant calls are counted as well.
+				 */
+				std::uint64_t stateChanges = 0;
+				std::uint64_t uniformUpdates = 0;
+				/** `BufferData` with data and `BufferSubData`. */
+				std::uint64_t bufferUploads = 0;
+				std::uint64_t bufferUploadBytes = 0;
+				/** `TexImage*` with data and `TexSubImage*`. */
+				std::uint64_t textureUploads = 0;
+				std::uint64_t textureUploadBytes = 0;
+			};
+
+		private:
+			struct Texture {
+				Enum target;
+				Sizei width = 0, height = 0, depth = 0;
+				/** The size of a texel in `data`. Zero if the format is unknown. */
+				std::size_t texelSize = 0;
+				std::vector<std::uint8_t> data;
+			};
+
+			Integer width, height;
+
+			/** Shared by all kinds of objects, so a stale name is never reused. */
+			UInteger nextName = 1;
+
+			std::unordered_map<UInteger, std::vector<std::uint8_t>> buffers;
+			std::map<Enum, UInteger> boundBuffers;
+
+			std::unordered_map<UInteger, Texture> textures;
+			/** The texture bound to each target of each texture unit. */
+			std::vector<std::map<Enum, UInteger>> textureUnits;
+			UInteger activeTextureUnit = 0;
+
+			UInteger drawFramebuffer = 0;
+
+			/** Uniform and attribute locations, shared by all programs. */
+			std::unordered_map<std::string, Integer> locations;
+
+			FrameStatistics currentFrame;
+			FrameStatistics lastFrame;
+
+			std::vector<std::uint8_t> *GetBoundBuffer(Enum target);
+			Texture *GetBoundTexture(Enum target);
+			void UploadTexture(Enum target, Integer level, Enum internalFormat, Sizei width,
+			                   Sizei height, Sizei depth, Enum format, Enum type, const void *data);
+			void UpdateTexture(Enum target, Integer level, Integer x, Integer y, Integer z,
+			                   Sizei width, Sizei height, Sizei depth, Enum format, Enum type,
+			                   const void *data);
+			void Draw(Sizei count, Sizei instances);
+			void StateChange() { currentFrame.stateChanges++; }
+			void UniformUpdate() { currentFrame.uniformUpdates++; }
+
+		protected:
+			~GLHeadlessDevice();
+
+		public:
+			GLHeadlessDevice(Integer width, Integer height);
+
+			/** The statistics of the last frame completed by `Swap`. */
+			const FrameStatistics &GetLastFrameStatistics() const { return lastFrame; }
+			/** Discards the calls counted since the last `Swap` (e.g., the loading time). */
+			void ResetStatistics() { currentFrame = FrameStatistics(); }
+
+			/** The number of bytes held by the buffers. */
+			std::size_t GetBufferMemoryUsage() const;
+			/** The number of bytes held by the textures. */
+			std::size_t GetTextureMemoryUsage() const;
+
+			void DepthRange(Float near, Float far) override;
+			void Viewport(Integer x, Integer y, Sizei width, Sizei height) override;
+
+			void ClearDepth(Float) override;
+			void ClearColor(Float, Float, Float, Float) override;
+			void Clear(Enum) override;
+
+			void DepthMask(bool) override;
+			void ColorMask(bool r, bool g, bool b, bool a) override;
+
+			void Finish() override;
+			void Flush() override;
+
+			void FrontFace(Enum) override;
+			void Enable(Enum state, bool) override;
+
+			const char *GetString(Enum type) override;
+			const char *GetIndexedString(Enum type, UInteger) override;
+
+			Integer GetInteger(Enum type) override;
+
+			void BlendEquation(Enum mode) override;
+			void BlendEquation(Enum rgb, Enum alpha) override;
+			void BlendFunc(Enum src, Enum dest) override;
+			void BlendFunc(Enum srcRgb, Enum destRgb, Enum srcAlpha, Enum destAlpha) override;
+			void BlendColor(Float r, Float g, Float b, Float a) override;
+			void DepthFunc(Enum) override;
+			void LineWidth(Float) override;
+
+			UInteger GenBuffer() override;
+			void DeleteBuffer(UInteger) override;
+			void BindBuffer(Enum, UInteger) override;
+
+			void BufferData(Enum target, Sizei size, const void *data, Enum usage) override;
+			void BufferSubData(Enum target, Sizei offset, Sizei size, const void *data) override;
+
+			UInteger GenQuery() override;
+			void DeleteQuery(UInteger) override;
+			void BeginQuery(Enum target, UInteger query) override;
+			void EndQuery(Enum target) override;
+			UInteger GetQueryObjectUInteger(UInteger query, Enum pname) override;
+			UInteger64 GetQueryObjectUInteger64(UInteger query, Enum pname) override;
+			void BeginConditionalRender(UInteger query, Enum mode) override;
+			void EndConditionalRender() override;
+
+			void *MapBuffer(Enum target, Enum access) override;
+			void UnmapBuffer(Enum target) override;
+
+			UInteger GenTexture() override;
+			void DeleteTexture(UInteger) override;
+
+			void ActiveTexture(UInteger stage) override;
+			void BindTexture(Enum, UInteger) override;
+			void TexParamater(Enum target, Enum paramater, Enum value) override;
+			void TexParamater(Enum target, Enum paramater, float value) override;
+			void TexImage2D(Enum target, Integer level, Enum internalFormat, Sizei width,
+			                Sizei height, Integer border, Enum format, Enum type,
+			                const void *data) override;
+			void TexImage3D(Enum target, Integer level, Enum internalFormat, Sizei width,
+			                Sizei height, Sizei depth, Integer border, Enum format,
+			                Enum type, const void *data) override;
+			void TexSubImage2D(Enum target, Integer level, Integer x, Integer y,
+			                   Sizei width, Sizei height, Enum format, Enum type,
+			                   const void *data) override;
+			void TexSubImage3D(Enum target, Integer level, Integer x, Integer y, Integer z,
+			                   Sizei width, Sizei height, Sizei depth, Enum format,
+			                   Enum type, const void *data) override;
+			void CopyTexSubImage2D(Enum target, Integer level, Integer destinationX,
+			                       Integer destinationY, Integer srcX, Integer srcY,
+			                       Sizei width, Sizei height) override;
+			void GenerateMipmap(Enum target) override;
+
+			void VertexAttrib(UInteger index, Float) override;
+			void VertexAttrib(UInteger index, Float, Float) override;
+			void VertexAttrib(UInteger index, Float, Float, Float) override;
+			void VertexAttrib(UInteger index, Float, Float, Float, Float) override;
+
+			void VertexAttribPointer(UInteger index, Integer size, Enum type,
+			                         bool normalized, Sizei stride, const void *) override;
+			void VertexAttribIPointer(UInteger index, Integer size, Enum type, Sizei stride,
+			                          const void *) override;
+			void EnableVertexAttribArray(UInteger index, bool) override;
+			void VertexAttribDivisor(UInteger index, UInteger divisor) override;
+
+			void DrawArrays(Enum mode, Integer first, Sizei count) override;
+			void DrawElements(Enum mode, Sizei count, Enum type, const void *indices) override;
+			void DrawArraysInstanced(Enum mode, Integer first, Sizei count,
+			                         Sizei instances) override;
+			void DrawElementsInstanced(Enum mode, Sizei count, Enum type,
+			                           const void *indices, Sizei instances) override;
+
+			UInteger CreateShader(Enum type) override;
+			void ShaderSource(UInteger shader, Sizei count, const char **string,
+			                  const int *len) override;
+			void CompileShader(UInteger) override;
+			void DeleteShader(UInteger) override;
+			Integer GetShaderInteger(UInteger shader, Enum param) override;
+			void GetShaderInfoLog(UInteger shader, Sizei bufferSize, Sizei *length,
+			                      char *outString) override;
+			Integer GetProgramInteger(UInteger program, Enum param) override;
+			void GetProgramInfoLog(UInteger program, Sizei bufferSize, Sizei *length,
+			                       char *outString) override;
+
+			UInteger CreateProgram() override;
+			void AttachShader(UInteger program, UInteger shader) override;
+			void DetachShader(UInteger program, UInteger shader) override;
+			void LinkProgram(UInteger program) override;
+			void UseProgram(UInteger program) override;
+			void DeleteProgram(UInteger program) override;
+			void ValidateProgram(UInteger program) override;
+			Integer GetAttribLocation(UInteger program, const char *name) override;
+			void BindAttribLocation(UInteger program, UInteger index, const char *name) override;
+			Integer GetUniformLocation(UInteger program, const char *name) override;
+			void Uniform(Integer loc, Float) override;
+			void Uniform(Integer loc, Float, Float) override;
+			void Uniform(Integer loc, Float, Float, Float) override;
+			void Uniform(Integer loc, Float, Float, Float, Float) override;
+			void Uniform(Integer loc, Integer) override;
+			void Uniform(Integer loc, Integer, Integer) override;
+			void Uniform(Integer loc, Integer, Integer, Integer) override;
+			void Uniform(Integer loc, Integer, Integer, Integer, Integer) override;
+			void Uniform(Integer loc, bool transpose, const Matrix4 &) override;
+
+			UInteger GenRenderbuffer() override;
+			void DeleteRenderbuffer(UInteger) override;
+			void BindRenderbuffer(Enum target, UInteger) override;
+			void RenderbufferStorage(Enum target, Enum internalFormat, Sizei width,
+			                         Sizei height) override;
+			void RenderbufferStorage(Enum target, Sizei samples, Enum internalFormat,
+			                         Sizei width, Sizei height) override;
+
+			UInteger GenFramebuffer() override;
+			void BindFramebuffer(Enum target, UInteger framebuffer) override;
+			void DeleteFramebuffer(UInteger) override;
+			void FramebufferTexture2D(Enum target, Enum attachment, Enum texTarget,
+			                          UInteger texture, Integer level) override;
+			void FramebufferRenderbuffer(Enum target, Enum attachment,
+			                             Enum renderbufferTarget,
+			                             UInteger renderbuffer) override;
+			void BlitFramebuffer(Integer srcX0, Integer srcY0, Integer srcX1, Integer srcY1,
+			                     Integer dstX0, Integer dstY0, Integer dstX1, Integer dstY1,
+			                     UInteger mask, Enum filter) override;
+			Enum CheckFramebufferStatus(Enum target) override;
+
+			void ReadPixels(Integer x, Integer y, Sizei width, Sizei height, Enum format,
+			                Enum type, void *data) override;
+
+			Integer ScreenWidth() override;
+			Integer ScreenHeight() override;
+
+			void Swap() override;
+		};
+	} // namespace draw
+} // namespace spades
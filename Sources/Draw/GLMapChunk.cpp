@@ -30,21 +30,93 @@
 #include "IGLDevice.h"
 #include <AngelScript/include/angelscript.h> // for asOFFSET. somehow `offsetof` fails on gcc-4.8
 #include <Client/GameMap.h>
+#include <Client/GameMapSnapshot.h>
 #include <Core/Debug.h>
 #include <Core/Settings.h>
+#include <Core/TaskScheduler.h>
 
 namespace spades {
 	namespace draw {
-		GLMapChunk::GLMapChunk(GLMapRenderer &r, client::GameMap *mp, int cx, int cy, int cz)
-		    : renderer(r), device(r.device) {
+		/**
+		 * Generates the mesh of a chunk. Reads the voxels from a snapshot so that it can run
+		 * on a worker thread while the map is being modified.
+		 *
+		 * If `greedy` is set, the coplanar faces with the same color and ambient occlusion
+		 * pattern are merged into larger quads, which are stored in `packedVertices`.
+		 * Otherwise, every face gets its own quad in `vertices`.
+		 */
+		class GLMapChunk::MeshTask : public Task {
+		public:
+			int chunkX, chunkY, chunkZ;
+			Handle<client::GameMapSnapshot> snapshot;
+			bool water;
+			bool greedy;
+
+			std::vector<Vertex> vertices;
+			std::vector<PackedVertex> packedVertices;
+			std::vector<uint16_t> indices;
+
+			MeshTask(int cx, int cy, int cz)
+			    : chunkX(cx), chunkY(cy), chunkZ(cz), water(false), greedy(false) {}
+
+			std::size_t GetNumVertices() const {
+				return greedy ? packedVertices.size() : vertices.size();
+			}
+			std::size_t GetNumBytes() const {
+				return vertices.size() * sizeof(Vertex) +
+				       packedVertices.size() * sizeof(PackedVertex) +
+				       indices.size() * sizeof(uint16_t);
+			}
+
+		protected:
+			void Execute() override;
+
+		private:
+			/**
+			 * The orientation of each face. The tangents `u` and `v` are the same as the ones
+			 * used by the per-face mesher (they determine the orientation of the ambient
+			 * occlusion texture) and must match `PackedBlockVertex.vs`.
+			 */
+			struct Face {
+				int n[3], u[3], v[3];
+				/** The axes of `n`, `u` and `v`. */
+				int nAxis, uAxis, vAxis;
+			};
+			static const Face faces[6];
+
+			uint8_t calcAOID(int x, int y, int z, int ux, int uy, int uz, int vx, int vy, int vz);
+
+			void EmitVertex(int aoX, int aoY, int aoZ, int x, int y, int z, int ux, int uy,
+			                int vx, int vy, uint32_t color, int nx, int ny, int nz);
+
+			bool IsSolid(int x, int y, int z);
+
+			uint32_t GetVoxelColor(int x, int y, int z);
+
+			void GenerateFaces();
+			void GenerateGreedyFaces();
+			void EmitGreedyQuad(int faceIndex, int slice, int u0, int v0, int width, int height,
+			                    uint64_t key);
+		};
+
+		// +Z, -Z, -X, +X, -Y, +Y
+		const GLMapChunk::MeshTask::Face GLMapChunk::MeshTask::faces[6] = {
+		  {{0, 0, 1}, {-1, 0, 0}, {0, 1, 0}, 2, 0, 1}, {{0, 0, -1}, {1, 0, 0}, {0, 1, 0}, 2, 0, 1},
+		  {{-1, 0, 0}, {0, 0, 1}, {0, -1, 0}, 0, 2, 1}, {{1, 0, 0}, {0, 0, 1}, {0, 1, 0}, 0, 2, 1},
+		  {{0, -1, 0}, {0, 0, 1}, {1, 0, 0}, 1, 2, 0}, {{0, 1, 0}, {0, 0, 1}, {-1, 0, 0}, 1, 2, 0}};
+
+		GLMapChunk::GLMapChunk(GLMapRenderer &r, int cx, int cy, int cz)
+		    : renderer(r), device(r.device), meshTask(new MeshTask(cx, cy, cz)) {
 			SPADES_MARK_FUNCTION();
 
-			map = mp;
 			chunkX = cx;
 			chunkY = cy;
 			chunkZ = cz;
 			needsUpdate = true;
 			realized = false;
+			meshPending = false;
+			queuedTime = -1.0;
+			meshQueuedTime = 0.0;
 
 			centerPos =
 			  MakeVector3(cx * Size + Size / 2, cy * Size + Size / 2, cz * Size + Size / 2);
@@ -53,6 +125,8 @@ namespace spades {
 
 			buffer = 0;
 			iBuffer = 0;
+			numIndices = 0;
+			numVertices = 0;
 		}
 
 		GLMapChunk::~GLMapChunk() { SetRealized(false); }
@@ -64,6 +138,7 @@ namespace spades {
 				return;
 
 			if (!b) {
+				CancelMeshing();
 				if (buffer) {
 					device.DeleteBuffer(buffer);
 					buffer = 0;
@@ -72,11 +147,9 @@ namespace spades {
 					device.DeleteBuffer(iBuffer);
 					iBuffer = 0;
 				}
-				std::vector<Vertex> i;
-				i.swap(vertices);
-
-				std::vector<uint16_t> i2;
-				i2.swap(indices);
+				numIndices = 0;
+				numVertices = 0;
+				queuedTime = -1.0;
 			} else {
 				needsUpdate = true;
 			}
@@ -84,8 +157,149 @@ namespace spades {
 			realized = b;
 		}
 
-		uint8_t GLMapChunk::calcAOID(int x, int y, int z, int ux, int uy, int uz, int vx, int vy,
-		                             int vz) {
+		void GLMapChunk::CancelMeshing() {
+			if (!meshPending)
+				return;
+
+			TaskScheduler &scheduler = TaskScheduler::GetInstance();
+			if (!scheduler.TryRevoke(*meshTask)) {
+				scheduler.Wait(*meshTask);
+			}
+			meshTask->snapshot.Set(nullptr);
+			std::vector<Vertex>().swap(meshTask->vertices);
+			std::vector<PackedVertex>().swap(meshTask->packedVertices);
+			std::vector<uint16_t>().swap(meshTask->indices);
+			meshPending = false;
+		}
+
+		bool GLMapChunk::IsMeshReady() const { return meshPending && meshTask->IsDone(); }
+
+		void GLMapChunk::StartMeshing(Handle<client::GameMapSnapshot> snapshot, bool water,
+		                              bool async) {
+			SPADES_MARK_FUNCTION_DEBUG();
+			SPAssert(NeedsMeshing());
+
+			meshTask->snapshot = std::move(snapshot);
+			meshTask->water = water;
+			meshTask->greedy = renderer.greedyMeshing;
+			needsUpdate = false;
+			meshPending = true;
+			meshQueuedTime = queuedTime;
+			queuedTime = -1.0;
+
+			TaskScheduler &scheduler = TaskScheduler::GetInstance();
+			if (async) {
+				scheduler.Spawn(*meshTask);
+			} else {
+				scheduler.BeginExternal(*meshTask);
+				scheduler.ExecuteExternal(*meshTask);
+			}
+		}
+
+		std::size_t GLMapChunk::GetPendingMeshSize() const { return meshTask->GetNumBytes(); }
+
+		void GLMapChunk::UploadMesh() {
+			SPADES_MARK_FUNCTION();
+			SPAssert(IsMeshReady());
+
+			std::vector<Vertex> vertices;
+			std::vector<PackedVertex> packedVertices;
+			std::vector<uint16_t> indices;
+			vertices.swap(meshTask->vertices);
+			packedVertices.swap(meshTask->packedVertices);
+			indices.swap(meshTask->indices);
+			meshPending = false;
+
+			numIndices = static_cast<IGLDevice::Sizei>(indices.size());
+			numVertices = vertices.size() + packedVertices.size();
+			if (indices.empty()) {
+				if (buffer) {
+					device.DeleteBuffer(buffer);
+					buffer = 0;
+				}
+				if (iBuffer) {
+					device.DeleteBuffer(iBuffer);
+					iBuffer = 0;
+				}
+				return;
+			}
+
+			// The existing buffers are respecified rather than recreated
+			if (!buffer)
+				buffer = device.GenBuffer();
+			if (!iBuffer)
+				iBuffer = device.GenBuffer();
+
+			device.BindBuffer(IGLDevice::ArrayBuffer, buffer);
+			if (renderer.greedyMeshing) {
+				device.BufferData(
+				  IGLDevice::ArrayBuffer,
+				  static_cast<IGLDevice::Sizei>(packedVertices.size() * sizeof(PackedVertex)),
+				  packedVertices.data(), IGLDevice::DynamicDraw);
+			} else {
+				device.BufferData(IGLDevice::ArrayBuffer,
+				                  static_cast<IGLDevice::Sizei>(vertices.size() * sizeof(Vertex)),
+				                  vertices.data(), IGLDevice::DynamicDraw);
+			}
+
+			device.BindBuffer(IGLDevice::ArrayBuffer, iBuffer);
+			device.BufferData(IGLDevice::ArrayBuffer,
+			                  static_cast<IGLDevice::Sizei>(indices.size() * sizeof(uint16_t)),
+			                  indices.data(), IGLDevice::DynamicDraw);
+			device.BindBuffer(IGLDevice::ArrayBuffer, 0);
+		}
+
+		void GLMapChunk::AddMeshStatistics(MeshStatistics &stats) const {
+			if (numIndices == 0)
+				return;
+			stats.numChunks++;
+			stats.numVertices += numVertices;
+			stats.numIndices += static_cast<std::size_t>(numIndices);
+			stats.numBytes +=
+			  numVertices * (renderer.greedyMeshing ? sizeof(PackedVertex) : sizeof(Vertex)) +
+			  static_cast<std::size_t>(numIndices) * sizeof(uint16_t);
+		}
+
+		GLMapChunk::MeshStatistics
+		GLMapChunk::MeasureMap(const Handle<client::GameMapSnapshot> &snapshot, bool water,
+		                       bool greedy) {
+			SPADES_MARK_FUNCTION();
+
+			const int numChunkWidth = client::GameMapSnapshot::Width / Size;
+			const int numChunkHeight = client::GameMapSnapshot::Height / Size;
+			const int numChunkDepth = client::GameMapSnapshot::Depth / Size;
+			const int numChunks = numChunkWidth * numChunkHeight * numChunkDepth;
+
+			TaskScheduler &scheduler = TaskScheduler::GetInstance();
+			std::vector<MeshStatistics> chunkStats(numChunks);
+			ParallelFor(0, numChunks, [&](int i) {
+				MeshTask task(i / numChunkDepth / numChunkHeight,
+				              (i / numChunkDepth) % numChunkHeight, i % numChunkDepth);
+				task.snapshot = snapshot;
+				task.water = water;
+				task.greedy = greedy;
+				scheduler.BeginExternal(task);
+				scheduler.ExecuteExternal(task);
+
+				MeshStatistics &stats = chunkStats[i];
+				stats.numChunks = task.indices.empty() ? 0 : 1;
+				stats.numVertices = task.GetNumVertices();
+				stats.numIndices = task.indices.size();
+				stats.numBytes = task.GetNumBytes();
+			});
+
+			MeshStatistics total{};
+			for (const MeshStatistics &stats : chunkStats) {
+				total.numChunks += stats.numChunks;
+				total.numVertices += stats.numVertices;
+				total.numIndices += stats.numIndices;
+				total.numBytes += stats.numBytes;
+			}
+			return total;
+		}
+
+		uint8_t GLMapChunk::MeshTask::calcAOID(int x, int y, int z, int ux, int uy, int uz, int vx,
+		                                       int vy, int vz) {
 			int v = 0;
 			if (IsSolid(x - ux, y - uy, z - uz))
 				v |= 1;
@@ -114,8 +328,9 @@ namespace spades {
 		 * @param y Chunk local Y coordinate
 		 * @param z Chunk local Z coordinate
 		 */
-		void GLMapChunk::EmitVertex(int x, int y, int z, int aoX, int aoY, int aoZ, int ux, int uy,
-		                            int vx, int vy, uint32_t color, int nx, int ny, int nz) {
+		void GLMapChunk::MeshTask::EmitVertex(int x, int y, int z, int aoX, int aoY, int aoZ,
+		                                      int ux, int uy, int vx, int vy, uint32_t color,
+		                                      int nx, int ny, int nz) {
 			SPADES_MARK_FUNCTION_DEBUG();
 
 			int uz = (ux == 0 && uy == 0) ? 1 : 0;
@@ -189,7 +404,7 @@ namespace spades {
 			indices.push_back(idx + 2);
 		}
 
-		bool GLMapChunk::IsSolid(int x, int y, int z) {
+		bool GLMapChunk::MeshTask::IsSolid(int x, int y, int z) {
 			if (z < 0)
 				return false;
 			if (z >= 64)
@@ -200,30 +415,47 @@ namespace spades {
 			y &= 511;
 
 			if (z == 63) {
-				if (renderer.renderer.GetSettings().r_water) {
-					return map->IsSolid(x, y, 62);
+				if (water) {
+					return snapshot->IsSolid(x, y, 62);
 				} else {
-					return map->IsSolid(x, y, 63);
+					return snapshot->IsSolid(x, y, 63);
 				}
 			} else {
-				return map->IsSolid(x, y, z);
+				return snapshot->IsSolid(x, y, z);
 			}
 		}
 
-		void GLMapChunk::Update() {
+		uint32_t GLMapChunk::MeshTask::GetVoxelColor(int x, int y, int z) {
+			uint32_t col = snapshot->GetColor(x, y, z);
+
+			// damaged block?
+			int health = col >> 24;
+			if (health < 100) {
+				col &= 0xffffff;
+				col &= 0xfefefe;
+				col >>= 1;
+			}
+			return col & 0xffffff;
+		}
+
+		void GLMapChunk::MeshTask::Execute() {
 			SPADES_MARK_FUNCTION();
 
 			vertices.clear();
+			packedVertices.clear();
 			indices.clear();
-			if (buffer) {
-				device.DeleteBuffer(buffer);
-				buffer = 0;
-			}
-			if (iBuffer) {
-				device.DeleteBuffer(iBuffer);
-				iBuffer = 0;
+
+			if (greedy) {
+				GenerateGreedyFaces();
+			} else {
+				GenerateFaces();
 			}
 
+			// The snapshot may be the last reference to some pages of an old map state
+			snapshot.Set(nullptr);
+		}
+
+		void GLMapChunk::MeshTask::GenerateFaces() {
 			int rchunkX = chunkX * Size;
 			int rchunkY = chunkY * Size;
 			int rchunkZ = chunkZ * Size;
@@ -239,16 +471,7 @@ namespace spades {
 						if (!IsSolid(xx, yy, zz))
 							continue;
 
-						uint32_t col = map->GetColor(xx, yy, zz);
-						// col = 0xffffffff;
-
-						// damaged block?
-						int health = col >> 24;
-						if (health < 100) {
-							col &= 0xffffff;
-							col &= 0xfefefe;
-							col >>= 1;
-						}
+						uint32_t col = GetVoxelColor(xx, yy, zz);
 
 						if (!IsSolid(xx, yy, zz + 1)) {
 							EmitVertex(x + 1, y, z + 1, xx, yy, zz + 1, -1, 0, 0, 1, col, 0, 0, 1);
@@ -271,26 +494,116 @@ namespace spades {
 					}
 				}
 			}
+		}
 
-			if (vertices.size() == 0)
-				return;
-
-			buffer = device.GenBuffer();
-			device.BindBuffer(IGLDevice::ArrayBuffer, buffer);
+		void GLMapChunk::MeshTask::GenerateGreedyFaces() {
+			int rchunkX = chunkX * Size;
+			int rchunkY = chunkY * Size;
+			int rchunkZ = chunkZ * Size;
 
-			device.BufferData(IGLDevice::ArrayBuffer,
-			                  static_cast<IGLDevice::Sizei>(vertices.size() * sizeof(Vertex)),
-			                  vertices.data(), IGLDevice::DynamicDraw);
+			// The merge keys of one face direction, indexed by `[slice][v][u]`. `0` means
+			// there's no face.
+			std::vector<uint64_t> faceKeys(Size * Size * Size);
+
+			for (int faceIndex = 0; faceIndex < 6; faceIndex++) {
+				const Face &face = faces[faceIndex];
+				std::fill(faceKeys.begin(), faceKeys.end(), 0);
+
+				for (int x = 0; x < Size; x++) {
+					for (int y = 0; y < Size; y++) {
+						for (int z = 0; z < Size; z++) {
+							int xx = x + rchunkX;
+							int yy = y + rchunkY;
+							int zz = z + rchunkZ;
+
+							if (!IsSolid(xx, yy, zz))
+								continue;
+
+							int ax = xx + face.n[0], ay = yy + face.n[1], az = zz + face.n[2];
+							if (IsSolid(ax, ay, az))
+								continue;
+
+							uint32_t col = GetVoxelColor(xx, yy, zz);
+							uint8_t aoID = calcAOID(ax, ay, az, face.u[0], face.u[1], face.u[2],
+							                        face.v[0], face.v[1], face.v[2]);
+
+							const int local[3] = {x, y, z};
+							int index = (local[face.nAxis] * Size + local[face.vAxis]) * Size +
+							            local[face.uAxis];
+							faceKeys[index] = static_cast<uint64_t>(col) |
+							                  (static_cast<uint64_t>(aoID) << 24) | (1ULL << 32);
+						}
+					}
+				}
 
-			if (!indices.empty()) {
-				iBuffer = device.GenBuffer();
-				device.BindBuffer(IGLDevice::ArrayBuffer, iBuffer);
+				// Grow each quad along `u` first, and then along `v` as long as every face in
+				// the next row matches
+				for (int slice = 0; slice < Size; slice++) {
+					uint64_t *sliceKeys = faceKeys.data() + slice * Size * Size;
+					for (int v = 0; v < Size; v++) {
+						for (int u = 0; u < Size; u++) {
+							uint64_t key = sliceKeys[v * Size + u];
+							if (!key)
+								continue;
+
+							int width = 1;
+							while (u + width < Size && sliceKeys[v * Size + u + width] == key)
+								width++;
+
+							int height = 1;
+							for (; v + height < Size; height++) {
+								const uint64_t *row = sliceKeys + (v + height) * Size + u;
+								if (!std::all_of(row, row + width,
+								                 [=](uint64_t k) { return k == key; }))
+									break;
+							}
+
+							for (int j = 0; j < height; j++) {
+								uint64_t *row = sliceKeys + (v + j) * Size + u;
+								std::fill(row, row + width, 0);
+							}
+
+							EmitGreedyQuad(faceIndex, slice, u, v, width, height, key);
+						}
+					}
+				}
+			}
+		}
 
-				device.BufferData(IGLDevice::ArrayBuffer,
-				                  static_cast<IGLDevice::Sizei>(indices.size() * sizeof(uint16_t)),
-				                  indices.data(), IGLDevice::DynamicDraw);
+		void GLMapChunk::MeshTask::EmitGreedyQuad(int faceIndex, int slice, int u0, int v0,
+		                                          int width, int height, uint64_t key) {
+			const Face &face = faces[faceIndex];
+
+			PackedVertex inst;
+			inst.colorRed = (uint8_t)(key);
+			inst.colorGreen = (uint8_t)(key >> 8);
+			inst.colorBlue = (uint8_t)(key >> 16);
+			inst.aoID = (uint8_t)(key >> 24);
+
+			uint16_t idx = (uint16_t)packedVertices.size();
+
+			// The same vertex order as `EmitVertex`: the origin, `+u`, `+v` and `+u+v`.
+			// A quad with a negative tangent starts from its far end.
+			for (int corner = 0; corner < 4; corner++) {
+				int cu = corner & 1, cv = corner >> 1;
+				int pos[3];
+				pos[face.nAxis] = slice + (face.n[face.nAxis] > 0 ? 1 : 0);
+				pos[face.uAxis] = u0 + (face.u[face.uAxis] > 0 ? cu : 1 - cu) * width;
+				pos[face.vAxis] = v0 + (face.v[face.vAxis] > 0 ? cv : 1 - cv) * height;
+
+				inst.x = (uint8_t)pos[0];
+				inst.y = (uint8_t)pos[1];
+				inst.z = (uint8_t)pos[2];
+				inst.faceCorner = (uint8_t)(faceIndex * 4 + corner);
+				packedVertices.push_back(inst);
 			}
-			device.BindBuffer(IGLDevice::ArrayBuffer, 0);
+
+			indices.push_back(idx);
+			indices.push_back(idx + 1);
+			indices.push_back(idx + 2);
+			indices.push_back(idx + 1);
+			indices.push_back(idx + 3);
+			indices.push_back(idx + 2);
 		}
 
 		void GLMapChunk::RenderDepthPass() {
@@ -299,12 +612,8 @@ namespace spades {
 
 			if (!realized)
 				return;
-			if (needsUpdate) {
-				Update();
-				needsUpdate = false;
-			}
-			if (!buffer) {
-				// empty chunk
+			if (numIndices == 0) {
+				// empty chunk (or not generated yet)
 				return;
 			}
 			AABB3 bx = aabb;
@@ -342,13 +651,17 @@ namespace spades {
 			positionAttribute(depthonlyProgram);
 
 			device.BindBuffer(IGLDevice::ArrayBuffer, buffer);
-			device.VertexAttribPointer(positionAttribute(), 3, IGLDevice::UnsignedByte, false,
-			                           sizeof(Vertex), (void *)asOFFSET(Vertex, x));
+			if (renderer.greedyMeshing)
+				device.VertexAttribPointer(positionAttribute(), 3, IGLDevice::UnsignedByte, false,
+				                           sizeof(PackedVertex),
+				                           (void *)asOFFSET(PackedVertex, x));
+			else
+				device.VertexAttribPointer(positionAttribute(), 3, IGLDevice::UnsignedByte, false,
+				                           sizeof(Vertex), (void *)asOFFSET(Vertex, x));
 
 			device.BindBuffer(IGLDevice::ArrayBuffer, 0);
 			device.BindBuffer(IGLDevice::ElementArrayBuffer, iBuffer);
-			device.DrawElements(IGLDevice::Triangles, static_cast<IGLDevice::Sizei>(indices.size()),
-			                    IGLDevice::UnsignedShort, NULL);
+			device.DrawElements(IGLDevice::Triangles, numIndices, IGLDevice::UnsignedShort, NULL);
 			device.BindBuffer(IGLDevice::ElementArrayBuffer, 0);
 		}
 		void GLMapChunk::RenderSunlightPass() {
@@ -357,12 +670,8 @@ namespace spades {
 
 			if (!realized)
 				return;
-			if (needsUpdate) {
-				Update();
-				needsUpdate = false;
-			}
-			if (!buffer) {
-				// empty chunk
+			if (numIndices == 0) {
+				// empty chunk (or not generated yet)
 				return;
 			}
 			AABB3 bx = aabb;
@@ -403,31 +712,41 @@ namespace spades {
 			static GLProgramAttribute fixedPositionAttribute("fixedPositionAttribute");
 
 			positionAttribute(basicProgram);
-			ambientOcclusionCoordAttribute(basicProgram);
 			colorAttribute(basicProgram);
-			normalAttribute(basicProgram);
-			fixedPositionAttribute(basicProgram);
 
 			device.BindBuffer(IGLDevice::ArrayBuffer, buffer);
-			device.VertexAttribPointer(positionAttribute(), 3, IGLDevice::UnsignedByte, false,
-			                           sizeof(Vertex), (void *)asOFFSET(Vertex, x));
-			if (ambientOcclusionCoordAttribute() != -1)
-				device.VertexAttribPointer(ambientOcclusionCoordAttribute(), 2,
-				                           IGLDevice::UnsignedShort, false, sizeof(Vertex),
-				                           (void *)asOFFSET(Vertex, aoX));
-			device.VertexAttribPointer(colorAttribute(), 4, IGLDevice::UnsignedByte, true,
-			                           sizeof(Vertex), (void *)asOFFSET(Vertex, colorRed));
-			if (normalAttribute() != -1)
-				device.VertexAttribPointer(normalAttribute(), 3, IGLDevice::Byte, false,
-				                           sizeof(Vertex), (void *)asOFFSET(Vertex, nx));
-
-			device.VertexAttribPointer(fixedPositionAttribute(), 3, IGLDevice::Byte, false,
-			                           sizeof(Vertex), (void *)asOFFSET(Vertex, sx));
+			if (renderer.greedyMeshing) {
+				// `PackedBlock(Phys).program` derives the other attributes from these
+				device.VertexAttribPointer(positionAttribute(), 4, IGLDevice::UnsignedByte, false,
+				                           sizeof(PackedVertex),
+				                           (void *)asOFFSET(PackedVertex, x));
+				device.VertexAttribPointer(colorAttribute(), 4, IGLDevice::UnsignedByte, true,
+				                           sizeof(PackedVertex),
+				                           (void *)asOFFSET(PackedVertex, colorRed));
+			} else {
+				ambientOcclusionCoordAttribute(basicProgram);
+				normalAttribute(basicProgram);
+				fixedPositionAttribute(basicProgram);
+
+				device.VertexAttribPointer(positionAttribute(), 3, IGLDevice::UnsignedByte, false,
+				                           sizeof(Vertex), (void *)asOFFSET(Vertex, x));
+				if (ambientOcclusionCoordAttribute() != -1)
+					device.VertexAttribPointer(ambientOcclusionCoordAttribute(), 2,
+					                           IGLDevice::UnsignedShort, false, sizeof(Vertex),
+					                           (void *)asOFFSET(Vertex, aoX));
+				device.VertexAttribPointer(colorAttribute(), 4, IGLDevice::UnsignedByte, true,
+				                           sizeof(Vertex), (void *)asOFFSET(Vertex, colorRed));
+				if (normalAttribute() != -1)
+					device.VertexAttribPointer(normalAttribute(), 3, IGLDevice::Byte, false,
+					                           sizeof(Vertex), (void *)asOFFSET(Vertex, nx));
+
+				device.VertexAttribPointer(fixedPositionAttribute(), 3, IGLDevice::Byte, false,
+				                           sizeof(Vertex), (void *)asOFFSET(Vertex, sx));
+			}
 
 			device.BindBuffer(IGLDevice::ArrayBuffer, 0);
 			device.BindBuffer(IGLDevice::ElementArrayBuffer, iBuffer);
-			device.DrawElements(IGLDevice::Triangles, static_cast<IGLDevice::Sizei>(indices.size()),
-			                    IGLDevice::UnsignedShort, NULL);
+			device.DrawElements(IGLDevice::Triangles, numIndices, IGLDevice::UnsignedShort, NULL);
 			device.BindBuffer(IGLDevice::ElementArrayBuffer, 0);
 		}
 
@@ -437,12 +756,8 @@ namespace spades {
 
 			if (!realized)
 				return;
-			if (needsUpdate) {
-				Update();
-				needsUpdate = false;
-			}
-			if (!buffer) {
-				// empty chunk
+			if (numIndices == 0) {
+				// empty chunk (or not generated yet)
 				return;
 			}
 			AABB3 bx = aabb;
@@ -481,15 +796,25 @@ namespace spades {
 
 			positionAttribute(program);
 			colorAttribute(program);
-			normalAttribute(program);
 
 			device.BindBuffer(IGLDevice::ArrayBuffer, buffer);
-			device.VertexAttribPointer(positionAttribute(), 3, IGLDevice::UnsignedByte, false,
-			                           sizeof(Vertex), (void *)asOFFSET(Vertex, x));
-			device.VertexAttribPointer(colorAttribute(), 4, IGLDevice::UnsignedByte, true,
-			                           sizeof(Vertex), (void *)asOFFSET(Vertex, colorRed));
-			device.VertexAttribPointer(normalAttribute(), 3, IGLDevice::Byte, false, sizeof(Vertex),
-			                           (void *)asOFFSET(Vertex, nx));
+			if (renderer.greedyMeshing) {
+				device.VertexAttribPointer(positionAttribute(), 4, IGLDevice::UnsignedByte, false,
+				                           sizeof(PackedVertex),
+				                           (void *)asOFFSET(PackedVertex, x));
+				device.VertexAttribPointer(colorAttribute(), 4, IGLDevice::UnsignedByte, true,
+				                           sizeof(PackedVertex),
+				                           (void *)asOFFSET(PackedVertex, colorRed));
+			} else {
+				normalAttribute(program);
+
+				device.VertexAttribPointer(positionAttribute(), 3, IGLDevice::UnsignedByte, false,
+				                           sizeof(Vertex), (void *)asOFFSET(Vertex, x));
+				device.VertexAttribPointer(colorAttribute(), 4, IGLDevice::UnsignedByte, true,
+				                           sizeof(Vertex), (void *)asOFFSET(Vertex, colorRed));
+				device.VertexAttribPointer(normalAttribute(), 3, IGLDevice::Byte, false,
+				                           sizeof(Vertex), (void *)asOFFSET(Vertex, nx));
+			}
 
 			device.BindBuffer(IGLDevice::ArrayBuffer, 0);
 			device.BindBuffer(IGLDevice::ElementArrayBuffer, iBuffer);
@@ -501,9 +826,8 @@ namespace spades {
 				if (!lights[i].Cull(bx))
 					continue;
 
-				device.DrawElements(IGLDevice::Triangles,
-				                    static_cast<IGLDevice::Sizei>(indices.size()),
-				                    IGLDevice::UnsignedShort, NULL);
+				device.DrawElements(IGLDevice::Triangles, numIndices, IGLDevice::UnsignedShort,
+				                    NULL);
 			}
 
 			device.BindBuffer(IGLDevice::ElementArrayBuffer, 0);
@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include <memory>
 #include <vector>
 
 #include "GLDynamicLight.h"
@@ -29,10 +30,15 @@
 #include <Core/Math.h>
 
 namespace spades {
+	namespace client {
+		class GameMapSnapshot;
+	}
 	namespace draw {
 		class GLMapRenderer;
 		class IGLDevice;
 		class GLMapChunk {
+			class MeshTask;
+
 			struct Vertex {
 				uint8_t x, y, z;
 				uint8_t pad;
@@ -51,41 +57,107 @@ namespace spades {
 				uint8_t pad3;
 			};
 
+			/**
+			 * The vertex format of `r_mapGreedyMeshing`. The normal, the tangents and the
+			 * shading are derived from the face index by `PackedBlockVertex.vs`.
+			 */
+			struct PackedVertex {
+				uint8_t x, y, z;
+				/** `face * 4 + corner`. `corner` is `cu + cv * 2` (see `MeshTask`). */
+				uint8_t faceCorner;
+
+				uint8_t colorRed;
+				uint8_t colorGreen;
+				uint8_t colorBlue;
+				uint8_t aoID;
+			};
+
 			GLMapRenderer &renderer;
 			IGLDevice &device;
-			client::GameMap *map;
 			int chunkX, chunkY, chunkZ;
 			AABB3 aabb;
 
 			Vector3 centerPos;
 			float radius;
 
-			std::vector<Vertex> vertices;
-			std::vector<uint16_t> indices;
+			/** The mesh being drawn. Replaced by the result of `meshTask` when it's uploaded. */
 			IGLDevice::UInteger buffer;
 			IGLDevice::UInteger iBuffer;
+			IGLDevice::Sizei numIndices;
+			std::size_t numVertices;
 
-			bool needsUpdate;
-			bool realized;
-
-			uint8_t calcAOID(int x, int y, int z, int ux, int uy, int uz, int vx, int vy, int vz);
+			/** Generates the next mesh on a worker thread. */
+			std::unique_ptr<MeshTask> meshTask;
+			/** `meshTask` was started and its result wasn't uploaded yet. */
+			bool meshPending;
 
-			void EmitVertex(int aoX, int aoY, int aoZ, int x, int y, int z, int ux, int uy, int vx,
-			                int vy, uint32_t color, int nx, int ny, int nz);
+			/** The time when this chunk was found out of date, or negative. */
+			double queuedTime;
+			/** `queuedTime` of the mesh being generated by `meshTask`. */
+			double meshQueuedTime;
 
-			bool IsSolid(int x, int y, int z);
+			bool needsUpdate;
+			bool realized;
 
-			void Update();
+			void CancelMeshing();
 
 		public:
 			enum { Size = 16, SizeBits = 4 };
-			GLMapChunk(GLMapRenderer &, client::GameMap *mp, int cx, int cy, int cz);
+
+			/** The total size of chunk meshes. */
+			struct MeshStatistics {
+				std::size_t numChunks;
+				std::size_t numVertices;
+				std::size_t numIndices;
+				std::size_t numBytes;
+			};
+
+			GLMapChunk(GLMapRenderer &, int cx, int cy, int cz);
 			~GLMapChunk();
 
 			void SetNeedsUpdate() { needsUpdate = true; }
 
 			void SetRealized(bool);
 
+			/** Returns `true` if the chunk is realized and needs a mesh not being generated. */
+			bool NeedsMeshing() const { return realized && needsUpdate && !meshPending; }
+			bool IsMeshing() const { return meshPending; }
+			/** Returns `true` if `meshTask` has completed and its result can be uploaded. */
+			bool IsMeshReady() const;
+
+			/**
+			 * Records the time when the chunk was first found by `NeedsMeshing` (for the
+			 * meshing latency statistic). Later calls don't change it.
+			 */
+			void MarkQueued(double time) {
+				if (queuedTime < 0.0)
+					queuedTime = time;
+			}
+
+			/**
+			 * Starts generating a mesh from `snapshot`. If `async` is `false`, generates it on
+			 * the calling thread before returning.
+			 */
+			void StartMeshing(Handle<client::GameMapSnapshot> snapshot, bool water, bool async);
+
+			/** Returns the number of bytes that `UploadMesh` would upload. */
+			std::size_t GetPendingMeshSize() const;
+			/** Returns the time elapsed since the pending mesh was queued. */
+			double GetPendingMeshLatency(double time) const { return time - meshQueuedTime; }
+
+			/** Replaces the current mesh with the result of `meshTask`. */
+			void UploadMesh();
+
+			/** Adds the size of the mesh being drawn to `stats`. */
+			void AddMeshStatistics(MeshStatistics &stats) const;
+
+			/**
+			 * Generates the meshes of all chunks of `snapshot` on the task pool and returns
+			 * their total size without uploading them. Used to compare the meshing modes.
+			 */
+			static MeshStatistics MeasureMap(const Handle<client::GameMapSnapshot> &snapshot,
+			                                 bool water, bool greedy);
+
 			float DistanceFromEye(const Vector3 &eye);
 
 			void RenderSunlightPass();
@@ -18,6 +18,8 @@
 
  */
 
+#include <algorithm>
+
 #include "GLMapRenderer.h"
 #include "GLDynamicLightShader.h"
 #include "GLImage.h"
@@ -31,18 +33,29 @@
 #include "GLShadowShader.h"
 #include "IGLDevice.h"
 #include <Client/GameMap.h>
+#include <Client/GameMapSnapshot.h>
 #include <Core/Debug.h>
 #include <Core/Settings.h>
+#include <Core/TaskScheduler.h>
 
 namespace spades {
 	namespace draw {
 		void GLMapRenderer::PreloadShaders(GLRenderer &renderer) {
-			if (renderer.GetSettings().r_physicalLighting)
-				renderer.RegisterProgram("Shaders/BasicBlockPhys.program");
-			else
-				renderer.RegisterProgram("Shaders/BasicBlock.program");
+			GLSettings &settings = renderer.GetSettings();
+			if (settings.r_mapGreedyMeshing) {
+				if (settings.r_physicalLighting)
+					renderer.RegisterProgram("Shaders/PackedBlockPhys.program");
+				else
+					renderer.RegisterProgram("Shaders/PackedBlock.program");
+				renderer.RegisterProgram("Shaders/PackedBlockDynamicLit.program");
+			} else {
+				if (settings.r_physicalLighting)
+					renderer.RegisterProgram("Shaders/BasicBlockPhys.program");
+				else
+					renderer.RegisterProgram("Shaders/BasicBlock.program");
+				renderer.RegisterProgram("Shaders/BasicBlockDynamicLit.program");
+			}
 			renderer.RegisterProgram("Shaders/BasicBlockDepthOnly.program");
-			renderer.RegisterProgram("Shaders/BasicBlockDynamicLit.program");
 			renderer.RegisterProgram("Shaders/BackFaceBlock.program");
 			renderer.RegisterImage("Gfx/AmbientOcclusion.png");
 		}
@@ -61,15 +74,26 @@ namespace spades {
 			chunkInfos = new ChunkRenderInfo[numChunks];
 
 			for (int i = 0; i < numChunks; i++)
-				chunks[i] = new GLMapChunk(*this, gameMap, i / numChunkDepth / numChunkHeight,
+				chunks[i] = new GLMapChunk(*this, i / numChunkDepth / numChunkHeight,
 				                           (i / numChunkDepth) % numChunkHeight, i % numChunkDepth);
 
-			if (r.GetSettings().r_physicalLighting)
-				basicProgram = renderer.RegisterProgram("Shaders/BasicBlockPhys.program");
-			else
-				basicProgram = renderer.RegisterProgram("Shaders/BasicBlock.program");
+			// The chunk meshes use a different vertex format in this mode. The depth-only
+			// program only reads the position, which is at the same offset in both formats.
+			greedyMeshing = r.GetSettings().r_mapGreedyMeshing;
+			if (greedyMeshing) {
+				if (r.GetSettings().r_physicalLighting)
+					basicProgram = renderer.RegisterProgram("Shaders/PackedBlockPhys.program");
+				else
+					basicProgram = renderer.RegisterProgram("Shaders/PackedBlock.program");
+				dlightProgram = renderer.RegisterProgram("Shaders/PackedBlockDynamicLit.program");
+			} else {
+				if (r.GetSettings().r_physicalLighting)
+					basicProgram = renderer.RegisterProgram("Shaders/BasicBlockPhys.program");
+				else
+					basicProgram = renderer.RegisterProgram("Shaders/BasicBlock.program");
+				dlightProgram = renderer.RegisterProgram("Shaders/BasicBlockDynamicLit.program");
+			}
 			depthonlyProgram = renderer.RegisterProgram("Shaders/BasicBlockDepthOnly.program");
-			dlightProgram = renderer.RegisterProgram("Shaders/BasicBlockDynamicLit.program");
 			backfaceProgram = renderer.RegisterProgram("Shaders/BackFaceBlock.program");
 			aoImage = renderer.RegisterImage("Gfx/AmbientOcclusion.png").Cast<GLImage>();
 
@@ -121,6 +145,37 @@ namespace spades {
 					}
 		}
 
+		void GLMapRenderer::GameMapColumnChanged(int x, int y, uint64_t mask, client::GameMap *) {
+			SPADES_MARK_FUNCTION_DEBUG();
+
+			// A voxel affects the meshes of the chunks containing its neighbors
+			uint64_t affected = mask | (mask << 1) | (mask >> 1);
+			const uint64_t chunkMask = (1ULL << GLMapChunk::Size) - 1;
+
+			int cx1 = (x - 1) >> GLMapChunk::SizeBits;
+			int cx2 = (x + 1) >> GLMapChunk::SizeBits;
+			int cy1 = (y - 1) >> GLMapChunk::SizeBits;
+			int cy2 = (y + 1) >> GLMapChunk::SizeBits;
+			for (int cz = 0; cz < numChunkDepth; cz++) {
+				if (!((affected >> (cz * GLMapChunk::Size)) & chunkMask)) {
+					continue;
+				}
+				for (int cx = cx1; cx <= cx2; cx++) {
+					for (int cy = cy1; cy <= cy2; cy++) {
+						GetChunk(cx & (numChunkWidth - 1), cy & (numChunkHeight - 1), cz)
+						  ->SetNeedsUpdate();
+					}
+				}
+			}
+		}
+
+		GLMapChunk::MeshStatistics GLMapRenderer::GetMeshStatistics() const {
+			GLMapChunk::MeshStatistics stats{};
+			for (int i = 0; i < numChunks; i++)
+				chunks[i]->AddMeshStatistics(stats);
+			return stats;
+		}
+
 		void GLMapRenderer::RealizeChunks(spades::Vector3 eye) {
 			SPADES_MARK_FUNCTION();
 
@@ -136,11 +191,92 @@ namespace spades {
 			}
 		}
 
+		void GLMapRenderer::UpdateChunkMeshes() {
+			SPADES_MARK_FUNCTION();
+
+			double now = clock.GetTime();
+			TaskScheduler &scheduler = TaskScheduler::GetInstance();
+			bool async = renderer.GetSettings().r_mapAsyncMeshing && scheduler.GetNumWorkers() > 0;
+			auto byDistance = [&](int a, int b) {
+				return chunkInfos[a].distance < chunkInfos[b].distance;
+			};
+
+			// Upload the finished meshes, nearest first
+			chunkQueue.clear();
+			int numMeshing = 0;
+			for (int i = 0; i < numChunks; i++) {
+				if (chunks[i]->IsMeshReady())
+					chunkQueue.push_back(i);
+				else if (chunks[i]->IsMeshing())
+					numMeshing++;
+			}
+			std::sort(chunkQueue.begin(), chunkQueue.end(), byDistance);
+
+			int budgetKB = std::max((int)renderer.GetSettings().r_mapChunkUploadBudget, 0);
+			std::size_t budget = static_cast<std::size_t>(budgetKB) * 1024;
+			std::size_t numUploads = 0, uploadedBytes = 0;
+			double latency = 0.0;
+			for (; numUploads < chunkQueue.size(); numUploads++) {
+				GLMapChunk &c = *chunks[chunkQueue[numUploads]];
+				std::size_t size = c.GetPendingMeshSize();
+				// Always upload at least one mesh so that large ones aren't starved
+				if (async && numUploads > 0 && uploadedBytes + size > budget)
+					break;
+				latency = std::max(latency, c.GetPendingMeshLatency(now));
+				uploadedBytes += size;
+			}
+			// The rest stay in flight until the next frame
+			numMeshing += static_cast<int>(chunkQueue.size() - numUploads);
+
+			// Start meshing the modified chunks, nearest first. The number of meshes in
+			// flight is limited so that the queue is re-sorted as the camera moves.
+			int maxMeshing = async ? scheduler.GetNumWorkers() * 2 : numChunks;
+			std::size_t numReady = chunkQueue.size();
+			for (int i = 0; i < numChunks; i++) {
+				if (chunks[i]->NeedsMeshing()) {
+					chunks[i]->MarkQueued(now);
+					chunkQueue.push_back(i);
+				}
+			}
+			int numQueued = static_cast<int>(chunkQueue.size() - numReady);
+
+			GLProfiler::Context profiler(renderer.GetGLProfiler(),
+			                             "Mesh Upload [%d queued, %d in flight, %.1fms latency]",
+			                             numQueued, numMeshing, latency * 1000.0);
+
+			for (std::size_t i = 0; i < numUploads; i++) {
+				chunks[chunkQueue[i]]->UploadMesh();
+			}
+
+			auto candidates = chunkQueue.begin() + numReady;
+			std::size_t numStarts =
+			  std::min<std::size_t>(std::max(maxMeshing - numMeshing, 0), numQueued);
+			if (numStarts == 0)
+				return;
+			std::partial_sort(candidates, candidates + numStarts, chunkQueue.end(), byDistance);
+
+			// The map may be modified while the meshes are being generated. The new snapshot
+			// is taken before the previous one is released so that `CreateSnapshot` shares the
+			// unmodified pages with it.
+			if (!meshingSnapshot || meshingSnapshot->GetVersion() != gameMap->GetVersion()) {
+				meshingSnapshot = gameMap->CreateSnapshot();
+			}
+			bool water = renderer.GetSettings().r_water;
+			for (std::size_t i = 0; i < numStarts; i++) {
+				GLMapChunk &c = *chunks[candidates[i]];
+				c.StartMeshing(meshingSnapshot, water, async);
+				if (!async) {
+					c.UploadMesh();
+				}
+			}
+		}
+
 		void GLMapRenderer::Realize() {
 			GLProfiler::Context profiler(renderer.GetGLProfiler(), "Map Chunks");
 
 			Vector3 eye = renderer.GetSceneDef().viewOrigin;
 			RealizeChunks(eye);
+			UpdateChunkMeshes();
 		}
 
 		void GLMapRenderer::Prerender() {
@@ -243,18 +379,21 @@ namespace spades {
 			static GLProgramAttribute fixedPositionAttribute("fixedPositionAttribute");
 
 			positionAttribute(basicProgram);
-			ambientOcclusionCoordAttribute(basicProgram);
 			colorAttribute(basicProgram);
-			normalAttribute(basicProgram);
-			fixedPositionAttribute(basicProgram);
 
 			device.EnableVertexAttribArray(positionAttribute(), true);
-			if (ambientOcclusionCoordAttribute() != -1)
-				device.EnableVertexAttribArray(ambientOcclusionCoordAttribute(), true);
 			device.EnableVertexAttribArray(colorAttribute(), true);
-			if (normalAttribute() != -1)
-				device.EnableVertexAttribArray(normalAttribute(), true);
-			device.EnableVertexAttribArray(fixedPositionAttribute(), true);
+			if (!greedyMeshing) {
+				ambientOcclusionCoordAttribute(basicProgram);
+				normalAttribute(basicProgram);
+				fixedPositionAttribute(basicProgram);
+
+				if (ambientOcclusionCoordAttribute() != -1)
+					device.EnableVertexAttribArray(ambientOcclusionCoordAttribute(), true);
+				if (normalAttribute() != -1)
+					device.EnableVertexAttribArray(normalAttribute(), true);
+				device.EnableVertexAttribArray(fixedPositionAttribute(), true);
+			}
 
 			static GLProgramUniform projectionViewMatrix("projectionViewMatrix");
 			projectionViewMatrix(basicProgram);
@@ -290,12 +429,14 @@ namespace spades {
 			}
 
 			device.EnableVertexAttribArray(positionAttribute(), false);
-			if (ambientOcclusionCoordAttribute() != -1)
-				device.EnableVertexAttribArray(ambientOcclusionCoordAttribute(), false);
 			device.EnableVertexAttribArray(colorAttribute(), false);
-			if (normalAttribute() != -1)
-				device.EnableVertexAttribArray(normalAttribute(), false);
-			device.EnableVertexAttribArray(fixedPositionAttribute(), false);
+			if (!greedyMeshing) {
+				if (ambientOcclusionCoordAttribute() != -1)
+					device.EnableVertexAttribArray(ambientOcclusionCoordAttribute(), false);
+				if (normalAttribute() != -1)
+					device.EnableVertexAttribArray(normalAttribute(), false);
+				device.EnableVertexAttribArray(fixedPositionAttribute(), false);
+			}
 
 			device.ActiveTexture(1);
 			device.BindTexture(IGLDevice::Texture2D, 0);
@@ -337,11 +478,13 @@ namespace spades {
 
 			positionAttribute(dlightProgram);
 			colorAttribute(dlightProgram);
-			normalAttribute(dlightProgram);
 
 			device.EnableVertexAttribArray(positionAttribute(), true);
 			device.EnableVertexAttribArray(colorAttribute(), true);
-			device.EnableVertexAttribArray(normalAttribute(), true);
+			if (!greedyMeshing) {
+				normalAttribute(dlightProgram);
+				device.EnableVertexAttribArray(normalAttribute(), true);
+			}
 
 			static GLProgramUniform projectionViewMatrix("projectionViewMatrix");
 			projectionViewMatrix(dlightProgram);
@@ -379,7 +522,8 @@ namespace spades {
 
 			device.EnableVertexAttribArray(positionAttribute(), false);
 			device.EnableVertexAttribArray(colorAttribute(), false);
-			device.EnableVertexAttribArray(normalAttribute(), false);
+			if (!greedyMeshing)
+				device.EnableVertexAttribArray(normalAttribute(), false);
 
 			device.ActiveTexture(0);
 			device.BindTexture(IGLDevice::Texture2D, 0);
@@ -21,15 +21,16 @@
 #pragma once
 
 #include "GLDynamicLight.h"
+#include "GLMapChunk.h"
 #include "IGLDevice.h"
 #include <Client/IGameMapListener.h>
 #include <Client/IRenderer.h>
 #include <Core/Math.h>
+#include <Core/Stopwatch.h>
 
 namespace spades {
 	namespace draw {
 		class GLRenderer;
-		class GLMapChunk;
 		class GLProgram;
 		class GLImage;
 		class GLMapRenderer {
@@ -46,6 +47,9 @@ namespace spades {
 			GLProgram *backfaceProgram;
 			Handle<GLImage> aoImage;
 
+			/** `r_mapGreedyMeshing`, latched when the map is loaded. */
+			bool greedyMeshing;
+
 			IGLDevice::UInteger squareVertexBuffer;
 
 			struct ChunkRenderInfo {
@@ -60,6 +64,16 @@ namespace spades {
 			int numChunkWidth, numChunkHeight;
 			int numChunkDepth, numChunks;
 
+			/** The time base of the meshing latency. */
+			Stopwatch clock;
+			/** Scratch space of `UpdateChunkMeshes`. */
+			std::vector<int> chunkQueue;
+			/**
+			 * The snapshot the last meshes were started from. Kept alive until the next one is
+			 * taken, and reused if the map wasn't modified since.
+			 */
+			Handle<client::GameMapSnapshot> meshingSnapshot;
+
 			inline int GetChunkIndex(int x, int y, int z) {
 				return (x * numChunkHeight + y) * numChunkDepth + z;
 			}
@@ -70,6 +84,13 @@ namespace spades {
 
 			void RealizeChunks(Vector3 eye);
 
+			/**
+			 * Uploads the meshes generated by the worker threads (nearest first, up to
+			 * `r_mapChunkUploadBudget` kilobytes per frame) and starts generating meshes for
+			 * the chunks modified since the last frame.
+			 */
+			void UpdateChunkMeshes();
+
 			void DrawColumnDepth(int cx, int cy, int cz, Vector3 eye);
 			void DrawColumnSunlight(int cx, int cy, int cz, Vector3 eye);
 			void DrawColumnDLight(int cx, int cy, int cz, Vector3 eye,
@@ -84,9 +105,17 @@ namespace spades {
 			static void PreloadShaders(GLRenderer &);
 
 			void GameMapChanged(int x, int y, int z, client::GameMap *);
+			/**
+			 * Equivalent to calling `GameMapChanged` for every voxel of the column `(x, y)`
+			 * in `mask`, but marks each affected chunk only once.
+			 */
+			void GameMapColumnChanged(int x, int y, uint64_t mask, client::GameMap *);
 
 			client::GameMap *GetMap() { return gameMap; }
 
+			/** Returns the total size of the chunk meshes currently uploaded. */
+			GLMapChunk::MeshStatistics GetMeshStatistics() const;
+
 			void Realize();
 			void Prerender();
 			void RenderSunlightPass();
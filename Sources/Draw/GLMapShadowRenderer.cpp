@@ -60,11 +60,14 @@ namespace spades {
 
 			updateBitmapPitch = (w + 31) / 32;
 			updateBitmap.resize(updateBitmapPitch * h);
+			prebuiltBitmap.resize(updateBitmapPitch * h);
+			prebuiltRows.resize(h);
 
 			coarseBitmap.resize((w * h) >> (CoarseBits * 2));
 
 			bitmap.resize(w * h);
 			std::fill(updateBitmap.begin(), updateBitmap.end(), 0xffffffffUL);
+			std::fill(prebuiltBitmap.begin(), prebuiltBitmap.end(), 0);
 			std::fill(bitmap.begin(), bitmap.end(), 0xffffffffUL);
 		}
 
@@ -93,17 +96,26 @@ namespace spades {
 					continue;
 
 				size_t bitmapPixelPosBase = i * 32;
+				uint32_t prebuilt = prebuiltBitmap[i];
+				prebuiltBitmap[i] = 0;
 
 				uint32_t pixels[32];
 				bool modified = false;
 				for (int j = 0; j < 32; j++) {
-					pixels[j] = GeneratePixel(x + j, y);
-					if (bitmap[bitmapPixelPosBase + j] != pixels[j]) {
+					uint32_t oldPixel = bitmap[bitmapPixelPosBase + j];
+					if ((prebuilt >> j) & 1) {
+						// Generated by `Prebuild` but not uploaded yet
+						pixels[j] = oldPixel;
+						oldPixel = 0xffffffffUL;
+					} else {
+						pixels[j] = GeneratePixel(x + j, y);
+					}
+					if (oldPixel != pixels[j]) {
 						if (radiosity) {
 							int dist = pixels[j] >> 24;
 							radiosity->GameMapChanged(x + j, (y + dist) & (h - 1), dist, map);
 
-							dist = bitmap[bitmapPixelPosBase + j] >> 24;
+							dist = oldPixel >> 24;
 							radiosity->GameMapChanged(x + j, (y + dist) & (h - 1), dist, map);
 						}
 						bitmap[bitmapPixelPosBase + j] = pixels[j];
@@ -221,11 +233,64 @@ namespace spades {
 			x &= w - 1;
 			y &= h - 1;
 			updateBitmap[(x >> 5) + y * updateBitmapPitch] |= 1UL << (x & 31);
+			prebuiltBitmap[(x >> 5) + y * updateBitmapPitch] &= ~(1UL << (x & 31));
+		}
+
+		void GLMapShadowRenderer::Prebuild(const std::vector<bool> &decodedRows) {
+			SPADES_MARK_FUNCTION();
+
+			SPAssert(decodedRows.size() == static_cast<std::size_t>(h));
+
+			// `GeneratePixel(x, y)` reads the rows `y` to `y + d`
+			std::vector<int> numUndecodedRows(h);
+			int numUndecoded = 0;
+			for (int i = 0; i <= d; i++) {
+				if (!decodedRows[i & (h - 1)]) {
+					numUndecoded++;
+				}
+			}
+			for (int y = 0; y < h; y++) {
+				numUndecodedRows[y] = numUndecoded;
+				if (!decodedRows[y]) {
+					numUndecoded--;
+				}
+				if (!decodedRows[(y + d + 1) & (h - 1)]) {
+					numUndecoded++;
+				}
+			}
+
+			for (int y = 0; y < h; y++) {
+				if (prebuiltRows[y] || numUndecodedRows[y] > 0) {
+					continue;
+				}
+
+				for (int x = 0; x < w; x++) {
+					bitmap[x + y * w] = GeneratePixel(x, y);
+				}
+				for (size_t i = 0; i < updateBitmapPitch; i++) {
+					prebuiltBitmap[i + y * updateBitmapPitch] = 0xffffffffUL;
+				}
+				prebuiltRows[y] = true;
+			}
 		}
 
 		void GLMapShadowRenderer::GameMapChanged(int x, int y, int z, client::GameMap *m) {
 			MarkUpdate(x, y - z);
 			MarkUpdate(x, y - z - 1);
 		}
+
+		void GLMapShadowRenderer::GameMapColumnChanged(int x, int y, uint64_t mask,
+		                                               client::GameMap *) {
+			// The voxel `z` affects the pixels `(x, y - z)` and `(x, y - z - 1)`
+			uint64_t rows = mask | (mask << 1);
+			while (rows) {
+				int z = CountTrailingZeros64(rows);
+				rows &= rows - 1;
+				MarkUpdate(x, y - z);
+			}
+			if (mask >> 63) {
+				MarkUpdate(x, y - 64);
+			}
+		}
 	} // namespace draw
 } // namespace spades
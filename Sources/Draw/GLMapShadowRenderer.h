@@ -49,6 +49,11 @@ namespace spades {
 			size_t updateBitmapPitch;
 			std::vector<uint32_t> updateBitmap;
 
+			/** Bits of the pixels in `bitmap` generated by `Prebuild` but not uploaded yet. */
+			std::vector<uint32_t> prebuiltBitmap;
+			/** `prebuiltRows[y]` is `true` if the row `y` was generated by `Prebuild`. */
+			std::vector<bool> prebuiltRows;
+
 			std::vector<uint32_t> bitmap;
 			std::vector<uint32_t> coarseBitmap;
 
@@ -60,6 +65,19 @@ namespace spades {
 			~GLMapShadowRenderer();
 
 			void GameMapChanged(int x, int y, int z, client::GameMap *);
+			/**
+			 * Equivalent to calling `GameMapChanged` for every voxel of the column `(x, y)`
+			 * in `mask`, but marks each affected pixel only once.
+			 */
+			void GameMapColumnChanged(int x, int y, uint64_t mask, client::GameMap *);
+
+			client::GameMap *GetMap() { return map; }
+
+			/**
+			 * Generates the pixels of the rows whose voxels are all decoded. They are
+			 * uploaded by the next call to `Update`. See `client::IRenderer::PrebuildGameMap`.
+			 */
+			void Prebuild(const std::vector<bool> &decodedRows);
 
 			void Update();
 
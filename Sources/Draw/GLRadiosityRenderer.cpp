@@ -18,6 +18,7 @@
 
  */
 
+#include <algorithm>
 #include <atomic>
 #include <cstdlib>
 
@@ -28,6 +29,7 @@
 
 #include <Core/ConcurrentDispatch.h>
 #include <Core/Settings.h>
+#include <Core/TaskScheduler.h>
 #if defined(__APPLE__)
 #if defined(__x86_64__)
 #include <xmmintrin.h>
@@ -38,6 +40,13 @@
 
 #include "GLProfiler.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ENABLE_SSE2 1
+#include <emmintrin.h>
+#else
+#define ENABLE_SSE2 0
+#endif
+
 namespace spades {
 	namespace draw {
 		class GLRadiosityRenderer::UpdateDispatch : public ConcurrentDispatch {
@@ -141,6 +150,7 @@ namespace spades {
 				}
 			}
 			dispatch = NULL;
+			convergenceTime = -1.0;
 
 			SPLog("Chunk texture initialized");
 		}
@@ -274,6 +284,129 @@ namespace spades {
 			return result;
 		}
 
+		void GLRadiosityRenderer::EvaluateRow(IntVector3 ipos, Result *results) {
+			SPADES_MARK_FUNCTION_DEBUG();
+
+#if ENABLE_SSE2
+			// Lane `i` evaluates the voxel at `ipos.x + i`. The shadow map columns are visited
+			// once for the union of the lanes' envelopes, and each lane ignores the columns
+			// outside its own envelope. The arithmetic is done in the same order as `Evaluate`.
+			GLMapShadowRenderer *shadowmap = renderer.mapShadowRenderer;
+			const uint32_t *bitmap = shadowmap->bitmap.data();
+			const int centerX = ipos.x;
+			const int centerY = ipos.y - ipos.z;
+			const int yMask = h - 1;
+			const int pitch = w;
+
+			const float posY = ipos.y + .5f;
+			const float posZ = ipos.z + .5f;
+
+			const __m128 lanes = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+			const __m128 signMask = _mm_set1_ps(-0.f);
+			const __m128 one = _mm_set1_ps(1.f);
+
+			__m128 baseR = _mm_setzero_ps(), baseG = _mm_setzero_ps(), baseB = _mm_setzero_ps();
+			__m128 xR = _mm_setzero_ps(), xG = _mm_setzero_ps(), xB = _mm_setzero_ps();
+			__m128 yR = _mm_setzero_ps(), yG = _mm_setzero_ps(), yB = _mm_setzero_ps();
+			__m128 zR = _mm_setzero_ps(), zG = _mm_setzero_ps(), zB = _mm_setzero_ps();
+
+			for (int x = -Envelope; x < Envelope + RowSize; x++) {
+				const uint32_t *column = bitmap + ((centerX + x) & (w - 1));
+
+				// pos.x - center.x
+				__m128 diffX = _mm_sub_ps(lanes, _mm_set1_ps(static_cast<float>(x)));
+				__m128 diffX2 = _mm_mul_ps(diffX, diffX);
+				__m128 laneMask = _mm_cmple_ps(_mm_andnot_ps(signMask, diffX),
+				                               _mm_set1_ps(static_cast<float>(Envelope)));
+
+				for (int y = -Envelope; y <= Envelope; y++) {
+					uint32_t pixel = column[pitch * ((centerY + y) & yMask)];
+					int depth = pixel >> 24;
+
+					// shadowmap pixel's world coord
+					int wy = centerY + y + depth;
+					int wz = depth;
+
+					bool isSide = (pixel & 0x80) != 0;
+
+					float diffY, diffZ, diffDot;
+					if (isSide) {
+						// normal cull (the same for all lanes)
+						if (wy <= ipos.y)
+							continue;
+
+						diffY = posY - static_cast<float>(wy);
+						diffZ = posZ - (wz - .5f);
+						diffDot = -diffY;
+					} else {
+						if (wz <= ipos.z)
+							continue;
+
+						diffY = posY - (wy + .5f);
+						diffZ = posZ - static_cast<float>(wz);
+						diffDot = -diffZ;
+					}
+
+					__m128 diffLen = _mm_add_ps(diffX2, _mm_set1_ps(diffY * diffY));
+					diffLen = _mm_sqrt_ps(_mm_add_ps(diffLen, _mm_set1_ps(diffZ * diffZ)));
+					__m128 invDiffLen = _mm_div_ps(one, diffLen);
+					__m128 invDiffLenSmooth =
+					  _mm_div_ps(one, _mm_add_ps(diffLen, _mm_set1_ps(.4f)));
+
+					__m128 intensity = _mm_mul_ps(_mm_set1_ps(diffDot), invDiffLen);
+					intensity = _mm_mul_ps(intensity, invDiffLenSmooth);
+					intensity = _mm_mul_ps(intensity, invDiffLenSmooth);
+					intensity = _mm_and_ps(intensity, laneMask);
+
+					__m128 negInvDiffLen = _mm_xor_ps(invDiffLen, signMask);
+					__m128 normX = _mm_mul_ps(diffX, negInvDiffLen);
+					__m128 normY = _mm_mul_ps(_mm_set1_ps(diffY), negInvDiffLen);
+					__m128 normZ = _mm_mul_ps(_mm_set1_ps(diffZ), negInvDiffLen);
+
+					__m128 red =
+					  _mm_mul_ps(_mm_set1_ps(static_cast<float>(pixel & 0x3f)), intensity);
+					__m128 green =
+					  _mm_mul_ps(_mm_set1_ps(static_cast<float>((pixel >> 8) & 0x3f)), intensity);
+					__m128 blue =
+					  _mm_mul_ps(_mm_set1_ps(static_cast<float>((pixel >> 16) & 0x3f)), intensity);
+
+					baseR = _mm_add_ps(baseR, red);
+					baseG = _mm_add_ps(baseG, green);
+					baseB = _mm_add_ps(baseB, blue);
+					xR = _mm_add_ps(xR, _mm_mul_ps(red, normX));
+					xG = _mm_add_ps(xG, _mm_mul_ps(green, normX));
+					xB = _mm_add_ps(xB, _mm_mul_ps(blue, normX));
+					yR = _mm_add_ps(yR, _mm_mul_ps(red, normY));
+					yG = _mm_add_ps(yG, _mm_mul_ps(green, normY));
+					yB = _mm_add_ps(yB, _mm_mul_ps(blue, normY));
+					zR = _mm_add_ps(zR, _mm_mul_ps(red, normZ));
+					zG = _mm_add_ps(zG, _mm_mul_ps(green, normZ));
+					zB = _mm_add_ps(zB, _mm_mul_ps(blue, normZ));
+				}
+			}
+
+			alignas(16) float out[12][RowSize];
+			const __m128 accumulators[12] = {baseR, baseG, baseB, xR, xG, xB,
+			                                 yR,    yG,    yB,    zR, zG, zB};
+			for (int i = 0; i < 12; i++) {
+				_mm_store_ps(out[i], accumulators[i]);
+			}
+
+			float scale = 0.1f / 64.f;
+			for (int i = 0; i < RowSize; i++) {
+				Result &result = results[i];
+				result.base = MakeVector3(out[0][i], out[1][i], out[2][i]) * scale;
+				result.x = MakeVector3(out[3][i], out[4][i], out[5][i]) * scale;
+				result.y = MakeVector3(out[6][i], out[7][i], out[8][i]) * scale;
+				result.z = MakeVector3(out[9][i], out[10][i], out[11][i]) * scale;
+			}
+#else
+			for (int i = 0; i < RowSize; i++) {
+				results[i] = Evaluate(IntVector3::Make(ipos.x + i, ipos.y, ipos.z));
+			}
+#endif
+		}
+
 		void GLRadiosityRenderer::GameMapChanged(int x, int y, int z, client::GameMap *map) {
 			SPADES_MARK_FUNCTION_DEBUG();
 			if (map != this->map)
@@ -346,7 +479,9 @@ namespace spades {
 		}
 
 		void GLRadiosityRenderer::Update() {
-			if (GetNumDirtyChunks() > 0 && (dispatch == NULL || dispatch->done.load())) {
+			int numDirtyChunks = GetNumDirtyChunks();
+			bool dispatchRunning = dispatch != NULL && !dispatch->done.load();
+			if (numDirtyChunks > 0 && !dispatchRunning) {
 				if (dispatch) {
 					dispatch->Join();
 					delete dispatch;
@@ -389,6 +524,12 @@ namespace spades {
 					                     IGLDevice::UnsignedInt2101010Rev, c.dataZ);
 				}
 			}
+
+			// every chunk was evaluated and the last results were uploaded just now
+			if (convergenceTime < 0.0 && numDirtyChunks == 0 && !dispatchRunning) {
+				convergenceTime = clock.GetTime();
+				SPLog("Radiosity converged in %.2fs after the map was loaded", convergenceTime);
+			}
 		}
 
 		void GLRadiosityRenderer::UpdateDirtyChunks() {
@@ -433,21 +574,21 @@ namespace spades {
 				}
 			}
 
-			// limit update count per frame
-			for (int i = 0; i < 8; i++) {
-				if (numDirtyChunks <= 0)
-					break;
-				int idx = SampleRandomInt(0, numDirtyChunks - 1);
-				Chunk &c = chunks[dirtyChunkIds[idx]];
-
-				// remove from list (fast)
-				if (idx < numDirtyChunks - 1) {
-					std::swap(dirtyChunkIds[idx], dirtyChunkIds[numDirtyChunks - 1]);
-				}
-				numDirtyChunks--;
+			// visit them in a random order
+			for (int i = numDirtyChunks - 1; i > 0; i--) {
+				std::swap(dirtyChunkIds[i], dirtyChunkIds[SampleRandomInt(0, i)]);
+			}
 
+			// limit update time per frame. the remaining chunks are skipped and left dirty
+			// (at least one is always updated)
+			Stopwatch sw;
+			double budget = std::max((float)settings.r_radiosityUpdateBudget, 0.f) * 0.001;
+			ParallelFor(0, numDirtyChunks, [&](int i) {
+				if (i > 0 && sw.GetTime() >= budget)
+					return;
+				Chunk &c = chunks[dirtyChunkIds[i]];
 				UpdateChunk(c.cx, c.cy, c.cz);
-			}
+			});
 			/*
 			printf("%d (%d near) chunk update left\n",
 			       GetNumDirtyChunks(), nearDirtyChunks);*/
@@ -525,17 +666,23 @@ namespace spades {
 
 			for (int z = c.dirtyMinZ; z <= c.dirtyMaxZ; z++)
 				for (int y = c.dirtyMinY; y <= c.dirtyMaxY; y++)
-					for (int x = c.dirtyMinX; x <= c.dirtyMaxX; x++) {
+					for (int x = c.dirtyMinX; x <= c.dirtyMaxX; x += RowSize) {
 						IntVector3 pos;
 						pos.x = (x + originX);
 						pos.y = (y + originY);
 						pos.z = (z + originZ);
 
-						Result res = Evaluate(pos);
-						c.dataFlat[z][y][x] = EncodeValue(res.base);
-						c.dataX[z][y][x] = EncodeValue(res.x);
-						c.dataY[z][y][x] = EncodeValue(res.y);
-						c.dataZ[z][y][x] = EncodeValue(res.z);
+						Result res[RowSize];
+						EvaluateRow(pos, res);
+
+						// the last row may extend past the dirty region
+						int count = std::min<int>(RowSize, c.dirtyMaxX - x + 1);
+						for (int i = 0; i < count; i++) {
+							c.dataFlat[z][y][x + i] = EncodeValue(res[i].base);
+							c.dataX[z][y][x + i] = EncodeValue(res[i].x);
+							c.dataY[z][y][x + i] = EncodeValue(res[i].y);
+							c.dataZ[z][y][x + i] = EncodeValue(res[i].z);
+						}
 					}
 
 			c.dirty = false;
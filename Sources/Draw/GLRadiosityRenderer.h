@@ -27,6 +27,7 @@
 #include "IGLDevice.h"
 #include <Core/Debug.h>
 #include <Core/Math.h>
+#include <Core/Stopwatch.h>
 
 namespace spades {
 	namespace client {
@@ -41,7 +42,7 @@ namespace spades {
 			typedef uint32_t VoxelType;
 
 			class UpdateDispatch;
-			enum { ChunkSize = 16, ChunkSizeBits = 4, Envelope = 6 };
+			enum { ChunkSize = 16, ChunkSizeBits = 4, Envelope = 6, RowSize = 4 };
 			GLRenderer &renderer;
 			IGLDevice &device;
 			GLSettings &settings;
@@ -89,6 +90,11 @@ namespace spades {
 			void Invalidate(int minX, int minY, int minZ, int maxX, int maxY, int maxZ);
 
 			void UpdateChunk(int cx, int cy, int cz);
+			/**
+			 * Updates up to 256 dirty chunks on all worker threads, in a random order, until
+			 * `r_radiosityUpdateBudget` milliseconds have elapsed. The chunks near the camera
+			 * are updated before any far chunk.
+			 */
 			void UpdateDirtyChunks();
 			int GetNumDirtyChunks();
 
@@ -97,6 +103,10 @@ namespace spades {
 
 			UpdateDispatch *dispatch;
 
+			/** The time base of `convergenceTime`, started when the map is loaded. */
+			Stopwatch clock;
+			double convergenceTime;
+
 		public:
 			struct Result {
 				Vector3 base, x, y, z;
@@ -107,10 +117,23 @@ namespace spades {
 
 			Result Evaluate(IntVector3);
 
+			/**
+			 * Evaluates `RowSize` voxels starting at `pos` along the X axis. Produces the same
+			 * results as `Evaluate`, but the voxels share the shadow map reads (and are
+			 * evaluated in SIMD lanes if SSE2 is available).
+			 */
+			void EvaluateRow(IntVector3 pos, Result *results);
+
 			void GameMapChanged(int x, int y, int z, client::GameMap *);
 
 			void Update();
 
+			/**
+			 * Returns the time in seconds from the map load until all chunks were evaluated
+			 * and uploaded for the first time, or a negative value if that hasn't happened yet.
+			 */
+			double GetConvergenceTime() const { return convergenceTime; }
+
 			IGLDevice::UInteger GetTextureFlat() { return textureFlat; }
 			IGLDevice::UInteger GetTextureX() { return textureX; }
 			IGLDevice::UInteger GetTextureY() { return textureY; }
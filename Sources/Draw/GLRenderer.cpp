@@ -332,6 +332,13 @@ namespace spades {
 
 			client::GameMap *oldMap = map;
 
+			std::unique_ptr<GLMapShadowRenderer> prebuiltMapShadowRenderer =
+			  std::move(this->prebuiltMapShadowRenderer);
+			if (prebuiltMap.GetPointerOrNull() != newMap.get_pointer()) {
+				prebuiltMapShadowRenderer.reset();
+			}
+			prebuiltMap = nullptr;
+
 			SPLog("New map loaded; freeing old renderers...");
 			delete radiosityRenderer;
 			radiosityRenderer = NULL;
@@ -349,7 +356,11 @@ namespace spades {
 				SPLog("Creating new renderers...");
 
 				SPLog("Creating Terrain Shadow Map Renderer");
-				mapShadowRenderer = new GLMapShadowRenderer(*this, newMap.get_pointer());
+				if (prebuiltMapShadowRenderer) {
+					mapShadowRenderer = prebuiltMapShadowRenderer.release();
+				} else {
+					mapShadowRenderer = new GLMapShadowRenderer(*this, newMap.get_pointer());
+				}
 				SPLog("Creating TerrainRenderer");
 				mapRenderer = new GLMapRenderer(newMap.get_pointer(), *this);
 				SPLog("Creating Minimap Renderer");
@@ -379,6 +390,23 @@ namespace spades {
 			}
 		}
 
+		void GLRenderer::PrebuildGameMap(client::GameMap &map,
+		                                 const std::vector<bool> &decodedRows) {
+			SPADES_MARK_FUNCTION();
+
+			EnsureInitialized();
+
+			// The terrain meshes are built lazily around the camera, and the ambient
+			// occlusion and radiosity are computed incrementally after the map is loaded, so
+			// only the terrain shadow map is prebuilt here.
+			if (prebuiltMap.GetPointerOrNull() != &map) {
+				prebuiltMapShadowRenderer.reset();
+				prebuiltMap = Handle<client::GameMap>{map};
+				prebuiltMapShadowRenderer.reset(new GLMapShadowRenderer(*this, &map));
+			}
+			prebuiltMapShadowRenderer->Prebuild(decodedRows);
+		}
+
 		float GLRenderer::ScreenWidth() { return device->ScreenWidth(); }
 
 		float GLRenderer::ScreenHeight() { return device->ScreenHeight(); }
@@ -1374,6 +1402,28 @@ namespace spades {
 				ambientShadowRenderer->GameMapChanged(x, y, z, map);
 		}
 
+		void GLRenderer::GameMapColumnsChanged(
+		  const std::vector<client::GameMapDirtyColumn> &columns, client::GameMap *map) {
+			SPADES_MARK_FUNCTION();
+
+			for (const client::GameMapDirtyColumn &column : columns) {
+				int x = column.x, y = column.y;
+
+				// These only care about which columns were modified
+				if (flatMapRenderer)
+					flatMapRenderer->GameMapChanged(x, y, CountTrailingZeros64(column.mask), *map);
+				if (waterRenderer && (column.mask >> 63))
+					waterRenderer->GameMapChanged(x, y, 63, map);
+
+				if (mapRenderer)
+					mapRenderer->GameMapColumnChanged(x, y, column.mask, map);
+				if (mapShadowRenderer)
+					mapShadowRenderer->GameMapColumnChanged(x, y, column.mask, map);
+				if (ambientShadowRenderer)
+					ambientShadowRenderer->GameMapColumnChanged(x, y, column.mask, map);
+			}
+		}
+
 		bool GLRenderer::BoxFrustrumCull(const AABB3 &box) {
 			if (IsRenderingMirror()) {
 				// reflect
@@ -97,6 +97,11 @@ namespace spades {
 			std::unique_ptr<IGLShadowMapRenderer> shadowMapRenderer;
 			GLMapShadowRenderer *mapShadowRenderer;
 			GLMapRenderer *mapRenderer;
+
+			/** The map being decoded, passed to `PrebuildGameMap`. */
+			Handle<client::GameMap> prebuiltMap;
+			std::unique_ptr<GLMapShadowRenderer> prebuiltMapShadowRenderer;
+
 			GLImageRenderer *imageRenderer;
 			GLFlatMapRenderer *flatMapRenderer;
 			GLModelRenderer *modelRenderer;
@@ -176,6 +181,8 @@ namespace spades {
 			GLShader *RegisterShader(const std::string &name);
 
 			void SetGameMap(stmp::optional<client::GameMap &>) override;
+			void PrebuildGameMap(client::GameMap &,
+			                     const std::vector<bool> &decodedRows) override;
 			void SetFogColor(Vector3 v) override;
 			void SetFogDistance(float f) override { fogDistance = f; }
 
@@ -229,6 +236,7 @@ namespace spades {
 			GLFramebufferManager *GetFramebufferManager() { return fbManager.get(); }
 			IGLShadowMapRenderer *GetShadowMapRenderer() { return shadowMapRenderer.get(); }
 			GLAmbientShadowRenderer *GetAmbientShadowRenderer() { return ambientShadowRenderer; }
+			GLMapRenderer *GetMapRenderer() { return mapRenderer; }
 			GLMapShadowRenderer *GetMapShadowRenderer() { return mapShadowRenderer; }
 			GLRadiosityRenderer *GetRadiosityRenderer() { return radiosityRenderer; }
 			GLModelRenderer *GetModelRenderer() { return modelRenderer; }
@@ -242,6 +250,8 @@ namespace spades {
 			bool IsRenderingMirror() const { return renderingMirror; }
 
 			void GameMapChanged(int x, int y, int z, client::GameMap *) override;
+			void GameMapColumnsChanged(const std::vector<client::GameMapDirtyColumn> &,
+			                           client::GameMap *) override;
 
 			const client::SceneDefinition &GetSceneDef() const { return sceneDef; }
 
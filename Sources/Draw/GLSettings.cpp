@@ -50,6 +50,9 @@ DEFINE_SPADES_SETTING(r_highPrec, "1");
 DEFINE_SPADES_SETTING(r_lens, "1");
 DEFINE_SPADES_SETTING(r_lensFlare, "1");
 DEFINE_SPADES_SETTING(r_lensFlareDynamic, "1");
+DEFINE_SPADES_SETTING(r_mapAsyncMeshing, "1");
+DEFINE_SPADES_SETTING(r_mapChunkUploadBudget, "1024");
+DEFINE_SPADES_SETTING(r_mapGreedyMeshing, "0");
 DEFINE_SPADES_SETTING(r_mapSoftShadow, "0");
 DEFINE_SPADES_SETTING(r_maxAnisotropy, "8");
 DEFINE_SPADES_SETTING(r_modelShadows, "1");
@@ -58,6 +61,7 @@ DEFINE_SPADES_SETTING(r_occlusionQuery, "0");
 DEFINE_SPADES_SETTING(r_optimizedVoxelModel, "1");
 DEFINE_SPADES_SETTING(r_physicalLighting, "0");
 DEFINE_SPADES_SETTING(r_radiosity, "0");
+DEFINE_SPADES_SETTING(r_radiosityUpdateBudget, "4");
 DEFINE_SPADES_SETTING(r_saturation, "1");
 DEFINE_SPADES_SETTING(r_scale, "1");
 DEFINE_SPADES_SETTING(r_scaleFilter, "1");
@@ -56,6 +56,9 @@ namespace spades {
 			TypedItemHandle<bool> r_lens                { *this, "r_lens" };
 			TypedItemHandle<bool> r_lensFlare           { *this, "r_lensFlare" };
 			TypedItemHandle<bool> r_lensFlareDynamic    { *this, "r_lensFlareDynamic" };
+			TypedItemHandle<bool> r_mapAsyncMeshing     { *this, "r_mapAsyncMeshing" };
+			TypedItemHandle<int> r_mapChunkUploadBudget { *this, "r_mapChunkUploadBudget" };
+			TypedItemHandle<bool> r_mapGreedyMeshing    { *this, "r_mapGreedyMeshing", ItemFlags::Latch };
 			TypedItemHandle<bool> r_mapSoftShadow       { *this, "r_mapSoftShadow", ItemFlags::Latch };
 			TypedItemHandle<float> r_maxAnisotropy      { *this, "r_maxAnisotropy", ItemFlags::Latch };
 			TypedItemHandle<bool> r_modelShadows        { *this, "r_modelShadows", ItemFlags::Latch };
@@ -64,6 +67,7 @@ namespace spades {
 			TypedItemHandle<bool> r_optimizedVoxelModel { *this, "r_optimizedVoxelModel", ItemFlags::Latch };
 			TypedItemHandle<bool> r_physicalLighting    { *this, "r_physicalLighting", ItemFlags::Latch };
 			TypedItemHandle<int> r_radiosity            { *this, "r_radiosity", ItemFlags::Latch };
+			TypedItemHandle<float> r_radiosityUpdateBudget{ *this, "r_radiosityUpdateBudget" };
 			TypedItemHandle<float> r_saturation         { *this, "r_saturation" };
 			TypedItemHandle<float> r_scale              { *this, "r_scale" };
 			TypedItemHandle<int> r_scaleFilter          { *this, "r_scaleFilter" };
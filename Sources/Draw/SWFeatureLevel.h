@@ -47,6 +47,15 @@
 #define ENABLE_SSE2 0
 #endif
 
+// The AVX2 kernels are built only when the build system enables them (`OPENSPADES_AVX2`).
+// They live in SWKernelsAVX2.cpp, the only translation unit compiled with AVX2 code
+// generation enabled, so the AVX2 intrinsics aren't included here.
+#if ENABLE_SSE2 && defined(OPENSPADES_ENABLE_AVX2) && (defined(__x86_64__) || defined(_M_X64))
+#define ENABLE_AVX2 1
+#else
+#define ENABLE_AVX2 0
+#endif
+
 #if ENABLE_SSE
 #include <xmmintrin.h>
 #endif
@@ -74,6 +83,9 @@ namespace spades {
 #endif
 #if ENABLE_SSE2
 			SSE2,
+#endif
+#if ENABLE_AVX2
+			AVX2,
 #endif
 		};
 
@@ -19,14 +19,17 @@
  */
 
 #include <algorithm>
+#include <atomic>
 
 #include "SWFlatMapRenderer.h"
 #include "SWImage.h"
 #include "SWMapRenderer.h"
 #include "SWRenderer.h"
+#include "SWUtils.h"
 #include <Client/GameMap.h>
 #include <Core/Debug.h>
 #include <Core/Exception.h>
+#include <Core/Math.h>
 
 namespace spades {
 	namespace draw {
@@ -34,15 +37,19 @@ namespace spades {
 		    : r(r), map(std::move(inMap)), w(map->Width()), h(map->Height()), needsUpdate(true) {
 			SPADES_MARK_FUNCTION();
 
-			if (w & 31) {
-				SPRaise("Map width must be a multiple of 32.");
+			if ((w & (TileSize - 1)) || (h & (TileSize - 1))) {
+				SPRaise("Map size must be a multiple of %d.", static_cast<int>(TileSize));
 			}
+			numTilesX = w >> TileSizeBits;
+			numTilesY = h >> TileSizeBits;
 
 			img = Handle<SWImage>::New(map->Width(), map->Height());
-			updateMap.resize(w * h / 32);
-			std::fill(updateMap.begin(), updateMap.end(), 0xffffffff);
-			updateMap2.resize(w * h / 32);
-			std::fill(updateMap2.begin(), updateMap2.end(), 0xffffffff);
+			updateMap.assign(w * h / 32, 0xffffffff);
+			updateMap2.assign(w * h / 32, 0);
+			tileQueued.assign(numTilesX * numTilesY, true);
+			for (int i = 0; i < numTilesX * numTilesY; i++) {
+				dirtyTiles.push_back(i);
+			}
 
 			Update(true);
 		}
@@ -58,56 +65,84 @@ namespace spades {
 					return;
 				needsUpdate = false;
 				updateMap.swap(updateMap2);
-				std::fill(updateMap.begin(), updateMap.end(), 0);
+				dirtyTiles.swap(dirtyTiles2);
+				for (int tileIndex : dirtyTiles2) {
+					tileQueued[tileIndex] = false;
+				}
 			}
-			auto *outPixels = img->GetRawBitmap();
 
-			auto *mapRenderer = r.mapRenderer.get();
+			std::atomic<std::size_t> nextTile{0};
+			InvokeParallel2([&](unsigned int, unsigned int) {
+				std::size_t i;
+				while ((i = nextTile.fetch_add(1)) < dirtyTiles2.size()) {
+					GenerateTile(dirtyTiles2[i], firstTime);
+				}
+			});
 
-			int idx = 0;
-			for (int y = 0; y < h; y++) {
-				for (int x = 0; x < w; x += 32) {
-					uint32_t upd = updateMap2[idx];
-					if (upd) {
-						for (int i = 0; i < 32; i++) {
-							if (upd & 1) {
-								auto c = GeneratePixel(x + i, y);
-								outPixels[i] = c;
-								if (!firstTime) {
-									mapRenderer->UpdateRle(x + i, y);
-									mapRenderer->UpdateRle((x + i + 1) & (w - 1), y);
-									mapRenderer->UpdateRle((x + i - 1) & (w - 1), y);
-									mapRenderer->UpdateRle(x + i, (y + 1) & (h - 1));
-									mapRenderer->UpdateRle(x + i, (y - 1) & (h - 1));
-								}
-							}
-							upd >>= 1;
-						}
-						// updateMap[idx] = 0;
+			// `SWMapRenderer::UpdateRle` isn't thread-safe. Clear `updateMap2` on the way.
+			auto *mapRenderer = r.mapRenderer.get();
+			int wordsPerRow = w >> 5;
+			for (int tileIndex : dirtyTiles2) {
+				int x = (tileIndex % numTilesX) << TileSizeBits;
+				int y1 = (tileIndex / numTilesX) << TileSizeBits;
+				for (int y = y1; y < y1 + TileSize; y++) {
+					uint32_t &word = updateMap2[(x >> 5) + y * wordsPerRow];
+					uint32_t upd = word;
+					word = 0;
+					if (firstTime) {
+						continue;
+					}
+					while (upd) {
+						int i = CountTrailingZeros64(upd);
+						upd &= upd - 1;
+						mapRenderer->UpdateRle(x + i, y);
+						mapRenderer->UpdateRle((x + i + 1) & (w - 1), y);
+						mapRenderer->UpdateRle((x + i - 1) & (w - 1), y);
+						mapRenderer->UpdateRle(x + i, (y + 1) & (h - 1));
+						mapRenderer->UpdateRle(x + i, (y - 1) & (h - 1));
 					}
-					outPixels += 32;
-					idx++;
 				}
 			}
+			dirtyTiles2.clear();
 		}
 
-		uint32_t SWFlatMapRenderer::GeneratePixel(int x, int y) {
-			const int depth = map->Depth();
-			for (int z = 0; z < depth; z++) {
-				if (map->IsSolid(x, y, z)) {
-					uint32_t col = map->GetColor(x, y, z);
-					col = (col & 0xff00) | ((col & 0xff) << 16) | ((col & 0xff0000) >> 16);
-					col |= 0xff000000;
-					return col;
+		void SWFlatMapRenderer::GenerateTile(int tileIndex, bool all) {
+			int x = (tileIndex % numTilesX) << TileSizeBits;
+			int y1 = (tileIndex / numTilesX) << TileSizeBits;
+			int wordsPerRow = w >> 5;
+			auto *outPixels = img->GetRawBitmap();
+			for (int y = y1; y < y1 + TileSize; y++) {
+				uint32_t upd = all ? 0xffffffff : updateMap2[(x >> 5) + y * wordsPerRow];
+				uint32_t *out = outPixels + x + y * w;
+				while (upd) {
+					int i = CountTrailingZeros64(upd);
+					upd &= upd - 1;
+					out[i] = GeneratePixel(x + i, y);
 				}
 			}
-			return 0; // shouldn't reach here for valid maps
+		}
+
+		uint32_t SWFlatMapRenderer::GeneratePixel(int x, int y) {
+			uint64_t solid = map->GetSolidMapWrapped(x, y);
+			if (!solid) {
+				return 0; // shouldn't reach here for valid maps
+			}
+			uint32_t col = map->GetColor(x, y, CountTrailingZeros64(solid));
+			col = (col & 0xff00) | ((col & 0xff) << 16) | ((col & 0xff0000) >> 16);
+			col |= 0xff000000;
+			return col;
 		}
 
 		void SWFlatMapRenderer::SetNeedsUpdate(int x, int y) {
 			std::lock_guard<std::mutex> lock(updateInfoLock);
 			needsUpdate = true;
 			updateMap[(x + y * w) >> 5] |= 1 << (x & 31);
+
+			int tileIndex = (x >> TileSizeBits) + (y >> TileSizeBits) * numTilesX;
+			if (!tileQueued[tileIndex]) {
+				tileQueued[tileIndex] = true;
+				dirtyTiles.push_back(tileIndex);
+			}
 		}
 	} // namespace draw
 } // namespace spades
@@ -33,17 +33,39 @@ namespace spades {
 		class SWRenderer;
 		class SWImage;
 
+		/**
+		 * Generates the top view of the map. The image is divided into 32x32 tiles, and only
+		 * the tiles with changed columns are regenerated (in parallel) by `Update`.
+		 */
 		class SWFlatMapRenderer {
+			enum { TileSize = 32, TileSizeBits = 5 };
+
 			SWRenderer &r;
 			Handle<SWImage> img;
 			Handle<client::GameMap> map;
 			int w, h;
+			int numTilesX, numTilesY;
+
 			std::mutex updateInfoLock;
+			/**
+			 * A bitmap of the changed columns, one bit per column. A word covers one row of a
+			 * tile. Filled by `SetNeedsUpdate`.
+			 */
 			std::vector<uint32_t> updateMap;
-			std::vector<uint32_t> updateMap2;
+			/** The indices of the tiles with a bit set in `updateMap`. */
+			std::vector<int> dirtyTiles;
+			std::vector<bool> tileQueued;
 			bool volatile needsUpdate;
 
+			/**
+			 * The counterparts of `updateMap` and `dirtyTiles` being processed by `Update`.
+			 * `updateMap2` is all zeros outside `Update`.
+			 */
+			std::vector<uint32_t> updateMap2;
+			std::vector<int> dirtyTiles2;
+
 			uint32_t GeneratePixel(int x, int y);
+			void GenerateTile(int tileIndex, bool all);
 
 		public:
 			SWFlatMapRenderer(SWRenderer &r, Handle<client::GameMap>);
@@ -0,0 +1,161 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <cstdio>
+
+#include "BenchmarkScene.h"
+#include "SWFeatureLevel.h"
+#include "SWFrameBenchmark.h"
+#include "SWOffscreenPort.h"
+#include "SWRenderer.h"
+#include <Client/GameMap.h>
+#include <Core/Debug.h>
+#include <Core/Exception.h>
+#include <Core/Settings.h>
+#include <Core/Stopwatch.h>
+
+SPADES_SETTING(r_swNumThreads);
+
+namespace spades {
+	namespace draw {
+		namespace SWFrameBenchmark {
+			namespace {
+				SWFeatureLevel ParseFeatureLevel(const std::string &name) {
+					SWFeatureLevel detected = DetectFeatureLevel();
+					if (name.empty()) {
+						return detected;
+					}
+
+					SWFeatureLevel level;
+					if (EqualsIgnoringCase(name, "none")) {
+						level = SWFeatureLevel::None;
+					} else if (EqualsIgnoringCase(name, "sse2")) {
+						level = SWFeatureLevel::SSE2;
+#if ENABLE_AVX2
+					} else if (EqualsIgnoringCase(name, "avx2")) {
+						level = SWFeatureLevel::AVX2;
+#endif
+					} else {
+						SPRaise("Unknown feature level: %s (none, sse2, or avx2 expected)",
+						        name.c_str());
+					}
+					if (static_cast<int>(level) > static_cast<int>(detected)) {
+						SPRaise("Feature level '%s' isn't supported by this CPU or build",
+						        name.c_str());
+					}
+					return level;
+				}
+
+				int RunInner(const Options &options) {
+					if (options.numFrames <= 0) {
+						SPRaise("The number of frames must be positive");
+					}
+
+					BenchmarkScene scene(options.scriptPath);
+					SWFeatureLevel level = ParseFeatureLevel(options.featureLevel);
+					if (options.numThreads > 0) {
+						r_swNumThreads = options.numThreads;
+					}
+
+					Stopwatch sw;
+					Handle<client::GameMap> map = LoadBenchmarkMap(options.mapPath);
+					double mapLoadTime = sw.GetTime();
+
+					auto port = Handle<SWOffscreenPort>::New(options.width, options.height);
+					auto renderer = Handle<SWRenderer>::New(port.Cast<SWPort>(), level);
+					renderer->Init();
+
+					sw.Reset();
+					renderer->SetGameMap(*map);
+					double rendererSetupTime = sw.GetTime();
+
+					scene.Register(*renderer);
+
+					BenchmarkSamples total{"Total"}, mapStats{"Map"}, models{"Models"},
+					  lightsAndFog{"Lights & fog"}, sprites{"Sprites"}, upscale{"Upscale"},
+					  images{"2D"};
+					// Varies if `r_swDynamicResolution` is enabled
+					double scaleSum = 0.0;
+
+					for (int frame = 0; frame < options.numFrames; frame++) {
+						float t = options.numFrames > 1
+						            ? static_cast<float>(frame) / (options.numFrames - 1)
+						            : 0.f;
+						client::SceneDefinition def =
+						  scene.MakeSceneDefinition(t, options.width, options.height);
+						def.time = static_cast<unsigned int>(frame * 1000 / 60);
+
+						scaleSum += renderer->GetResolutionScale();
+						sw.Reset();
+						scene.Render(*renderer, def, *map);
+						total.samples.push_back(sw.GetTime());
+
+						if (!options.dumpDirectory.empty()) {
+							char name[32];
+							sprintf(name, "/frame%04d.png", frame);
+							SaveBenchmarkFrame(*renderer, options.dumpDirectory + name);
+						}
+
+						renderer->Flip();
+
+						const SWRenderer::FrameTimings &timings = renderer->GetLastFrameTimings();
+						mapStats.samples.push_back(timings.map);
+						models.samples.push_back(timings.models);
+						lightsAndFog.samples.push_back(timings.lightsAndFog);
+						sprites.samples.push_back(timings.sprites);
+						upscale.samples.push_back(timings.upscale);
+						images.samples.push_back(timings.images);
+					}
+
+					printf("Software renderer frame benchmark\n");
+					printf("  Map:            %s (loaded in %.1fms, renderer set up in %.1fms)\n",
+					       options.mapPath.c_str(), mapLoadTime * 1000.0,
+					       rendererSetupTime * 1000.0);
+					printf("  Script:         %s\n", options.scriptPath.c_str());
+					printf("  Frames:         %d at %dx%d, %d thread(s), feature level %d\n",
+					       options.numFrames, options.width, options.height,
+					       static_cast<int>(r_swNumThreads), static_cast<int>(level));
+					total.Print();
+					mapStats.Print();
+					models.Print();
+					lightsAndFog.Print();
+					sprites.Print();
+					upscale.Print();
+					images.Print();
+					printf("  Average resolution scale: %.3f\n", scaleSum / options.numFrames);
+
+					renderer->Shutdown();
+					return 0;
+				}
+			} // namespace
+
+			int Run(const Options &options) {
+				SPADES_MARK_FUNCTION();
+
+				try {
+					return RunInner(options);
+				} catch (const std::exception &ex) {
+					fprintf(stderr, "Software renderer frame benchmark failed: %s\n", ex.what());
+					return 1;
+				}
+			}
+		} // namespace SWFrameBenchmark
+	} // namespace draw
+} // namespace spades
@@ -0,0 +1,62 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <string>
+
+namespace spades {
+	namespace draw {
+		/**
+		 * A headless benchmark of `SWRenderer` that renders a scripted scene into a
+		 * `SWOffscreenPort`. Doesn't need a window or a GPU, so it can run on CI machines.
+		 *
+		 * The scene script is described in `BenchmarkScene`.
+		 */
+		namespace SWFrameBenchmark {
+			struct Options {
+				/** The path of a `.vxl` file in the host filesystem. */
+				std::string mapPath;
+				/** The path of a scene script in the host filesystem. */
+				std::string scriptPath;
+				int width = 1280;
+				int height = 720;
+				int numFrames = 300;
+				/** Overrides `r_swNumThreads` if positive. */
+				int numThreads = 0;
+				/** `none`, `sse2`, or `avx2`. Empty to use the best one the CPU supports. */
+				std::string featureLevel;
+				/**
+				 * If not empty, every frame is saved as `frameNNNN.png` in this directory of the
+				 * host filesystem, to be compared with golden images.
+				 */
+				std::string dumpDirectory;
+			};
+
+			/**
+			 * Renders the frames and prints the time spent in each phase to the standard
+			 * output. Errors are reported to the standard error.
+			 *
+			 * @return The exit code for the process.
+			 */
+			int Run(const Options &);
+		} // namespace SWFrameBenchmark
+	} // namespace draw
+} // namespace spades
@@ -18,14 +18,28 @@
 
  */
 
+#include <atomic>
+
 #include "SWImageRenderer.h"
 #include "SWImage.h"
+#include "SWKernels.h"
+#include "SWUtils.h"
 #include <Core/Bitmap.h>
 
 namespace spades {
 	namespace draw {
 		SWImageRenderer::SWImageRenderer(SWFeatureLevel lvl)
-		    : shader(ShaderType::Image), featureLevel(lvl) {}
+		    : shader(ShaderType::Image),
+		      featureLevel(lvl),
+		      pixelsDrawn(0),
+		      clipMinX(0),
+		      clipMinY(0),
+		      clipMaxX(0),
+		      clipMaxY(0),
+		      batching(false),
+		      batchTrianglesDrawn(0),
+		      batchTilesDrawn(0),
+		      maxTilePixelsDrawn(0) {}
 
 		SWImageRenderer::~SWImageRenderer() {}
 
@@ -36,6 +50,8 @@ namespace spades {
 				                      static_cast<float>(bmp->GetHeight()) * -.5f, 1.f, 1.f);
 				fbCenter4 = MakeVector4(static_cast<float>(bmp->GetWidth()) * .5f,
 				                        static_cast<float>(bmp->GetHeight()) * .5f, 0.f, 0.f);
+				clipMaxX = bmp->GetWidth();
+				clipMaxY = bmp->GetHeight();
 			}
 		}
 
@@ -170,7 +186,6 @@ namespace spades {
 			}
 		};
 
-		enum { texUVScaleBits = 16, texUVScaleInt = 1 << texUVScaleBits };
 		static const float texUVScaleFloat = static_cast<float>(texUVScaleInt);
 
 		struct SWImageVarying {
@@ -282,16 +297,15 @@ namespace spades {
 
 				Bitmap &fb = *r.frame;
 
-				if (v3.position.y <= 0.f) {
+				if (v3.position.y <= static_cast<float>(r.clipMinY)) {
 					// viewport cull
 					return;
 				}
 
 				const int fbW = fb.GetWidth();
-				const int fbH = fb.GetHeight();
 				uint32_t *const bmp = fb.GetPixels();
 
-				if (v1.position.y >= static_cast<float>(fbH)) {
+				if (v1.position.y >= static_cast<float>(r.clipMaxY)) {
 					// viewport cull
 					return;
 				}
@@ -316,9 +330,9 @@ namespace spades {
 					return; // area cull
 				if (y1 == y3)
 					return; // area cull
-				if (std::min(std::min(x1, x2), x3) >= fbW)
+				if (std::min(std::min(x1, x2), x3) >= r.clipMaxX)
 					return; // viewport cull
-				if (std::max(std::max(x1, x2), x3) <= 0)
+				if (std::max(std::max(x1, x2), x3) <= r.clipMinX)
 					return; // viewport cull
 
 				auto convertColor = [](float f) {
@@ -402,7 +416,7 @@ namespace spades {
 					dest = outR | (outG << 8) | (outB << 16);
 				};
 
-				auto drawScanline = [tw, th, tpixels, bmp, fbW, fbH, depthBuffer, &drawPixel, &r,
+				auto drawScanline = [tw, th, tpixels, bmp, fbW, depthBuffer, &drawPixel, &r,
 				                     &ditherMap](int y, int x1, int x2, const SWImageVarying &vary1,
 				                                 const SWImageVarying &vary2, float z1, float z2) {
 					uint32_t *out = bmp + (y * fbW);
@@ -413,8 +427,11 @@ namespace spades {
 					SPAssert(x1 < x2);
 					int width = x2 - x1;
 					SWImageGouraudInterpolator<level> vary(vary1, vary2, width);
-					int minX = std::max(x1, 0);
-					int maxX = std::min(x2, fbW);
+					int minX = std::max(x1, r.clipMinX);
+					int maxX = std::min(x2, r.clipMaxX);
+					if (minX >= maxX) {
+						return; // clipped out
+					}
 					vary.MoveNext(minX - x1);
 					out += minX;
 					if (depthTest) {
@@ -454,8 +471,8 @@ namespace spades {
 				{
 					Interpolator shortSpanX(x1, x2, y2 - y1);
 					SWImageGouraudInterpolator<level> shortSpan(v1, v2, y2 - y1);
-					int minY = std::max(0, y1);
-					int maxY = std::min(fbH, y2);
+					int minY = std::max(r.clipMinY, y1);
+					int maxY = std::min(r.clipMaxY, y2);
 					shortSpanX.MoveNext(minY - y1);
 					shortSpan.MoveNext(minY - y1);
 					longSpanX.MoveNext(minY - y1);
@@ -483,8 +500,8 @@ namespace spades {
 				{
 					Interpolator shortSpanX(x2, x3, y3 - y2);
 					SWImageGouraudInterpolator<level> shortSpan(v2, v3, y3 - y2);
-					int minY = std::max(0, y2);
-					int maxY = std::min(fbH, y3);
+					int minY = std::max(r.clipMinY, y2);
+					int maxY = std::min(r.clipMaxY, y3);
 					shortSpanX.MoveNext(minY - y2);
 					shortSpan.MoveNext(minY - y2);
 					longSpanX.MoveNext(minY - y2);
@@ -547,16 +564,15 @@ namespace spades {
 
 				Bitmap &fb = *r.frame;
 
-				if (v3.position.y <= 0.f) {
+				if (v3.position.y <= static_cast<float>(r.clipMinY)) {
 					// viewport cull
 					return;
 				}
 
 				const int fbW = fb.GetWidth();
-				const int fbH = fb.GetHeight();
 				uint32_t *const bmp = fb.GetPixels();
 
-				if (v1.position.y >= static_cast<float>(fbH)) {
+				if (v1.position.y >= static_cast<float>(r.clipMaxY)) {
 					// viewport cull
 					return;
 				}
@@ -581,9 +597,9 @@ namespace spades {
 					return; // area cull
 				if (y1 == y3)
 					return; // area cull
-				if (std::min(std::min(x1, x2), x3) >= fbW)
+				if (std::min(std::min(x1, x2), x3) >= r.clipMaxX)
 					return; // viewport cull
-				if (std::max(std::max(x1, x2), x3) <= 0)
+				if (std::max(std::max(x1, x2), x3) <= r.clipMinX)
 					return; // viewport cull
 
 				auto convertColor = [](float f) {
@@ -620,6 +636,17 @@ namespace spades {
 
 				__m128i mulCol = _mm_setr_epi16(mulB, mulG, mulR, mulA, mulB, mulG, mulR, mulA);
 
+				// The parameters for `DrawImageSpan`
+				ImageSpan spanBase;
+				spanBase.texture = tpixels;
+				spanBase.tw = tw;
+				spanBase.th = th;
+				spanBase.ditherMap = linearInterpolate ? ditherMap : nullptr;
+				spanBase.mulColor[0] = mulB;
+				spanBase.mulColor[1] = mulG;
+				spanBase.mulColor[2] = mulR;
+				spanBase.mulColor[3] = mulA;
+
 				auto drawPixel = [mulCol, mulA](uint32_t &dest, float &destDepth, uint32_t texture,
 				                                float inDepth) {
 					if (depthTest) {
@@ -702,7 +729,7 @@ namespace spades {
 							return;
 						}
 						if (inDepth2 > destDepth[1]) {
-							drawPixel(dest[0], destDepth[0], texture2, inDepth2);
+							drawPixel(dest[0], destDepth[0], texture1, inDepth1);
 							return;
 						}
 					}
@@ -774,9 +801,9 @@ namespace spades {
 				};
 
 				auto drawScanline =
-				  [tw, th, tpixels, bmp, fbW, fbH, depthBuffer, &drawPixel, &drawPixel2, &r,
-				   &ditherMap, &ditherMap2](int y, int x1, int x2, const SWImageVarying &vary1,
-				                            const SWImageVarying &vary2, float z1, float z2) {
+				  [tw, th, tpixels, bmp, fbW, depthBuffer, &drawPixel, &drawPixel2, &r, &ditherMap,
+				   &ditherMap2, &spanBase](int y, int x1, int x2, const SWImageVarying &vary1,
+				                           const SWImageVarying &vary2, float z1, float z2) {
 					  uint32_t *out = bmp + (y * fbW);
 					  float *depthOut = nullptr;
 					  if (depthTest) {
@@ -785,14 +812,36 @@ namespace spades {
 					  SPAssert(x1 < x2);
 					  int width = x2 - x1;
 					  SWImageGouraudInterpolator<SWFeatureLevel::SSE2> vary(vary1, vary2, width);
-					  int minX = std::max(x1, 0);
-					  int maxX = std::min(x2, fbW);
+					  int minX = std::max(x1, r.clipMinX);
+					  int maxX = std::min(x2, r.clipMaxX);
+					  if (minX >= maxX) {
+						  return; // clipped out
+					  }
 					  r.pixelsDrawn += maxX - minX;
 					  vary.MoveNext(minX - x1);
 					  out += minX;
 					  if (depthTest) {
 						  depthOut += minX;
 					  }
+#if ENABLE_AVX2
+					  // The AVX2 kernel is in another translation unit, so it's selected at run
+					  // time
+					  if (r.featureLevel >= SWFeatureLevel::AVX2) {
+						  ImageSpan span = spanBase;
+						  span.out = out;
+						  span.depthOut = depthOut;
+						  span.x = minX;
+						  span.y = y;
+						  span.width = maxX - minX;
+						  span.u = vary.uvU;
+						  span.v = vary.uvV;
+						  span.stepU = vary.stepU;
+						  span.stepV = vary.stepV;
+						  span.z = z1;
+						  DrawImageSpan<SWFeatureLevel::AVX2>(span);
+						  return;
+					  }
+#endif
 					  auto uvMask = _mm_set1_epi32(texUVScaleInt - 1);
 					  auto uvScale = _mm_setr_epi32(tw, tw, th, th);
 
@@ -892,8 +941,8 @@ namespace spades {
 				{
 					Interpolator shortSpanX(x1, x2, y2 - y1);
 					SWImageGouraudInterpolator<SWFeatureLevel::SSE2> shortSpan(v1, v2, y2 - y1);
-					int minY = std::max(0, y1);
-					int maxY = std::min(fbH, y2);
+					int minY = std::max(r.clipMinY, y1);
+					int maxY = std::min(r.clipMaxY, y2);
 					shortSpanX.MoveNext(minY - y1);
 					shortSpan.MoveNext(minY - y1);
 					longSpanX.MoveNext(minY - y1);
@@ -921,8 +970,8 @@ namespace spades {
 				{
 					Interpolator shortSpanX(x2, x3, y3 - y2);
 					SWImageGouraudInterpolator<SWFeatureLevel::SSE2> shortSpan(v2, v3, y3 - y2);
-					int minY = std::max(0, y2);
-					int maxY = std::min(fbH, y3);
+					int minY = std::max(r.clipMinY, y2);
+					int maxY = std::min(r.clipMaxY, y3);
 					shortSpanX.MoveNext(minY - y2);
 					shortSpan.MoveNext(minY - y2);
 					longSpanX.MoveNext(minY - y2);
@@ -980,16 +1029,15 @@ namespace spades {
 
 				Bitmap &fb = *r.frame;
 
-				if (v3.position.y <= 0.f) {
+				if (v3.position.y <= static_cast<float>(r.clipMinY)) {
 					// viewport cull
 					return;
 				}
 
 				const int fbW = fb.GetWidth();
-				const int fbH = fb.GetHeight();
 				uint32_t *const bmp = fb.GetPixels();
 
-				if (v1.position.y >= static_cast<float>(fbH)) {
+				if (v1.position.y >= static_cast<float>(r.clipMaxY)) {
 					// viewport cull
 					return;
 				}
@@ -1010,9 +1058,9 @@ namespace spades {
 					return; // area cull
 				if (y1 == y3)
 					return; // area cull
-				if (std::min(std::min(x1, x2), x3) >= fbW)
+				if (std::min(std::min(x1, x2), x3) >= r.clipMaxX)
 					return; // viewport cull
-				if (std::max(std::max(x1, x2), x3) <= 0)
+				if (std::max(std::max(x1, x2), x3) <= r.clipMinX)
 					return; // viewport cull
 
 				auto convertColor = [](float f) {
@@ -1033,6 +1081,14 @@ namespace spades {
 				__m128i mulInv = _mm_set1_epi16(256 - (mulA + (mulA >> 7)));
 				mulCol = _mm_slli_epi16(mulCol, 8);
 
+				// The parameters for `DrawSolidSpan`
+				SolidSpan spanBase;
+				spanBase.color[0] = mulB;
+				spanBase.color[1] = mulG;
+				spanBase.color[2] = mulR;
+				spanBase.color[3] = mulA;
+				spanBase.inverseAlpha = static_cast<uint16_t>(256 - (mulA + (mulA >> 7)));
+
 				auto drawPixel = [mulCol, mulInv](uint32_t &dest, float &destDepth, float inDepth) {
 					if (depthTest) {
 						if (inDepth > destDepth) {
@@ -1072,7 +1128,7 @@ namespace spades {
 							return;
 						}
 						if (inDepth2 > destDepth[1]) {
-							drawPixel(dest[0], destDepth[0], inDepth2);
+							drawPixel(dest[0], destDepth[0], inDepth1);
 							return;
 						}
 					}
@@ -1101,9 +1157,9 @@ namespace spades {
 					_mm_store_sd(reinterpret_cast<double *>(dest), _mm_castsi128_pd(dcol));
 				};
 
-				auto drawScanline = [bmp, fbW, fbH, depthBuffer, &drawPixel, &drawPixel2,
-				                     &r](int y, int x1, int x2, const SWImageVarying &vary1,
-				                         const SWImageVarying &vary2, float z1, float z2) {
+				auto drawScanline = [bmp, fbW, depthBuffer, &drawPixel, &drawPixel2, &r,
+				                     &spanBase](int y, int x1, int x2, const SWImageVarying &vary1,
+				                                const SWImageVarying &vary2, float z1, float z2) {
 					uint32_t *out = bmp + (y * fbW);
 					float *depthOut = nullptr;
 					if (depthTest) {
@@ -1111,13 +1167,27 @@ namespace spades {
 					}
 					SPAssert(x1 < x2);
 					// int width = x2 - x1;
-					int minX = std::max(x1, 0);
-					int maxX = std::min(x2, fbW);
+					int minX = std::max(x1, r.clipMinX);
+					int maxX = std::min(x2, r.clipMaxX);
+					if (minX >= maxX) {
+						return; // clipped out
+					}
 					r.pixelsDrawn += maxX - minX;
 					out += minX;
 					if (depthTest) {
 						depthOut += minX;
 					}
+#if ENABLE_AVX2
+					if (r.featureLevel >= SWFeatureLevel::AVX2) {
+						SolidSpan span = spanBase;
+						span.out = out;
+						span.depthOut = depthOut;
+						span.width = maxX - minX;
+						span.z = z1;
+						DrawSolidSpan<SWFeatureLevel::AVX2>(span);
+						return;
+					}
+#endif
 
 					auto unalignedPixel = [&]() {
 						// FIXME: Z interpolation
@@ -1157,8 +1227,8 @@ namespace spades {
 				{
 					Interpolator shortSpanX(x1, x2, y2 - y1);
 					SWImageGouraudInterpolator<SWFeatureLevel::SSE2> shortSpan(v1, v2, y2 - y1);
-					int minY = std::max(0, y1);
-					int maxY = std::min(fbH, y2);
+					int minY = std::max(r.clipMinY, y1);
+					int maxY = std::min(r.clipMaxY, y2);
 					shortSpanX.MoveNext(minY - y1);
 					shortSpan.MoveNext(minY - y1);
 					longSpanX.MoveNext(minY - y1);
@@ -1186,8 +1256,8 @@ namespace spades {
 				{
 					Interpolator shortSpanX(x2, x3, y3 - y2);
 					SWImageGouraudInterpolator<SWFeatureLevel::SSE2> shortSpan(v2, v3, y3 - y2);
-					int minY = std::max(0, y2);
-					int maxY = std::min(fbH, y3);
+					int minY = std::max(r.clipMinY, y2);
+					int maxY = std::min(r.clipMaxY, y3);
 					shortSpanX.MoveNext(minY - y2);
 					shortSpan.MoveNext(minY - y2);
 					longSpanX.MoveNext(minY - y2);
@@ -1250,6 +1320,10 @@ namespace spades {
 				vv1.position = (vv1.position * r.fbSize4) + r.fbCenter4;
 				vv2.position = (vv2.position * r.fbSize4) + r.fbCenter4;
 				vv3.position = (vv3.position * r.fbSize4) + r.fbCenter4;
+				if (r.batching) {
+					r.QueueTriangle(img, vv1, vv2, vv3);
+					return;
+				}
 				PolygonRenderer<featureLvl, false, false, depthTest, solidFill,
 				                lerp>::DrawPolygonInternal(img, vv1, vv2, vv3, r);
 			}
@@ -1437,11 +1511,32 @@ namespace spades {
 			}
 		};
 
+		void SWImageRenderer::DrawScreenPolygon(SWImage *img, ShaderType shader, const Vertex &v1,
+		                                        const Vertex &v2, const Vertex &v3) {
+			switch (shader) {
+				case ShaderType::Sprite:
+					PolygonRenderer2<false, // already transformed
+					                 false, // already denormalized
+					                 true,  // depth tested
+					                 true   // linear interpolation
+					                 >::DrawPolygonInternal(img, v1, v2, v3, *this, featureLevel);
+					break;
+				case ShaderType::Image:
+					PolygonRenderer2<false, // don't need transform
+					                 false, // not NDC
+					                 false, // no depth test
+					                 false  // point sampling
+					                 >::DrawPolygonInternal(img, v1, v2, v3, *this, featureLevel);
+					break;
+			}
+		}
+
 		void SWImageRenderer::DrawPolygon(SWImage *img, const Vertex &v1, const Vertex &v2,
 		                                  const Vertex &v3) {
 			SPAssert(frame);
 			switch (shader) {
 				case ShaderType::Sprite:
+					// Queued by the denormalize pass when batching
 					PolygonRenderer2<true, // needs transform
 					                 true, // in NDC
 					                 true, // depth tested
@@ -1449,13 +1544,137 @@ namespace spades {
 					                 >::DrawPolygonInternal(img, v1, v2, v3, *this, featureLevel);
 					break;
 				case ShaderType::Image:
-					PolygonRenderer2<false, // don't need transform
-					                 false, // not NDC
-					                 false, // no depth test
-					                 false  // point sampling
-					                 >::DrawPolygonInternal(img, v1, v2, v3, *this, featureLevel);
+					if (batching) {
+						QueueTriangle(img, v1, v2, v3);
+					} else {
+						DrawScreenPolygon(img, shader, v1, v2, v3);
+					}
 					break;
 			}
 		}
+
+		void SWImageRenderer::QueueTriangle(SWImage *img, const Vertex &v1, const Vertex &v2,
+		                                    const Vertex &v3) {
+			// The rasterizer truncates the vertex positions and never draws outside their
+			// bounding box (exclusive of the maximum coordinates)
+			int x1 = static_cast<int>(v1.position.x), y1 = static_cast<int>(v1.position.y);
+			int x2 = static_cast<int>(v2.position.x), y2 = static_cast<int>(v2.position.y);
+			int x3 = static_cast<int>(v3.position.x), y3 = static_cast<int>(v3.position.y);
+
+			BatchTriangle tri;
+			tri.minX = std::max(std::min(std::min(x1, x2), x3), 0);
+			tri.minY = std::max(std::min(std::min(y1, y2), y3), 0);
+			tri.maxX = std::min(std::max(std::max(x1, x2), x3), frame->GetWidth());
+			tri.maxY = std::min(std::max(std::max(y1, y2), y3), frame->GetHeight());
+			if (tri.minX >= tri.maxX || tri.minY >= tri.maxY) {
+				return;
+			}
+
+			tri.img = img;
+			tri.shader = shader;
+			tri.v1 = v1;
+			tri.v2 = v2;
+			tri.v3 = v3;
+			batchTriangles.push_back(tri);
+		}
+
+		void SWImageRenderer::BeginBatch() {
+			SPAssert(!batching);
+			batching = true;
+			batchTriangles.clear();
+		}
+
+		void SWImageRenderer::EndBatch() {
+			SPADES_MARK_FUNCTION();
+			SPAssert(batching);
+			batching = false;
+
+			if (batchTriangles.empty()) {
+				return;
+			}
+
+			int numTilesX = (frame->GetWidth() + BatchTileSize - 1) >> BatchTileSizeBits;
+			int numTilesY = (frame->GetHeight() + BatchTileSize - 1) >> BatchTileSizeBits;
+			int numTiles = numTilesX * numTilesY;
+
+			// Counting sort, which keeps the triangles of every bin in the submission order
+			binOffsets.assign(numTiles + 1, 0);
+			for (const BatchTriangle &tri : batchTriangles) {
+				for (int ty = tri.minY >> BatchTileSizeBits;
+				     ty <= (tri.maxY - 1) >> BatchTileSizeBits; ty++) {
+					for (int tx = tri.minX >> BatchTileSizeBits;
+					     tx <= (tri.maxX - 1) >> BatchTileSizeBits; tx++) {
+						binOffsets[tx + ty * numTilesX + 1]++;
+					}
+				}
+			}
+
+			activeTiles.clear();
+			for (int i = 0; i < numTiles; i++) {
+				if (binOffsets[i + 1]) {
+					activeTiles.push_back(i);
+				}
+				binOffsets[i + 1] += binOffsets[i];
+			}
+
+			binnedTriangles.resize(binOffsets[numTiles]);
+			std::vector<uint32_t> cursors(binOffsets.begin(), binOffsets.end() - 1);
+			for (std::size_t i = 0; i < batchTriangles.size(); i++) {
+				const BatchTriangle &tri = batchTriangles[i];
+				for (int ty = tri.minY >> BatchTileSizeBits;
+				     ty <= (tri.maxY - 1) >> BatchTileSizeBits; ty++) {
+					for (int tx = tri.minX >> BatchTileSizeBits;
+					     tx <= (tri.maxX - 1) >> BatchTileSizeBits; tx++) {
+						binnedTriangles[cursors[tx + ty * numTilesX]++] =
+						  static_cast<uint32_t>(i);
+					}
+				}
+			}
+
+			// Each worker draws with its own renderer so that the clip rectangle and the
+			// statistics aren't shared. Spans are clipped by stepping the interpolators,
+			// which is exact, so the tiles join seamlessly.
+			std::atomic<std::size_t> nextTile{0};
+			std::atomic<unsigned long long> totalPixels{0};
+			std::atomic<unsigned long long> maxTilePixels{maxTilePixelsDrawn};
+			InvokeParallel2([&](unsigned int, unsigned int) {
+				SWImageRenderer tileRenderer(featureLevel);
+				tileRenderer.frame = frame;
+				tileRenderer.depthBuffer = depthBuffer;
+
+				unsigned long long workerMaxTilePixels = 0;
+				std::size_t i;
+				while ((i = nextTile.fetch_add(1)) < activeTiles.size()) {
+					int tile = activeTiles[i];
+					tileRenderer.clipMinX = (tile % numTilesX) << BatchTileSizeBits;
+					tileRenderer.clipMinY = (tile / numTilesX) << BatchTileSizeBits;
+					tileRenderer.clipMaxX =
+					  std::min(tileRenderer.clipMinX + BatchTileSize, frame->GetWidth());
+					tileRenderer.clipMaxY =
+					  std::min(tileRenderer.clipMinY + BatchTileSize, frame->GetHeight());
+
+					unsigned long long pixelsBefore = tileRenderer.pixelsDrawn;
+					for (uint32_t j = binOffsets[tile]; j < binOffsets[tile + 1]; j++) {
+						const BatchTriangle &tri = batchTriangles[binnedTriangles[j]];
+						tileRenderer.DrawScreenPolygon(tri.img, tri.shader, tri.v1, tri.v2,
+						                               tri.v3);
+					}
+					workerMaxTilePixels =
+					  std::max(workerMaxTilePixels, tileRenderer.pixelsDrawn - pixelsBefore);
+				}
+
+				totalPixels.fetch_add(tileRenderer.pixelsDrawn);
+				unsigned long long currentMax = maxTilePixels.load();
+				while (workerMaxTilePixels > currentMax &&
+				       !maxTilePixels.compare_exchange_weak(currentMax, workerMaxTilePixels)) {
+				}
+			});
+
+			pixelsDrawn += totalPixels.load();
+			maxTilePixelsDrawn = maxTilePixels.load();
+			batchTrianglesDrawn += batchTriangles.size();
+			batchTilesDrawn += activeTiles.size();
+			batchTriangles.clear();
+		}
 	} // namespace draw
 } // namespace spades
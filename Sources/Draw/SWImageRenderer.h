@@ -20,6 +20,9 @@
 
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
 #include "SWFeatureLevel.h"
 #include <Core/Math.h>
 #include <Core/RefCountedObject.h>
@@ -49,6 +52,35 @@ namespace spades {
 			SWFeatureLevel featureLevel;
 			unsigned long long pixelsDrawn;
 
+			/** Pixels outside this rectangle are not drawn. */
+			int clipMinX, clipMinY, clipMaxX, clipMaxY;
+
+			enum { BatchTileSizeBits = 6, BatchTileSize = 1 << BatchTileSizeBits };
+
+			/** A screen-space triangle queued between `BeginBatch` and `EndBatch`. */
+			struct BatchTriangle {
+				SWImage *img;
+				ShaderType shader;
+				Vertex v1, v2, v3;
+				int minX, minY, maxX, maxY;
+			};
+
+			bool batching;
+			std::vector<BatchTriangle> batchTriangles;
+			/** `binOffsets[i]` is where the bin of tile `i` starts in `binnedTriangles`. */
+			std::vector<uint32_t> binOffsets;
+			std::vector<uint32_t> binnedTriangles;
+			/** The indices of the tiles with at least one triangle. */
+			std::vector<int> activeTiles;
+
+			unsigned long long batchTrianglesDrawn;
+			unsigned long long batchTilesDrawn;
+			unsigned long long maxTilePixelsDrawn;
+
+			void QueueTriangle(SWImage *img, const Vertex &v1, const Vertex &v2, const Vertex &v3);
+			void DrawScreenPolygon(SWImage *img, ShaderType, const Vertex &v1, const Vertex &v2,
+			                       const Vertex &v3);
+
 			template <SWFeatureLevel, bool, bool, bool, bool, bool> struct PolygonRenderer;
 
 			template <SWFeatureLevel, bool, bool, bool, bool> struct PolygonRenderer3;
@@ -68,8 +100,33 @@ namespace spades {
 
 			void DrawPolygon(SWImage *img, const Vertex &v1, const Vertex &v2, const Vertex &v3);
 
+			/**
+			 * Starts queueing the polygons passed to `DrawPolygon` instead of drawing them
+			 * immediately. The images must be alive until `EndBatch` is called.
+			 */
+			void BeginBatch();
+
+			/**
+			 * Draws the polygons queued since `BeginBatch`. They are sorted into screen
+			 * tiles, which are rasterized in parallel. Within each tile, polygons are drawn
+			 * in the order they were queued, so blending works as if they were drawn
+			 * immediately.
+			 */
+			void EndBatch();
+
 			unsigned long long GetPixelsDrawn() { return pixelsDrawn; }
-			void ResetPixelStatistics() { pixelsDrawn = 0; }
+			/** Returns the number of polygons drawn through `EndBatch`. */
+			unsigned long long GetBatchTrianglesDrawn() { return batchTrianglesDrawn; }
+			/** Returns the number of tiles rasterized by `EndBatch`. */
+			unsigned long long GetBatchTilesDrawn() { return batchTilesDrawn; }
+			/** Returns the largest number of pixels drawn in a single batch tile. */
+			unsigned long long GetMaxTilePixelsDrawn() { return maxTilePixelsDrawn; }
+			void ResetPixelStatistics() {
+				pixelsDrawn = 0;
+				batchTrianglesDrawn = 0;
+				batchTilesDrawn = 0;
+				maxTilePixelsDrawn = 0;
+			}
 		};
 	} // namespace draw
 } // namespace spades
@@ -0,0 +1,367 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "SWImage.h"
+#include "SWImageRenderer.h"
+#include "SWKernelBenchmark.h"
+#include "SWKernels.h"
+#include <Core/Bitmap.h>
+#include <Core/Debug.h>
+#include <Core/Stopwatch.h>
+
+namespace spades {
+	namespace draw {
+		namespace SWKernelBenchmark {
+#if ENABLE_AVX2
+			namespace {
+				enum { FrameWidth = 1280, FrameHeight = 720, TileSize = 32 };
+
+				/** Returns the average time taken by `f(level)` in milliseconds. */
+				template <class F> double Measure(int numRepeats, SWFeatureLevel level, F f) {
+					f(level); // warm up
+					Stopwatch sw;
+					for (int i = 0; i < numRepeats; i++) {
+						f(level);
+					}
+					return sw.GetTime() / numRepeats * 1.0e3;
+				}
+
+				template <class F> void Compare(const char *name, int numRepeats, F f) {
+					double sse2Time = Measure(numRepeats, SWFeatureLevel::SSE2, f);
+					double avx2Time = Measure(numRepeats, SWFeatureLevel::AVX2, f);
+					SPLog("  %-22s SSE2 %8.3fms  AVX2 %8.3fms  (%.2fx)", name, sse2Time,
+					      avx2Time, sse2Time / avx2Time);
+				}
+
+				struct Frame {
+					std::vector<uint32_t> colors;
+					std::vector<float> depths;
+
+					Frame(std::mt19937 &rng)
+					    : colors(FrameWidth * FrameHeight), depths(FrameWidth * FrameHeight) {
+						std::uniform_real_distribution<float> depthDist(1.f, 128.f);
+						for (auto &c : colors) {
+							c = rng() & 0xffffff;
+						}
+						for (auto &d : depths) {
+							d = depthDist(rng);
+						}
+					}
+				};
+
+				void RunLightsAndFog(std::mt19937 &rng) {
+					Frame frame(rng);
+
+					PostPassTarget target;
+					target.fb = frame.colors.data();
+					target.db = frame.depths.data();
+					target.fw = FrameWidth;
+					target.fovX = 1.f;
+					target.fovY = 0.5625f;
+					target.dvx = -target.fovX * 2.f / static_cast<float>(FrameWidth);
+					target.dvy = -target.fovY * 2.f / static_cast<float>(FrameHeight);
+					target.blockDvx = -target.fovX * 2.f / static_cast<float>(FrameWidth / 4);
+					target.blockDvy = -target.fovY * 2.f / static_cast<float>(FrameHeight / 4);
+					target.fogScale = 255.f / 128.f;
+					target.fogR = 128;
+					target.fogG = 160;
+					target.fogB = 192;
+
+					// Muzzle flashes and explosions cover a large part of the screen
+					std::vector<ScreenLight> lights(16);
+					std::uniform_int_distribution<int> xDist(0, FrameWidth - 1);
+					std::uniform_int_distribution<int> yDist(0, FrameHeight - 1);
+					for (auto &light : lights) {
+						int x = xDist(rng), y = yDist(rng);
+						light.minX = std::max(x - 200, 0);
+						light.minY = std::max(y - 200, 0);
+						light.maxX = std::min(x + 200, static_cast<int>(FrameWidth));
+						light.maxY = std::min(y + 200, static_cast<int>(FrameHeight));
+						light.center = MakeVector3(0.f, 0.f, 8.f);
+						light.invRadius2 = 1.f / (8.f * 8.f);
+						light.r = light.g = light.b = 256;
+					}
+
+					auto eachTile = [&](SWFeatureLevel level, bool lighting) {
+						for (int y = 0; y < FrameHeight; y += TileSize) {
+							for (int x = 0; x < FrameWidth; x += TileSize) {
+								int maxX = std::min(x + TileSize, static_cast<int>(FrameWidth));
+								int maxY = std::min(y + TileSize, static_cast<int>(FrameHeight));
+								if (!lighting) {
+									if (level == SWFeatureLevel::AVX2) {
+										ApplyFogToRect<SWFeatureLevel::AVX2>(target, x, y, maxX,
+										                                     maxY);
+									} else {
+										ApplyFogToRect<SWFeatureLevel::SSE2>(target, x, y, maxX,
+										                                     maxY);
+									}
+									continue;
+								}
+								for (const ScreenLight &light : lights) {
+									int x1 = std::max(light.minX, x);
+									int y1 = std::max(light.minY, y);
+									int x2 = std::min(light.maxX, maxX);
+									int y2 = std::min(light.maxY, maxY);
+									if (x1 >= x2 || y1 >= y2) {
+										continue;
+									}
+									if (level == SWFeatureLevel::AVX2) {
+										ApplyLightToRect<SWFeatureLevel::AVX2>(target, light, x1,
+										                                       y1, x2, y2);
+									} else {
+										ApplyLightToRect<SWFeatureLevel::SSE2>(target, light, x1,
+										                                       y1, x2, y2);
+									}
+								}
+							}
+						}
+					};
+
+					Compare("Dynamic lights (x16)", 10,
+					        [&](SWFeatureLevel level) { eachTile(level, true); });
+					Compare("Fog", 20, [&](SWFeatureLevel level) { eachTile(level, false); });
+				}
+
+				void RunSplats(std::mt19937 &rng) {
+					Frame frame(rng);
+
+					// A crowd of models seen from a distance
+					std::vector<ScreenSplat> splats(200000);
+					std::uniform_int_distribution<int> xDist(0, FrameWidth - 8);
+					std::uniform_int_distribution<int> yDist(0, FrameHeight - 8);
+					std::uniform_int_distribution<int> sizeDist(1, 8);
+					std::uniform_real_distribution<float> depthDist(1.f, 128.f);
+					for (auto &splat : splats) {
+						splat.minX = static_cast<int16_t>(xDist(rng));
+						splat.minY = static_cast<int16_t>(yDist(rng));
+						splat.maxX = static_cast<int16_t>(splat.minX + sizeDist(rng));
+						splat.maxY = static_cast<int16_t>(splat.minY + sizeDist(rng));
+						splat.z = depthDist(rng);
+						splat.color = rng() & 0xffffff;
+					}
+
+					// Bin them like `SWModelRenderer` does
+					int numTilesX = FrameWidth / TileSize;
+					int numTilesY = (FrameHeight + TileSize - 1) / TileSize;
+					std::vector<std::vector<const ScreenSplat *>> bins(numTilesX * numTilesY);
+					for (const ScreenSplat &splat : splats) {
+						int maxTileY = std::min((splat.maxY - 1) / TileSize, numTilesY - 1);
+						for (int ty = splat.minY / TileSize; ty <= maxTileY; ty++) {
+							for (int tx = splat.minX / TileSize; tx <= (splat.maxX - 1) / TileSize;
+							     tx++) {
+								bins[tx + ty * numTilesX].push_back(&splat);
+							}
+						}
+					}
+
+					Compare("Model splats", 10, [&](SWFeatureLevel level) {
+						for (int i = 0; i < numTilesX * numTilesY; i++) {
+							const auto &bin = bins[i];
+							if (bin.empty()) {
+								continue;
+							}
+							int x = (i % numTilesX) * TileSize, y = (i / numTilesX) * TileSize;
+							int maxY = std::min(y + TileSize, static_cast<int>(FrameHeight));
+							auto *begin = bin.data(), *end = bin.data() + bin.size();
+							if (level == SWFeatureLevel::AVX2) {
+								DrawSplatsInRect<SWFeatureLevel::AVX2>(
+								  frame.colors.data(), frame.depths.data(), FrameWidth, x, y,
+								  x + TileSize, maxY, begin, end);
+							} else {
+								DrawSplatsInRect<SWFeatureLevel::None>(
+								  frame.colors.data(), frame.depths.data(), FrameWidth, x, y,
+								  x + TileSize, maxY, begin, end);
+							}
+						}
+					});
+				}
+
+				void RunMap(std::mt19937 &rng) {
+					Frame frame(rng);
+
+					// A synthetic line table covering the view. The pitch index is computed as
+					// `((pitch >> 13) - pitchTanMinI) * pitchScaleI >> 32`, so a line maps
+					// tangents in `[-1, 1]` (16.16 fixed point) to the whole line.
+					enum { NumLines = 2048, LineResolution = 512 };
+					std::vector<MapPixel> pixels(NumLines * LineResolution);
+					for (auto &pixel : pixels) {
+						pixel.combined = (rng() & 0xffffff) | 0x1000000;
+						pixel.depth = static_cast<float>(rng() % 12800) * 0.01f;
+					}
+					std::vector<MapLineRef> lines(NumLines);
+					for (int i = 0; i < NumLines; i++) {
+						lines[i].pixels = pixels.data() + i * LineResolution;
+						lines[i].pitchTanMinI = -65536;
+						lines[i].pitchScaleI = LineResolution / 2 * 65536;
+					}
+
+					for (int under = 1; under <= 4; under *= 2) {
+						MapBlock block;
+						block.fw = FrameWidth;
+						block.under = under;
+						block.lines = lines.data();
+						block.numLines = NumLines;
+						block.yawScale = 65536;
+						block.lineResolution = LineResolution;
+
+						// The yaw covers a quarter turn horizontally, and the pitch's tangent
+						// goes from -0.5 to 0.5 vertically
+						const int32_t yawPerPixel = (16384 << 8) / FrameWidth;
+						const int32_t pitchPerPixel = (1 << 29) / FrameHeight;
+
+						char name[64];
+						std::sprintf(name, "Map (undersampling %d)", under);
+						Compare(name, 20, [&](SWFeatureLevel level) {
+							for (int y = 0; y + 8 <= FrameHeight; y += 8) {
+								for (int x = 0; x < FrameWidth; x += 8) {
+									block.fb = frame.colors.data() + x + y * FrameWidth;
+									block.db = frame.depths.data() + x + y * FrameWidth;
+									block.yawIndexA = block.yawIndexB = x * yawPerPixel;
+									block.pitchA = y * pitchPerPixel - (1 << 28);
+									block.pitchB = block.pitchA + 8 * pitchPerPixel;
+									block.yawDiffA = block.yawDiffB = yawPerPixel * under;
+									block.pitchDiffA = block.pitchDiffB = 0;
+									if (level == SWFeatureLevel::AVX2) {
+										DrawMapBlock<SWFeatureLevel::AVX2>(block);
+									} else {
+										DrawMapBlock<SWFeatureLevel::SSE2>(block);
+									}
+								}
+							}
+						});
+					}
+				}
+
+				void RunPolygons(std::mt19937 &rng) {
+					Handle<Bitmap> fb(new Bitmap(FrameWidth, FrameHeight), false);
+					std::vector<float> depthBuffer(FrameWidth * FrameHeight);
+					{
+						Frame frame(rng);
+						std::memcpy(fb->GetPixels(), frame.colors.data(),
+						            frame.colors.size() * sizeof(uint32_t));
+						depthBuffer = frame.depths;
+					}
+
+					Handle<Bitmap> texture(new Bitmap(64, 64), false);
+					for (int i = 0; i < 64 * 64; i++) {
+						uint32_t alpha = (i & 7) == 0 ? 0 : 255 - (i & 63);
+						texture->GetPixels()[i] = (rng() & 0xffffff) | (alpha << 24);
+					}
+					Handle<SWImage> image(new SWImage(*texture), false);
+
+					// HUD elements and particles: many small and medium quads
+					struct Quad {
+						Vector2 center;
+						float radius;
+						float depth;
+					};
+					std::vector<Quad> quads(2000);
+					std::uniform_real_distribution<float> xDist(0.f, FrameWidth);
+					std::uniform_real_distribution<float> yDist(0.f, FrameHeight);
+					std::uniform_real_distribution<float> radiusDist(4.f, 64.f);
+					std::uniform_real_distribution<float> depthDist(1.f, 128.f);
+					for (auto &quad : quads) {
+						quad.center = MakeVector2(xDist(rng), yDist(rng));
+						quad.radius = radiusDist(rng);
+						quad.depth = depthDist(rng);
+					}
+
+					auto draw = [&](SWFeatureLevel level, SWImage *img,
+					                SWImageRenderer::ShaderType shader) {
+						SWImageRenderer r(level);
+						r.SetFramebuffer(fb.GetPointerOrNull());
+						r.SetDepthBuffer(depthBuffer.data());
+						r.SetShaderType(shader);
+
+						// Maps `(x, y, z)` to `(x / z, y / z)` in NDC for the sprite shader
+						Matrix4 m = Matrix4::Scale(2.f / FrameWidth, -2.f / FrameHeight, 1.f);
+						m.m[11] = 1.f;
+						m.m[15] = 0.f;
+						r.SetMatrix(m);
+						r.SetZRange(0.1f, 1000.f);
+
+						bool sprite = shader == SWImageRenderer::ShaderType::Sprite;
+						for (const Quad &quad : quads) {
+							SWImageRenderer::Vertex v[4];
+							for (int i = 0; i < 4; i++) {
+								float dx = (i & 1) ? quad.radius : -quad.radius;
+								float dy = (i & 2) ? quad.radius : -quad.radius;
+								Vector2 p = quad.center + MakeVector2(dx, dy);
+								if (sprite) {
+									// Undo the perspective divide and the viewport transform
+									p -= MakeVector2(FrameWidth * .5f, FrameHeight * .5f);
+									v[i].position = MakeVector4(p.x * quad.depth,
+									                            p.y * quad.depth, quad.depth, 1.f);
+								} else {
+									v[i].position = MakeVector4(p.x, p.y, 0.f, 1.f);
+								}
+								v[i].color = MakeVector4(.8f, .8f, .8f, .8f);
+								v[i].uv = MakeVector2((i & 1) ? 1.f : 0.f, (i & 2) ? 1.f : 0.f);
+							}
+							r.DrawPolygon(img, v[0], v[1], v[2]);
+							r.DrawPolygon(img, v[1], v[3], v[2]);
+						}
+					};
+
+					Compare("Images", 10, [&](SWFeatureLevel level) {
+						draw(level, image.GetPointerOrNull(), SWImageRenderer::ShaderType::Image);
+					});
+					Compare("Sprites (depth tested)", 10, [&](SWFeatureLevel level) {
+						draw(level, image.GetPointerOrNull(), SWImageRenderer::ShaderType::Sprite);
+					});
+					Compare("Solid polygons", 10, [&](SWFeatureLevel level) {
+						draw(level, nullptr, SWImageRenderer::ShaderType::Image);
+					});
+				}
+			} // namespace
+#endif
+
+			void Run() {
+				SPADES_MARK_FUNCTION();
+
+#if ENABLE_AVX2
+				if (DetectFeatureLevel() < SWFeatureLevel::AVX2) {
+					SPLog("Software renderer kernel benchmark: AVX2 is not supported by this "
+					      "CPU or OS");
+					return;
+				}
+
+				std::mt19937 rng(42);
+				SPLog("Software renderer kernel benchmark (%dx%d, single thread)",
+				      static_cast<int>(FrameWidth), static_cast<int>(FrameHeight));
+				RunLightsAndFog(rng);
+				RunSplats(rng);
+				RunMap(rng);
+				RunPolygons(rng);
+#else
+				SPLog("Software renderer kernel benchmark: this build doesn't have the AVX2 "
+				      "kernels (OPENSPADES_AVX2)");
+#endif
+			}
+		} // namespace SWKernelBenchmark
+	}     // namespace draw
+} // namespace spades
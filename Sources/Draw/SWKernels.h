@@ -0,0 +1,293 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "SWFeatureLevel.h"
+#include <Core/Math.h>
+
+// The innermost loops of the software renderer that have AVX2 versions.
+//
+// They only take plain data, so the AVX2 versions can be compiled in a separate translation
+// unit (SWKernelsAVX2.cpp) and `SWKernelBenchmark` can measure each of them in isolation.
+// Each kernel is a function template explicitly specialized for the feature levels it
+// supports. The non-AVX2 specializations are defined next to the code calling them.
+
+namespace spades {
+	namespace draw {
+
+		enum { texUVScaleBits = 16, texUVScaleInt = 1 << texUVScaleBits };
+
+#pragma mark - Lights and Fog (SWRenderer.cpp)
+
+		/** A dynamic light prepared for `SWRenderer::ApplyLightsAndFog`. */
+		struct ScreenLight {
+			int minX, minY, maxX, maxY;
+			/** The light's position in the view space. */
+			Vector3 center;
+			float invRadius2;
+			int r, g, b;
+		};
+
+		/** The framebuffer and the view parameters shared by all tiles. */
+		struct PostPassTarget {
+			uint32_t *fb;
+			const float *db;
+			/** The framebuffer width. Must be a multiple of 8. */
+			int fw;
+
+			float fovX, fovY;
+			/** The view vector increments per pixel. */
+			float dvx, dvy;
+			/** The view vector increments per 4x4 block. */
+			float blockDvx, blockDvy;
+
+			float fogScale;
+			int fogR, fogG, fogB;
+		};
+
+		/**
+		 * Applies `light` to the pixels in `[x1, x2) x [y1, y2)`. SIMD versions may read and
+		 * write back the pixels up to the next multiples of 4 (SSE2) or 8 (AVX2) outside the
+		 * rectangle.
+		 */
+		template <SWFeatureLevel>
+		void ApplyLightToRect(const PostPassTarget &, const ScreenLight &, int x1, int y1,
+		                      int x2, int y2);
+
+		/** Applies the fog to the 4x4 blocks in `[x1, x2) x [y1, y2)`. */
+		template <SWFeatureLevel>
+		void ApplyFogToRect(const PostPassTarget &, int x1, int y1, int x2, int y2);
+
+		template <>
+		void ApplyLightToRect<SWFeatureLevel::None>(const PostPassTarget &, const ScreenLight &,
+		                                            int, int, int, int);
+		template <>
+		void ApplyFogToRect<SWFeatureLevel::None>(const PostPassTarget &, int, int, int, int);
+#if ENABLE_SSE2
+		template <>
+		void ApplyLightToRect<SWFeatureLevel::SSE2>(const PostPassTarget &, const ScreenLight &,
+		                                            int, int, int, int);
+		template <>
+		void ApplyFogToRect<SWFeatureLevel::SSE2>(const PostPassTarget &, int, int, int, int);
+#endif
+#if ENABLE_AVX2
+		template <>
+		void ApplyLightToRect<SWFeatureLevel::AVX2>(const PostPassTarget &, const ScreenLight &,
+		                                            int, int, int, int);
+		template <>
+		void ApplyFogToRect<SWFeatureLevel::AVX2>(const PostPassTarget &, int, int, int, int);
+#endif
+
+#pragma mark - Upscaling (SWRenderer.cpp)
+
+		/**
+		 * A scene rendered at a reduced resolution and the bilinear mapping to the port's
+		 * framebuffer. The filter works in 8-bit fixed point (vertically, then horizontally),
+		 * so all feature levels produce the same result.
+		 */
+		struct UpscaleTarget {
+			const uint32_t *src;
+			/** The size of `src`. `srcW` must be a multiple of 8. */
+			int srcW, srcH;
+			uint32_t *dest;
+			/** Must be a multiple of 8. */
+			int destW;
+
+			/** The left source column of each destination column. */
+			const int32_t *columns;
+			/**
+			 * The weights of the left and right source columns of each destination column,
+			 * each repeated four times (`256 - w` x 4 and then `w` x 4).
+			 */
+			const uint16_t *columnWeights;
+			/** The upper source row of each destination row. */
+			const int32_t *rows;
+			/** The weight (0-255) of the lower source row of each destination row. */
+			const int32_t *rowWeights;
+		};
+
+		/**
+		 * Upscales the destination rows `[y1, y2)`. `rowBuffer` is a scratch buffer with room
+		 * for `srcW + 1` pixels.
+		 */
+		template <SWFeatureLevel>
+		void UpscaleRows(const UpscaleTarget &, uint32_t *rowBuffer, int y1, int y2);
+
+		template <>
+		void UpscaleRows<SWFeatureLevel::None>(const UpscaleTarget &, uint32_t *, int, int);
+#if ENABLE_SSE2
+		template <>
+		void UpscaleRows<SWFeatureLevel::SSE2>(const UpscaleTarget &, uint32_t *, int, int);
+#endif
+#if ENABLE_AVX2
+		template <>
+		void UpscaleRows<SWFeatureLevel::AVX2>(const UpscaleTarget &, uint32_t *, int, int);
+#endif
+
+#pragma mark - Model Splats (SWModelRenderer.cpp)
+
+		/** A point splat of a model, transformed and clipped to the screen. */
+		struct ScreenSplat {
+			float z;
+			uint32_t color;
+			int16_t minX, minY, maxX, maxY;
+		};
+
+		/**
+		 * Draws the parts of the splats in `[begin, end)` inside `[minX, maxX) x [minY, maxY)`
+		 * with depth test, in order.
+		 */
+		template <SWFeatureLevel>
+		void DrawSplatsInRect(uint32_t *fb, float *db, int fw, int minX, int minY, int maxX,
+		                      int maxY, const ScreenSplat *const *begin,
+		                      const ScreenSplat *const *end);
+
+		template <>
+		void DrawSplatsInRect<SWFeatureLevel::None>(uint32_t *, float *, int, int, int, int,
+		                                            int, const ScreenSplat *const *,
+		                                            const ScreenSplat *const *);
+#if ENABLE_AVX2
+		template <>
+		void DrawSplatsInRect<SWFeatureLevel::AVX2>(uint32_t *, float *, int, int, int, int,
+		                                            int, const ScreenSplat *const *,
+		                                            const ScreenSplat *const *);
+#endif
+
+#pragma mark - Map (SWMapRenderer.cpp)
+
+		/** A sample of a line traced by `SWMapRenderer`. */
+		struct MapPixel {
+			union {
+				struct {
+					uint32_t combined;
+					float depth;
+				};
+				struct {
+					unsigned int color : 24;
+					// Face face: 7;
+					bool filled : 1;
+				};
+				struct {
+					uint64_t allData;
+				};
+			};
+
+			// using "operator =" makes this struct non-POD
+			void Set(const MapPixel &p) { allData = p.allData; }
+
+			inline void Clear() {
+				combined = 0;
+				depth = 10000.f;
+			}
+
+			inline bool IsEmpty() const { return combined == 0; }
+		};
+
+		/** The parts of a line used by `DrawMapBlock`. */
+		struct MapLineRef {
+			const MapPixel *pixels;
+			int32_t pitchTanMinI;
+			int32_t pitchScaleI;
+		};
+
+		/**
+		 * An 8x8 block of the screen whose line indices and pitches are bilinearly
+		 * interpolated from the corners.
+		 */
+		struct MapBlock {
+			uint32_t *fb;
+			float *db;
+			int fw;
+			/** The undersampling factor (1, 2, or 4). */
+			int under;
+
+			const MapLineRef *lines;
+			uint32_t numLines;
+			int32_t yawScale;
+			/** A power of two. */
+			int lineResolution;
+
+			/** The yaw indices and the pitches of the top and bottom ends of the first column. */
+			int32_t yawIndexA, yawIndexB, pitchA, pitchB;
+			/** Their increments per column. */
+			int32_t yawDiffA, yawDiffB, pitchDiffA, pitchDiffB;
+		};
+
+		template <SWFeatureLevel> void DrawMapBlock(const MapBlock &);
+
+		template <> void DrawMapBlock<SWFeatureLevel::None>(const MapBlock &);
+#if ENABLE_SSE2
+		template <> void DrawMapBlock<SWFeatureLevel::SSE2>(const MapBlock &);
+#endif
+#if ENABLE_AVX2
+		template <> void DrawMapBlock<SWFeatureLevel::AVX2>(const MapBlock &);
+#endif
+
+#pragma mark - Polygon Spans (SWImageRenderer.cpp)
+
+		/** A horizontal span of a textured polygon. */
+		struct ImageSpan {
+			uint32_t *out;
+			/** `nullptr` to disable the depth test. */
+			const float *depthOut;
+			/** The position of the first pixel, which selects the dither pattern. */
+			int x, y;
+			int width;
+
+			/** The texture coordinates (`texUVScaleInt` = 1.0) in 32.32 fixed point. */
+			int64_t u, v, stepU, stepV;
+
+			const uint32_t *texture;
+			int tw, th;
+			/** The offsets added to the texture coordinates, or `nullptr` for none. */
+			const int16_t *ditherMap;
+
+			/** The modulation color (BGRA order, 256 = 1.0). */
+			uint16_t mulColor[4];
+			float z;
+		};
+
+		/** A horizontal span of a solid polygon. */
+		struct SolidSpan {
+			uint32_t *out;
+			/** `nullptr` to disable the depth test. */
+			const float *depthOut;
+			int width;
+
+			/** The premultiplied color (BGRA order, 255 = 1.0). */
+			uint16_t color[4];
+			/** 256 minus the alpha (256 = 1.0). */
+			uint16_t inverseAlpha;
+			float z;
+		};
+
+		// `SWImageRenderer` draws spans inline up to SSE2
+		template <SWFeatureLevel> void DrawImageSpan(const ImageSpan &);
+		template <SWFeatureLevel> void DrawSolidSpan(const SolidSpan &);
+
+#if ENABLE_AVX2
+		template <> void DrawImageSpan<SWFeatureLevel::AVX2>(const ImageSpan &);
+		template <> void DrawSolidSpan<SWFeatureLevel::AVX2>(const SolidSpan &);
+#endif
+	} // namespace draw
+} // namespace spades
@@ -0,0 +1,563 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <cstddef>
+
+#include "SWKernels.h"
+
+#if ENABLE_AVX2
+
+#if !defined(__AVX2__)
+#error "SWKernelsAVX2.cpp must be compiled with AVX2 code generation enabled"
+#endif
+
+#include <immintrin.h>
+
+// This is the only translation unit compiled with AVX2 code generation enabled, and the
+// functions defined here are called only after `DetectFeatureLevel` has confirmed AVX2
+// support. Only intrinsics and functions with internal linkage may be used here. An inline
+// function with external linkage (e.g., `std::min` or a `Vector3` operator) would be
+// emitted here with AVX2 instructions, and the linker might pick this copy over the ones
+// in the other translation units.
+//
+// FMA is not enabled, so the floating-point results are identical to the SSE2 versions.
+
+namespace spades {
+	namespace draw {
+
+		static_assert(sizeof(MapPixel) == 8, "MapPixel must be 8 bytes long");
+		static_assert(sizeof(MapLineRef) == 16 && offsetof(MapLineRef, pitchTanMinI) == 8 &&
+		                offsetof(MapLineRef, pitchScaleI) == 12,
+		              "DrawMapBlock gathers MapLineRef's fields by offset");
+
+		static inline int MinInt(int a, int b) { return a < b ? a : b; }
+		static inline int MaxInt(int a, int b) { return a > b ? a : b; }
+
+		/** Returns a mask of the lanes whose index is less than `count`. */
+		static inline __m256i TailMask(int count) {
+			return _mm256_cmpgt_epi32(_mm256_set1_epi32(count),
+			                          _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		}
+
+		/** Broadcasts four 16-bit channels to all pixels. */
+		static inline __m256i BroadcastChannels(const uint16_t *c) {
+			// `_mm256_setr_epi16` would go through the stack and stall store forwarding
+			uint64_t v = c[0] | (static_cast<uint64_t>(c[1]) << 16) |
+			             (static_cast<uint64_t>(c[2]) << 32) | (static_cast<uint64_t>(c[3]) << 48);
+			return _mm256_set1_epi64x(static_cast<long long>(v));
+		}
+
+		/** Converts the high 32 bits of eight 64-bit integers to a vector. */
+		static inline __m256i High32(__m256i lo, __m256i hi) {
+			__m256 v = _mm256_shuffle_ps(_mm256_castsi256_ps(lo), _mm256_castsi256_ps(hi), 0xdd);
+			return _mm256_permute4x64_epi64(_mm256_castps_si256(v), 0xd8);
+		}
+
+		/**
+		 * Computes `dest * inverseAlpha + src` on eight 16-bit channels and packs the result,
+		 * where `inverseAlpha` and `src` are in the 8.8 fixed point format.
+		 */
+		static inline __m256i BlendPixels(__m256i dest, __m256i srcLo, __m256i srcHi,
+		                                  __m256i invLo, __m256i invHi) {
+			__m256i destLo = _mm256_unpacklo_epi8(dest, _mm256_setzero_si256());
+			__m256i destHi = _mm256_unpackhi_epi8(dest, _mm256_setzero_si256());
+			destLo = _mm256_adds_epu16(_mm256_mullo_epi16(destLo, invLo), srcLo);
+			destHi = _mm256_adds_epu16(_mm256_mullo_epi16(destHi, invHi), srcHi);
+			return _mm256_packus_epi16(_mm256_srli_epi16(destLo, 8),
+			                           _mm256_srli_epi16(destHi, 8));
+		}
+
+#pragma mark - Lights and Fog
+
+		template <>
+		void ApplyLightToRect<SWFeatureLevel::AVX2>(const PostPassTarget &t,
+		                                            const ScreenLight &light, int x1, int y1,
+		                                            int x2, int y2) {
+			// Process aligned groups of 8 pixels, masking out the ones outside the rect. `fw`
+			// and the tiles are aligned to 8 pixels, so the groups never cross into another
+			// tile and no scalar tail is needed.
+			int groupX1 = x1 & ~7;
+			int groupX2 = (x2 + 7) & ~7;
+
+			auto centerX = _mm256_set1_ps(light.center.x);
+			auto centerY = _mm256_set1_ps(light.center.y);
+			auto centerZ = _mm256_set1_ps(light.center.z);
+			auto invRadius2 = _mm256_set1_ps(light.invRadius2);
+			auto lightR = _mm256_set1_ps(static_cast<float>(light.r) * (1.f / 65536.f));
+			auto lightG = _mm256_set1_ps(static_cast<float>(light.g) * (1.f / 65536.f));
+			auto lightB = _mm256_set1_ps(static_cast<float>(light.b) * (1.f / 65536.f));
+			auto laneOffsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			auto rectX1 = _mm256_set1_epi32(x1 - 1);
+			auto rectX2 = _mm256_set1_epi32(x2);
+			auto byteMask = _mm256_set1_epi32(0xff);
+
+			for (int y = y1; y < y2; y++) {
+				auto vy = _mm256_set1_ps(t.fovY + t.dvy * y);
+				uint32_t *fb = t.fb + y * t.fw;
+				const float *db = t.db + y * t.fw;
+
+				for (int x = groupX1; x < groupX2; x += 8) {
+					auto laneX = _mm256_add_epi32(_mm256_set1_epi32(x), laneOffsets);
+					auto inRect = _mm256_and_si256(_mm256_cmpgt_epi32(laneX, rectX1),
+					                               _mm256_cmpgt_epi32(rectX2, laneX));
+
+					auto vx = _mm256_mul_ps(_mm256_set1_ps(t.dvx), _mm256_cvtepi32_ps(laneX));
+					vx = _mm256_add_ps(_mm256_set1_ps(t.fovX), vx);
+					auto z = _mm256_loadu_ps(db + x);
+					auto px = _mm256_sub_ps(_mm256_mul_ps(vx, z), centerX);
+					auto py = _mm256_sub_ps(_mm256_mul_ps(vy, z), centerY);
+					auto pz = _mm256_sub_ps(z, centerZ);
+					auto dist = _mm256_add_ps(
+					  _mm256_add_ps(_mm256_mul_ps(px, px), _mm256_mul_ps(py, py)),
+					  _mm256_mul_ps(pz, pz));
+					dist = _mm256_mul_ps(dist, invRadius2);
+
+					auto lit =
+					  _mm256_castps_si256(_mm256_cmp_ps(dist, _mm256_set1_ps(1.f), _CMP_LT_OQ));
+					lit = _mm256_and_si256(lit, inRect);
+					if (_mm256_testz_si256(lit, lit)) {
+						continue;
+					}
+
+					auto strength = _mm256_sub_ps(_mm256_set1_ps(1.f), dist);
+					strength =
+					  _mm256_mul_ps(_mm256_mul_ps(strength, strength), _mm256_set1_ps(256.f));
+					auto factor = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(strength));
+
+					auto src = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(fb + x));
+					auto srcR = _mm256_and_si256(_mm256_srli_epi32(src, 16), byteMask);
+					auto srcG = _mm256_and_si256(_mm256_srli_epi32(src, 8), byteMask);
+					auto srcB = _mm256_and_si256(src, byteMask);
+
+					auto addR = _mm256_cvttps_epi32(
+					  _mm256_mul_ps(_mm256_mul_ps(lightR, factor), _mm256_cvtepi32_ps(srcR)));
+					auto addG = _mm256_cvttps_epi32(
+					  _mm256_mul_ps(_mm256_mul_ps(lightG, factor), _mm256_cvtepi32_ps(srcG)));
+					auto addB = _mm256_cvttps_epi32(
+					  _mm256_mul_ps(_mm256_mul_ps(lightB, factor), _mm256_cvtepi32_ps(srcB)));
+
+					auto destR = _mm256_min_epi32(_mm256_add_epi32(srcR, addR), byteMask);
+					auto destG = _mm256_min_epi32(_mm256_add_epi32(srcG, addG), byteMask);
+					auto destB = _mm256_min_epi32(_mm256_add_epi32(srcB, addB), byteMask);
+
+					auto dest = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(destR, 16),
+					                                            _mm256_slli_epi32(destG, 8)),
+					                            destB);
+					dest = _mm256_blendv_epi8(src, dest, lit);
+					_mm256_storeu_si256(reinterpret_cast<__m256i *>(fb + x), dest);
+				}
+			}
+		}
+
+		template <>
+		void ApplyFogToRect<SWFeatureLevel::AVX2>(const PostPassTarget &t, int x1, int y1, int x2,
+		                                          int y2) {
+			// Two 4x4 blocks are processed at once. The fog color's alpha channel is zero,
+			// so the alpha channel is scaled by `256 - factor` like the SSE2 version does.
+			auto fog = _mm256_setr_epi16(t.fogB, t.fogG, t.fogR, 0, t.fogB, t.fogG, t.fogR, 0,
+			                             t.fogB, t.fogG, t.fogR, 0, t.fogB, t.fogG, t.fogR, 0);
+
+			for (int y = y1; y < y2; y += 4) {
+				float vy = t.fovY + t.blockDvy * (y >> 2);
+				uint32_t *fb = t.fb + y * t.fw;
+				const float *db = t.db + y * t.fw;
+
+				for (int x = x1; x < x2; x += 8) {
+					// `x2 - x` is a multiple of 4
+					bool twoBlocks = x + 4 < x2;
+
+					float vx1 = t.fovX + t.blockDvx * (x >> 2);
+					float depthScale1 = (1.f + vx1 * vx1 + vy * vy);
+					depthScale1 *= fastRSqrt(depthScale1) * t.fogScale;
+
+					float vx2 = t.fovX + t.blockDvx * ((x >> 2) + 1);
+					float depthScale2 = (1.f + vx2 * vx2 + vy * vy);
+					depthScale2 *= fastRSqrt(depthScale2) * t.fogScale;
+
+					auto depthScale = _mm256_setr_ps(depthScale1, depthScale1, depthScale1,
+					                                 depthScale1, depthScale2, depthScale2,
+					                                 depthScale2, depthScale2);
+					auto mask = TailMask(4);
+
+					auto *fb2 = fb + x;
+					auto *db2 = db + x;
+					for (int by = 0; by < 4; by++) {
+						__m256 dist;
+						__m256i color;
+						if (twoBlocks) {
+							dist = _mm256_loadu_ps(db2);
+							color = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(fb2));
+						} else {
+							dist = _mm256_maskload_ps(db2, mask);
+							color = _mm256_maskload_epi32(reinterpret_cast<const int *>(fb2), mask);
+						}
+
+						dist = _mm256_mul_ps(dist, depthScale);
+						dist = _mm256_max_ps(dist, _mm256_setzero_ps());
+						dist = _mm256_min_ps(dist, _mm256_set1_ps(256.f));
+						auto factorX = _mm256_cvtps_epi32(dist);
+						auto factorY = _mm256_sub_epi32(_mm256_set1_epi32(0x100), factorX);
+
+						// Broadcast each pixel's factors to its four 16-bit channels
+						factorX = _mm256_or_si256(factorX, _mm256_slli_epi32(factorX, 16));
+						factorY = _mm256_or_si256(factorY, _mm256_slli_epi32(factorY, 16));
+
+						auto colorLo = _mm256_unpacklo_epi8(color, _mm256_setzero_si256());
+						auto colorHi = _mm256_unpackhi_epi8(color, _mm256_setzero_si256());
+						auto factorLoX = _mm256_unpacklo_epi32(factorX, factorX);
+						auto factorHiX = _mm256_unpackhi_epi32(factorX, factorX);
+						auto factorLoY = _mm256_unpacklo_epi32(factorY, factorY);
+						auto factorHiY = _mm256_unpackhi_epi32(factorY, factorY);
+						colorLo = _mm256_mullo_epi16(colorLo, factorLoY);
+						colorHi = _mm256_mullo_epi16(colorHi, factorHiY);
+						auto fogLo = _mm256_mullo_epi16(fog, factorLoX);
+						auto fogHi = _mm256_mullo_epi16(fog, factorHiX);
+						fogLo = _mm256_srli_epi16(_mm256_adds_epu16(fogLo, colorLo), 8);
+						fogHi = _mm256_srli_epi16(_mm256_adds_epu16(fogHi, colorHi), 8);
+
+						auto pack = _mm256_packus_epi16(fogLo, fogHi);
+						if (twoBlocks) {
+							_mm256_storeu_si256(reinterpret_cast<__m256i *>(fb2), pack);
+						} else {
+							_mm256_maskstore_epi32(reinterpret_cast<int *>(fb2), mask, pack);
+						}
+
+						fb2 += t.fw;
+						db2 += t.fw;
+					}
+				}
+			}
+		}
+
+#pragma mark - Upscaling
+
+		template <>
+		void UpscaleRows<SWFeatureLevel::AVX2>(const UpscaleTarget &t, uint32_t *rowBuffer,
+		                                       int y1, int y2) {
+			auto zero = _mm256_setzero_si256();
+			for (int y = y1; y < y2; y++) {
+				const uint32_t *upper = t.src + t.rows[y] * t.srcW;
+				const uint32_t *lower = t.src + MinInt(t.rows[y] + 1, t.srcH - 1) * t.srcW;
+				auto wLower = _mm256_set1_epi16(static_cast<short>(t.rowWeights[y]));
+				auto wUpper = _mm256_sub_epi16(_mm256_set1_epi16(256), wLower);
+
+				for (int x = 0; x < t.srcW; x += 8) {
+					auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(upper + x));
+					auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lower + x));
+					auto lo =
+					  _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), wUpper),
+					                   _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), wLower));
+					auto hi =
+					  _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), wUpper),
+					                   _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), wLower));
+					lo = _mm256_srli_epi16(lo, 8);
+					hi = _mm256_srli_epi16(hi, 8);
+					_mm256_storeu_si256(reinterpret_cast<__m256i *>(rowBuffer + x),
+					                    _mm256_packus_epi16(lo, hi));
+				}
+				rowBuffer[t.srcW] = rowBuffer[t.srcW - 1];
+
+				// Eight destination pixels at once. Each gather fetches four pairs of adjacent
+				// pixels; a 128-bit lane holds the pairs of columns `x + i` and `x + i + 1`.
+				auto *base = reinterpret_cast<const long long *>(rowBuffer);
+				uint32_t *out = t.dest + y * t.destW;
+				for (int x = 0; x < t.destW; x += 8) {
+					__m256i sums[2];
+					for (int k = 0; k < 2; k++) {
+						int x2 = x + k * 4;
+						auto indices =
+						  _mm_loadu_si128(reinterpret_cast<const __m128i *>(t.columns + x2));
+						auto pairs = _mm256_i32gather_epi64(base, indices, 4);
+						auto w1 = _mm256_loadu_si256(
+						  reinterpret_cast<const __m256i *>(t.columnWeights + x2 * 8));
+						auto w2 = _mm256_loadu_si256(
+						  reinterpret_cast<const __m256i *>(t.columnWeights + x2 * 8 + 16));
+
+						// Columns `x2` and `x2 + 2` / `x2 + 1` and `x2 + 3`
+						auto pEven = _mm256_mullo_epi16(_mm256_unpacklo_epi8(pairs, zero),
+						                                _mm256_permute2x128_si256(w1, w2, 0x20));
+						auto pOdd = _mm256_mullo_epi16(_mm256_unpackhi_epi8(pairs, zero),
+						                               _mm256_permute2x128_si256(w1, w2, 0x31));
+						auto sum = _mm256_add_epi16(_mm256_unpacklo_epi64(pEven, pOdd),
+						                            _mm256_unpackhi_epi64(pEven, pOdd));
+						sums[k] = _mm256_srli_epi16(sum, 8);
+					}
+					auto packed = _mm256_packus_epi16(sums[0], sums[1]);
+					_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + x),
+					                    _mm256_permute4x64_epi64(packed, 0xd8));
+				}
+			}
+		}
+
+#pragma mark - Model Splats
+
+		template <>
+		void DrawSplatsInRect<SWFeatureLevel::AVX2>(uint32_t *fb, float *db, int fw, int rectMinX,
+		                                            int rectMinY, int rectMaxX, int rectMaxY,
+		                                            const ScreenSplat *const *it,
+		                                            const ScreenSplat *const *end) {
+			for (; it != end; ++it) {
+				const ScreenSplat &splat = **it;
+				int minX = MaxInt(splat.minX, rectMinX);
+				int minY = MaxInt(splat.minY, rectMinY);
+				int maxX = MinInt(splat.maxX, rectMaxX);
+				int maxY = MinInt(splat.maxY, rectMaxY);
+				int w = maxX - minX;
+				if (w <= 0) {
+					continue;
+				}
+
+				auto zval = _mm256_set1_ps(splat.z);
+				auto color = _mm256_set1_epi32(static_cast<int>(splat.color));
+
+				auto *fb2 = fb + (minX + minY * fw);
+				auto *db2 = db + (minX + minY * fw);
+
+				for (int yy = minY; yy < maxY; yy++) {
+					for (int xx = 0; xx < w; xx += 8) {
+						auto mask = TailMask(w - xx);
+						auto depth = _mm256_maskload_ps(db2 + xx, mask);
+						auto pass = _mm256_and_si256(
+						  mask, _mm256_castps_si256(_mm256_cmp_ps(zval, depth, _CMP_LT_OQ)));
+						_mm256_maskstore_ps(db2 + xx, pass, zval);
+						_mm256_maskstore_epi32(reinterpret_cast<int *>(fb2 + xx), pass, color);
+					}
+
+					fb2 += fw;
+					db2 += fw;
+				}
+			}
+		}
+
+#pragma mark - Map
+
+		template <> void DrawMapBlock<SWFeatureLevel::AVX2>(const MapBlock &b) {
+			if (b.under != 1) {
+				// Undersampled blocks have only 2 or 4 columns
+				DrawMapBlock<SWFeatureLevel::SSE2>(b);
+				return;
+			}
+
+			// Each lane traces one of the eight columns. See `DrawMapBlockInner` in
+			// SWMapRenderer.cpp for the scalar version this must match bit by bit.
+			auto lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			auto column = [lanes](int32_t start, int32_t diff) {
+				return _mm256_add_epi32(_mm256_set1_epi32(start),
+				                        _mm256_mullo_epi32(lanes, _mm256_set1_epi32(diff)));
+			};
+			auto yawA = column(b.yawIndexA, b.yawDiffA);
+			auto yawB = column(b.yawIndexB, b.yawDiffB);
+			auto pitchA = column(b.pitchA, b.pitchDiffA);
+			auto pitchB = column(b.pitchB, b.pitchDiffB);
+
+			// Signed division by 8 rounding toward zero
+			auto div8 = [](__m256i v) {
+				auto bias = _mm256_and_si256(_mm256_srai_epi32(v, 31), _mm256_set1_epi32(7));
+				return _mm256_srai_epi32(_mm256_add_epi32(v, bias), 3);
+			};
+			auto yawDelta = _mm256_sub_epi32(yawB, yawA);
+			yawDelta = div8(_mm256_srai_epi32(_mm256_slli_epi32(yawDelta, 8), 8));
+			auto pitchDelta = div8(_mm256_sub_epi32(pitchB, pitchA));
+
+			auto yawScale = _mm256_set1_epi32(b.yawScale);
+			auto numLines = _mm256_set1_epi32(static_cast<int>(b.numLines));
+			auto resMask = _mm256_set1_epi32(b.lineResolution - 1);
+			const auto *lineWords = reinterpret_cast<const int *>(b.lines);
+			const auto *linePtrs = reinterpret_cast<const long long *>(b.lines);
+
+			auto yaw = yawA;
+			auto pitch = pitchA;
+			uint32_t *fb = b.fb;
+			float *db = b.db;
+
+			for (int y = 0; y < 8; y++) {
+				auto yawIndex = _mm256_srai_epi32(_mm256_slli_epi32(yaw, 8), 16);
+				yawIndex = _mm256_srli_epi32(_mm256_mullo_epi32(yawIndex, yawScale), 16);
+				yawIndex = _mm256_srli_epi32(_mm256_mullo_epi32(yawIndex, numLines), 16);
+
+				auto wordIndex = _mm256_slli_epi32(yawIndex, 2);
+				auto tanMin = _mm256_i32gather_epi32(
+				  lineWords, _mm256_add_epi32(wordIndex, _mm256_set1_epi32(2)), 4);
+				auto scale = _mm256_i32gather_epi32(
+				  lineWords, _mm256_add_epi32(wordIndex, _mm256_set1_epi32(3)), 4);
+				auto ptrIndex = _mm256_slli_epi32(yawIndex, 1);
+				auto pixels1 =
+				  _mm256_i32gather_epi64(linePtrs, _mm256_castsi256_si128(ptrIndex), 8);
+				auto pixels2 =
+				  _mm256_i32gather_epi64(linePtrs, _mm256_extracti128_si256(ptrIndex, 1), 8);
+
+				// `((int64_t)(pitch >> 13) - tanMin) * scale) >> 32`
+				auto p = _mm256_sub_epi32(_mm256_srai_epi32(pitch, 13), tanMin);
+				auto prodEven = _mm256_srli_epi64(_mm256_mul_epi32(p, scale), 32);
+				auto prodOdd = _mm256_mul_epi32(_mm256_srli_epi64(p, 32),
+				                                _mm256_srli_epi64(scale, 32));
+				auto pitchIndex = _mm256_blend_epi32(prodEven, prodOdd, 0xaa);
+				pitchIndex = _mm256_and_si256(pitchIndex, resMask);
+
+				auto offset1 = _mm256_slli_epi64(
+				  _mm256_cvtepi32_epi64(_mm256_castsi256_si128(pitchIndex)), 3);
+				auto offset2 = _mm256_slli_epi64(
+				  _mm256_cvtepi32_epi64(_mm256_extracti128_si256(pitchIndex, 1)), 3);
+				auto pix1 = _mm256_i64gather_epi64(
+				  static_cast<const long long *>(nullptr), _mm256_add_epi64(pixels1, offset1), 1);
+				auto pix2 = _mm256_i64gather_epi64(
+				  static_cast<const long long *>(nullptr), _mm256_add_epi64(pixels2, offset2), 1);
+
+				// Deinterleave [color, depth] pairs
+				auto colors = _mm256_shuffle_ps(_mm256_castsi256_ps(pix1),
+				                                _mm256_castsi256_ps(pix2), 0x88);
+				auto depths = _mm256_shuffle_ps(_mm256_castsi256_ps(pix1),
+				                                _mm256_castsi256_ps(pix2), 0xdd);
+				colors = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(colors), 0xd8));
+				depths = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(depths), 0xd8));
+
+				_mm256_storeu_ps(reinterpret_cast<float *>(fb), colors);
+				_mm256_storeu_ps(db, depths);
+
+				fb += b.fw;
+				db += b.fw;
+				yaw = _mm256_add_epi32(yaw, yawDelta);
+				pitch = _mm256_add_epi32(pitch, pitchDelta);
+			}
+		}
+
+#pragma mark - Polygon Spans
+
+		template <> void DrawImageSpan<SWFeatureLevel::AVX2>(const ImageSpan &s) {
+			auto stepU = _mm256_set1_epi64x(s.stepU * 8);
+			auto stepV = _mm256_set1_epi64x(s.stepV * 8);
+			auto u1 = _mm256_setr_epi64x(s.u, s.u + s.stepU, s.u + s.stepU * 2,
+			                             s.u + s.stepU * 3);
+			auto u2 = _mm256_setr_epi64x(s.u + s.stepU * 4, s.u + s.stepU * 5,
+			                             s.u + s.stepU * 6, s.u + s.stepU * 7);
+			auto v1 = _mm256_setr_epi64x(s.v, s.v + s.stepV, s.v + s.stepV * 2,
+			                             s.v + s.stepV * 3);
+			auto v2 = _mm256_setr_epi64x(s.v + s.stepV * 4, s.v + s.stepV * 5,
+			                             s.v + s.stepV * 6, s.v + s.stepV * 7);
+
+			// The dither pattern repeats every two pixels, so it's the same for every group
+			auto ditherU = _mm256_setzero_si256();
+			auto ditherV = _mm256_setzero_si256();
+			if (s.ditherMap) {
+				const int16_t *even = s.ditherMap + ((s.x & 1) + ((s.y & 1) << 1)) * 2;
+				const int16_t *odd = s.ditherMap + (((s.x + 1) & 1) + ((s.y & 1) << 1)) * 2;
+				auto pair = [](int16_t a, int16_t b) {
+					uint64_t v = static_cast<uint32_t>(a) |
+					             (static_cast<uint64_t>(static_cast<uint32_t>(b)) << 32);
+					return _mm256_set1_epi64x(static_cast<long long>(v));
+				};
+				ditherU = pair(even[0], odd[0]);
+				ditherV = pair(even[1], odd[1]);
+			}
+
+			auto uvMask = _mm256_set1_epi32(0xffff);
+			auto tw = _mm256_set1_epi32(s.tw);
+			auto th = _mm256_set1_epi32(s.th);
+			auto mulCol = BroadcastChannels(s.mulColor);
+			auto z = _mm256_set1_ps(s.z);
+			const auto *texture = reinterpret_cast<const int *>(s.texture);
+			uint32_t *const out = s.out;
+			const float *const depthOut = s.depthOut;
+			const int width = s.width;
+
+			for (int x = 0; x < width; x += 8) {
+				auto mask = TailMask(width - x);
+
+				auto u = _mm256_add_epi32(High32(u1, u2), ditherU);
+				auto v = _mm256_add_epi32(High32(v1, v2), ditherV);
+				u = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(u, uvMask), tw), 16);
+				v = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(v, uvMask), th), 16);
+				// The indices are always inside the texture, so the gather isn't masked
+				auto index = _mm256_add_epi32(u, _mm256_mullo_epi32(v, tw));
+				auto tex = _mm256_i32gather_epi32(texture, index, 4);
+
+				if (depthOut) {
+					auto depth = _mm256_maskload_ps(depthOut + x, mask);
+					mask = _mm256_and_si256(
+					  mask, _mm256_castps_si256(_mm256_cmp_ps(z, depth, _CMP_NGT_UQ)));
+				}
+
+				// The texture is premultiplied. See SWImage.cpp
+				auto tcolLo =
+				  _mm256_mullo_epi16(_mm256_unpacklo_epi8(tex, _mm256_setzero_si256()), mulCol);
+				auto tcolHi =
+				  _mm256_mullo_epi16(_mm256_unpackhi_epi8(tex, _mm256_setzero_si256()), mulCol);
+
+				// Broadcast the alpha and map [0, 255] to [0, 256]
+				auto alphaLo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(tcolLo, 0xff), 0xff);
+				auto alphaHi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(tcolHi, 0xff), 0xff);
+				alphaLo = _mm256_srli_epi16(alphaLo, 8);
+				alphaHi = _mm256_srli_epi16(alphaHi, 8);
+				alphaLo = _mm256_add_epi16(alphaLo, _mm256_srli_epi16(alphaLo, 7));
+				alphaHi = _mm256_add_epi16(alphaHi, _mm256_srli_epi16(alphaHi, 7));
+				auto invLo = _mm256_sub_epi16(_mm256_set1_epi16(0x100), alphaLo);
+				auto invHi = _mm256_sub_epi16(_mm256_set1_epi16(0x100), alphaHi);
+
+				uint32_t *pixels = out + x;
+				if (!depthOut && width - x >= 8) {
+					auto dest = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pixels));
+					dest = BlendPixels(dest, tcolLo, tcolHi, invLo, invHi);
+					_mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels), dest);
+				} else {
+					auto dest = _mm256_maskload_epi32(reinterpret_cast<const int *>(pixels), mask);
+					dest = BlendPixels(dest, tcolLo, tcolHi, invLo, invHi);
+					_mm256_maskstore_epi32(reinterpret_cast<int *>(pixels), mask, dest);
+				}
+
+				u1 = _mm256_add_epi64(u1, stepU);
+				u2 = _mm256_add_epi64(u2, stepU);
+				v1 = _mm256_add_epi64(v1, stepV);
+				v2 = _mm256_add_epi64(v2, stepV);
+			}
+		}
+
+		template <> void DrawSolidSpan<SWFeatureLevel::AVX2>(const SolidSpan &s) {
+			auto color = _mm256_slli_epi16(BroadcastChannels(s.color), 8);
+			auto inv = _mm256_set1_epi16(static_cast<short>(s.inverseAlpha));
+			auto z = _mm256_set1_ps(s.z);
+			uint32_t *const out = s.out;
+			const float *const depthOut = s.depthOut;
+			const int width = s.width;
+
+			for (int x = 0; x < width; x += 8) {
+				auto mask = TailMask(width - x);
+
+				if (depthOut) {
+					auto depth = _mm256_maskload_ps(depthOut + x, mask);
+					mask = _mm256_and_si256(
+					  mask, _mm256_castps_si256(_mm256_cmp_ps(z, depth, _CMP_NGT_UQ)));
+				}
+
+				uint32_t *pixels = out + x;
+				if (!depthOut && width - x >= 8) {
+					auto dest = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pixels));
+					dest = BlendPixels(dest, color, color, inv, inv);
+					_mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels), dest);
+				} else {
+					auto dest = _mm256_maskload_epi32(reinterpret_cast<const int *>(pixels), mask);
+					dest = BlendPixels(dest, color, color, inv, inv);
+					_mm256_maskstore_epi32(reinterpret_cast<int *>(pixels), mask, dest);
+				}
+			}
+		}
+	} // namespace draw
+} // namespace spades
+
+#endif // ENABLE_AVX2
@@ -18,7 +18,9 @@
 
  */
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 
@@ -67,33 +69,6 @@ namespace spades {
 
 		enum class Face : short { PosX, NegX, PosY, NegY, PosZ, NegZ };
 
-		struct SWMapRenderer::LinePixel {
-			union {
-				struct {
-					uint32_t combined;
-					float depth;
-				};
-				struct {
-					unsigned int color : 24;
-					// Face face: 7;
-					bool filled : 1;
-				};
-				struct {
-					uint64_t allData;
-				};
-			};
-
-			// using "operator =" makes this struct non-POD
-			void Set(const LinePixel &p) { allData = p.allData; }
-
-			inline void Clear() {
-				combined = 0;
-				depth = 10000.f;
-			}
-
-			inline bool IsEmpty() const { return combined == 0; }
-		};
-
 		// infinite length line from -z to +z
 		struct SWMapRenderer::Line {
 			std::vector<LinePixel> pixels;
@@ -104,7 +79,8 @@ namespace spades {
 			int pitchScaleI;
 		};
 
-		SWMapRenderer::SWMapRenderer(SWRenderer &r, client::GameMap *m, SWFeatureLevel level)
+		SWMapRenderer::SWMapRenderer(SWRenderer &r, client::GameMap *m, SWFeatureLevel level,
+		                             bool prebuild)
 		    : w(m->Width()),
 		      h(m->Height()),
 		      renderer(r),
@@ -112,35 +88,29 @@ namespace spades {
 		      map(m),
 		      frameBuf(nullptr),
 		      depthBuf(nullptr),
-		      rleHeap(m->Width() * m->Height() * 64) {
+		      rleHeap(m->Width() * m->Height() * 64),
+		      rleGeneration(0),
+		      // No lines are built yet
+		      lineCacheGeneration(~static_cast<uint64_t>(0)),
+		      changedRleColumnsBase(0),
+		      linesBuilt(0),
+		      linesReused(0) {
 			rle.resize(w * h);
 			rleLen.resize(w * h);
+			rleRowBuilt.resize(h, false);
+			rleDirty.resize(w * h, false);
 
-			Stopwatch sw;
-			sw.Reset();
-			SPLog("Building RLE map...");
-
-			int idx = 0;
-			for (int y = 0; y < h; y++)
-				for (int x = 0; x < w; x++) {
-					BuildRle(x, y, rleBuf);
-
-					auto ref = rleHeap.Alloc(rleBuf.size() * sizeof(RleData));
-					short *ptr = rleHeap.Dereference<short>(ref);
-					std::memcpy(ptr, rleBuf.data(), rleBuf.size() * sizeof(RleData));
-
-					rle[idx] = ref;
-					rleLen[idx] = rleBuf.size() * sizeof(RleData);
-
-					idx++;
-				}
-			SPLog("RLE map created in %.6f seconds", sw.GetTime());
+			if (!prebuild) {
+				BuildRemainingRle();
+			}
 		}
 
 		SWMapRenderer::~SWMapRenderer() {}
 
 		void SWMapRenderer::BuildRle(int x, int y, std::vector<RleData> &out) {
-			out.clear();
+			// The header holds offsets relative to the start of this column, so columns can be
+			// appended to a buffer holding other columns
+			const size_t start = out.size();
 
 			out.push_back(0); // [0] = +Z face position address
 			out.push_back(0);
@@ -154,7 +124,7 @@ namespace spades {
 			out.push_back(0);
 
 			auto setHeader = [&](size_t idx, size_t val) {
-				reinterpret_cast<short *>(out.data())[idx] = static_cast<short>(val);
+				reinterpret_cast<short *>(out.data() + start)[idx] = static_cast<short>(val);
 			};
 
 			uint64_t smap = map->GetSolidMapWrapped(x, y);
@@ -172,7 +142,7 @@ namespace spades {
 			}
 			out.push_back(-1);
 
-			setHeader(0, out.size());
+			setHeader(0, out.size() - start);
 
 			old = true;
 			for (int z = 63; z >= 0; z--) {
@@ -185,7 +155,7 @@ namespace spades {
 			out.push_back(-1);
 
 			for (int k = 0; k < 4; k++) {
-				setHeader(k + 1, out.size());
+				setHeader(k + 1, out.size() - start);
 				for (int z = 0; z < 64; z++) {
 					if ((smap >> z) & 1) {
 						if (!((adjs[k] >> z) & 1)) {
@@ -197,23 +167,240 @@ namespace spades {
 			}
 
 			// padding
-			while (out.size() & 3) {
+			while ((out.size() - start) & 3) {
 				out.push_back(42);
 			}
 		}
 
+		unsigned int SWMapRenderer::BuildRleColumns(const std::vector<int> &columns) {
+			// Don't wake up the workers for a handful of columns
+			enum { MinParallelColumns = 256 };
+
+			// Each thread builds a contiguous range of `columns`, so concatenating the arenas
+			// in order gives the same layout as building the columns one by one
+			unsigned int numArenas = 1;
+			auto build = [&](unsigned int th, unsigned int numThreads) {
+				if (th == 0) {
+					numArenas = numThreads;
+				}
+
+				size_t begin = columns.size() * th / numThreads;
+				size_t end = columns.size() * (th + 1) / numThreads;
+				RleArena &arena = rleArenas[th];
+				arena.data.clear();
+				arena.offsets.clear();
+				for (size_t i = begin; i < end; i++) {
+					arena.offsets.push_back(arena.data.size());
+					BuildRle(columns[i] % w, columns[i] / w, arena.data);
+				}
+				arena.offsets.push_back(arena.data.size());
+			};
+
+			rleArenas.resize(32);
+			if (columns.size() < MinParallelColumns) {
+				build(0, 1);
+			} else {
+				InvokeParallel2(build);
+			}
+			return numArenas;
+		}
+
+		void SWMapRenderer::BuildRleRows(const std::vector<int> &rows) {
+			rleColumns.clear();
+			for (int y : rows) {
+				SPAssert(!rleRowBuilt[y]);
+				for (int x = 0; x < w; x++) {
+					rleColumns.push_back(x + y * w);
+				}
+			}
+
+			unsigned int numArenas = BuildRleColumns(rleColumns);
+
+			// Move each arena into the heap with a single allocation. `MiniHeap` doesn't
+			// remember the allocation sizes, so `FlushRleUpdates` can still free the columns
+			// one by one.
+			size_t i = 0;
+			for (unsigned int k = 0; k < numArenas; k++) {
+				const RleArena &arena = rleArenas[k];
+				if (arena.data.empty()) {
+					continue;
+				}
+
+				auto base = rleHeap.Alloc(arena.data.size() * sizeof(RleData));
+				std::memcpy(rleHeap.Dereference<RleData>(base), arena.data.data(),
+				            arena.data.size() * sizeof(RleData));
+
+				for (size_t j = 0; j + 1 < arena.offsets.size(); j++) {
+					int idx = rleColumns[i++];
+					rle[idx] = base + arena.offsets[j] * sizeof(RleData);
+					rleLen[idx] = (arena.offsets[j + 1] - arena.offsets[j]) * sizeof(RleData);
+				}
+			}
+			SPAssert(i == rleColumns.size());
+
+			for (int y : rows) {
+				rleRowBuilt[y] = true;
+			}
+
+			// Too many columns to track
+			rleGeneration++;
+			changedRleColumns.clear();
+			changedRleColumnsBase = rleGeneration;
+		}
+
+		void SWMapRenderer::Prebuild(const std::vector<bool> &decodedRows) {
+			SPADES_MARK_FUNCTION();
+
+			SPAssert(decodedRows.size() == static_cast<std::size_t>(h));
+
+			Stopwatch sw;
+			std::vector<int> rows;
+
+			// The RLE of a column depends on the adjacent columns
+			for (int y = 0; y < h; y++) {
+				if (!rleRowBuilt[y] && decodedRows[(y + h - 1) & (h - 1)] && decodedRows[y] &&
+				    decodedRows[(y + 1) & (h - 1)]) {
+					rows.push_back(y);
+				}
+			}
+
+			if (!rows.empty()) {
+				BuildRleRows(rows);
+				SPLog("Prebuilt the RLE of %d row(s) in %.6f seconds",
+				      static_cast<int>(rows.size()), sw.GetTime());
+			}
+		}
+
+		void SWMapRenderer::BuildRemainingRle() {
+			SPADES_MARK_FUNCTION();
+
+			Stopwatch sw;
+			sw.Reset();
+			SPLog("Building RLE map...");
+
+			std::vector<int> rows;
+			for (int y = 0; y < h; y++) {
+				if (!rleRowBuilt[y]) {
+					rows.push_back(y);
+				}
+			}
+			if (!rows.empty()) {
+				BuildRleRows(rows);
+			}
+
+			// The arenas are as large as the map by now and are only needed for small updates
+			// from now on
+			rleArenas.clear();
+			rleArenas.shrink_to_fit();
+			rleColumns.clear();
+			rleColumns.shrink_to_fit();
+
+			SPLog("RLE map created in %.6f seconds", sw.GetTime());
+		}
+
 		void SWMapRenderer::UpdateRle(int x, int y) {
 			int idx = x + y * w;
-			BuildRle(x, y, rleBuf);
 
-			rleHeap.Free(rle[idx], rleLen[idx]);
+			// A row not built yet will see the latest map when it's built
+			if (!rleRowBuilt[y] || rleDirty[idx]) {
+				return;
+			}
+			rleDirty[idx] = true;
+			dirtyRleColumns.push_back(idx);
+		}
+
+		void SWMapRenderer::FlushRleUpdates() {
+			SPADES_MARK_FUNCTION();
+
+			if (dirtyRleColumns.empty()) {
+				return;
+			}
+
+			unsigned int numArenas = BuildRleColumns(dirtyRleColumns);
 
-			auto ref = rleHeap.Alloc(rleBuf.size() * sizeof(RleData));
-			short *ptr = rleHeap.Dereference<short>(ref);
-			std::memcpy(ptr, rleBuf.data(), rleBuf.size() * sizeof(RleData));
+			size_t i = 0;
+			for (unsigned int k = 0; k < numArenas; k++) {
+				const RleArena &arena = rleArenas[k];
+				for (size_t j = 0; j + 1 < arena.offsets.size(); j++) {
+					int idx = dirtyRleColumns[i++];
+					size_t len = (arena.offsets[j + 1] - arena.offsets[j]) * sizeof(RleData);
 
-			rle[idx] = ref;
-			rleLen[idx] = rleBuf.size() * sizeof(RleData);
+					// A column whose size didn't change is overwritten in place
+					if (len != rleLen[idx]) {
+						rleHeap.Free(rle[idx], rleLen[idx]);
+						rle[idx] = rleHeap.Alloc(len);
+						rleLen[idx] = len;
+					}
+					std::memcpy(rleHeap.Dereference<RleData>(rle[idx]),
+					            arena.data.data() + arena.offsets[j], len);
+
+					rleDirty[idx] = false;
+				}
+			}
+			SPAssert(i == dirtyRleColumns.size());
+
+			rleGeneration++;
+			changedRleColumns.insert(changedRleColumns.end(), dirtyRleColumns.begin(),
+			                         dirtyRleColumns.end());
+			dirtyRleColumns.clear();
+		}
+
+		void SWMapRenderer::MarkLinesThroughColumn(int x, int y, float yawMin, float yawStep,
+		                                           std::size_t numLines) {
+			static const float pi = static_cast<float>(M_PI);
+
+			// The position of the nearest copy of the column relative to the camera. The lines
+			// end at the fog distance, which is less than half the map size.
+			float dx = static_cast<float>(x) - sceneDef.viewOrigin.x;
+			float dy = static_cast<float>(y) - sceneDef.viewOrigin.y;
+			dx -= static_cast<float>(w) * floorf(dx / static_cast<float>(w) + .5f);
+			dy -= static_cast<float>(h) * floorf(dy / static_cast<float>(h) + .5f);
+
+			float nearX = std::max(std::max(dx, -(dx + 1.f)), 0.f);
+			float nearY = std::max(std::max(dy, -(dy + 1.f)), 0.f);
+			float nearDist = nearX * nearX + nearY * nearY;
+			if (nearDist > 130.f * 130.f) {
+				return;
+			}
+			if (nearDist < 1.5f * 1.5f) {
+				// Too close to compute the angular extent reliably
+				std::fill(lineDirty.begin(), lineDirty.begin() + numLines, 1);
+				return;
+			}
+
+			// The angular extent of the column, with a margin for the error of the line
+			// directions, which are computed incrementally
+			float center = atan2f(dy + .5f, dx + .5f);
+			float minDelta = 0.f, maxDelta = 0.f;
+			for (int i = 0; i < 4; i++) {
+				float cornerX = dx + static_cast<float>(i & 1);
+				float cornerY = dy + static_cast<float>(i >> 1);
+				float delta = atan2f(cornerY, cornerX) - center;
+				if (delta > pi) {
+					delta -= pi * 2.f;
+				} else if (delta < -pi) {
+					delta += pi * 2.f;
+				}
+				minDelta = std::min(minDelta, delta);
+				maxDelta = std::max(maxDelta, delta);
+			}
+			float margin = yawStep * 2.f;
+			float start = center + minDelta - margin - yawMin;
+			float length = maxDelta - minDelta + margin * 2.f;
+			start -= pi * 2.f * floorf(start / (pi * 2.f));
+
+			auto mark = [&](float from, float to) {
+				long first = std::max(static_cast<long>(floorf(from / yawStep)), 0L);
+				long last = std::min(static_cast<long>(ceilf(to / yawStep)),
+				                     static_cast<long>(numLines) - 1);
+				for (long i = first; i <= last; i++) {
+					lineDirty[i] = 1;
+				}
+			};
+			mark(start, std::min(start + length, pi * 2.f));
+			if (start + length > pi * 2.f) {
+				mark(0.f, start + length - pi * 2.f);
+			}
 		}
 
 		template <SWFeatureLevel flevel>
@@ -533,7 +720,7 @@ namespace spades {
 					LinePixel px;
 					px.depth = dist;
 #if ENABLE_SSE
-					if (flevel == SWFeatureLevel::SSE2) {
+					if (flevel >= SWFeatureLevel::SSE2) {
 						__m128i m;
 						uint32_t col = map.GetColorWrapped(x, y, z);
 						m = _mm_setr_epi32(col, 0, 0, 0);
@@ -741,6 +928,123 @@ namespace spades {
 			}
 		}
 
+		template <SWFeatureLevel flevel, int under>
+		static void DrawMapBlockInner(const MapBlock &b) {
+			enum { blockSize = 8 };
+
+			std::int32_t yawIndexA = b.yawIndexA;
+			std::int32_t yawIndexB = b.yawIndexB;
+			std::int32_t pitchA = b.pitchA;
+			std::int32_t pitchB = b.pitchB;
+
+			for (unsigned int x = 0; x < blockSize; x += under) {
+				uint32_t *fb3 = b.fb + x;
+				auto *db3 = b.db + x;
+
+				std::int32_t yawIndexC = yawIndexA;
+				std::int32_t yawDelta = ((yawIndexB - yawIndexA) << 8 >> 8) / blockSize;
+				std::int32_t pitchC = pitchA;
+				std::int32_t pitchDelta = (pitchB - pitchA) / blockSize;
+
+				for (unsigned int y = 0; y < blockSize; y++) {
+
+					std::uint32_t yawIndex = static_cast<unsigned int>(yawIndexC << 8 >> 16);
+					yawIndex = (yawIndex * b.yawScale) >> 16;
+					yawIndex = (yawIndex * b.numLines) >> 16;
+					const MapLineRef &line = b.lines[yawIndex];
+					auto *pixels = line.pixels;
+
+					// solve pitch
+					std::int32_t pitchIndex;
+
+					{
+						pitchIndex = pitchC >> 13;
+						pitchIndex -= line.pitchTanMinI;
+						pitchIndex =
+						  static_cast<int>((static_cast<int64_t>(pitchIndex) *
+						                    static_cast<int64_t>(line.pitchScaleI)) >>
+						                   32);
+						// pitch = (pitch - line.pitchTanMin) * line.pitchScale;
+						// pitchIndex = static_cast<int>(pitch);
+						pitchIndex &= b.lineResolution - 1;
+						// pitchIndex = std::max(pitchIndex, 0);
+						// pitchIndex = std::min(pitchIndex, lineResolution - 1);
+					}
+
+					auto &pix = pixels[pitchIndex];
+
+// write color.
+// NOTE: combined contains both color and other information,
+// though this isn't a problem as long as the color comes
+// in the LSB's
+#if ENABLE_SSE
+					if (flevel >= SWFeatureLevel::SSE2) {
+						__m128i m;
+
+						if (under == 1) {
+							*fb3 = pix.combined;
+							*db3 = pix.depth;
+						} else if (under == 2) {
+							m = _mm_castpd_si128(
+							  _mm_load_sd(reinterpret_cast<const double *>(&pix)));
+							_mm_store_sd(reinterpret_cast<double *>(fb3),
+							             _mm_castsi128_pd(_mm_shuffle_epi32(m, 0x00)));
+							_mm_store_sd(reinterpret_cast<double *>(db3),
+							             _mm_castsi128_pd(_mm_shuffle_epi32(m, 0x55)));
+						} else if (under == 4) {
+							m = _mm_castpd_si128(
+							  _mm_load_sd(reinterpret_cast<const double *>(&pix)));
+							_mm_stream_si128(reinterpret_cast<__m128i *>(fb3),
+							                 _mm_shuffle_epi32(m, 0x00));
+							_mm_stream_si128(reinterpret_cast<__m128i *>(db3),
+							                 _mm_shuffle_epi32(m, 0x55));
+						}
+
+					} else
+#endif
+					// non-optimized
+					{
+						uint32_t col = pix.combined;
+						float d = pix.depth;
+
+						for (int k = 0; k < under; k++) {
+							fb3[k] = col;
+							db3[k] = d;
+						}
+					}
+
+					fb3 += b.fw;
+					db3 += b.fw;
+
+					yawIndexC += yawDelta;
+					pitchC += pitchDelta;
+				}
+
+				yawIndexA += b.yawDiffA;
+				yawIndexB += b.yawDiffB;
+				pitchA += b.pitchDiffA;
+				pitchB += b.pitchDiffB;
+			}
+		}
+
+		template <SWFeatureLevel flevel> static void DrawMapBlockWithLevel(const MapBlock &b) {
+			switch (b.under) {
+				case 1: DrawMapBlockInner<flevel, 1>(b); break;
+				case 2: DrawMapBlockInner<flevel, 2>(b); break;
+				default: DrawMapBlockInner<flevel, 4>(b); break;
+			}
+		}
+
+		template <> void DrawMapBlock<SWFeatureLevel::None>(const MapBlock &b) {
+			DrawMapBlockWithLevel<SWFeatureLevel::None>(b);
+		}
+
+#if ENABLE_SSE2
+		template <> void DrawMapBlock<SWFeatureLevel::SSE2>(const MapBlock &b) {
+			DrawMapBlockWithLevel<SWFeatureLevel::SSE2>(b);
+		}
+#endif
+
 		template <SWFeatureLevel flevel, int under>
 		void SWMapRenderer::RenderFinal(float yawMin, float yawMax, unsigned int numLines,
 		                                unsigned int threadId, unsigned int numThreads) {
@@ -771,6 +1075,14 @@ namespace spades {
 
 			enum { blockSize = 8, hBlock = blockSize / under };
 
+			MapBlock block;
+			block.fw = static_cast<int>(fw);
+			block.under = under;
+			block.lines = lineRefs.data();
+			block.numLines = static_cast<uint32_t>(numLines);
+			block.yawScale = yawScale2;
+			block.lineResolution = lineResolution;
+
 			Vector3 deltaDownLarge = deltaDown * blockSize;
 			Vector3 deltaRightLarge = deltaRight * hBlock;
 
@@ -840,100 +1152,17 @@ namespace spades {
 					std::int32_t pitchDiff1 = (pitch2 - pitch1) / hBlock;
 					std::int32_t pitchDiff2 = (pitch4 - pitch3) / hBlock;
 
-					std::int32_t yawIndexA = yawIndex1;
-					std::int32_t yawIndexB = yawIndex3;
-					std::int32_t pitchA = pitch1;
-					std::int32_t pitchB = pitch3;
-
-					for (unsigned int x = 0; x < blockSize; x += under) {
-						uint32_t *fb3 = fb2 + x;
-						auto *db3 = db2 + x;
-
-						std::int32_t yawIndexC = yawIndexA;
-						std::int32_t yawDelta = ((yawIndexB - yawIndexA) << 8 >> 8) / blockSize;
-						std::int32_t pitchC = pitchA;
-						std::int32_t pitchDelta = (pitchB - pitchA) / blockSize;
-
-						for (unsigned int y = 0; y < blockSize; y++) {
-
-							std::uint32_t yawIndex =
-							  static_cast<unsigned int>(yawIndexC << 8 >> 16);
-							yawIndex = (yawIndex * yawScale2) >> 16;
-							yawIndex = (yawIndex * numLines) >> 16;
-							auto &line = lineList[yawIndex];
-							auto *pixels = line.pixels.data();
-
-							// solve pitch
-							std::int32_t pitchIndex;
-
-							{
-								pitchIndex = pitchC >> 13;
-								pitchIndex -= line.pitchTanMinI;
-								pitchIndex =
-								  static_cast<int>((static_cast<int64_t>(pitchIndex) *
-								                    static_cast<int64_t>(line.pitchScaleI)) >>
-								                   32);
-								// pitch = (pitch - line.pitchTanMin) * line.pitchScale;
-								// pitchIndex = static_cast<int>(pitch);
-								pitchIndex &= lineResolution - 1;
-								// pitchIndex = std::max(pitchIndex, 0);
-								// pitchIndex = std::min(pitchIndex, lineResolution - 1);
-							}
-
-							auto &pix = pixels[pitchIndex];
-
-// write color.
-// NOTE: combined contains both color and other information,
-// though this isn't a problem as long as the color comes
-// in the LSB's
-#if ENABLE_SSE
-							if (flevel == SWFeatureLevel::SSE2) {
-								__m128i m;
-
-								if (under == 1) {
-									*fb3 = pix.combined;
-									*db3 = pix.depth;
-								} else if (under == 2) {
-									m = _mm_castpd_si128(
-									  _mm_load_sd(reinterpret_cast<const double *>(&pix)));
-									_mm_store_sd(reinterpret_cast<double *>(fb3),
-									             _mm_castsi128_pd(_mm_shuffle_epi32(m, 0x00)));
-									_mm_store_sd(reinterpret_cast<double *>(db3),
-									             _mm_castsi128_pd(_mm_shuffle_epi32(m, 0x55)));
-								} else if (under == 4) {
-									m = _mm_castpd_si128(
-									  _mm_load_sd(reinterpret_cast<const double *>(&pix)));
-									_mm_stream_si128(reinterpret_cast<__m128i *>(fb3),
-									                 _mm_shuffle_epi32(m, 0x00));
-									_mm_stream_si128(reinterpret_cast<__m128i *>(db3),
-									                 _mm_shuffle_epi32(m, 0x55));
-								}
-
-							} else
-#endif
-							// non-optimized
-							{
-								uint32_t col = pix.combined;
-								float d = pix.depth;
-
-								for (int k = 0; k < under; k++) {
-									fb3[k] = col;
-									db3[k] = d;
-								}
-							}
-
-							fb3 += fw;
-							db3 += fw;
-
-							yawIndexC += yawDelta;
-							pitchC += pitchDelta;
-						}
-
-						yawIndexA += yawDiff1;
-						yawIndexB += yawDiff2;
-						pitchA += pitchDiff1;
-						pitchB += pitchDiff2;
-					}
+					block.fb = fb2;
+					block.db = db2;
+					block.yawIndexA = yawIndex1;
+					block.yawIndexB = yawIndex3;
+					block.pitchA = pitch1;
+					block.pitchB = pitch3;
+					block.yawDiffA = yawDiff1;
+					block.yawDiffB = yawDiff2;
+					block.pitchDiffA = pitchDiff1;
+					block.pitchDiffB = pitchDiff2;
+					DrawMapBlock<flevel>(block);
 				}
 					goto Converge;
 
@@ -985,7 +1214,7 @@ namespace spades {
 // though this isn't a problem as long as the color comes
 // in the LSB's
 #if ENABLE_SSE
-							if (flevel == SWFeatureLevel::SSE2) {
+							if (flevel >= SWFeatureLevel::SSE2) {
 								__m128i m;
 
 								if (under == 1) {
@@ -1142,16 +1371,63 @@ namespace spades {
 				}
 			}
 
+			// Decide which lines to build. A static camera can reuse most of the lines of the
+			// previous frame.
+			{
+				LineCacheKey key;
+				key.viewOrigin = def.viewOrigin;
+				key.viewAxis = {{def.viewAxis[0], def.viewAxis[1], def.viewAxis[2]}};
+				key.fovX = def.fovX;
+				key.fovY = def.fovY;
+				key.lineResolution = lineResolution;
+				key.numLines = numLines;
+
+				// Beyond this, most of the lines would be rebuilt anyway
+				const std::size_t maxChangedColumns = 4096;
+
+				lineDirty.resize(std::max(numLines, lineDirty.size()));
+				if (key == lineCacheKey && changedRleColumnsBase == lineCacheGeneration &&
+				    changedRleColumns.size() <= maxChangedColumns) {
+					std::fill(lineDirty.begin(), lineDirty.begin() + numLines, 0);
+					float yawStep = (yawMax - yawMin) / numLines;
+					for (int column : changedRleColumns) {
+						MarkLinesThroughColumn(column % w, column / w, yawMin, yawStep, numLines);
+					}
+				} else {
+					std::fill(lineDirty.begin(), lineDirty.begin() + numLines, 1);
+				}
+
+				lineCacheKey = key;
+				lineCacheGeneration = rleGeneration;
+				changedRleColumns.clear();
+				changedRleColumnsBase = rleGeneration;
+			}
+
 			{
 				unsigned int nlines = static_cast<unsigned int>(numLines);
+				lineRefs.resize(numLines);
+				std::atomic<unsigned int> numBuilt{0};
 				InvokeParallel2([&](unsigned int th, unsigned int numThreads) {
 					unsigned int start = th * nlines / numThreads;
 					unsigned int end = (th + 1) * nlines / numThreads;
+					unsigned int built = 0;
 
 					for (size_t i = start; i < end; i++) {
-						BuildLine<flevel>(lines[i], pitchMin, pitchMax);
+						Line &line = lines[i];
+						if (lineDirty[i]) {
+							BuildLine<flevel>(line, pitchMin, pitchMax);
+							built++;
+						}
+
+						MapLineRef &ref = lineRefs[i];
+						ref.pixels = line.pixels.data();
+						ref.pitchTanMinI = line.pitchTanMinI;
+						ref.pitchScaleI = line.pitchScaleI;
 					}
+					numBuilt.fetch_add(built);
 				});
+				linesBuilt += numBuilt.load();
+				linesReused += numLines - numBuilt.load();
 			}
 
 			int under = r_swUndersampling;
@@ -1173,24 +1449,33 @@ namespace spades {
 			depthBuf = nullptr;
 		}
 
-		void SWMapRenderer::Render(const client::SceneDefinition &def, Bitmap &frame,
+		bool SWMapRenderer::Render(const client::SceneDefinition &def, Bitmap &frame,
 		                           float *depthBuffer) {
 			if (!depthBuffer)
 				SPInvalidArgument("depthBuffer");
 
+			FlushRleUpdates();
+
 			auto p = def.viewOrigin.Floor();
 			if (map->IsSolidWrapped(p.x, p.y, p.z)) {
-				return;
+				return false;
 			}
 
+#if ENABLE_AVX2
+			if (static_cast<int>(level) >= static_cast<int>(SWFeatureLevel::AVX2)) {
+				RenderInner<SWFeatureLevel::AVX2>(def, &frame, depthBuffer);
+				return true;
+			}
+#endif
 #if ENABLE_SSE2
 			if (static_cast<int>(level) >= static_cast<int>(SWFeatureLevel::SSE2)) {
 				RenderInner<SWFeatureLevel::SSE2>(def, &frame, depthBuffer);
-				return;
+				return true;
 			}
 #endif
 
 			RenderInner<SWFeatureLevel::None>(def, &frame, depthBuffer);
+			return true;
 		}
 	} // namespace draw
 } // namespace spades
@@ -20,10 +20,13 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <memory>
 #include <vector>
 
 #include "SWFeatureLevel.h"
+#include "SWKernels.h"
 #include <Client/SceneDefinition.h>
 #include <Core/Math.h>
 #include <Core/MiniHeap.h>
@@ -40,7 +43,7 @@ namespace spades {
 		class SWRenderer;
 		class SWMapRenderer {
 			struct Line;
-			struct LinePixel;
+			typedef MapPixel LinePixel;
 
 			int w, h;
 			SWRenderer &renderer;
@@ -53,19 +56,87 @@ namespace spades {
 			Bitmap *frameBuf;
 			float *depthBuf;
 			std::vector<Line> lines;
+			/** The pixel pointers and the pitch mappings of `lines`, passed to `DrawMapBlock`. */
+			std::vector<MapLineRef> lineRefs;
 			std::vector<MiniHeap::Ref> rle;
 			std::vector<size_t> rleLen;
+			/** `rleRowBuilt[y]` is `true` if the RLE of the row `y` was built. */
+			std::vector<bool> rleRowBuilt;
 
 			int lineResolution;
 
 			typedef int8_t RleData;
-			std::vector<RleData> rleBuf;
+
+			/** The RLE of consecutive columns built by one thread. */
+			struct RleArena {
+				std::vector<RleData> data;
+				/** The start of each column in `data`, followed by `data.size()`. */
+				std::vector<size_t> offsets;
+			};
+			std::vector<RleArena> rleArenas;
+			std::vector<int> rleColumns;
+
+			/** `rleDirty[x + y * w]` is `true` if the column is in `dirtyRleColumns`. */
+			std::vector<bool> rleDirty;
+			/** The columns passed to `UpdateRle` since the last `FlushRleUpdates`. */
+			std::vector<int> dirtyRleColumns;
 
 			MiniHeap rleHeap;
 
+			/** Incremented whenever the RLE changes. */
+			uint64_t rleGeneration;
+
+			/**
+			 * The parameters `lines` were built with. If the next frame has the same ones,
+			 * only the lines passing through the columns rebuilt in the meantime are rebuilt.
+			 */
+			struct LineCacheKey {
+				Vector3 viewOrigin;
+				std::array<Vector3, 3> viewAxis;
+				float fovX, fovY;
+				int lineResolution;
+				std::size_t numLines;
+
+				bool operator==(const LineCacheKey &o) const {
+					return viewOrigin == o.viewOrigin && viewAxis[0] == o.viewAxis[0] &&
+					       viewAxis[1] == o.viewAxis[1] && viewAxis[2] == o.viewAxis[2] &&
+					       fovX == o.fovX && fovY == o.fovY &&
+					       lineResolution == o.lineResolution && numLines == o.numLines;
+				}
+			};
+			LineCacheKey lineCacheKey;
+			/** The `rleGeneration` the lines were built at. */
+			uint64_t lineCacheGeneration;
+			/**
+			 * The columns rebuilt by `FlushRleUpdates` since `rleGeneration` was
+			 * `changedRleColumnsBase`. Rebuilding whole rows resets it.
+			 */
+			std::vector<int> changedRleColumns;
+			uint64_t changedRleColumnsBase;
+			/** `lineDirty[i]` is non-zero if `lines[i]` must be rebuilt in this frame. */
+			std::vector<uint8_t> lineDirty;
+
+			unsigned long long linesBuilt;
+			unsigned long long linesReused;
+
 			template <SWFeatureLevel level>
 			void BuildLine(Line &line, float minPitch, float maxPitch);
+			/**
+			 * Marks the lines that may pass through the column `(x, y)` in `lineDirty`.
+			 * `yawMin` and `yawStep` are the yaw of the first line and the interval of lines.
+			 */
+			void MarkLinesThroughColumn(int x, int y, float yawMin, float yawStep,
+			                            std::size_t numLines);
+			/** Appends the RLE of the column `(x, y)` to the vector. */
 			void BuildRle(int x, int y, std::vector<RleData> &);
+			/**
+			 * Builds the RLE of `columns` (given as `x + y * w`) into `rleArenas` in parallel.
+			 * Returns the number of the arenas used.
+			 */
+			unsigned int BuildRleColumns(const std::vector<int> &columns);
+			void BuildRleRows(const std::vector<int> &rows);
+			/** Rebuilds the columns passed to `UpdateRle` in one batch. */
+			void FlushRleUpdates();
 
 			template <SWFeatureLevel level, int undersamp>
 			void RenderFinal(float yawMin, float yawMax, unsigned int numLines,
@@ -75,12 +146,45 @@ namespace spades {
 			void RenderInner(const client::SceneDefinition &, Bitmap *fb, float *depthBuffer);
 
 		public:
-			SWMapRenderer(SWRenderer &r, client::GameMap *, SWFeatureLevel level);
+			/**
+			 * @param prebuild If `true`, the RLE map isn't built until `Prebuild` or
+			 *                 `BuildRemainingRle` is called, so the map can be incomplete.
+			 */
+			SWMapRenderer(SWRenderer &r, client::GameMap *, SWFeatureLevel level,
+			              bool prebuild = false);
 			~SWMapRenderer();
 
-			void Render(const client::SceneDefinition &, Bitmap &fb, float *depthBuffer);
+			client::GameMap &GetMap() { return *map; }
+
+			/**
+			 * Builds the RLE of the rows whose neighbors are all decoded.
+			 * See `IRenderer::PrebuildGameMap`.
+			 */
+			void Prebuild(const std::vector<bool> &decodedRows);
 
+			/** Builds the RLE of the rows not built by `Prebuild` yet. */
+			void BuildRemainingRle();
+
+			/**
+			 * @return `false` if nothing was drawn (and `depthBuffer` wasn't written) because the
+			 *         camera is inside a solid voxel.
+			 */
+			bool Render(const client::SceneDefinition &, Bitmap &fb, float *depthBuffer);
+
+			/**
+			 * Marks the RLE of the column as outdated. Outdated columns are rebuilt by the next
+			 * call to `Render`, so a column changed many times in a frame is rebuilt once.
+			 */
 			void UpdateRle(int x, int y);
+
+			/** The number of lines built by `Render`. */
+			unsigned long long GetLinesBuilt() { return linesBuilt; }
+			/** The number of lines reused from the previous frame by `Render`. */
+			unsigned long long GetLinesReused() { return linesReused; }
+			void ResetStatistics() {
+				linesBuilt = 0;
+				linesReused = 0;
+			}
 		};
 	} // namespace draw
 } // namespace spades
@@ -18,6 +18,9 @@
 
  */
 
+#include <algorithm>
+#include <atomic>
+
 #include "SWModelRenderer.h"
 #include "SWModel.h"
 #include "SWRenderer.h"
@@ -25,11 +28,19 @@
 #include <Core/Bitmap.h>
 #include <Core/Debug.h>
 #include <Core/Math.h>
+#include <Core/Settings.h>
+
+DEFINE_SPADES_SETTING(r_swOcclusionCulling, "1");
 
 namespace spades {
 	namespace draw {
 		SWModelRenderer::SWModelRenderer(SWRenderer *r, SWFeatureLevel level)
-		    : r(r), level(level) {}
+		    : r(r),
+		      level(level),
+		      numTilesX(0),
+		      numTilesY(0),
+		      modelsQueued(0),
+		      modelsOccluded(0) {}
 
 		SWModelRenderer::~SWModelRenderer() {}
 
@@ -44,8 +55,9 @@ namespace spades {
 		static ZVals zvals;
 
 		template <SWFeatureLevel lvl>
-		void SWModelRenderer::RenderInner(spades::draw::SWModel &model,
-		                                  const client::ModelRenderParam &param) {
+		void SWModelRenderer::TransformInner(spades::draw::SWModel &model,
+		                                     const client::ModelRenderParam &param,
+		                                     std::vector<Splat> &outSplats) {
 			auto &mat = param.matrix;
 			auto origin = mat.GetOrigin();
 			auto axis1 = mat.GetAxis(0);
@@ -145,10 +157,8 @@ namespace spades {
 			}
 
 			Bitmap &fbmp = *r->fb;
-			auto *fb = fbmp.GetPixels();
 			int fw = fbmp.GetWidth();
 			int fh = fbmp.GetHeight();
-			auto *db = r->depthBuffer.data();
 
 			Matrix4 viewproj = r->GetProjectionViewMatrix();
 			Vector4 ndc2scrscale = {fw * 0.5f, -fh * 0.5f, 1.f, 1.f};
@@ -223,10 +233,6 @@ namespace spades {
 						maxX = std::min(maxX, fw);
 						maxY = std::min(maxY, fh);
 
-						auto *fb2 = fb + (minX + minY * fw);
-						auto *db2 = db + (minX + minY * fw);
-						int w = maxX - minX;
-
 						uint32_t color = data & 0xffffff;
 						if (color == 0)
 							color = customColor;
@@ -253,22 +259,14 @@ namespace spades {
 							color = ((c1 & 0xff0000) | (c2 & 0xff00ff00)) >> 8;
 						}
 
-						for (int yy = minY; yy < maxY; yy++) {
-							auto *fb3 = fb2;
-							auto *db3 = db2;
-
-							for (int xx = w; xx > 0; xx--) {
-								if (zval < *db3) {
-									*db3 = zval;
-									*fb3 = color;
-								}
-								fb3++;
-								db3++;
-							}
-
-							fb2 += fw;
-							db2 += fw;
-						}
+						Splat splat;
+						splat.z = zval;
+						splat.color = color;
+						splat.minX = static_cast<int16_t>(minX);
+						splat.minY = static_cast<int16_t>(minY);
+						splat.maxX = static_cast<int16_t>(maxX);
+						splat.maxY = static_cast<int16_t>(maxY);
+						outSplats.push_back(splat);
 					}
 					v2 += tAxis2;
 				}
@@ -276,14 +274,339 @@ namespace spades {
 			}
 		}
 
-		void SWModelRenderer::Render(spades::draw::SWModel &model,
-		                             const client::ModelRenderParam &param) {
+		void SWModelRenderer::Transform(spades::draw::SWModel &model,
+		                                const client::ModelRenderParam &param,
+		                                std::vector<Splat> &outSplats) {
 #if ENABLE_SSE2
 			if (static_cast<int>(level) >= static_cast<int>(SWFeatureLevel::SSE2)) {
-				RenderInner<SWFeatureLevel::SSE2>(model, param);
+				TransformInner<SWFeatureLevel::SSE2>(model, param, outSplats);
 			} else
 #endif
-				RenderInner<SWFeatureLevel::None>(model, param);
+				TransformInner<SWFeatureLevel::None>(model, param, outSplats);
+		}
+
+		void SWModelRenderer::BinSplats() {
+			int numTiles = numTilesX * numTilesY;
+
+			// Counting sort. The splats are visited in the same order in both passes so
+			// that every bin lists its splats in the order they were queued.
+			binOffsets.assign(numTiles + 1, 0);
+			for (const auto &splats : modelSplats) {
+				for (const Splat &splat : splats) {
+					int tx1 = splat.minX >> TileSizeBits, tx2 = (splat.maxX - 1) >> TileSizeBits;
+					int ty1 = splat.minY >> TileSizeBits, ty2 = (splat.maxY - 1) >> TileSizeBits;
+					for (int ty = ty1; ty <= ty2; ty++) {
+						for (int tx = tx1; tx <= tx2; tx++) {
+							binOffsets[tx + ty * numTilesX + 1]++;
+						}
+					}
+				}
+			}
+
+			activeTiles.clear();
+			for (int i = 0; i < numTiles; i++) {
+				if (binOffsets[i + 1]) {
+					activeTiles.push_back(i);
+				}
+				binOffsets[i + 1] += binOffsets[i];
+			}
+
+			binnedSplats.resize(binOffsets[numTiles]);
+			std::vector<uint32_t> cursors(binOffsets.begin(), binOffsets.end() - 1);
+			for (const auto &splats : modelSplats) {
+				for (const Splat &splat : splats) {
+					int tx1 = splat.minX >> TileSizeBits, tx2 = (splat.maxX - 1) >> TileSizeBits;
+					int ty1 = splat.minY >> TileSizeBits, ty2 = (splat.maxY - 1) >> TileSizeBits;
+					for (int ty = ty1; ty <= ty2; ty++) {
+						for (int tx = tx1; tx <= tx2; tx++) {
+							binnedSplats[cursors[tx + ty * numTilesX]++] = &splat;
+						}
+					}
+				}
+			}
+		}
+
+		void SWModelRenderer::RasterizeTile(int tileIndex) {
+			Bitmap &fbmp = *r->fb;
+			auto *fb = fbmp.GetPixels();
+			int fw = fbmp.GetWidth();
+			int fh = fbmp.GetHeight();
+			auto *db = r->depthBuffer.data();
+
+			int tileMinX = (tileIndex % numTilesX) << TileSizeBits;
+			int tileMinY = (tileIndex / numTilesX) << TileSizeBits;
+			int tileMaxX = std::min(tileMinX + TileSize, fw);
+			int tileMaxY = std::min(tileMinY + TileSize, fh);
+
+			const Splat *const *begin = binnedSplats.data() + binOffsets[tileIndex];
+			const Splat *const *end = binnedSplats.data() + binOffsets[tileIndex + 1];
+#if ENABLE_AVX2
+			if (level >= SWFeatureLevel::AVX2) {
+				DrawSplatsInRect<SWFeatureLevel::AVX2>(fb, db, fw, tileMinX, tileMinY, tileMaxX,
+				                                       tileMaxY, begin, end);
+				return;
+			}
+#endif
+			DrawSplatsInRect<SWFeatureLevel::None>(fb, db, fw, tileMinX, tileMinY, tileMaxX,
+			                                       tileMaxY, begin, end);
+		}
+
+		template <>
+		void DrawSplatsInRect<SWFeatureLevel::None>(uint32_t *fb, float *db, int fw, int rectMinX,
+		                                            int rectMinY, int rectMaxX, int rectMaxY,
+		                                            const ScreenSplat *const *it,
+		                                            const ScreenSplat *const *end) {
+			for (; it != end; ++it) {
+				const ScreenSplat &splat = **it;
+				int minX = std::max<int>(splat.minX, rectMinX);
+				int minY = std::max<int>(splat.minY, rectMinY);
+				int maxX = std::min<int>(splat.maxX, rectMaxX);
+				int maxY = std::min<int>(splat.maxY, rectMaxY);
+				float zval = splat.z;
+				uint32_t color = splat.color;
+
+				auto *fb2 = fb + (minX + minY * fw);
+				auto *db2 = db + (minX + minY * fw);
+				int w = maxX - minX;
+
+				for (int yy = minY; yy < maxY; yy++) {
+					auto *fb3 = fb2;
+					auto *db3 = db2;
+
+					for (int xx = w; xx > 0; xx--) {
+						if (zval < *db3) {
+							*db3 = zval;
+							*fb3 = color;
+						}
+						fb3++;
+						db3++;
+					}
+
+					fb2 += fw;
+					db2 += fw;
+				}
+			}
+		}
+
+		void SWModelRenderer::BuildDepthPyramid() {
+			Bitmap &fbmp = *r->fb;
+			int fw = fbmp.GetWidth();
+			const float *db = r->depthBuffer.data();
+
+			// The framebuffer size is a multiple of 8
+			depthPyramid.resize(1);
+			DepthPyramidLevel &base = depthPyramid[0];
+			base.width = fw >> 3;
+			base.height = fbmp.GetHeight() >> 3;
+			base.depths.resize(base.width * base.height);
+
+			InvokeParallel2([&](unsigned int th, unsigned int numThreads) {
+				int cy1 = static_cast<int>(base.height * th / numThreads);
+				int cy2 = static_cast<int>(base.height * (th + 1) / numThreads);
+				std::vector<float> rowMax(fw);
+				for (int cy = cy1; cy < cy2; cy++) {
+					const float *row = db + (cy << 3) * fw;
+					std::copy(row, row + fw, rowMax.begin());
+					for (int y = 1; y < 8; y++) {
+						row += fw;
+						for (int x = 0; x < fw; x++) {
+							rowMax[x] = std::max(rowMax[x], row[x]);
+						}
+					}
+
+					float *out = base.depths.data() + cy * base.width;
+					for (int cx = 0; cx < base.width; cx++) {
+						const float *cell = rowMax.data() + (cx << 3);
+						out[cx] = *std::max_element(cell, cell + 8);
+					}
+				}
+			});
+
+			while (depthPyramid.back().width > 1 || depthPyramid.back().height > 1) {
+				depthPyramid.emplace_back();
+				const DepthPyramidLevel &prev = depthPyramid[depthPyramid.size() - 2];
+				DepthPyramidLevel &next = depthPyramid.back();
+				next.width = (prev.width + 1) >> 1;
+				next.height = (prev.height + 1) >> 1;
+				next.depths.resize(next.width * next.height);
+				for (int y = 0; y < next.height; y++) {
+					int y1 = y << 1, y2 = std::min((y << 1) + 1, prev.height - 1);
+					for (int x = 0; x < next.width; x++) {
+						int x1 = x << 1, x2 = std::min((x << 1) + 1, prev.width - 1);
+						const float *d = prev.depths.data();
+						next.depths[x + y * next.width] = std::max(
+						  std::max(d[x1 + y1 * prev.width], d[x2 + y1 * prev.width]),
+						  std::max(d[x1 + y2 * prev.width], d[x2 + y2 * prev.width]));
+					}
+				}
+			}
+		}
+
+		bool SWModelRenderer::IsOccluded(spades::draw::SWModel &model,
+		                                 const client::ModelRenderParam &param) {
+			// Compute the corners of the box enclosing the splats in the same way as
+			// `TransformInner`
+			auto &mat = param.matrix;
+			auto origin = mat.GetOrigin();
+			auto axis1 = mat.GetAxis(0);
+			auto axis2 = mat.GetAxis(1);
+			auto axis3 = mat.GetAxis(2);
+			auto &rawModel = model.GetRawModel();
+			auto rawModelOrigin = rawModel.GetOrigin();
+			rawModelOrigin += 0.25f;
+			origin += axis1 * rawModelOrigin.x;
+			origin += axis2 * rawModelOrigin.y;
+			origin += axis3 * rawModelOrigin.z;
+
+			Bitmap &fbmp = *r->fb;
+			int fw = fbmp.GetWidth();
+			int fh = fbmp.GetHeight();
+
+			Matrix4 viewproj = r->GetProjectionViewMatrix();
+			Vector4 ndc2scrscale = {fw * 0.5f, -fh * 0.5f, 1.f, 1.f};
+
+			auto tOrigin = viewproj * MakeVector4(origin.x, origin.y, origin.z, 1.f);
+			auto tAxis1 = viewproj * MakeVector4(axis1.x, axis1.y, axis1.z, 0.f);
+			auto tAxis2 = viewproj * MakeVector4(axis2.x, axis2.y, axis2.z, 0.f);
+			auto tAxis3 = viewproj * MakeVector4(axis3.x, axis3.y, axis3.z, 0.f);
+			tOrigin *= ndc2scrscale;
+			tAxis1 *= ndc2scrscale;
+			tAxis2 *= ndc2scrscale;
+			tAxis3 *= ndc2scrscale;
+
+			float pointDiameter;
+			{
+				float largestAxis = tAxis1.GetPoweredLength();
+				largestAxis = std::max(largestAxis, tAxis2.GetPoweredLength());
+				largestAxis = std::max(largestAxis, tAxis3.GetPoweredLength());
+				pointDiameter = sqrtf(largestAxis);
+			}
+
+			tAxis1 *= static_cast<float>(std::max(rawModel.GetWidth() - 1, 0));
+			tAxis2 *= static_cast<float>(std::max(rawModel.GetHeight() - 1, 0));
+			tAxis3 *= static_cast<float>(std::max(rawModel.GetDepth() - 1, 0));
+
+			float zNear = r->sceneDef.zNear;
+			float minZ = 1.e+30f, minW = 1.e+30f;
+			float minX = 1.e+30f, minY = 1.e+30f, maxX = -1.e+30f, maxY = -1.e+30f;
+			for (int i = 0; i < 8; i++) {
+				auto v = tOrigin;
+				if (i & 1)
+					v += tAxis1;
+				if (i & 2)
+					v += tAxis2;
+				if (i & 4)
+					v += tAxis3;
+				if (v.z < zNear || v.w < zNear) {
+					// Crosses the near plane
+					return false;
+				}
+				minZ = std::min(minZ, v.z);
+				minW = std::min(minW, v.w);
+
+				float scl = 1.f / v.w;
+				minX = std::min(minX, v.x * scl);
+				minY = std::min(minY, v.y * scl);
+				maxX = std::max(maxX, v.x * scl);
+				maxY = std::max(maxY, v.y * scl);
+			}
+
+			// Add the largest splat size and a margin for the rounding
+			int margin = static_cast<int>(pointDiameter / minW + .99f) + 2;
+			int rectMinX = std::max(static_cast<int>(floorf(minX)) + (fw >> 1) - margin, 0);
+			int rectMinY = std::max(static_cast<int>(floorf(minY)) + (fh >> 1) - margin, 0);
+			int rectMaxX = std::min(static_cast<int>(ceilf(maxX)) + (fw >> 1) + margin, fw);
+			int rectMaxY = std::min(static_cast<int>(ceilf(maxY)) + (fh >> 1) + margin, fh);
+			if (rectMinX >= rectMaxX || rectMinY >= rectMaxY) {
+				// Off-screen. Left to the frustum culling.
+				return false;
+			}
+
+			// Choose the finest level where the rectangle covers at most 4x4 cells
+			int cx1 = rectMinX >> 3, cx2 = (rectMaxX - 1) >> 3;
+			int cy1 = rectMinY >> 3, cy2 = (rectMaxY - 1) >> 3;
+			std::size_t levelIndex = 0;
+			while (levelIndex + 1 < depthPyramid.size() && (cx2 - cx1 > 3 || cy2 - cy1 > 3)) {
+				cx1 >>= 1;
+				cx2 >>= 1;
+				cy1 >>= 1;
+				cy2 >>= 1;
+				levelIndex++;
+			}
+
+			// A splat passes the depth test if `z < depth`. The voxel positions are computed
+			// incrementally by `TransformInner`, so allow for a small error.
+			float threshold = minZ - 0.01f;
+			const DepthPyramidLevel &pyramidLevel = depthPyramid[levelIndex];
+			for (int cy = cy1; cy <= cy2; cy++) {
+				const float *row = pyramidLevel.depths.data() + cy * pyramidLevel.width;
+				for (int cx = cx1; cx <= cx2; cx++) {
+					if (row[cx] > threshold) {
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+
+		void SWModelRenderer::AddModel(spades::draw::SWModel &model,
+		                               const client::ModelRenderParam &param) {
+			queuedModels.push_back(QueuedModel{&model, param});
+		}
+
+		void SWModelRenderer::Flush(bool cullOccluded) {
+			SPADES_MARK_FUNCTION();
+
+			if (queuedModels.empty()) {
+				return;
+			}
+
+			Bitmap &fbmp = *r->fb;
+			numTilesX = (fbmp.GetWidth() + TileSize - 1) >> TileSizeBits;
+			numTilesY = (fbmp.GetHeight() + TileSize - 1) >> TileSizeBits;
+
+			cullOccluded = cullOccluded && r_swOcclusionCulling;
+			if (cullOccluded) {
+				BuildDepthPyramid();
+			}
+
+			// Transform the splats. Models vary a lot in size, so they are handed out one by
+			// one rather than in fixed ranges.
+			std::size_t numModels = queuedModels.size();
+			if (modelSplats.size() < numModels) {
+				modelSplats.resize(numModels);
+			}
+			for (auto &splats : modelSplats) {
+				splats.clear();
+			}
+
+			std::atomic<std::size_t> nextModel{0};
+			std::atomic<unsigned int> numOccluded{0};
+			InvokeParallel2([&](unsigned int, unsigned int) {
+				std::size_t i;
+				while ((i = nextModel.fetch_add(1)) < numModels) {
+					const QueuedModel &m = queuedModels[i];
+					if (cullOccluded && IsOccluded(*m.model, m.param)) {
+						numOccluded.fetch_add(1);
+						continue;
+					}
+					Transform(*m.model, m.param, modelSplats[i]);
+				}
+			});
+			queuedModels.clear();
+			modelsQueued += numModels;
+			modelsOccluded += numOccluded.load();
+
+			BinSplats();
+
+			// Tiles don't overlap, so they can be rasterized in any order
+			std::atomic<std::size_t> nextTile{0};
+			InvokeParallel2([&](unsigned int, unsigned int) {
+				std::size_t i;
+				while ((i = nextTile.fetch_add(1)) < activeTiles.size()) {
+					RasterizeTile(activeTiles[i]);
+				}
+			});
 		}
 	} // namespace draw
 } // namespace spades
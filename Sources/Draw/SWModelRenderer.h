@@ -20,26 +20,109 @@
 
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
 #include "SWFeatureLevel.h"
+#include "SWKernels.h"
 #include <Client/IRenderer.h>
 
 namespace spades {
 	namespace draw {
 		class SWModel;
 		class SWRenderer;
+
+		/**
+		 * Draws `SWModel`s as point splats.
+		 *
+		 * Models are queued by `AddModel` and drawn together by `Flush` in three stages: the
+		 * splats of every model are transformed into screen space (one model per task), sorted
+		 * into screen tiles, and then the tiles are rasterized in parallel against the depth
+		 * buffer. Within a tile, splats are drawn in the order they were queued, so the result
+		 * is the same as drawing the models one by one.
+		 *
+		 * Before the transformation, models hidden behind the map can be culled with a depth
+		 * pyramid built from the depth buffer (see `Flush`).
+		 */
 		class SWModelRenderer {
 			friend class SWRenderer;
 			SWRenderer *r;
 			SWFeatureLevel level;
 
+			enum { TileSizeBits = 6, TileSize = 1 << TileSizeBits };
+
+			typedef ScreenSplat Splat;
+
+			struct QueuedModel {
+				SWModel *model;
+				client::ModelRenderParam param;
+			};
+			std::vector<QueuedModel> queuedModels;
+
+			/** The splats of each queued model. Retained to reuse the memory. */
+			std::vector<std::vector<Splat>> modelSplats;
+
+			int numTilesX, numTilesY;
+			/** `binOffsets[i]` is the index in `binnedSplats` where the bin of tile `i` starts. */
+			std::vector<uint32_t> binOffsets;
+			std::vector<const Splat *> binnedSplats;
+			/** The indices of the tiles with at least one splat. */
+			std::vector<int> activeTiles;
+
+			struct DepthPyramidLevel {
+				int width, height;
+				std::vector<float> depths;
+			};
+			/**
+			 * Level 0 holds the maximum depth of each 8x8 block of the depth buffer, and each
+			 * following level the maximum of 2x2 cells of the previous one, down to 1x1.
+			 */
+			std::vector<DepthPyramidLevel> depthPyramid;
+
+			unsigned long long modelsQueued;
+			unsigned long long modelsOccluded;
+
 			template <SWFeatureLevel>
-			void RenderInner(SWModel &model, const client::ModelRenderParam &param);
+			void TransformInner(SWModel &model, const client::ModelRenderParam &param,
+			                    std::vector<Splat> &outSplats);
+			void Transform(SWModel &model, const client::ModelRenderParam &param,
+			               std::vector<Splat> &outSplats);
+
+			void BinSplats();
+			void RasterizeTile(int tileIndex);
+
+			void BuildDepthPyramid();
+			/**
+			 * Returns `true` if no splat of the model would pass the depth test against the
+			 * depth buffer summarized by `depthPyramid`. Conservative: may return `false` for
+			 * hidden models.
+			 */
+			bool IsOccluded(SWModel &model, const client::ModelRenderParam &param);
 
 		public:
 			SWModelRenderer(SWRenderer *, SWFeatureLevel level);
 			~SWModelRenderer();
 
-			void Render(SWModel &model, const client::ModelRenderParam &param);
+			/** Queues `model` for drawing. `model` must be alive until `Flush` is called. */
+			void AddModel(SWModel &model, const client::ModelRenderParam &param);
+
+			/**
+			 * Draws all models queued by `AddModel`.
+			 *
+			 * @param cullOccluded If `true`, models hidden behind the current contents of the
+			 *                     depth buffer are skipped. The depth buffer must be fully
+			 *                     written (e.g., by the map pass).
+			 */
+			void Flush(bool cullOccluded = false);
+
+			/** The number of models passed to `Flush`, including the occluded ones. */
+			unsigned long long GetModelsQueued() { return modelsQueued; }
+			/** The number of models skipped by the occlusion culling. */
+			unsigned long long GetModelsOccluded() { return modelsOccluded; }
+			void ResetStatistics() {
+				modelsQueued = 0;
+				modelsOccluded = 0;
+			}
 		};
 	} // namespace draw
 } // namespace spades
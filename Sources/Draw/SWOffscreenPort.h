@@ -0,0 +1,53 @@
+/*
+ Copyright (c) 2021 yvt
+
+ This file is part of OpenSpades.
+
+ OpenSpades is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ OpenSpades is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with OpenSpades.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#pragma once
+
+#include "SWPort.h"
+
+namespace spades {
+	namespace draw {
+		/**
+		 * A `SWPort` that renders into an owned `Bitmap` without presenting it anywhere.
+		 * Doesn't need a window or a video driver, so `SWRenderer` can run headless.
+		 */
+		class SWOffscreenPort : public SWPort {
+			Handle<Bitmap> framebuffer;
+			unsigned int numFramesSwapped;
+
+		protected:
+			~SWOffscreenPort();
+
+		public:
+			/** The size must be a multiple of 8, as required by `SWRenderer`. */
+			SWOffscreenPort(int width, int height);
+
+			Bitmap &GetFramebuffer() override { return *framebuffer; }
+
+			/**
+			 * Does nothing but count the frames. The framebuffer keeps the contents of the
+			 * last frame until the next frame is rendered.
+			 */
+			void Swap() override { numFramesSwapped++; }
+
+			unsigned int GetNumFramesSwapped() const { return numFramesSwapped; }
+		};
+	} // namespace draw
+} // namespace spades
@@ -20,12 +20,15 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cfenv>
+#include <cmath>
 #include <cstdlib>
 
 #include "SWFlatMapRenderer.h"
 #include "SWImage.h"
 #include "SWImageRenderer.h"
+#include "SWKernels.h"
 #include "SWMapRenderer.h"
 #include "SWModel.h"
 #include "SWModelRenderer.h"
@@ -39,6 +42,12 @@
 
 DEFINE_SPADES_SETTING(r_swStatistics, "0");
 DEFINE_SPADES_SETTING(r_swNumThreads, "4");
+DEFINE_SPADES_SETTING(r_swDynamicResolution, "0");
+/** The time budget of `EndScene` in milliseconds. */
+DEFINE_SPADES_SETTING(r_swDynamicResolutionTarget, "12");
+DEFINE_SPADES_SETTING(r_swDynamicResolutionMin, "0.5");
+/** Can't exceed 1 (supersampling isn't supported). */
+DEFINE_SPADES_SETTING(r_swDynamicResolutionMax, "1");
 
 namespace spades {
 	namespace draw {
@@ -47,6 +56,8 @@ namespace spades {
 		      port(std::move(_port)),
 		      map(nullptr),
 		      fb(nullptr),
+		      resolutionScale(1.f),
+		      smoothedSceneTime(0.0),
 		      inited(false),
 		      sceneUsedInThisFrame(false),
 		      fogDistance(128.f),
@@ -173,6 +184,10 @@ namespace spades {
 			SPADES_MARK_FUNCTION();
 			if (map)
 				EnsureInitialized();
+
+			std::shared_ptr<SWMapRenderer> prebuilt = std::move(prebuiltMapRenderer);
+			prebuiltMapRenderer.reset();
+
 			if (map.get_pointer() == this->map.GetPointerOrNull())
 				return;
 
@@ -185,9 +200,27 @@ namespace spades {
 			if (this->map) {
 				this->map->AddListener(this);
 				flatMapRenderer = std::make_shared<SWFlatMapRenderer>(*this, map);
-				mapRenderer =
-				  std::make_shared<SWMapRenderer>(*this, map.get_pointer(), featureLevel);
+				if (prebuilt && &prebuilt->GetMap() == map.get_pointer()) {
+					mapRenderer = std::move(prebuilt);
+					mapRenderer->BuildRemainingRle();
+				} else {
+					mapRenderer =
+					  std::make_shared<SWMapRenderer>(*this, map.get_pointer(), featureLevel);
+				}
+			}
+		}
+
+		void SWRenderer::PrebuildGameMap(client::GameMap &map,
+		                                 const std::vector<bool> &decodedRows) {
+			SPADES_MARK_FUNCTION();
+			EnsureInitialized();
+
+			if (!prebuiltMapRenderer || &prebuiltMapRenderer->GetMap() != &map) {
+				prebuiltMapRenderer.reset();
+				prebuiltMapRenderer =
+				  std::make_shared<SWMapRenderer>(*this, &map, featureLevel, true);
 			}
+			prebuiltMapRenderer->Prebuild(decodedRows);
 		}
 
 		void SWRenderer::SetFogColor(spades::Vector3 v) { fogColor = v; }
@@ -226,295 +259,422 @@ namespace spades {
 			  sceneDef.viewOrigin, sceneDef.viewAxis[2] * ySin + sceneDef.viewAxis[1] * yCos);
 		}
 
-		template <SWFeatureLevel> void SWRenderer::ApplyDynamicLight(const DynamicLight &light) {
-			int fw = this->fb->GetWidth();
-			int fh = this->fb->GetHeight();
-
-			float fovX = tanf(sceneDef.fovX * 0.5f);
-			float fovY = tanf(sceneDef.fovY * 0.5f);
-
-			float dvx = -fovX * 2.f / static_cast<float>(fw);
-			float dvy = -fovY * 2.f / static_cast<float>(fh);
-
-			int minX = light.minX;
-			int minY = light.minY;
-			int maxX = light.maxX;
-			int maxY = light.maxY;
-			int lightHeight = maxY - minY;
-
-			SPAssert(minX >= 0);
-			SPAssert(minY >= 0);
-			SPAssert(maxX <= fw);
-			SPAssert(maxY <= fh);
+		template <>
+		void ApplyLightToRect<SWFeatureLevel::None>(const PostPassTarget &t,
+		                                            const ScreenLight &light, int x1, int y1,
+		                                            int x2, int y2) {
+			for (int y = y1; y < y2; y++) {
+				float vy = t.fovY + t.dvy * y;
+				uint32_t *fb = t.fb + y * t.fw;
+				const float *db = t.db + y * t.fw;
 
-			Vector3 lightCenter;
-			Vector3 diff = light.param.origin - sceneDef.viewOrigin;
-			lightCenter.x = Vector3::Dot(diff, sceneDef.viewAxis[0]);
-			lightCenter.y = Vector3::Dot(diff, sceneDef.viewAxis[1]);
-			lightCenter.z = Vector3::Dot(diff, sceneDef.viewAxis[2]);
+				for (int x = x1; x < x2; x++) {
+					Vector3 pos;
 
-			int lightR = ToFixedFactor8(light.param.color.x);
-			int lightG = ToFixedFactor8(light.param.color.y);
-			int lightB = ToFixedFactor8(light.param.color.z);
+					pos.z = db[x];
+					pos.x = (t.fovX + t.dvx * x) * pos.z;
+					pos.y = vy * pos.z;
 
-			float invRadius2 = 1.f / (light.param.radius * light.param.radius);
+					pos -= light.center;
 
-			InvokeParallel2([=](unsigned int threadId, unsigned int numThreads) {
-				int startY = lightHeight * threadId / numThreads;
-				int endY = lightHeight * (threadId + 1) / numThreads;
-				startY += minY;
-				endY += minY;
+					float dist = pos.GetPoweredLength();
+					dist *= light.invRadius2;
 
-				auto *fb = this->fb->GetPixels();
-				float *db = depthBuffer.data();
-				fb += startY * fw + minX;
-				db += startY * fw + minX;
+					if (dist < 1.f) {
+						float strength = 1.f - dist;
+						strength *= strength;
+						strength *= 256.f;
 
-				float vy = fovY + dvy * startY;
-				float vx = fovX + dvx * minX;
+						int factor = static_cast<int>(strength);
 
-				int lightWidth = maxX - minX;
+						int actualLightR = light.r * factor;
+						int actualLightG = light.g * factor;
+						int actualLightB = light.b * factor;
 
-				for (int y = startY; y < endY; y++) {
-					float vx2 = vx;
-					auto *fb2 = fb;
-					auto *db2 = db;
+						auto srcColor = fb[x];
+						auto srcColorR = (srcColor >> 16) & 0xff;
+						auto srcColorG = (srcColor >> 8) & 0xff;
+						auto srcColorB = srcColor & 0xff;
 
-					for (int x = lightWidth; x > 0; x--) {
-						Vector3 pos;
+						actualLightR *= srcColorR;
+						actualLightG *= srcColorG;
+						actualLightB *= srcColorB;
 
-						pos.z = *db2;
-						pos.x = vx2 * pos.z;
-						pos.y = vy * pos.z;
+						auto destColorR = actualLightR >> 16;
+						auto destColorG = actualLightG >> 16;
+						auto destColorB = actualLightB >> 16;
 
-						pos -= lightCenter;
+						destColorR = std::min<uint32_t>(destColorR + srcColorR, 255);
+						destColorG = std::min<uint32_t>(destColorG + srcColorG, 255);
+						destColorB = std::min<uint32_t>(destColorB + srcColorB, 255);
 
-						float dist = pos.GetPoweredLength();
-						dist *= invRadius2;
-
-						if (dist < 1.f) {
-							float strength = 1.f - dist;
-							strength *= strength;
-							strength *= 256.f;
-
-							int factor = static_cast<int>(strength);
-
-							int actualLightR = lightR * factor;
-							int actualLightG = lightG * factor;
-							int actualLightB = lightB * factor;
-
-							auto srcColor = *fb2;
-							auto srcColorR = (srcColor >> 16) & 0xff;
-							auto srcColorG = (srcColor >> 8) & 0xff;
-							auto srcColorB = srcColor & 0xff;
+						fb[x] = destColorB | (destColorG << 8) | (destColorR << 16);
+					}
+				}
+			}
+		}
 
-							actualLightR *= srcColorR;
-							actualLightG *= srcColorG;
-							actualLightB *= srcColorB;
+		template <>
+		void ApplyFogToRect<SWFeatureLevel::None>(const PostPassTarget &t, int x1, int y1, int x2,
+		                                          int y2) {
+			uint32_t fog1 = static_cast<uint32_t>(t.fogB + t.fogR * 0x10000);
+			uint32_t fog2 = static_cast<uint32_t>(t.fogG * 0x100);
+
+			for (int y = y1; y < y2; y += 4) {
+				float vy = t.fovY + t.blockDvy * (y >> 2);
+				uint32_t *fb = t.fb + y * t.fw;
+				const float *db = t.db + y * t.fw;
+
+				for (int x = x1; x < x2; x += 4) {
+					float vx = t.fovX + t.blockDvx * (x >> 2);
+					float depthScale = (1.f + vx * vx + vy * vy);
+					depthScale *= fastRSqrt(depthScale) * t.fogScale;
+					auto *fb2 = fb + x;
+					auto *db2 = db + x;
+					for (int by = 0; by < 4; by++) {
+						auto *fb3 = fb2;
+						auto *db3 = db2;
+
+						for (int bx = 0; bx < 4; bx++) {
+
+							float dist = *db3 * depthScale;
+							int factor = std::min(static_cast<int>(dist), 256);
+							factor = std::max(0, factor);
+							int factor2 = 256 - factor;
+
+							uint32_t color = *fb3;
+							uint32_t v1 = (color & 0xff00ff) * factor2;
+							uint32_t v2 = (color & 0x00ff00) * factor2;
+							v1 += fog1 * factor;
+							v2 += fog2 * factor;
+							v1 &= 0xff00ff00;
+							v2 &= 0xff0000;
+							*fb3 = (v1 | v2) >> 8;
+
+							fb3++;
+							db3++;
+						}
 
-							auto destColorR = actualLightR >> 16;
-							auto destColorG = actualLightG >> 16;
-							auto destColorB = actualLightB >> 16;
+						fb2 += t.fw;
+						db2 += t.fw;
+					}
+				}
+			}
+		}
 
-							destColorR = std::min<uint32_t>(destColorR + srcColorR, 255);
-							destColorG = std::min<uint32_t>(destColorG + srcColorG, 255);
-							destColorB = std::min<uint32_t>(destColorB + srcColorB, 255);
+#if ENABLE_SSE2
+		template <>
+		void ApplyLightToRect<SWFeatureLevel::SSE2>(const PostPassTarget &t,
+		                                            const ScreenLight &light, int x1, int y1,
+		                                            int x2, int y2) {
+			// Process aligned groups of 4 pixels, masking out the ones outside the rect.
+			// The tiles are aligned to 4 pixels, so the groups never cross into another
+			// tile. The products below are exact in single precision (they are less than
+			// 2^24), so this matches the scalar version.
+			int groupX1 = x1 & ~3;
+			int groupX2 = std::min((x2 + 3) & ~3, t.fw);
+			int scalarX = groupX1 + ((groupX2 - groupX1) & ~3);
+
+			auto centerX = _mm_set1_ps(light.center.x);
+			auto centerY = _mm_set1_ps(light.center.y);
+			auto centerZ = _mm_set1_ps(light.center.z);
+			auto invRadius2 = _mm_set1_ps(light.invRadius2);
+			auto lightR = _mm_set1_ps(static_cast<float>(light.r) * (1.f / 65536.f));
+			auto lightG = _mm_set1_ps(static_cast<float>(light.g) * (1.f / 65536.f));
+			auto lightB = _mm_set1_ps(static_cast<float>(light.b) * (1.f / 65536.f));
+			auto laneOffsets = _mm_setr_epi32(0, 1, 2, 3);
+			auto rectX1 = _mm_set1_epi32(x1 - 1);
+			auto rectX2 = _mm_set1_epi32(x2);
+			auto byteMask = _mm_set1_epi32(0xff);
+
+			for (int y = y1; y < y2; y++) {
+				auto vy = _mm_set1_ps(t.fovY + t.dvy * y);
+				uint32_t *fb = t.fb + y * t.fw;
+				const float *db = t.db + y * t.fw;
+
+				for (int x = groupX1; x < scalarX; x += 4) {
+					auto laneX = _mm_add_epi32(_mm_set1_epi32(x), laneOffsets);
+					auto inRect = _mm_and_si128(_mm_cmpgt_epi32(laneX, rectX1),
+					                            _mm_cmplt_epi32(laneX, rectX2));
+
+					auto vx = _mm_mul_ps(_mm_set1_ps(t.dvx), _mm_cvtepi32_ps(laneX));
+					vx = _mm_add_ps(_mm_set1_ps(t.fovX), vx);
+					auto z = _mm_loadu_ps(db + x);
+					auto px = _mm_sub_ps(_mm_mul_ps(vx, z), centerX);
+					auto py = _mm_sub_ps(_mm_mul_ps(vy, z), centerY);
+					auto pz = _mm_sub_ps(z, centerZ);
+					auto dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)),
+					                       _mm_mul_ps(pz, pz));
+					dist = _mm_mul_ps(dist, invRadius2);
+
+					auto lit = _mm_castps_si128(_mm_cmplt_ps(dist, _mm_set1_ps(1.f)));
+					lit = _mm_and_si128(lit, inRect);
+					if (_mm_movemask_epi8(lit) == 0) {
+						continue;
+					}
 
-							uint32_t destColor =
-							  destColorB | (destColorG << 8) | (destColorR << 16);
+					auto strength = _mm_sub_ps(_mm_set1_ps(1.f), dist);
+					strength = _mm_mul_ps(_mm_mul_ps(strength, strength), _mm_set1_ps(256.f));
+					auto factor = _mm_cvtepi32_ps(_mm_cvttps_epi32(strength));
+
+					auto src = _mm_loadu_si128(reinterpret_cast<const __m128i *>(fb + x));
+					auto srcR = _mm_and_si128(_mm_srli_epi32(src, 16), byteMask);
+					auto srcG = _mm_and_si128(_mm_srli_epi32(src, 8), byteMask);
+					auto srcB = _mm_and_si128(src, byteMask);
+
+					auto addR = _mm_cvttps_epi32(
+					  _mm_mul_ps(_mm_mul_ps(lightR, factor), _mm_cvtepi32_ps(srcR)));
+					auto addG = _mm_cvttps_epi32(
+					  _mm_mul_ps(_mm_mul_ps(lightG, factor), _mm_cvtepi32_ps(srcG)));
+					auto addB = _mm_cvttps_epi32(
+					  _mm_mul_ps(_mm_mul_ps(lightB, factor), _mm_cvtepi32_ps(srcB)));
+
+					// The upper halves are zero, so 16-bit min works on these 32-bit lanes
+					auto destR = _mm_min_epi16(_mm_add_epi32(srcR, addR), byteMask);
+					auto destG = _mm_min_epi16(_mm_add_epi32(srcG, addG), byteMask);
+					auto destB = _mm_min_epi16(_mm_add_epi32(srcB, addB), byteMask);
+
+					auto dest = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(destR, 16),
+					                                      _mm_slli_epi32(destG, 8)),
+					                         destB);
+					dest = _mm_or_si128(_mm_and_si128(lit, dest), _mm_andnot_si128(lit, src));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(fb + x), dest);
+				}
+			}
 
-							*fb2 = destColor;
-						}
+			if (scalarX < x2) {
+				ApplyLightToRect<SWFeatureLevel::None>(t, light, std::max(scalarX, x1), y1,
+				                                       x2, y2);
+			}
+		}
 
-						vx2 += dvx;
-						fb2++;
-						db2++;
+		template <>
+		void ApplyFogToRect<SWFeatureLevel::SSE2>(const PostPassTarget &t, int x1, int y1, int x2,
+		                                          int y2) {
+			__m128i fog =
+			  _mm_setr_epi16(t.fogB, t.fogG, t.fogR, 0, t.fogB, t.fogG, t.fogR, 0);
+
+			for (int y = y1; y < y2; y += 4) {
+				float vy = t.fovY + t.blockDvy * (y >> 2);
+				uint32_t *fb = t.fb + y * t.fw;
+				const float *db = t.db + y * t.fw;
+
+				for (int x = x1; x < x2; x += 4) {
+					float vx = t.fovX + t.blockDvx * (x >> 2);
+					float depthScale = (1.f + vx * vx + vy * vy);
+					depthScale *= fastRSqrt(depthScale) * t.fogScale;
+					auto depthScale4 = _mm_set1_ps(depthScale);
+
+					auto *fb2 = fb + x;
+					auto *db2 = db + x;
+					for (int by = 0; by < 4; by++) {
+						auto *fb3 = fb2;
+						auto *db3 = db2;
+
+						auto dist = _mm_load_ps(db3);
+						auto color = _mm_load_si128(reinterpret_cast<__m128i *>(fb3));
+
+						dist = _mm_mul_ps(dist, depthScale4);
+						dist = _mm_max_ps(dist, _mm_set1_ps(0.f));
+						dist = _mm_min_ps(dist, _mm_set1_ps(256.f));
+						auto factorX = _mm_cvtps_epi32(dist);
+
+						auto factorY = _mm_sub_epi32(_mm_set1_epi32(0x100), factorX);
+
+						factorX = _mm_shufflelo_epi16(factorX, 0xa0);
+						factorX = _mm_shufflehi_epi16(factorX, 0xa0);
+						factorY = _mm_shufflelo_epi16(factorY, 0xa0);
+						factorY = _mm_shufflehi_epi16(factorY, 0xa0);
+
+						// first 2px
+						auto color1 = _mm_unpacklo_epi8(color, _mm_setzero_si128());
+						auto factor1X = _mm_shuffle_epi32(factorY, 0x50);
+						auto factor1Y = _mm_shuffle_epi32(factorX, 0x50);
+						color1 = _mm_mullo_epi16(color1, factor1X);
+						auto fog1 = _mm_mullo_epi16(fog, factor1Y);
+						fog1 = _mm_adds_epu16(fog1, color1);
+						fog1 = _mm_srli_epi16(fog1, 8);
+
+						// next 2px
+						auto color2 = _mm_unpackhi_epi8(color, _mm_setzero_si128());
+						auto factor2X = _mm_shuffle_epi32(factorY, 0xfa);
+						auto factor2Y = _mm_shuffle_epi32(factorX, 0xfa);
+						color2 = _mm_mullo_epi16(color2, factor2X);
+						auto fog2 = _mm_mullo_epi16(fog, factor2Y);
+						fog2 = _mm_adds_epu16(fog2, color2);
+						fog2 = _mm_srli_epi16(fog2, 8);
+
+						auto pack = _mm_packus_epi16(fog1, fog2);
+						_mm_store_si128(reinterpret_cast<__m128i *>(fb3), pack);
+
+						fb2 += t.fw;
+						db2 += t.fw;
 					}
-
-					vy += dvy;
-					fb += fw;
-					db += fw;
 				}
-			});
+			}
 		}
+#endif
 
-		template <SWFeatureLevel level> void SWRenderer::ApplyFog() {
+		template <SWFeatureLevel level> void SWRenderer::ApplyLightsAndFog() {
 			int fw = this->fb->GetWidth();
 			int fh = this->fb->GetHeight();
 
-			float fovX = tanf(sceneDef.fovX * 0.5f);
-			float fovY = tanf(sceneDef.fovY * 0.5f);
-
-			float dvx = -fovX * 2.f / static_cast<float>(fw / 4);
-			float dvy = -fovY * 2.f / static_cast<float>(fh / 4);
-
-			int fogR = ToFixed8(fogColor.x);
-			int fogG = ToFixed8(fogColor.y);
-			int fogB = ToFixed8(fogColor.z);
-			uint32_t fog1 = static_cast<uint32_t>(fogB + fogR * 0x10000);
-			uint32_t fog2 = static_cast<uint32_t>(fogG * 0x100);
-
-			float scale = 255.f / fogDistance;
-
-			InvokeParallel2([&](unsigned int threadId, unsigned int numThreads) {
-				int startY = fh * threadId / numThreads;
-				int endY = fh * (threadId + 1) / numThreads;
-				startY &= ~3;
-				endY &= ~3;
-
-				float vy = fovY;
-				auto *fb = this->fb->GetPixels();
-				float *db = depthBuffer.data();
-
-				vy += dvy * (startY >> 2);
-				fb += fw * startY;
-				db += fw * startY;
-
-				for (int y = startY; y < endY; y += 4) {
-					float vx = fovX;
-
-					for (int x = 0; x < fw; x += 4) {
-						float depthScale = (1.f + vx * vx + vy * vy);
-						depthScale *= fastRSqrt(depthScale) * scale;
-						auto *fb2 = fb + x;
-						auto *db2 = db + x;
-						for (int by = 0; by < 4; by++) {
-							auto *fb3 = fb2;
-							auto *db3 = db2;
-
-							for (int bx = 0; bx < 4; bx++) {
-
-								float dist = *db3 * depthScale;
-								int factor = std::min(static_cast<int>(dist), 256);
-								factor = std::max(0, factor);
-								int factor2 = 256 - factor;
-
-								uint32_t color = *fb3;
-								uint32_t v1 = (color & 0xff00ff) * factor2;
-								uint32_t v2 = (color & 0x00ff00) * factor2;
-								v1 += fog1 * factor;
-								v2 += fog2 * factor;
-								v1 &= 0xff00ff00;
-								v2 &= 0xff0000;
-								*fb3 = (v1 | v2) >> 8;
-
-								fb3++;
-								db3++;
-							}
+			PostPassTarget target;
+			target.fb = this->fb->GetPixels();
+			target.db = depthBuffer.data();
+			target.fw = fw;
+			target.fovX = tanf(sceneDef.fovX * 0.5f);
+			target.fovY = tanf(sceneDef.fovY * 0.5f);
+			target.dvx = -target.fovX * 2.f / static_cast<float>(fw);
+			target.dvy = -target.fovY * 2.f / static_cast<float>(fh);
+			target.blockDvx = -target.fovX * 2.f / static_cast<float>(fw / 4);
+			target.blockDvy = -target.fovY * 2.f / static_cast<float>(fh / 4);
+			target.fogScale = 255.f / fogDistance;
+			target.fogR = ToFixed8(fogColor.x);
+			target.fogG = ToFixed8(fogColor.y);
+			target.fogB = ToFixed8(fogColor.z);
+
+			std::vector<ScreenLight> screenLights;
+			screenLights.reserve(lights.size());
+			for (const auto &light : lights) {
+				SPAssert(light.minX >= 0);
+				SPAssert(light.minY >= 0);
+				SPAssert(light.maxX <= fw);
+				SPAssert(light.maxY <= fh);
+				if (light.minX >= light.maxX || light.minY >= light.maxY) {
+					continue;
+				}
 
-							fb2 += fw;
-							db2 += fw;
-						}
+				ScreenLight l;
+				l.minX = light.minX;
+				l.minY = light.minY;
+				l.maxX = light.maxX;
+				l.maxY = light.maxY;
+
+				Vector3 diff = light.param.origin - sceneDef.viewOrigin;
+				l.center.x = Vector3::Dot(diff, sceneDef.viewAxis[0]);
+				l.center.y = Vector3::Dot(diff, sceneDef.viewAxis[1]);
+				l.center.z = Vector3::Dot(diff, sceneDef.viewAxis[2]);
+				l.invRadius2 = 1.f / (light.param.radius * light.param.radius);
+				l.r = ToFixedFactor8(light.param.color.x);
+				l.g = ToFixedFactor8(light.param.color.y);
+				l.b = ToFixedFactor8(light.param.color.z);
+				screenLights.push_back(l);
+			}
 
-						vx += dvx;
+			// The fog is computed in 4x4 blocks, so partial blocks at the bottom are skipped
+			int fogMaxY = fh & ~3;
+
+			// Each tile is lit and fogged while it's in the cache. The lights are applied in
+			// the order they were added, so the result is the same as applying them one by
+			// one over the whole screen.
+			int numTilesX = (fw + PostPassTileSize - 1) / PostPassTileSize;
+			int numTilesY = (fh + PostPassTileSize - 1) / PostPassTileSize;
+			int numTiles = numTilesX * numTilesY;
+
+			std::atomic<int> nextTile{0};
+			InvokeParallel2([&](unsigned int, unsigned int) {
+				int i;
+				while ((i = nextTile.fetch_add(1)) < numTiles) {
+					int tileMinX = (i % numTilesX) * PostPassTileSize;
+					int tileMinY = (i / numTilesX) * PostPassTileSize;
+					int tileMaxX = std::min(tileMinX + PostPassTileSize, fw);
+					int tileMaxY = std::min(tileMinY + PostPassTileSize, fh);
+
+					for (const ScreenLight &light : screenLights) {
+						int x1 = std::max(light.minX, tileMinX);
+						int y1 = std::max(light.minY, tileMinY);
+						int x2 = std::min(light.maxX, tileMaxX);
+						int y2 = std::min(light.maxY, tileMaxY);
+						if (x1 < x2 && y1 < y2) {
+							ApplyLightToRect<level>(target, light, x1, y1, x2, y2);
+						}
 					}
 
-					vy += dvy;
-					fb += fw * 4;
-					db += fw * 4;
+					ApplyFogToRect<level>(target, tileMinX, tileMinY, tileMaxX,
+					                      std::min(tileMaxY, fogMaxY));
 				}
 			});
+		}
 
-		} // ApplyFog()
-
-#if ENABLE_SSE2
-
-		template <> void SWRenderer::ApplyFog<SWFeatureLevel::SSE2>() {
-			int fw = this->fb->GetWidth();
-			int fh = this->fb->GetHeight();
-
-			float fovX = tanf(sceneDef.fovX * 0.5f);
-			float fovY = tanf(sceneDef.fovY * 0.5f);
-
-			float dvx = -fovX * 2.f / static_cast<float>(fw / 4);
-			float dvy = -fovY * 2.f / static_cast<float>(fh / 4);
-
-			int fogR = ToFixed8(fogColor.x);
-			int fogG = ToFixed8(fogColor.y);
-			int fogB = ToFixed8(fogColor.z);
-			__m128i fog = _mm_setr_epi16(fogB, fogG, fogR, 0, fogB, fogG, fogR, 0);
-
-			float scale = 255.f / fogDistance;
-
-			InvokeParallel2([&](unsigned int threadId, unsigned int numThreads) {
-				int startY = fh * threadId / numThreads;
-				int endY = fh * (threadId + 1) / numThreads;
-				startY &= ~3;
-				endY &= ~3;
-
-				float vy = fovY;
-				auto *fb = this->fb->GetPixels();
-				float *db = depthBuffer.data();
-
-				vy += dvy * (startY >> 2);
-				fb += fw * startY;
-				db += fw * startY;
-
-				for (int y = startY; y < endY; y += 4) {
-					float vx = fovX;
-
-					for (int x = 0; x < fw; x += 4) {
-						float depthScale = (1.f + vx * vx + vy * vy);
-						depthScale *= fastRSqrt(depthScale) * scale;
-						auto depthScale4 = _mm_set1_ps(depthScale);
-
-						auto *fb2 = fb + x;
-						auto *db2 = db + x;
-						for (int by = 0; by < 4; by++) {
-							auto *fb3 = fb2;
-							auto *db3 = db2;
-
-							auto dist = _mm_load_ps(db3);
-							auto color = _mm_load_si128(reinterpret_cast<__m128i *>(fb3));
-
-							dist = _mm_mul_ps(dist, depthScale4);
-							dist = _mm_max_ps(dist, _mm_set1_ps(0.f));
-							dist = _mm_min_ps(dist, _mm_set1_ps(256.f));
-							auto factorX = _mm_cvtps_epi32(dist);
-
-							auto factorY = _mm_sub_epi32(_mm_set1_epi32(0x100), factorX);
-
-							factorX = _mm_shufflelo_epi16(factorX, 0xa0);
-							factorX = _mm_shufflehi_epi16(factorX, 0xa0);
-							factorY = _mm_shufflelo_epi16(factorY, 0xa0);
-							factorY = _mm_shufflehi_epi16(factorY, 0xa0);
-
-							// first 2px
-							auto color1 = _mm_unpacklo_epi8(color, _mm_setzero_si128());
-							auto factor1X = _mm_shuffle_epi32(factorY, 0x50);
-							auto factor1Y = _mm_shuffle_epi32(factorX, 0x50);
-							color1 = _mm_mullo_epi16(color1, factor1X);
-							auto fog1 = _mm_mullo_epi16(fog, factor1Y);
-							fog1 = _mm_adds_epu16(fog1, color1);
-							fog1 = _mm_srli_epi16(fog1, 8);
-
-							// next 2px
-							auto color2 = _mm_unpackhi_epi8(color, _mm_setzero_si128());
-							auto factor2X = _mm_shuffle_epi32(factorY, 0xfa);
-							auto factor2Y = _mm_shuffle_epi32(factorX, 0xfa);
-							color2 = _mm_mullo_epi16(color2, factor2X);
-							auto fog2 = _mm_mullo_epi16(fog, factor2Y);
-							fog2 = _mm_adds_epu16(fog2, color2);
-							fog2 = _mm_srli_epi16(fog2, 8);
-
-							auto pack = _mm_packus_epi16(fog1, fog2);
-							_mm_store_si128(reinterpret_cast<__m128i *>(fb3), pack);
-
-							fb2 += fw;
-							db2 += fw;
-						}
-
-						vx += dvx;
-					}
+		/** `(a * (256 - w) + b * w) >> 8` for each channel. */
+		static inline uint32_t LerpPixel(uint32_t a, uint32_t b, uint32_t w) {
+			uint32_t result = 0;
+			for (int shift = 0; shift < 32; shift += 8) {
+				uint32_t ca = (a >> shift) & 0xff;
+				uint32_t cb = (b >> shift) & 0xff;
+				result |= ((ca * (256 - w) + cb * w) >> 8) << shift;
+			}
+			return result;
+		}
 
-					vy += dvy;
-					fb += fw * 4;
-					db += fw * 4;
+		template <>
+		void UpscaleRows<SWFeatureLevel::None>(const UpscaleTarget &t, uint32_t *rowBuffer,
+		                                       int y1, int y2) {
+			for (int y = y1; y < y2; y++) {
+				const uint32_t *upper = t.src + t.rows[y] * t.srcW;
+				const uint32_t *lower = t.src + std::min(t.rows[y] + 1, t.srcH - 1) * t.srcW;
+				uint32_t wy = static_cast<uint32_t>(t.rowWeights[y]);
+				for (int x = 0; x < t.srcW; x++) {
+					rowBuffer[x] = LerpPixel(upper[x], lower[x], wy);
 				}
-			});
+				rowBuffer[t.srcW] = rowBuffer[t.srcW - 1];
 
-		} // ApplyFog()
+				uint32_t *out = t.dest + y * t.destW;
+				for (int x = 0; x < t.destW; x++) {
+					const uint32_t *p = rowBuffer + t.columns[x];
+					out[x] = LerpPixel(p[0], p[1], t.columnWeights[x * 8 + 4]);
+				}
+			}
+		}
 
+#if ENABLE_SSE2
+		template <>
+		void UpscaleRows<SWFeatureLevel::SSE2>(const UpscaleTarget &t, uint32_t *rowBuffer,
+		                                       int y1, int y2) {
+			auto zero = _mm_setzero_si128();
+			for (int y = y1; y < y2; y++) {
+				const uint32_t *upper = t.src + t.rows[y] * t.srcW;
+				const uint32_t *lower = t.src + std::min(t.rows[y] + 1, t.srcH - 1) * t.srcW;
+				auto wLower = _mm_set1_epi16(static_cast<short>(t.rowWeights[y]));
+				auto wUpper = _mm_sub_epi16(_mm_set1_epi16(256), wLower);
+
+				// The products are at most 255 * 256, so they fit in unsigned 16-bit lanes
+				for (int x = 0; x < t.srcW; x += 4) {
+					auto a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(upper + x));
+					auto b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lower + x));
+					auto lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), wUpper),
+					                        _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), wLower));
+					auto hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), wUpper),
+					                        _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), wLower));
+					lo = _mm_srli_epi16(lo, 8);
+					hi = _mm_srli_epi16(hi, 8);
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(rowBuffer + x),
+					                 _mm_packus_epi16(lo, hi));
+				}
+				rowBuffer[t.srcW] = rowBuffer[t.srcW - 1];
+
+				// Two destination pixels at once. Each reads a pair of adjacent pixels.
+				uint32_t *out = t.dest + y * t.destW;
+				for (int x = 0; x < t.destW; x += 2) {
+					auto pair1 = _mm_loadl_epi64(
+					  reinterpret_cast<const __m128i *>(rowBuffer + t.columns[x]));
+					auto pair2 = _mm_loadl_epi64(
+					  reinterpret_cast<const __m128i *>(rowBuffer + t.columns[x + 1]));
+					auto w1 =
+					  _mm_loadu_si128(reinterpret_cast<const __m128i *>(t.columnWeights + x * 8));
+					auto w2 = _mm_loadu_si128(
+					  reinterpret_cast<const __m128i *>(t.columnWeights + x * 8 + 8));
+					auto p1 = _mm_mullo_epi16(_mm_unpacklo_epi8(pair1, zero), w1);
+					auto p2 = _mm_mullo_epi16(_mm_unpacklo_epi8(pair2, zero), w2);
+					auto sum =
+					  _mm_add_epi16(_mm_unpacklo_epi64(p1, p2), _mm_unpackhi_epi64(p1, p2));
+					sum = _mm_srli_epi16(sum, 8);
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(out + x),
+					                 _mm_packus_epi16(sum, sum));
+				}
+			}
+		}
 #endif
 
 		void SWRenderer::EnsureSceneStarted() {
@@ -555,6 +715,8 @@ namespace spades {
 			sceneDef = def;
 			duringSceneRendering = true;
 
+			SetSceneFramebuffer();
+
 			BuildProjectionMatrix();
 			BuildView();
 			BuildFrustrum();
@@ -562,6 +724,159 @@ namespace spades {
 			projectionViewMatrix = projectionMatrix * viewMatrix;
 		}
 
+		void SWRenderer::SetSceneFramebuffer() {
+			Bitmap &portFb = port->GetFramebuffer();
+			int w = portFb.GetWidth();
+			int h = portFb.GetHeight();
+			if (!r_swDynamicResolution) {
+				return;
+			}
+
+			// Both dimensions must remain multiples of 8
+			int sw = static_cast<int>(static_cast<float>(w) * resolutionScale) & ~7;
+			int sh = static_cast<int>(static_cast<float>(h) * resolutionScale) & ~7;
+			sw = std::max(std::min(sw, w), 8);
+			sh = std::max(std::min(sh, h), 8);
+			if (sw == w && sh == h) {
+				return;
+			}
+
+			if (!scaledFb || scaledFb->GetWidth() != sw || scaledFb->GetHeight() != sh) {
+				scaledFb = Handle<Bitmap>::New(sw, sh);
+			}
+			fb = scaledFb;
+			imageRenderer->SetFramebuffer(scaledFb.GetPointerOrNull());
+		}
+
+		void SWRenderer::UpscaleScene() {
+			SPADES_MARK_FUNCTION();
+
+			Bitmap &dest = port->GetFramebuffer();
+			int srcW = fb->GetWidth();
+			int srcH = fb->GetHeight();
+			int destW = dest.GetWidth();
+			int destH = dest.GetHeight();
+
+			UpscaleTables &tables = upscaleTables;
+			if (tables.srcW != srcW || tables.srcH != srcH || tables.destW != destW ||
+			    tables.destH != destH) {
+				// Maps pixel centers, clamping at the edges
+				auto map = [](int i, int srcSize, int destSize, int32_t &index, int &weight) {
+					float f = (static_cast<float>(i) + .5f) * static_cast<float>(srcSize) /
+					            static_cast<float>(destSize) -
+					          .5f;
+					f = std::max(f, 0.f);
+					index = static_cast<int32_t>(f);
+					weight = static_cast<int>((f - static_cast<float>(index)) * 256.f);
+					if (index >= srcSize - 1) {
+						index = srcSize - 1;
+						weight = 0;
+					}
+				};
+
+				tables.columns.resize(destW);
+				tables.columnWeights.resize(destW * 8);
+				for (int x = 0; x < destW; x++) {
+					int weight;
+					map(x, srcW, destW, tables.columns[x], weight);
+					for (int i = 0; i < 4; i++) {
+						tables.columnWeights[x * 8 + i] = static_cast<uint16_t>(256 - weight);
+						tables.columnWeights[x * 8 + 4 + i] = static_cast<uint16_t>(weight);
+					}
+				}
+
+				tables.rows.resize(destH);
+				tables.rowWeights.resize(destH);
+				for (int y = 0; y < destH; y++) {
+					int weight;
+					map(y, srcH, destH, tables.rows[y], weight);
+					tables.rowWeights[y] = weight;
+				}
+
+				tables.srcW = srcW;
+				tables.srcH = srcH;
+				tables.destW = destW;
+				tables.destH = destH;
+			}
+
+			UpscaleTarget target;
+			target.src = fb->GetPixels();
+			target.srcW = srcW;
+			target.srcH = srcH;
+			target.dest = dest.GetPixels();
+			target.destW = destW;
+			target.columns = tables.columns.data();
+			target.columnWeights = tables.columnWeights.data();
+			target.rows = tables.rows.data();
+			target.rowWeights = tables.rowWeights.data();
+
+			InvokeParallel2([&](unsigned int th, unsigned int numThreads) {
+				int y1 = static_cast<int>(static_cast<long long>(destH) * th / numThreads);
+				int y2 = static_cast<int>(static_cast<long long>(destH) * (th + 1) / numThreads);
+				std::vector<uint32_t> rowBuffer(srcW + 1);
+
+#if ENABLE_AVX2
+				if (featureLevel >= SWFeatureLevel::AVX2)
+					UpscaleRows<SWFeatureLevel::AVX2>(target, rowBuffer.data(), y1, y2);
+				else
+#endif
+#if ENABLE_SSE2
+				if (static_cast<int>(featureLevel) >= static_cast<int>(SWFeatureLevel::SSE2))
+					UpscaleRows<SWFeatureLevel::SSE2>(target, rowBuffer.data(), y1, y2);
+				else
+#endif
+					UpscaleRows<SWFeatureLevel::None>(target, rowBuffer.data(), y1, y2);
+			});
+
+			// 2D drawing happens at the native resolution
+			fb = &dest;
+			imageRenderer->SetFramebuffer(&dest);
+		}
+
+		void SWRenderer::UpdateResolutionScale(double sceneTime) {
+			if (!r_swDynamicResolution) {
+				resolutionScale = 1.f;
+				smoothedSceneTime = 0.0;
+				resolutionHistory.clear();
+				return;
+			}
+
+			resolutionHistory.push_back(ResolutionSample{resolutionScale, sceneTime});
+			while (resolutionHistory.size() > static_cast<std::size_t>(MaxResolutionHistory)) {
+				resolutionHistory.pop_front();
+			}
+
+			if (smoothedSceneTime <= 0.0) {
+				smoothedSceneTime = sceneTime;
+			} else {
+				smoothedSceneTime += (sceneTime - smoothedSceneTime) * 0.25;
+			}
+
+			float maxScale = std::max(std::min(static_cast<float>(r_swDynamicResolutionMax), 1.f),
+			                          .1f);
+			float minScale =
+			  std::max(std::min(static_cast<float>(r_swDynamicResolutionMin), maxScale), .1f);
+			double target =
+			  std::max(static_cast<double>(static_cast<float>(r_swDynamicResolutionTarget)), 1.0) *
+			  0.001;
+
+			float newScale = resolutionScale;
+			// Ignore small deviations so the resolution doesn't flicker
+			if (std::fabs(smoothedSceneTime - target) > target * 0.05) {
+				// The cost is roughly proportional to the number of pixels. Reduce the resolution
+				// quickly, but raise it slowly.
+				newScale *= static_cast<float>(std::sqrt(target / smoothedSceneTime));
+				newScale = std::max(std::min(newScale, resolutionScale * 1.05f),
+				                    resolutionScale * .9f);
+			}
+			newScale = std::max(std::min(newScale, maxScale), minScale);
+
+			// Predict the time at the new resolution so the next adjustment doesn't overshoot
+			float ratio = newScale / resolutionScale;
+			smoothedSceneTime *= ratio * ratio;
+			resolutionScale = newScale;
+		}
+
 		void SWRenderer::RenderModel(client::IModel &model, const client::ModelRenderParam &param) {
 			SPADES_MARK_FUNCTION();
 			EnsureInitialized();
@@ -642,10 +957,12 @@ namespace spades {
 				auto invRad = 1.f / param.radius;
 				auto rangeX = viewRange(Vector3::Dot(diff, sceneDef.viewAxis[2]) * invRad,
 				                        Vector3::Dot(diff, sceneDef.viewAxis[0]) * invRad,
-				                        tanf(sceneDef.fovX * 0.5f), ScreenWidth());
+				                        tanf(sceneDef.fovX * 0.5f),
+				                        static_cast<float>(fb->GetWidth()));
 				auto rangeY = viewRange(Vector3::Dot(diff, sceneDef.viewAxis[1]) * invRad,
 				                        Vector3::Dot(diff, sceneDef.viewAxis[0]) * invRad,
-				                        tanf(sceneDef.fovY * 0.5f), ScreenHeight());
+				                        tanf(sceneDef.fovY * 0.5f),
+				                        static_cast<float>(fb->GetHeight()));
 				light.minX = rangeX[0];
 				light.maxX = rangeX[1];
 				light.minY = rangeY[0];
@@ -685,12 +1002,25 @@ namespace spades {
 			spr.color = drawColorAlphaPremultiplied;
 		}
 
-		void SWRenderer::AddLongSprite(client::IImage &, spades::Vector3 p1, spades::Vector3 p2,
-		                               float radius) {
+		void SWRenderer::AddLongSprite(client::IImage &image, spades::Vector3 p1,
+		                               spades::Vector3 p2, float radius) {
 			SPADES_MARK_FUNCTION();
 			EnsureInitialized();
 			EnsureSceneStarted();
-			// TODO: long sprite
+
+			if (!SphereFrustrumCull((p1 + p2) * .5f, (p1 - p2).GetLength() * .5f + radius * 1.5f))
+				return;
+
+			SWImage &swImage = dynamic_cast<SWImage &>(image);
+
+			longSprites.push_back(LongSprite());
+			auto &spr = longSprites.back();
+
+			spr.img = swImage;
+			spr.start = p1;
+			spr.end = p2;
+			spr.radius = radius;
+			spr.color = drawColorAlphaPremultiplied;
 		}
 
 		static uint32_t ConvertColor32(Vector4 col) {
@@ -706,48 +1036,134 @@ namespace spades {
 			return c;
 		}
 
+		void SWRenderer::RenderLongSprite(LongSprite &spr) {
+			SWImage *img = spr.img.GetPointerOrNull();
+			auto drawQuad = [&](Vector3 p1, Vector3 p2, Vector3 p3, Vector3 p4, float v1,
+			                    float v2) {
+				SWImageRenderer::Vertex vt1, vt2, vt3;
+				vt1.color = vt2.color = vt3.color = spr.color;
+				vt1.uv = MakeVector2(0.f, v1);
+				vt1.position = MakeVector4(p1.x, p1.y, p1.z, 1.f);
+				vt2.uv = MakeVector2(1.f, v1);
+				vt2.position = MakeVector4(p2.x, p2.y, p2.z, 1.f);
+				vt3.uv = MakeVector2(0.f, v2);
+				vt3.position = MakeVector4(p3.x, p3.y, p3.z, 1.f);
+				imageRenderer->DrawPolygon(img, vt1, vt2, vt3);
+				vt1.uv = MakeVector2(1.f, v1);
+				vt1.position = MakeVector4(p2.x, p2.y, p2.z, 1.f);
+				vt2.uv = MakeVector2(1.f, v2);
+				vt2.position = MakeVector4(p4.x, p4.y, p4.z, 1.f);
+				imageRenderer->DrawPolygon(img, vt1, vt2, vt3);
+			};
+
+			// clip by view plane
+			{
+				float d1 = Vector3::Dot(spr.start - sceneDef.viewOrigin, sceneDef.viewAxis[2]);
+				float d2 = Vector3::Dot(spr.end - sceneDef.viewOrigin, sceneDef.viewAxis[2]);
+				const float clipPlane = .1f;
+				if (d1 < clipPlane && d2 < clipPlane)
+					return;
+				if (d1 < clipPlane) {
+					spr.start = Mix(spr.start, spr.end, (clipPlane - d1) / (d2 - d1));
+				} else if (d2 < clipPlane) {
+					spr.end = Mix(spr.start, spr.end, (clipPlane - d1) / (d2 - d1));
+				}
+			}
+
+			// calculate view position
+			auto toView = [&](Vector3 v) {
+				v -= sceneDef.viewOrigin;
+				return MakeVector3(Vector3::Dot(v, sceneDef.viewAxis[0]),
+				                   Vector3::Dot(v, sceneDef.viewAxis[1]),
+				                   Vector3::Dot(v, sceneDef.viewAxis[2]));
+			};
+			Vector3 view1 = toView(spr.start);
+			Vector3 view2 = toView(spr.end);
+
+			// transform to screen
+			Vector2 scr1 = MakeVector2(view1.x / view1.z, view1.y / view1.z);
+			Vector2 scr2 = MakeVector2(view2.x / view2.z, view2.y / view2.z);
+
+			Vector3 vecX = sceneDef.viewAxis[0] * spr.radius;
+			Vector3 vecY = sceneDef.viewAxis[1] * spr.radius;
+			float normalThreshold = spr.radius * 0.5f / ((view1.z + view2.z) * .5f);
+			if ((scr2 - scr1).GetPoweredLength() < normalThreshold * normalThreshold) {
+				// too short in screen; normal sprite
+				drawQuad(spr.start - vecX - vecY, spr.start + vecX - vecY, spr.start - vecX + vecY,
+				         spr.start + vecX + vecY, 0.f, 1.f);
+				return;
+			}
+
+			Vector2 scrDir = (scr2 - scr1).Normalize();
+			Vector2 normDir = {scrDir.y, -scrDir.x};
+			Vector3 vecU = vecX * normDir.x + vecY * normDir.y;
+			Vector3 vecV = vecX * scrDir.x + vecY * scrDir.y;
+
+			// start cap, body, and end cap
+			drawQuad(spr.start - vecU - vecV, spr.start + vecU - vecV, spr.start - vecU,
+			         spr.start + vecU, 0.f, .5f);
+			drawQuad(spr.start - vecU, spr.start + vecU, spr.end - vecU, spr.end + vecU, .5f, .5f);
+			drawQuad(spr.end - vecU, spr.end + vecU, spr.end - vecU + vecV, spr.end + vecU + vecV,
+			         .5f, 1.f);
+		}
+
 		void SWRenderer::EndScene() {
 			EnsureInitialized();
 			EnsureSceneStarted();
 
+			double sceneStartTime = renderStopwatch.GetTime();
+
 			// clear scene
 			std::fill(fb->GetPixels(), fb->GetPixels() + fb->GetWidth() * fb->GetHeight(),
 			          ConvertColor32(MakeVector4(fogColor.x, fogColor.y, fogColor.z, 1.f)));
 			std::fill(fb->GetPixels(), fb->GetPixels() + fb->GetWidth() * fb->GetHeight(),
 			          0x7f7f7f);
 
+			Stopwatch phaseStopwatch;
+
 			// draw map
+			bool mapDrawn = false;
 			if (mapRenderer) {
 				// flat map renderer sends 'Update RLE' to map renderer.
 				// rendering map before this leads to the corrupted renderer image.
 				flatMapRenderer->Update();
-				mapRenderer->Render(sceneDef, *fb, depthBuffer.data());
+				mapDrawn = mapRenderer->Render(sceneDef, *fb, depthBuffer.data());
 			}
+			frameTimings.map = phaseStopwatch.GetTime();
+			phaseStopwatch.Reset();
 
 			// draw models
 			for (auto &m : models) {
-				modelRenderer->Render(*m.model, m.param);
+				modelRenderer->AddModel(*m.model, m.param);
 			}
+			// The depth buffer is stale if the map wasn't drawn
+			modelRenderer->Flush(mapDrawn);
 			models.clear();
+			frameTimings.models = phaseStopwatch.GetTime();
+			phaseStopwatch.Reset();
 
-			// deferred lighting
-			for (const auto &light : lights) {
-				ApplyDynamicLight<SWFeatureLevel::None>(light);
-			}
-			lights.clear();
-
+			// deferred lighting and fog
+#if ENABLE_AVX2
+			if (featureLevel >= SWFeatureLevel::AVX2)
+				ApplyLightsAndFog<SWFeatureLevel::AVX2>();
+			else
+#endif
 #if ENABLE_SSE2
 			if (static_cast<int>(featureLevel) >= static_cast<int>(SWFeatureLevel::SSE2))
-				ApplyFog<SWFeatureLevel::SSE2>();
+				ApplyLightsAndFog<SWFeatureLevel::SSE2>();
 			else
 #endif
-				ApplyFog<SWFeatureLevel::None>();
+				ApplyLightsAndFog<SWFeatureLevel::None>();
+			lights.clear();
+			frameTimings.lightsAndFog = phaseStopwatch.GetTime();
+			phaseStopwatch.Reset();
 
 			// render sprites
 			{
 				imageRenderer->SetShaderType(SWImageRenderer::ShaderType::Sprite);
 				imageRenderer->SetMatrix(projectionViewMatrix);
 				imageRenderer->SetZRange(sceneDef.zNear, sceneDef.zFar);
+				imageRenderer->BeginBatch();
 
 				auto right = sceneDef.viewAxis[0];
 				auto up = sceneDef.viewAxis[1];
@@ -782,8 +1198,16 @@ namespace spades {
 					v3.position = x3;
 					imageRenderer->DrawPolygon(spr.img.GetPointerOrNull(), v1, v2, v3);
 				}
+
+				for (auto &spr : longSprites) {
+					RenderLongSprite(spr);
+				}
+
+				imageRenderer->EndBatch();
 				sprites.clear();
+				longSprites.clear();
 			}
+			frameTimings.sprites = phaseStopwatch.GetTime();
 
 			// render debug lines
 			{
@@ -914,6 +1338,13 @@ namespace spades {
 
 			// all objects were rendered
 
+			if (fb.GetPointerOrNull() != &port->GetFramebuffer()) {
+				phaseStopwatch.Reset();
+				UpscaleScene();
+				frameTimings.upscale = phaseStopwatch.GetTime();
+			}
+			UpdateResolutionScale(renderStopwatch.GetTime() - sceneStartTime);
+
 			duringSceneRendering = false;
 		}
 
@@ -980,6 +1411,8 @@ namespace spades {
 			EnsureValid();
 			EnsureSceneNotStarted();
 
+			Stopwatch imageStopwatch;
+
 			// d = a + (b - a) + (c - a)
 			//   = b + c - a
 			Vector2 outBottomRight = outTopRight + outBottomLeft - outTopLeft;
@@ -1021,6 +1454,8 @@ namespace spades {
 
 			imageRenderer->DrawPolygon(img, vtx[0], vtx[1], vtx[2]);
 			imageRenderer->DrawPolygon(img, vtx[1], vtx[3], vtx[2]);
+
+			frameTimings.images += imageStopwatch.GetTime();
 		}
 
 		void SWRenderer::DrawFlatGameMap(const spades::AABB2 &outRect,
@@ -1052,10 +1487,40 @@ namespace spades {
 				SPLog("==== SWRenderer Statistics ====");
 				SPLog("Elapsed Time: %.3fus", dur * 1000000.0);
 				SPLog("Polygon pixels drawn: %llu", imageRenderer->GetPixelsDrawn());
+				SPLog("Batched polygons: %llu in %llu tiles (max. %llu pixels per tile)",
+				      imageRenderer->GetBatchTrianglesDrawn(), imageRenderer->GetBatchTilesDrawn(),
+				      imageRenderer->GetMaxTilePixelsDrawn());
+				SPLog("Map: %.3fus, Models: %.3fus, Lights and fog: %.3fus, Sprites: %.3fus, "
+				      "Upscale: %.3fus, 2D: %.3fus",
+				      frameTimings.map * 1000000.0, frameTimings.models * 1000000.0,
+				      frameTimings.lightsAndFog * 1000000.0, frameTimings.sprites * 1000000.0,
+				      frameTimings.upscale * 1000000.0, frameTimings.images * 1000000.0);
+				if (modelRenderer) {
+					SPLog("Models: %llu queued, %llu occluded", modelRenderer->GetModelsQueued(),
+					      modelRenderer->GetModelsOccluded());
+				}
+				if (mapRenderer) {
+					unsigned long long built = mapRenderer->GetLinesBuilt();
+					unsigned long long reused = mapRenderer->GetLinesReused();
+					SPLog("Map lines: %llu built, %llu reused (%.1f%% hit rate)", built, reused,
+					      built + reused ? reused * 100.0 / (built + reused) : 0.0);
+				}
+				if (r_swDynamicResolution) {
+					SPLog("Resolution scale: %.3f (smoothed scene time: %.3fus)",
+					      resolutionScale, smoothedSceneTime * 1000000.0);
+				}
 			}
 
 			imageRenderer->ResetPixelStatistics();
+			if (modelRenderer) {
+				modelRenderer->ResetStatistics();
+			}
+			if (mapRenderer) {
+				mapRenderer->ResetStatistics();
+			}
 			renderStopwatch.Reset();
+			lastFrameTimings = frameTimings;
+			frameTimings = FrameTimings();
 			/*
 			{
 			    uint32_t rdb = mt_engine();
@@ -1100,13 +1565,14 @@ namespace spades {
 		float SWRenderer::ScreenWidth() {
 			SPADES_MARK_FUNCTION();
 			EnsureValid();
-			return static_cast<float>(fb->GetWidth());
+			// Not `fb`, which may be smaller during the scene rendering
+			return static_cast<float>(port->GetFramebuffer().GetWidth());
 		}
 
 		float SWRenderer::ScreenHeight() {
 			SPADES_MARK_FUNCTION();
 			EnsureValid();
-			return static_cast<float>(fb->GetHeight());
+			return static_cast<float>(port->GetFramebuffer().GetHeight());
 		}
 
 		bool SWRenderer::BoxFrustrumCull(const AABB3 &box) {
@@ -1152,5 +1618,16 @@ namespace spades {
 
 			flatMapRenderer->SetNeedsUpdate(x, y);
 		}
+
+		void SWRenderer::GameMapColumnsChanged(
+		  const std::vector<client::GameMapDirtyColumn> &columns, client::GameMap *map) {
+			if (map != this->map.GetPointerOrNull()) {
+				return;
+			}
+
+			for (const client::GameMapDirtyColumn &column : columns) {
+				flatMapRenderer->SetNeedsUpdate(column.x, column.y);
+			}
+		}
 	} // namespace draw
 } // namespace spades
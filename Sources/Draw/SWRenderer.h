@@ -21,6 +21,7 @@
 #pragma once
 
 #include <array>
+#include <deque>
 #include <map>
 #include <memory>
 #include <vector>
@@ -50,14 +51,64 @@ namespace spades {
 			friend class SWModelRenderer;
 			friend class SWMapRenderer;
 
+		public:
+			/** The time spent in each phase of a frame, in seconds. */
+			struct FrameTimings {
+				/** Updating the RLE map and rendering the map. */
+				double map = 0.0;
+				double models = 0.0;
+				/** The dynamic lights and the fog, which are applied in a single pass. */
+				double lightsAndFog = 0.0;
+				double sprites = 0.0;
+				/** The 2D images drawn after `EndScene`, including the flat map. */
+				double images = 0.0;
+				/** Upscaling the scene rendered at a reduced resolution. */
+				double upscale = 0.0;
+			};
+
+			/** A frame observed by the dynamic resolution controller. */
+			struct ResolutionSample {
+				/** The resolution scale the scene was rendered at. */
+				float scale;
+				/** The time spent in `EndScene`, in seconds. */
+				double sceneTime;
+			};
+
+		private:
 			SWFeatureLevel featureLevel;
 
 			Handle<SWPort> port;
 			Handle<client::GameMap> map;
 
 			Handle<Bitmap> fb;
+			/**
+			 * Sized for the port's framebuffer. A scene rendered at a reduced resolution uses
+			 * its prefix.
+			 */
 			std::vector<float> depthBuffer;
 
+			/**
+			 * The framebuffer the scene is rendered to when the dynamic resolution is
+			 * enabled. Upscaled into the port's framebuffer at the end of `EndScene`.
+			 */
+			Handle<Bitmap> scaledFb;
+			/** The ratio of the scene's resolution to the port's resolution. */
+			float resolutionScale;
+			/** The exponential moving average of the time spent in `EndScene`. */
+			double smoothedSceneTime;
+			std::deque<ResolutionSample> resolutionHistory;
+			enum { MaxResolutionHistory = 256 };
+
+			/** The bilinear mapping from `scaledFb` to the port. See `UpscaleTarget`. */
+			struct UpscaleTables {
+				int srcW = 0, srcH = 0, destW = 0, destH = 0;
+				std::vector<int32_t> columns;
+				std::vector<uint16_t> columnWeights;
+				std::vector<int32_t> rows;
+				std::vector<int32_t> rowWeights;
+			};
+			UpscaleTables upscaleTables;
+
 			std::shared_ptr<SWImageManager> imageManager;
 			std::shared_ptr<SWModelManager> modelManager;
 
@@ -66,6 +117,8 @@ namespace spades {
 
 			std::shared_ptr<SWFlatMapRenderer> flatMapRenderer;
 			std::shared_ptr<SWMapRenderer> mapRenderer;
+			/** Created by `PrebuildGameMap` for a map being decoded. */
+			std::shared_ptr<SWMapRenderer> prebuiltMapRenderer;
 
 			struct Sprite {
 				Handle<SWImage> img;
@@ -124,6 +177,11 @@ namespace spades {
 
 			Stopwatch renderStopwatch;
 
+			/** The timings of the frame being rendered. */
+			FrameTimings frameTimings;
+			/** The timings of the frame last presented by `Flip`. */
+			FrameTimings lastFrameTimings;
+
 			bool duringSceneRendering;
 
 			void BuildProjectionMatrix();
@@ -131,6 +189,7 @@ namespace spades {
 			void BuildFrustrum();
 
 			void RenderDebugLines();
+			void RenderLongSprite(LongSprite &);
 
 			void RenderObjects();
 
@@ -141,9 +200,23 @@ namespace spades {
 
 			void SetFramebuffer(Bitmap *);
 
-			template <SWFeatureLevel> void ApplyFog();
+			/**
+			 * Chooses the framebuffer the scene is rendered to, according to
+			 * `resolutionScale`. Unlike `SetFramebuffer`, the size may differ from the port's.
+			 */
+			void SetSceneFramebuffer();
+			/** Upscales `scaledFb` into the port's framebuffer and switches back to it. */
+			void UpscaleScene();
+			/** Adjusts `resolutionScale` based on the time spent in `EndScene`. */
+			void UpdateResolutionScale(double sceneTime);
+
+			enum { PostPassTileSize = 32 };
 
-			template <SWFeatureLevel> void ApplyDynamicLight(const DynamicLight &);
+			/**
+			 * Applies the dynamic lights and the fog in one pass over the screen, which is
+			 * divided into tiles processed in parallel.
+			 */
+			template <SWFeatureLevel> void ApplyLightsAndFog();
 
 		protected:
 			~SWRenderer();
@@ -163,6 +236,8 @@ namespace spades {
 			void ClearCache() override;
 
 			void SetGameMap(stmp::optional<client::GameMap &>) override;
+			void PrebuildGameMap(client::GameMap &,
+			                     const std::vector<bool> &decodedRows) override;
 			void SetFogColor(Vector3 v) override;
 			void SetFogDistance(float f) override { fogDistance = f; }
 
@@ -211,9 +286,20 @@ namespace spades {
 			const Matrix4 &GetViewMatrix() const { return viewMatrix; }
 
 			void GameMapChanged(int x, int y, int z, client::GameMap *) override;
+			void GameMapColumnsChanged(const std::vector<client::GameMapDirtyColumn> &,
+			                           client::GameMap *) override;
 
 			const client::SceneDefinition &GetSceneDef() const { return sceneDef; }
 
+			const FrameTimings &GetLastFrameTimings() const { return lastFrameTimings; }
+
+			/** The resolution scale the next scene will be rendered at. */
+			float GetResolutionScale() const { return resolutionScale; }
+			/** The recent frames observed by the dynamic resolution controller, oldest first. */
+			const std::deque<ResolutionSample> &GetResolutionHistory() const {
+				return resolutionHistory;
+			}
+
 			bool BoxFrustrumCull(const AABB3 &);
 			bool SphereFrustrumCull(const Vector3 &center, float radius);
 		};
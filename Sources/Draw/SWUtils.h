@@ -21,48 +21,30 @@
 #pragma once
 
 #include <algorithm>
-#include <array>
-#include <memory>
-
-#include <Core/ConcurrentDispatch.h>
 #include <Core/Debug.h>
+#include <Core/TaskScheduler.h>
 
 namespace spades {
 	namespace draw {
 		int GetNumSWRendererThreads();
 
+		/** Calls `f(i)` for every `i` in `[0, numThreads)` in parallel. */
 		template <class F> static void InvokeParallel(F f, unsigned int numThreads) {
 			SPAssert(numThreads <= 32);
-			std::array<std::unique_ptr<ConcurrentDispatch>, 32> disp;
-			for (auto i = 1U; i < numThreads; i++) {
-				auto ff = [i, &f]() { f(i); };
-				disp[i] = std::unique_ptr<ConcurrentDispatch>(
-				  static_cast<ConcurrentDispatch *>(new FunctionDispatch<decltype(ff)>(ff)));
-				disp[i]->Start();
-			}
-			f(0);
-			for (auto i = 1U; i < numThreads; i++) {
-				disp[i]->Join();
-			}
+			ParallelFor(0, static_cast<int>(numThreads),
+			            [&](int i) { f(static_cast<unsigned int>(i)); });
 		}
 
+		/**
+		 * Calls `f(i, numThreads)` for every `i` in `[0, numThreads)` in parallel, where
+		 * `numThreads` is specified by `r_swNumThreads`.
+		 */
 		template <class F> static void InvokeParallel2(F f) {
-
 			unsigned int numThreads = static_cast<unsigned int>(GetNumSWRendererThreads());
 			numThreads = std::max(numThreads, 1U);
 			numThreads = std::min(numThreads, 32U);
 
-			std::array<std::unique_ptr<ConcurrentDispatch>, 32> disp;
-			for (auto i = 1U; i < numThreads; i++) {
-				auto ff = [i, &f, numThreads]() { f(i, numThreads); };
-				disp[i] = std::unique_ptr<ConcurrentDispatch>(
-				  static_cast<ConcurrentDispatch *>(new FunctionDispatch<decltype(ff)>(ff)));
-				disp[i]->Start();
-			}
-			f(0, numThreads);
-			for (auto i = 1U; i < numThreads; i++) {
-				disp[i]->Join();
-			}
+			InvokeParallel([&](unsigned int i) { f(i, numThreads); }, numThreads);
 		}
 
 		static inline int ToFixed8(float v) {
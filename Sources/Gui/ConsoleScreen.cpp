@@ -21,6 +21,8 @@
 #include <ScriptBindings/ScriptFunction.h>
 
 #include <Client/Fonts.h>
+#include <Core/TaskSchedulerBenchmark.h>
+#include <Draw/SWKernelBenchmark.h>
 
 #include "ConfigConsoleResponder.h"
 #include "ConsoleCommand.h"
@@ -227,11 +229,15 @@ namespace spades {
 			constexpr const char *CMD_HELP = "help";
 			constexpr const char *CMD_CLEARGFXCACHE = "cleargfxcache";
 			constexpr const char *CMD_CLEARSFXCACHE = "clearsfxcache";
+			constexpr const char *CMD_TASKBENCH = "taskbench";
+			constexpr const char *CMD_SWBENCH = "swbench";
 
 			std::map<std::string, std::string> const g_commands{
 			  {CMD_HELP, ": Display all available commands"},
 			  {CMD_CLEARGFXCACHE, ": Clear the GFX (models and images) cache, forcing reload"},
 			  {CMD_CLEARSFXCACHE, ": Clear the SFX cache, forcing reload"},
+			  {CMD_TASKBENCH, ": Measure the overhead of dispatching tasks to worker threads"},
+			  {CMD_SWBENCH, ": Measure the SSE2 and AVX2 kernels of the software renderer"},
 			};
 		} // namespace
 
@@ -258,6 +264,20 @@ namespace spades {
 				}
 				audioDevice->ClearCache();
 				return true;
+			} else if (command->GetName() == CMD_TASKBENCH) {
+				if (command->GetNumArguments() != 0) {
+					SPLog("Usage: %s (no arguments)", CMD_TASKBENCH);
+					return true;
+				}
+				TaskSchedulerBenchmark::Run();
+				return true;
+			} else if (command->GetName() == CMD_SWBENCH) {
+				if (command->GetNumArguments() != 0) {
+					SPLog("Usage: %s (no arguments)", CMD_SWBENCH);
+					return true;
+				}
+				draw::SWKernelBenchmark::Run();
+				return true;
 			}
 			return ConfigConsoleResponder::ExecCommand(command) || subview->ExecCommand(command);
 		}
@@ -54,6 +54,8 @@
 
 #include <Core/VoxelModel.h>
 #include <Draw/GLOptimizedVoxelModel.h>
+#include <Draw/GLFrameBenchmark.h>
+#include <Draw/SWFrameBenchmark.h>
 
 #include <ScriptBindings/ScriptManager.h>
 
@@ -185,9 +187,22 @@ namespace {
 	bool g_printVersion = false;
 	bool g_printHelp = false;
 
+	bool g_runSWBenchmark = false;
+	spades::draw::SWFrameBenchmark::Options g_swBenchmarkOptions;
+
+	bool g_runGLBenchmark = false;
+	spades::draw::GLFrameBenchmark::Options g_glBenchmarkOptions;
+
 	void printHelp(char *binaryName) {
 		printf("usage: %s [server_address] [v=protocol_version] [-h|--help] [-v|--version] \n",
 		       binaryName);
+		printf("       %s --sw-benchmark map.vxl scene.txt [--sw-benchmark-frames N]\n"
+		       "         [--sw-benchmark-size WxH] [--sw-benchmark-threads N]\n"
+		       "         [--sw-benchmark-level none|sse2|avx2] [--sw-benchmark-dump dir]\n",
+		       binaryName);
+		printf("       %s --gl-benchmark map.vxl scene.txt [--gl-benchmark-frames N]\n"
+		       "         [--gl-benchmark-size WxH]\n",
+		       binaryName);
 	}
 
 	std::regex const hostNameRegex{"aos://.*"};
@@ -218,6 +233,70 @@ namespace {
 				g_printHelp = true;
 				return ++i;
 			}
+
+			// Headless software renderer benchmark (see `SWFrameBenchmark`)
+			auto &options = g_swBenchmarkOptions;
+			if (!strcasecmp(a, "--sw-benchmark")) {
+				if (i + 2 >= argc) {
+					g_printHelp = true;
+					return ++i;
+				}
+				g_runSWBenchmark = true;
+				options.mapPath = argv[i + 1];
+				options.scriptPath = argv[i + 2];
+				return i += 3;
+			}
+			if (i + 1 < argc) {
+				const char *value = argv[i + 1];
+				if (!strcasecmp(a, "--sw-benchmark-frames")) {
+					options.numFrames = atoi(value);
+					return i += 2;
+				}
+				if (!strcasecmp(a, "--sw-benchmark-size")) {
+					if (sscanf(value, "%dx%d", &options.width, &options.height) != 2) {
+						g_printHelp = true;
+					}
+					return i += 2;
+				}
+				if (!strcasecmp(a, "--sw-benchmark-threads")) {
+					options.numThreads = atoi(value);
+					return i += 2;
+				}
+				if (!strcasecmp(a, "--sw-benchmark-level")) {
+					options.featureLevel = value;
+					return i += 2;
+				}
+				if (!strcasecmp(a, "--sw-benchmark-dump")) {
+					options.dumpDirectory = value;
+					return i += 2;
+				}
+			}
+
+			// Headless OpenGL renderer benchmark (see `GLFrameBenchmark`)
+			auto &glOptions = g_glBenchmarkOptions;
+			if (!strcasecmp(a, "--gl-benchmark")) {
+				if (i + 2 >= argc) {
+					g_printHelp = true;
+					return ++i;
+				}
+				g_runGLBenchmark = true;
+				glOptions.mapPath = argv[i + 1];
+				glOptions.scriptPath = argv[i + 2];
+				return i += 3;
+			}
+			if (i + 1 < argc) {
+				const char *value = argv[i + 1];
+				if (!strcasecmp(a, "--gl-benchmark-frames")) {
+					glOptions.numFrames = atoi(value);
+					return i += 2;
+				}
+				if (!strcasecmp(a, "--gl-benchmark-size")) {
+					if (sscanf(value, "%dx%d", &glOptions.width, &glOptions.height) != 2) {
+						g_printHelp = true;
+					}
+					return i += 2;
+				}
+			}
 		}
 
 		return 0;
@@ -319,11 +398,17 @@ int main(int argc, char **argv) {
 		spades::reflection::Backtrace::StartBacktrace();
 		SPADES_MARK_FUNCTION();
 
-		// show splash window
+		// show splash window (unless running headless)
 		// NOTE: splash window uses image loader, which assumes backtrace is already initialized.
-		splashWindow.reset(new spades::SplashWindow());
+		if (!g_runSWBenchmark && !g_runGLBenchmark) {
+			splashWindow.reset(new spades::SplashWindow());
+		}
 		auto showSplashWindowTime = SDL_GetTicks();
-		auto pumpEvents = [&splashWindow] { splashWindow->PumpEvents(); };
+		auto pumpEvents = [&splashWindow] {
+			if (splashWindow) {
+				splashWindow->PumpEvents();
+			}
+		};
 
 		// initialize threads
 		spades::Thread::InitThreadSystem();
@@ -454,7 +539,8 @@ int main(int argc, char **argv) {
 			  "OpenSpades will continue to run, but any critical events are not logged.",
 			  ex.what());
 			if (SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_WARNING, "OpenSpades Log System Failure",
-			                             msg.c_str(), splashWindow->GetWindow())) {
+			                             msg.c_str(),
+			                             splashWindow ? splashWindow->GetWindow() : nullptr)) {
 				// showing dialog failed.
 			}
 		}
@@ -594,6 +680,17 @@ int main(int argc, char **argv) {
 		ThreadQuantumSetter quantumSetter;
 		(void)quantumSetter; // suppress "unused variable" warning
 
+		if (g_runSWBenchmark) {
+			int exitCode = spades::draw::SWFrameBenchmark::Run(g_swBenchmarkOptions);
+			spades::FileManager::Close();
+			return exitCode;
+		}
+		if (g_runGLBenchmark) {
+			int exitCode = spades::draw::GLFrameBenchmark::Run(g_glBenchmarkOptions);
+			spades::FileManager::Close();
+			return exitCode;
+		}
+
 		SDL_InitSubSystem(SDL_INIT_VIDEO);
 
 		// we want to show splash window at least for some time...